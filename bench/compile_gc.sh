@@ -0,0 +1,67 @@
+#!/bin/sh
+# what compiling a big script costs the GC: reallocate() calls and
+# collections, and how long the compile takes.
+# usage: bench/compile_gc.sh [functions] [compiles]
+#
+# the generated script only declares functions, nested by 100 and by
+# 10000 so that each chunk has room for their constants. the first
+# compile is cold, then the same source is compiled again and again on
+# one VM by --batch, which shows what earlier compiles leave the GC to
+# trace. the counts are gcStats().compileReallocations and
+# compileCollections, summed over the compiles
+
+CLOX=${CLOX:-bin/clox}
+FUNCTIONS=${1:-24000}
+COMPILES=${2:-40}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$FUNCTIONS" 'BEGIN {
+	for (f = 0; f < n; f++) {
+		if (f % 10000 == 0)
+			printf "fun part%d() {\n", f / 10000
+		if (f % 100 == 0)
+			printf "  fun group%d() {\n", f / 100
+		printf "    fun f%d(a, b) {\n", f % 100
+		printf "      var sum = 0;\n"
+		printf "      for (var i = 0; i < a; i = i + 1) {\n"
+		printf "        if (i > b) sum = sum + i * 2; else sum = sum - 1;\n"
+		printf "      }\n"
+		printf "      return \"f%d\" + \" done\";\n", f
+		printf "    }\n"
+		if (f % 100 == 99 || f == n - 1)
+			printf "  }\n"
+		if (f % 10000 == 9999 || f == n - 1)
+			printf "}\n"
+	}
+}' > "$DIR/script.lox"
+
+cat > "$DIR/stats.lox" <<EOF
+var stats = gcStats();
+print stats.compileReallocations;
+print stats.compileCollections;
+print stats.live;
+EOF
+
+# compiles the script count times, prints the ms and the counts
+compile() {
+	files=
+	i=0
+	while [ $i -lt "$1" ]; do
+		files="$files $DIR/script.lox"
+		i=$((i + 1))
+	done
+	start=$(date +%s%N)
+	counts=$("$CLOX" --no-cache --batch $files "$DIR/stats.lox" 2> /dev/null) ||
+		exit 1
+	ms=$(( ($(date +%s%N) - start) / 1000000 ))
+	echo $ms $counts
+}
+
+echo "$FUNCTIONS functions, $(wc -c < "$DIR/script.lox") bytes"
+echo "compiles       ms  reallocate()  collections   live bytes"
+for count in 1 "$COMPILES"; do
+	compile "$count" | awk -v count="$count" \
+		'{ printf "%8d %8d  %12d  %11d  %11d\n", count, $1, $2, $3, $4 }'
+done
@@ -0,0 +1,58 @@
+#!/bin/sh
+# measures how --files compile time scales with --jobs.
+# usage: bench/compile_scaling.sh [files] [functions per file] [max jobs]
+#
+# the generated scripts only declare functions, so the time clox takes
+# is nearly all compile time. the best of 5 runs is reported per job count
+
+CLOX=${CLOX:-bin/clox}
+FILES=${1:-32}
+FUNCTIONS=${2:-2000}
+MAXJOBS=${3:-$(getconf _NPROCESSORS_ONLN)}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$FILES" ]; do
+	awk -v file=$i -v n="$FUNCTIONS" 'BEGIN {
+		# grouped by 100, a chunk has room for only 256 constants
+		for (f = 0; f < n; f++) {
+			if (f % 100 == 0)
+				printf "fun group%d_%d() {\n", file, f / 100
+			printf "  fun f%d(a, b) {\n", f % 100
+			printf "    var sum = 0;\n"
+			printf "    for (var i = 0; i < a; i = i + 1) {\n"
+			printf "      if (i > b) sum = sum + i * 2; else sum = sum - 1;\n"
+			printf "    }\n"
+			printf "    return \"f%d_%d\" + \" done\";\n", file, f
+			printf "  }\n"
+			if (f % 100 == 99 || f == n - 1)
+				printf "}\n"
+		}
+	}' > "$DIR/file$i.lox"
+	i=$((i + 1))
+done
+
+echo "$FILES files, $(cat "$DIR"/*.lox | wc -c) bytes, $MAXJOBS cores"
+echo "jobs  best ms  speedup"
+
+base=
+jobs=1
+while [ "$jobs" -le "$MAXJOBS" ]; do
+	best=
+	run=0
+	while [ $run -lt 5 ]; do
+		start=$(date +%s%N)
+		"$CLOX" --jobs "$jobs" --files "$DIR"/*.lox || exit 1
+		ms=$(( ($(date +%s%N) - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+		run=$((run + 1))
+	done
+	[ -z "$base" ] && base=$best
+	awk -v j="$jobs" -v ms="$best" -v base="$base" \
+		'BEGIN { printf "%4d  %7d  %6.2fx\n", j, ms, base / (ms > 0 ? ms : 1) }'
+	jobs=$((jobs * 2))
+done
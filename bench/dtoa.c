@@ -0,0 +1,167 @@
+// measures formatNumber() against printf's %g and %.17g, checks that
+// what it writes reads back as the same double, and counts where it is
+// longer than the shortest decimal that does. exits with 1 if any
+// number didn't read back.
+// usage: dtoa [numbers]
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dtoa.h"
+
+// each conversion is timed over this many values, again and again
+#define SAMPLE_SIZE 1000
+#define REPEATS 5000
+
+// xorshift, so every run checks the same numbers
+static uint64_t state = 88172645463325252u;
+
+static uint64_t randomBits()
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+// what scripts mostly print, like 1234.5678
+static double randomFraction()
+{
+	return (double)(randomBits() % 100000000) /
+		   (double)(1 + randomBits() % 10000);
+}
+
+static double randomInteger()
+{
+	return (double)(randomBits() % 1000000);
+}
+
+// any finite double
+static double randomDouble()
+{
+	for (;;)
+	{
+		uint64_t bits = randomBits();
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		if (value - value == 0)
+			return value;
+	}
+}
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// the significant digits of a number written by formatNumber
+static int countDigits(const char *chars)
+{
+	int digits = 0;
+	bool leading = true;
+	for (const char *c = chars; *c != '\0' && *c != 'e'; c++)
+	{
+		if (*c < '0' || *c > '9' || (leading && *c == '0'))
+			continue;
+		leading = false;
+		digits++;
+	}
+	return digits;
+}
+
+// the fewest significant digits that read back as value
+static int shortestDigits(double value)
+{
+	char buffer[64];
+	for (int digits = 1; digits < 17; digits++)
+	{
+		snprintf(buffer, sizeof(buffer), "%.*e", digits - 1, value);
+		if (strtod(buffer, NULL) == value)
+			return digits;
+	}
+	return 17;
+}
+
+// ns per conversion. format is NULL for formatNumber()
+static double timeConversions(double (*random)(), const char *format)
+{
+	double values[SAMPLE_SIZE];
+	for (int i = 0; i < SAMPLE_SIZE; i++)
+		values[i] = random();
+
+	char buffer[64];
+	volatile int sink = 0;
+	double start = now();
+	for (int repeat = 0; repeat < REPEATS; repeat++)
+	{
+		for (int i = 0; i < SAMPLE_SIZE; i++)
+		{
+			if (format == NULL)
+				sink += formatNumber(values[i], buffer);
+			else
+				sink += snprintf(buffer, sizeof(buffer), format, values[i]);
+		}
+	}
+	(void)sink;
+	return (now() - start) / ((double)REPEATS * SAMPLE_SIZE);
+}
+
+int main(int argc, const char *argv[])
+{
+	long numbers = argc > 1 ? atol(argv[1]) : 1000000;
+	if (numbers < 1)
+	{
+		fprintf(stderr, "Usage: dtoa [numbers]\n");
+		return 64;
+	}
+
+	// a third are fractions, the rest any double. integers are exact
+	// whatever the digits, so they need no checking
+	long wrong = 0;
+	long longer = 0;
+	for (long i = 0; i < numbers; i++)
+	{
+		double value = i % 3 == 0 ? randomFraction() : randomDouble();
+		char buffer[NUMBER_BUFFER_SIZE];
+		int length = formatNumber(value, buffer);
+		if (strtod(buffer, NULL) != value || length != (int)strlen(buffer))
+		{
+			if (wrong++ < 5)
+				printf("%.17g was written as %s\n", value, buffer);
+		}
+		else if (strchr(buffer, '.') != NULL || strchr(buffer, 'e') != NULL)
+		{
+			if (countDigits(buffer) > shortestDigits(value))
+				longer++;
+		}
+	}
+	printf("%ld numbers: %ld don't read back, %ld (%.3f%%) a digit longer "
+		   "than the shortest\n",
+		   numbers, wrong, longer, 100.0 * longer / numbers);
+
+	printf("%-10s %14s %8s %8s\n", "values", "formatNumber", "%g", "%.17g");
+	struct
+	{
+		const char *name;
+		double (*random)();
+	} kinds[] = {
+		{"fractions", randomFraction},
+		{"integers", randomInteger},
+		{"any", randomDouble},
+	};
+	for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+	{
+		printf("%-10s %11.1f ns %5.1f ns %5.1f ns\n", kinds[i].name,
+			   timeConversions(kinds[i].random, NULL),
+			   timeConversions(kinds[i].random, "%g"),
+			   timeConversions(kinds[i].random, "%.17g"));
+	}
+	return wrong > 0 ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+// measures what fibers cost: the time of a switch between two of them
+// and the memory held by a million suspended ones.
+// usage: fibers [switches] [fibers]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// resume() and yield() are two switches per iteration. the baseline
+// makes the same number of native calls without switching
+static const char *switchScript =
+	"fun loop() { while (true) yield(); }\n"
+	"var f = fiber(loop);\n"
+	"for (var i = 0; i < n; i = i + 1) resume(f);\n";
+static const char *baselineScript =
+	"fun loop() {}\n"
+	"var f = fiber(loop);\n"
+	"for (var i = 0; i < n; i = i + 1) { done(f); done(f); }\n";
+
+// every fiber is suspended holding on to the one before it
+static const char *holdScript =
+	"fun hold(previous) { yield(); return previous; }\n"
+	"var last = nil;\n"
+	"for (var i = 0; i < n; i = i + 1) {\n"
+	"  var f = fiber(hold);\n"
+	"  resume(f, last);\n"
+	"  last = f;\n"
+	"}\n";
+
+static double now()
+{
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static long maxResidentKb()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+// runs script with the global n set, returns the time it took
+static double run(VM *vm, const char *script, long n)
+{
+	char source[1024];
+	snprintf(source, sizeof(source), "var n = %ld;\n%s", n, script);
+
+	double start = now();
+	if (interpret(vm, source) != INTERPRET_OK)
+		exit(70);
+	return now() - start;
+}
+
+int main(int argc, const char *argv[])
+{
+	long switches = argc > 1 ? atol(argv[1]) : 1000000;
+	long fibers = argc > 2 ? atol(argv[2]) : 1000000;
+	if (switches < 1 || fibers < 1)
+	{
+		fprintf(stderr, "Usage: fibers [switches] [fibers]\n");
+		return 64;
+	}
+
+	VM *vm = createVM();
+	double switched = run(vm, switchScript, switches / 2);
+	double baseline = run(vm, baselineScript, switches / 2);
+	destroyVM(vm);
+	printf("%ld switches: %.1f ns each, %.1f ns over a native call\n",
+		   switches / 2 * 2, switched * 1e9 / switches,
+		   (switched - baseline) * 1e9 / switches);
+
+	vm = createVM();
+	collectGarbage(vm);
+	size_t before = vm->bytesAllocated;
+	long residentBefore = maxResidentKb();
+	double elapsed = run(vm, holdScript, fibers);
+	collectGarbage(vm);
+	size_t after = vm->bytesAllocated;
+	long residentAfter = maxResidentKb();
+	printf("%ld suspended fibers in %.2f s: %.0f bytes each on the heap, "
+		   "%.0f resident\n",
+		   fibers, elapsed, (double)(after - before) / fibers,
+		   (residentAfter - residentBefore) * 1024.0 / fibers);
+	printf("(a stack the size of the VM's would be %zu bytes)\n",
+		   sizeof(vm->stack) + sizeof(vm->frames));
+	destroyVM(vm);
+	return 0;
+}
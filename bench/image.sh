@@ -0,0 +1,49 @@
+#!/bin/sh
+# startup with a prelude, run from source every time against restored
+# from an image made with --dump-image.
+# usage: bench/image.sh [runs]
+#
+# the script after the prelude only looks a few things up, so the time
+# is nearly all startup. "none" prints the same without a prelude, for
+# what starting clox costs at all. caches are off, so "source" compiles
+# the prelude too. the best of the runs is reported
+
+CLOX=${CLOX:-bin/clox}
+PRELUDE=bench/prelude.lox
+RUNS=${1:-10}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/script.lox" <<EOF
+print price(32768);
+print worth(16384);
+EOF
+cat > "$DIR/empty.lox" <<EOF
+print 98304;
+print 688128;
+EOF
+
+"$CLOX" --no-cache --dump-image "$DIR/prelude.img" "$PRELUDE" > /dev/null || exit 1
+
+# best ms of the runs of clox with the arguments
+best() {
+	best=
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		start=$(date +%s%N)
+		"$CLOX" --no-cache "$@" > /dev/null || exit 1
+		ms=$(( ($(date +%s%N) - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+		run=$((run + 1))
+	done
+	echo "$best"
+}
+
+echo "$PRELUDE, image of $(wc -c < "$DIR/prelude.img") bytes, best of $RUNS"
+echo "startup           ms"
+printf "%-12s %7d\n" "none" "$(best "$DIR/empty.lox")"
+printf "%-12s %7d\n" "source" "$(best --files "$PRELUDE" "$DIR/script.lox")"
+printf "%-12s %7d\n" "image" "$(best --image "$DIR/prelude.img" "$DIR/script.lox")"
@@ -0,0 +1,69 @@
+#!/bin/sh
+# throughput of -n, in lines and megabytes per second.
+# usage: bench/lines.sh [megabytes] [runs]
+#
+# the input is generated once into a temp file, log lines of 40 to 120
+# bytes, so it can be made as big as the disk allows. "count" only
+# counts the lines, "print" writes each one back out through a pipe.
+# wc -l and cat show what reading the input costs without clox. the
+# best of the runs is reported
+
+CLOX=${CLOX:-bin/clox}
+MEGABYTES=${1:-256}
+RUNS=${2:-3}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v bytes=$((MEGABYTES * 1000000)) 'BEGIN {
+	srand(1)
+	while (written < bytes) {
+		line = sprintf("2024-05-%02d 12:%02d:%02d INFO request %d served in %d ms",
+			1 + int(rand() * 28), int(rand() * 60), int(rand() * 60),
+			n++, int(rand() * 500))
+		for (pad = int(rand() * 70); pad > 0; pad -= 10)
+			line = line " padding"
+		print line
+		written += length(line) + 1
+	}
+}' > "$DIR/input.log"
+BYTES=$(wc -c < "$DIR/input.log")
+LINES=$(wc -l < "$DIR/input.log")
+
+cat > "$DIR/count.lox" <<EOF
+var count = 0;
+fun line(text) { count = count + 1; }
+fun end() { print count; }
+EOF
+cat > "$DIR/print.lox" <<EOF
+fun line(text) { print text; }
+EOF
+
+# best ms of the runs of the command
+best() {
+	best=
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		start=$(date +%s%N)
+		"$@" < "$DIR/input.log" | cat > /dev/null || exit 1
+		ms=$(( ($(date +%s%N) - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+		run=$((run + 1))
+	done
+	echo "$best"
+}
+
+report() {
+	awk -v name="$1" -v ms="$2" -v lines="$LINES" -v bytes="$BYTES" \
+		'BEGIN { s = (ms > 0 ? ms : 1) / 1e3
+			printf "%-8s %8d  %10.2f  %8.1f\n", name, ms, lines / s / 1e6, bytes / s / 1e6 }'
+}
+
+echo "$LINES lines, $BYTES bytes, best of $RUNS"
+echo "run            ms  Mlines/s      MB/s"
+report "wc -l" "$(best wc -l)"
+report "cat" "$(best cat)"
+report "count" "$(best "$CLOX" --no-cache -n "$DIR/count.lox")"
+report "print" "$(best "$CLOX" --no-cache -n "$DIR/print.lox")"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# map/reduce over a large file on 1 to 32 isolates.
+# usage: bench/mapreduce.sh [lines] [work per line]
+#
+# the main isolate streams the lines of the file into a channel (with
+# -n), the workers score them and send back partial sums
+
+CLOX=${CLOX:-bin/clox}
+LINES=${1:-200000}
+WORK=${2:-50}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf "%d,record %d,%f,some text to make the line longer\n", i, i * 7, i / 3
+}' > "$DIR/input.csv"
+
+echo "$LINES lines ($(wc -c < "$DIR/input.csv") bytes), $WORK work per line, $(getconf _NPROCESSORS_ONLN) cores"
+echo "workers  ms  speedup"
+
+base=
+for workers in 1 2 4 8 16 32; do
+	{
+		echo "var workers = $workers;"
+		echo "var work = $WORK;"
+		echo "var workerScript = \"$HERE/mapreduce/worker.lox\";"
+		cat "$HERE/mapreduce/main.lox"
+	} > "$DIR/main.lox"
+
+	start=$(date +%s%N)
+	"$CLOX" --no-cache -n "$DIR/main.lox" < "$DIR/input.csv" > "$DIR/out" || exit 1
+	ms=$(( ($(date +%s%N) - start) / 1000000 ))
+	[ -z "$base" ] && base=$ms
+
+	if [ "$(sed -n 1p "$DIR/out")" != "$LINES" ] || [ "$(sed -n 2p "$DIR/out")" != "$LINES" ]; then
+		echo "wrong result with $workers workers"
+		exit 1
+	fi
+	awk -v w="$workers" -v ms="$ms" -v base="$base" \
+		'BEGIN { printf "%7d  %5d  %6.2fx\n", w, ms, base / (ms > 0 ? ms : 1) }'
+done
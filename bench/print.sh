@@ -0,0 +1,63 @@
+#!/bin/sh
+# throughput of print, for numbers and for strings, with each way of
+# buffering the output.
+# usage: bench/print.sh [prints] [runs]
+#
+# each script prints its values in a loop, "loop" runs the same loop
+# without printing to tell what the prints themselves cost. output goes
+# through a pipe, as it would to another program. the best of the runs
+# is reported
+
+CLOX=${CLOX:-bin/clox}
+PRINTS=${1:-10000000}
+RUNS=${2:-3}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# numbers are half integers, half with a fraction
+cat > "$DIR/numbers.lox" <<EOF
+for (var i = 0; i < $PRINTS; i = i + 1) print i * 0.5;
+EOF
+cat > "$DIR/strings.lox" <<EOF
+var line = "a line of text about as long as a log message";
+for (var i = 0; i < $PRINTS; i = i + 1) print line;
+EOF
+cat > "$DIR/loop.lox" <<EOF
+var x;
+for (var i = 0; i < $PRINTS; i = i + 1) x = i * 0.5;
+EOF
+
+# best ms of the runs of script with options
+best() {
+	script=$1
+	shift
+	best=
+	run=0
+	while [ $run -lt "$RUNS" ]; do
+		start=$(date +%s%N)
+		"$CLOX" --no-cache "$@" "$DIR/$script.lox" | cat > /dev/null || exit 1
+		ms=$(( ($(date +%s%N) - start) / 1000000 ))
+		if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+			best=$ms
+		fi
+		run=$((run + 1))
+	done
+	echo "$best"
+}
+
+echo "$PRINTS prints, best of $RUNS"
+echo "buffering        numbers ms  strings ms  Mprints/s"
+echo "loop             $(best loop | awk '{ printf "%10d", $1 }')"
+for mode in "64 KiB" "line" "none"; do
+	case $mode in
+	"64 KiB") options= ;;
+	line) options=--line-buffered ;;
+	none) options="--output-buffer 0" ;;
+	esac
+	numbers=$(best numbers $options)
+	strings=$(best strings $options)
+	awk -v mode="$mode" -v n="$numbers" -v s="$strings" -v prints="$PRINTS" \
+		'BEGIN { printf "%-16s %10d  %10d  %9.1f\n", mode, n, s,
+			2 * prints / 1e3 / (n + s > 0 ? n + s : 1) }'
+done
@@ -0,0 +1,145 @@
+// measures how fast scanToken() gets through source, in MB/s and tokens
+// per second. without files it scans generated code with the comments,
+// strings and indentation that the fast paths are for.
+// usage: scanner [file...]
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+// each run scans the source again and again, at least this many bytes
+#define RUN_BYTES (256u << 20)
+#define RUNS 5
+
+typedef struct
+{
+	char *chars;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static void append(Buffer *buffer, const char *chars, size_t length)
+{
+	if (buffer->length + length > buffer->capacity)
+	{
+		buffer->capacity = (buffer->length + length) * 2;
+		buffer->chars = (char *)realloc(buffer->chars, buffer->capacity);
+		if (buffer->chars == NULL)
+			exit(1);
+	}
+	memcpy(buffer->chars + buffer->length, chars, length);
+	buffer->length += length;
+}
+
+static bool appendFile(Buffer *buffer, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+
+	char chunk[65536];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		append(buffer, chunk, read);
+	fclose(file);
+	return true;
+}
+
+// about 1 MB of functions like a library would have
+static void generate(Buffer *buffer)
+{
+	char text[1024];
+	for (int i = 0; i < 2500; i++)
+	{
+		int length = snprintf(text, sizeof(text),
+			"// returns the weighted sum of the first n values, with\n"
+			"// the label used when it is printed\n"
+			"fun weighted%d(values, n, weight) {\n"
+			"    var sum = 0;\n"
+			"    for (var i = 0; i < n; i = i + 1) {\n"
+			"        if (values.at(i) != nil and weight > 0.5) {\n"
+			"            sum = sum + values.at(i) * weight;\n"
+			"        }\n"
+			"    }\n"
+			"    print \"weighted sum number %d of the values is\";\n"
+			"    return sum / %d.25;\n"
+			"}\n\n",
+			i, i, i + 1);
+		append(buffer, text, (size_t)length);
+	}
+}
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// scans the whole source once, returns the number of tokens
+static long scanAll(const Buffer *source, long *errors)
+{
+	Scanner scanner;
+	initScanner(&scanner, source->chars, source->length, 1);
+	long tokens = 0;
+	for (;;)
+	{
+		Token token = scanToken(&scanner);
+		tokens++;
+		if (token.type == TOKEN_ERROR)
+			(*errors)++;
+		else if (token.type == TOKEN_EOF)
+			return tokens;
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	Buffer source = {NULL, 0, 0};
+	for (int i = 1; i < argc; i++)
+	{
+		if (!appendFile(&source, argv[i]))
+		{
+			fprintf(stderr, "Could not read \"%s\".\n", argv[i]);
+			return 74;
+		}
+	}
+	if (argc == 1)
+		generate(&source);
+	if (source.length == 0)
+	{
+		fprintf(stderr, "Usage: scanner [file...]\n");
+		return 64;
+	}
+
+	long errors = 0;
+	long tokens = scanAll(&source, &errors);
+	long passes = (long)(RUN_BYTES / source.length) + 1;
+	printf("%zu bytes, %ld tokens, %ld errors, %ld passes per run\n",
+		   source.length, tokens, errors, passes);
+
+	double best = 0;
+	for (int run = 0; run < RUNS; run++)
+	{
+		volatile long sink = 0;
+		double start = now();
+		for (long pass = 0; pass < passes; pass++)
+			sink += scanAll(&source, &errors);
+		double elapsed = now() - start;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	double seconds = best / 1e9;
+	printf("best of %d: %.1f MB/s, %.1f Mtokens/s\n", RUNS,
+		   (double)source.length * passes / 1e6 / seconds,
+		   (double)tokens * passes / 1e6 / seconds);
+	free(source.chars);
+	return 0;
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# fan-out on a pool() of 1 to max workers.
+# usage: bench/stealing.sh [n] [cutoff] [max workers]
+#
+# a job of n computes fib(n) by sending jobs for n - 1 and n - 2 to its
+# own worker, down to cutoff, so all the work starts on one worker and
+# the others have to steal it
+
+CLOX=${CLOX:-bin/clox}
+N=${1:-36}
+CUTOFF=${2:-20}
+MAXWORKERS=${3:-$(getconf _NPROCESSORS_ONLN)}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/worker.lox" <<LOX
+fun fib(n) {
+  if (n < 2) return n;
+  return fib(n - 2) + fib(n - 1);
+}
+
+fun task(n) {
+  if (n < $CUTOFF) return fib(n);
+  send(pool, n - 1);
+  send(pool, n - 2);
+  return nil;
+}
+LOX
+
+echo "fib($N) split down to fib($CUTOFF), $(getconf _NPROCESSORS_ONLN) cores"
+echo "workers  ms  speedup"
+
+base=
+workers=1
+while [ "$workers" -le "$MAXWORKERS" ]; do
+	cat > "$DIR/main.lox" <<LOX
+var p = pool("$DIR/worker.lox", $workers);
+send(p, $N);
+close(p);
+var sum = 0;
+var result = receive(p);
+while (result != nil) {
+  sum = sum + result;
+  result = receive(p);
+}
+print sum;
+LOX
+	start=$(date +%s%N)
+	out=$("$CLOX" --no-cache "$DIR/main.lox") || exit 1
+	ms=$(( ($(date +%s%N) - start) / 1000000 ))
+	[ -z "$base" ] && base=$ms
+	[ "$out" = "$(awk -v n="$N" 'BEGIN { a = 0; b = 1; for (i = 0; i < n; i++) { t = a + b; a = b; b = t } print a }')" ] || {
+		echo "wrong result $out with $workers workers"
+		exit 1
+	}
+	awk -v w="$workers" -v ms="$ms" -v base="$base" \
+		'BEGIN { printf "%7d  %6d  %6.2fx\n", w, ms, base / (ms > 0 ? ms : 1) }'
+	workers=$((workers * 2))
+done
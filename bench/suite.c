@@ -0,0 +1,272 @@
+// runs the workloads of bench/suite several times each and reports
+// the median and standard deviation of their run time along with their
+// peak resident memory, compared to a stored baseline.
+// usage: suite [-n runs] [-t percent] [-b baseline [-w]] [-a option]
+//              clox workload.lox...
+//
+// -a passes one more option to clox, e.g. -a --no-jit.
+// with -w the results are written to the baseline instead. a workload
+// is reported as a regression when its median time or peak memory is
+// more than -t percent (10 by default) over the baseline, which makes
+// the exit status 1
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 100
+#define MAX_WORKLOADS 64
+#define NAME_MAX_LENGTH 64
+
+typedef struct
+{
+	char name[NAME_MAX_LENGTH];
+	double median; // ms
+	double stddev;
+	long peakKb;
+} Result;
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+// the file name without directory and extension
+static void workloadName(const char *path, char *name)
+{
+	const char *start = strrchr(path, '/');
+	start = start != NULL ? start + 1 : path;
+	size_t length = strcspn(start, ".");
+	if (length >= NAME_MAX_LENGTH)
+		length = NAME_MAX_LENGTH - 1;
+	memcpy(name, start, length);
+	name[length] = '\0';
+}
+
+// runs the workload once, with its output discarded. returns false if
+// it could not be run or failed
+static bool runOnce(const char *clox, const char *option, const char *path,
+					double *ms, long *peakKb)
+{
+	double start = now();
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0)
+	{
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		if (option != NULL)
+			execl(clox, clox, "--no-cache", option, path, (char *)NULL);
+		else
+			execl(clox, clox, "--no-cache", path, (char *)NULL);
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		return false;
+	*ms = now() - start;
+	*peakKb = usage.ru_maxrss;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static bool measure(const char *clox, const char *option, const char *path,
+					int runs, Result *result)
+{
+	double times[MAX_RUNS];
+	double ms;
+	long peakKb;
+	workloadName(path, result->name);
+	result->peakKb = 0;
+
+	// the first run warms up the caches and is not counted
+	if (!runOnce(clox, option, path, &ms, &peakKb))
+		return false;
+	for (int i = 0; i < runs; i++)
+	{
+		if (!runOnce(clox, option, path, &times[i], &peakKb))
+			return false;
+		if (peakKb > result->peakKb)
+			result->peakKb = peakKb;
+	}
+
+	qsort(times, runs, sizeof(double), compareDoubles);
+	result->median = runs % 2 == 1
+						 ? times[runs / 2]
+						 : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+
+	double mean = 0;
+	for (int i = 0; i < runs; i++)
+		mean += times[i];
+	mean /= runs;
+	double variance = 0;
+	for (int i = 0; i < runs; i++)
+		variance += (times[i] - mean) * (times[i] - mean);
+	result->stddev = runs > 1 ? sqrt(variance / (runs - 1)) : 0;
+	return true;
+}
+
+// reads the lines of a baseline written with -w, returns how many
+static int readBaseline(const char *path, Result *results)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return 0;
+
+	int count = 0;
+	char line[256];
+	while (count < MAX_WORKLOADS && fgets(line, sizeof(line), file) != NULL)
+	{
+		Result *result = &results[count];
+		if (line[0] != '#' &&
+			sscanf(line, "%63s %lf %lf %ld", result->name, &result->median,
+				   &result->stddev, &result->peakKb) == 4)
+			count++;
+	}
+	fclose(file);
+	return count;
+}
+
+static bool writeBaseline(const char *path, Result *results, int count)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return false;
+
+	fprintf(file, "# workload  median ms  stddev ms  peak KB\n");
+	for (int i = 0; i < count; i++)
+		fprintf(file, "%s %.1f %.1f %ld\n", results[i].name,
+				results[i].median, results[i].stddev, results[i].peakKb);
+	return fclose(file) == 0;
+}
+
+static Result *findResult(Result *results, int count, const char *name)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(results[i].name, name) == 0)
+			return &results[i];
+	}
+	return NULL;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: suite [-n runs] [-t percent] "
+					"[-b baseline [-w]] [-a option] clox workload.lox...\n");
+	exit(64);
+}
+
+int main(int argc, char *argv[])
+{
+	int runs = 5;
+	double threshold = 10;
+	const char *baselinePath = NULL;
+	bool write = false;
+	const char *cloxOption = NULL;
+
+	int option;
+	while ((option = getopt(argc, argv, "n:t:b:wa:")) != -1)
+	{
+		switch (option)
+		{
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'b':
+			baselinePath = optarg;
+			break;
+		case 'w':
+			write = true;
+			break;
+		case 'a':
+			cloxOption = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	int count = argc - optind - 1;
+	if (runs < 1 || runs > MAX_RUNS || count < 1 || count > MAX_WORKLOADS ||
+		(write && baselinePath == NULL))
+		usage();
+	const char *clox = argv[optind];
+
+	static Result baseline[MAX_WORKLOADS];
+	static Result results[MAX_WORKLOADS];
+	int baselineCount = 0;
+	if (baselinePath != NULL && !write)
+	{
+		baselineCount = readBaseline(baselinePath, baseline);
+		if (baselineCount == 0)
+			fprintf(stderr, "No baseline in \"%s\", see 'make "
+							"bench-baseline'.\n", baselinePath);
+	}
+
+	printf("%d runs each, regressions over %.0f%%\n", runs, threshold);
+	printf("%-16s %10s %8s %9s  %s\n", "workload", "median ms", "stddev",
+		   "peak KB", baselineCount > 0 ? "vs baseline" : "");
+
+	int regressions = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const char *path = argv[optind + 1 + i];
+		Result *result = &results[i];
+		if (!measure(clox, cloxOption, path, runs, result))
+		{
+			fprintf(stderr, "Could not run \"%s\".\n", path);
+			return 70;
+		}
+		printf("%-16s %10.1f %8.1f %9ld", result->name, result->median,
+			   result->stddev, result->peakKb);
+
+		Result *base = findResult(baseline, baselineCount, result->name);
+		if (base != NULL)
+		{
+			double time = (result->median / base->median - 1) * 100;
+			double memory = ((double)result->peakKb / base->peakKb - 1) * 100;
+			bool regressed = time > threshold || memory > threshold;
+			printf("  %+6.1f%% time %+6.1f%% memory%s", time, memory,
+				   regressed ? "  REGRESSION" : "");
+			if (regressed)
+				regressions++;
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (write)
+	{
+		if (!writeBaseline(baselinePath, results, count))
+		{
+			fprintf(stderr, "Could not write \"%s\".\n", baselinePath);
+			return 74;
+		}
+		printf("baseline written to %s\n", baselinePath);
+	}
+	return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+// runs one VM per thread through the embedding API and reports how the
+// throughput scales with the number of threads.
+// usage: vm_threads [runs per thread] [max threads] [script.lox]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+// cpu bound and allocation heavy, so that the GC runs too
+static const char *defaultScript =
+	"fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+	"class Pair { init(a, b) { this.a = a; this.b = b; } }\n"
+	"var list = nil;\n"
+	"for (var i = 0; i < 20000; i = i + 1) list = Pair(\"item\" + \"s\", list);\n"
+	"var result = fib(20);\n";
+
+typedef struct
+{
+	const char *source;
+	int runs;
+	int failed;
+} Worker;
+
+static int runWorker(void *arg)
+{
+	Worker *worker = (Worker *)arg;
+	for (int i = 0; i < worker->runs; i++)
+	{
+		VM *vm = createVM();
+		if (vm == NULL || interpret(vm, worker->source) != INTERPRET_OK)
+			worker->failed++;
+		if (vm != NULL)
+			destroyVM(vm);
+	}
+	return 0;
+}
+
+static char *readFile(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	char *source = (char *)malloc(size + 1);
+	if (source != NULL)
+	{
+		size_t read = fread(source, 1, size, file);
+		source[read] = '\0';
+	}
+	fclose(file);
+	return source;
+}
+
+static double now()
+{
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main(int argc, const char *argv[])
+{
+	int runs = argc > 1 ? atoi(argv[1]) : 20;
+	int maxThreads = argc > 2 ? atoi(argv[2])
+							  : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	const char *source = defaultScript;
+	if (argc > 3 && (source = readFile(argv[3])) == NULL)
+	{
+		fprintf(stderr, "Could not read \"%s\".\n", argv[3]);
+		return 74;
+	}
+	if (runs < 1 || maxThreads < 1)
+	{
+		fprintf(stderr, "Usage: vm_threads [runs per thread] [max threads] "
+						"[script.lox]\n");
+		return 64;
+	}
+
+	printf("%d runs per thread, %ld cores\n", runs,
+		   sysconf(_SC_NPROCESSORS_ONLN));
+	printf("threads  runs/s  speedup\n");
+
+	double base = 0;
+	for (int threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		thrd_t *ids = (thrd_t *)malloc(sizeof(thrd_t) * threads);
+		Worker *workers = (Worker *)calloc(threads, sizeof(Worker));
+		if (ids == NULL || workers == NULL)
+			return 1;
+
+		double start = now();
+		for (int i = 0; i < threads; i++)
+		{
+			workers[i].source = source;
+			workers[i].runs = runs;
+			if (thrd_create(&ids[i], runWorker, &workers[i]) != thrd_success)
+				return 1;
+		}
+
+		int failed = 0;
+		for (int i = 0; i < threads; i++)
+		{
+			thrd_join(ids[i], NULL);
+			failed += workers[i].failed;
+		}
+		double elapsed = now() - start;
+
+		double throughput = threads * runs / elapsed;
+		if (threads == 1)
+			base = throughput;
+		printf("%7d  %6.1f  %6.2fx%s\n", threads, throughput,
+			   throughput / base, failed > 0 ? "  (runs failed)" : "");
+
+		free(workers);
+		free(ids);
+	}
+
+	if (source != defaultScript)
+		free((char *)source);
+	return 0;
+}
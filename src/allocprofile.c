@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocprofile.h"
+#include "bytecode.h"
+#include "vm.h"
+
+#define MAX_NAME 128
+// the sites with the most bytes that are reported
+#define REPORT_SITES 30
+
+// a function and line, along with the type of object allocated there
+typedef struct
+{
+	char *name;
+	ObjType type;
+	uint64_t hash;
+	uint64_t samples;
+	uint64_t bytes; // estimated from the samples
+	uint64_t liveBytes;
+	// of objects that were freed after outliving a collection
+	uint64_t survivedBytes;
+} Site;
+
+// a sampled object that is still alive
+typedef struct
+{
+	Obj *object; // NULL if empty, TOMBSTONE if removed
+	int site;
+	uint64_t bytes;
+	uint64_t collection; // collections before it was allocated
+} Sample;
+
+#define TOMBSTONE ((Obj *)1)
+
+// nothing here lives on the Lox heap, so sampling never collects
+typedef struct AllocProfile
+{
+	size_t interval;
+	size_t countdown;
+	uint64_t sinceSample;
+	uint64_t bytes;
+
+	Site *sites;
+	int siteCount;
+	int siteCapacity;
+	int *siteSlots; // index + 1 into sites, 0 if empty
+	int slotCapacity;
+
+	Sample *samples;
+	int sampleCount; // including tombstones
+	int sampleCapacity;
+} AllocProfile;
+
+static void *allocate(size_t size)
+{
+	void *result = calloc(1, size);
+	if (result == NULL)
+		exit(1);
+	return result;
+}
+
+void startAllocProfile(VM *vm, size_t interval)
+{
+	AllocProfile *profile = (AllocProfile *)allocate(sizeof(AllocProfile));
+	profile->interval = interval;
+	profile->countdown = interval;
+	vm->allocProfile = profile;
+}
+
+// -------- sites --------
+
+// the allocating function and line, from the frame on top
+static int describeSite(VM *vm, char *buffer, size_t size)
+{
+	if (vm->frameCount == 0)
+		return snprintf(buffer, size, "(compiler)");
+
+	CallFrame *frame = &vm->frames[vm->frameCount - 1];
+	ObjFunction *function = frame->closure->function;
+	const char *name = function->name == NULL ? "script"
+											  : function->name->chars;
+	int offset = (int)(frame->ip - function->chunk.code - 1);
+#ifdef STRIP_LINE_INFO
+	(void)offset;
+	return snprintf(buffer, size, "%.*s", MAX_NAME, name);
+#else
+	return snprintf(buffer, size, "%.*s:%d", MAX_NAME, name,
+					getLine(&function->chunk, offset < 0 ? 0 : offset));
+#endif
+}
+
+static void growSlots(AllocProfile *profile)
+{
+	int capacity = profile->slotCapacity < 64 ? 64 : profile->slotCapacity * 2;
+	int *slots = (int *)allocate(sizeof(int) * capacity);
+	for (int i = 0; i < profile->siteCount; i++)
+	{
+		uint64_t index = profile->sites[i].hash & (capacity - 1);
+		while (slots[index] != 0)
+			index = (index + 1) & (capacity - 1);
+		slots[index] = i + 1;
+	}
+	free(profile->siteSlots);
+	profile->siteSlots = slots;
+	profile->slotCapacity = capacity;
+}
+
+static int findSite(AllocProfile *profile, const char *name, int length,
+					ObjType type)
+{
+	if (profile->siteCount + 1 > profile->slotCapacity * 3 / 4)
+		growSlots(profile);
+
+	uint64_t hash = hashSource(name, length) ^ type;
+	uint64_t index = hash & (profile->slotCapacity - 1);
+	for (;;)
+	{
+		int slot = profile->siteSlots[index];
+		if (slot == 0)
+			break;
+		Site *site = &profile->sites[slot - 1];
+		if (site->hash == hash && site->type == type &&
+			strcmp(site->name, name) == 0)
+			return slot - 1;
+		index = (index + 1) & (profile->slotCapacity - 1);
+	}
+
+	if (profile->siteCount == profile->siteCapacity)
+	{
+		int capacity = profile->siteCapacity < 16 ? 16
+												  : profile->siteCapacity * 2;
+		Site *sites = (Site *)realloc(profile->sites, sizeof(Site) * capacity);
+		if (sites == NULL)
+			exit(1);
+		profile->sites = sites;
+		profile->siteCapacity = capacity;
+	}
+
+	Site *site = &profile->sites[profile->siteCount];
+	memset(site, 0, sizeof(Site));
+	site->name = (char *)allocate(length + 1);
+	memcpy(site->name, name, length);
+	site->type = type;
+	site->hash = hash;
+	profile->siteSlots[index] = ++profile->siteCount;
+	return profile->siteCount - 1;
+}
+
+// -------- samples --------
+
+static uint64_t hashObject(Obj *object)
+{
+	return ((uintptr_t)object >> 4) * 0x9e3779b97f4a7c15u;
+}
+
+static Sample *findSample(Sample *samples, int capacity, Obj *object)
+{
+	uint64_t index = hashObject(object) & (capacity - 1);
+	Sample *tombstone = NULL;
+	for (;;)
+	{
+		Sample *sample = &samples[index];
+		if (sample->object == NULL)
+			return tombstone != NULL ? tombstone : sample;
+		if (sample->object == TOMBSTONE)
+		{
+			if (tombstone == NULL)
+				tombstone = sample;
+		}
+		else if (sample->object == object)
+		{
+			return sample;
+		}
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void growSamples(AllocProfile *profile)
+{
+	int capacity = profile->sampleCapacity < 64 ? 64
+												: profile->sampleCapacity * 2;
+	Sample *samples = (Sample *)allocate(sizeof(Sample) * capacity);
+	int count = 0;
+	for (int i = 0; i < profile->sampleCapacity; i++)
+	{
+		Sample *sample = &profile->samples[i];
+		if (sample->object == NULL || sample->object == TOMBSTONE)
+			continue;
+		*findSample(samples, capacity, sample->object) = *sample;
+		count++;
+	}
+	free(profile->samples);
+	profile->samples = samples;
+	profile->sampleCapacity = capacity;
+	profile->sampleCount = count;
+}
+
+void countAllocation(VM *vm, Obj *object, size_t size)
+{
+	AllocProfile *profile = vm->allocProfile;
+	profile->bytes += size;
+	profile->sinceSample += size;
+	if (size < profile->countdown)
+	{
+		profile->countdown -= size;
+		return;
+	}
+	profile->countdown = profile->interval;
+
+	// the sample stands for everything allocated since the last one
+	char name[MAX_NAME + 16];
+	int length = describeSite(vm, name, sizeof(name));
+	int index = findSite(profile, name, length, object->type);
+	Site *site = &profile->sites[index];
+	site->samples++;
+	site->bytes += profile->sinceSample;
+	site->liveBytes += profile->sinceSample;
+
+	if (profile->sampleCount + 1 > profile->sampleCapacity * 3 / 4)
+		growSamples(profile);
+	Sample *sample = findSample(profile->samples, profile->sampleCapacity,
+								object);
+	if (sample->object == NULL)
+		profile->sampleCount++;
+	sample->object = object;
+	sample->site = index;
+	sample->bytes = profile->sinceSample;
+	sample->collection = vm->gcStats.collections;
+	object->isSampled = true;
+	profile->sinceSample = 0;
+}
+
+void sampledFree(VM *vm, Obj *object)
+{
+	AllocProfile *profile = vm->allocProfile;
+	if (profile == NULL)
+		return;
+	Sample *sample = findSample(profile->samples, profile->sampleCapacity,
+								object);
+	if (sample->object != object)
+		return;
+
+	// a collection frees what it finds unreachable, so one that
+	// started later than the first after the allocation was outlived
+	Site *site = &profile->sites[sample->site];
+	site->liveBytes -= sample->bytes;
+	if (vm->gcStats.collections > sample->collection)
+		site->survivedBytes += sample->bytes;
+	sample->object = TOMBSTONE;
+}
+
+// -------- report --------
+
+typedef struct
+{
+	Site *site;
+	uint64_t survived;
+} Row;
+
+// sorts by bytes, descending
+static int compareRows(const void *a, const void *b)
+{
+	uint64_t x = ((const Row *)a)->site->bytes;
+	uint64_t y = ((const Row *)b)->site->bytes;
+	return (x < y) - (x > y);
+}
+
+static const char *typeName(ObjType type)
+{
+	switch (type)
+	{
+	case OBJ_BOUND_METHOD:
+		return "bound method";
+	case OBJ_CLASS:
+		return "class";
+	case OBJ_CLOSURE:
+		return "closure";
+	case OBJ_FUNCTION:
+		return "function";
+	case OBJ_INSTANCE:
+		return "instance";
+	case OBJ_NATIVE:
+		return "native";
+	case OBJ_STRING:
+		return "string";
+	case OBJ_UPVALUE:
+		return "upvalue";
+	case OBJ_CHANNEL:
+		return "channel";
+	case OBJ_FIBER:
+		return "fiber";
+	}
+	return "?";
+}
+
+void printAllocProfile(VM *vm)
+{
+	AllocProfile *profile = vm->allocProfile;
+	if (profile == NULL)
+		return;
+
+	Row *rows = (Row *)allocate(sizeof(Row) * (profile->siteCount + 1));
+	for (int i = 0; i < profile->siteCount; i++)
+	{
+		rows[i].site = &profile->sites[i];
+		rows[i].survived = profile->sites[i].survivedBytes;
+	}
+	// live objects count as survivors once a collection has passed
+	for (int i = 0; i < profile->sampleCapacity; i++)
+	{
+		Sample *sample = &profile->samples[i];
+		if (sample->object != NULL && sample->object != TOMBSTONE &&
+			vm->gcStats.collections > sample->collection)
+			rows[sample->site].survived += sample->bytes;
+	}
+	qsort(rows, profile->siteCount, sizeof(Row), compareRows);
+
+	fprintf(stderr, "-- allocations: %llu bytes of objects, sampled every "
+					"%zu bytes\n",
+			(unsigned long long)profile->bytes, profile->interval);
+	fprintf(stderr, "%-32s %-12s %12s %8s %12s %9s\n", "site", "type",
+			"bytes", "samples", "live", "survived");
+	for (int i = 0; i < profile->siteCount && i < REPORT_SITES; i++)
+	{
+		Site *site = rows[i].site;
+		fprintf(stderr, "%-32s %-12s %12llu %8llu %12llu %8.1f%%\n",
+				site->name, typeName(site->type),
+				(unsigned long long)site->bytes,
+				(unsigned long long)site->samples,
+				(unsigned long long)site->liveBytes,
+				100.0 * rows[i].survived / site->bytes);
+	}
+	if (profile->siteCount > REPORT_SITES)
+		fprintf(stderr, "(%d more sites)\n",
+				profile->siteCount - REPORT_SITES);
+	free(rows);
+}
+
+void stopAllocProfile(VM *vm)
+{
+	AllocProfile *profile = vm->allocProfile;
+	if (profile == NULL)
+		return;
+	printAllocProfile(vm);
+	vm->allocProfile = NULL;
+
+	for (int i = 0; i < profile->siteCount; i++)
+		free(profile->sites[i].name);
+	free(profile->sites);
+	free(profile->siteSlots);
+	free(profile->samples);
+	free(profile);
+}
+
+Value allocProfileNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+	if (vm->allocProfile == NULL)
+		return nativeError(vm, "Allocations are not being profiled, see "
+							   "--alloc-profile.");
+
+	flushOutput(&vm->output);
+	printAllocProfile(vm);
+	return NIL_VAL;
+}
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// every allocation is aligned for doubles and pointers
+#define ARENA_ALIGNMENT 8
+#define ALIGN_SIZE(size) \
+	(((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+void initArena(Arena *arena)
+{
+	arena->blocks = NULL;
+	arena->spare = NULL;
+	arena->last = NULL;
+	arena->bytesAllocated = 0;
+}
+
+static void freeBlocks(ArenaBlock *block)
+{
+	while (block != NULL)
+	{
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+void freeArena(Arena *arena)
+{
+	freeBlocks(arena->blocks);
+	freeBlocks(arena->spare);
+	initArena(arena);
+}
+
+static ArenaBlock *newBlock(Arena *arena, size_t size)
+{
+	if (size == ARENA_BLOCK_SIZE && arena->spare != NULL)
+	{
+		ArenaBlock *block = arena->spare;
+		arena->spare = block->next;
+		block->used = 0;
+		return block;
+	}
+
+	ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL)
+		exit(1);
+
+	block->size = size;
+	block->used = 0;
+	arena->bytesAllocated += size;
+	return block;
+}
+
+void *arenaAllocate(Arena *arena, size_t size)
+{
+	size = ALIGN_SIZE(size);
+	ArenaBlock *head = arena->blocks;
+
+	// big allocations go behind the head, so that
+	// the rest of the head block is not wasted
+	if (size > ARENA_BLOCK_SIZE / 4)
+	{
+		ArenaBlock *block = newBlock(arena, size);
+		block->used = size;
+		if (head != NULL)
+		{
+			block->next = head->next;
+			head->next = block;
+		}
+		else
+		{
+			block->next = NULL;
+			arena->blocks = block;
+			arena->last = NULL;
+		}
+		return block->bytes;
+	}
+
+	if (head == NULL || head->size - head->used < size)
+	{
+		head = newBlock(arena, ARENA_BLOCK_SIZE);
+		head->next = arena->blocks;
+		arena->blocks = head;
+	}
+
+	void *pointer = head->bytes + head->used;
+	head->used += size;
+	arena->last = pointer;
+	return pointer;
+}
+
+void *arenaGrow(Arena *arena, void *pointer, size_t oldSize, size_t newSize)
+{
+	// the newest allocation of the head block can simply be extended
+	if (pointer != NULL && pointer == arena->last)
+	{
+		ArenaBlock *head = arena->blocks;
+		size_t offset = (size_t)((uint8_t *)pointer - head->bytes);
+		if (offset + ALIGN_SIZE(newSize) <= head->size)
+		{
+			head->used = offset + ALIGN_SIZE(newSize);
+			return pointer;
+		}
+	}
+
+	void *grown = arenaAllocate(arena, newSize);
+	if (oldSize > 0)
+		memcpy(grown, pointer, oldSize < newSize ? oldSize : newSize);
+	return grown;
+}
+
+void *arenaCopy(Arena *arena, const void *pointer, size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	void *copy = arenaAllocate(arena, size);
+	memcpy(copy, pointer, size);
+	return copy;
+}
+
+ArenaMark arenaMark(Arena *arena)
+{
+	ArenaMark mark;
+	mark.block = arena->blocks;
+	mark.used = mark.block != NULL ? mark.block->used : 0;
+	mark.last = arena->last;
+	return mark;
+}
+
+void arenaRelease(Arena *arena, ArenaMark mark)
+{
+	// big blocks that went behind the marked block are left
+	// alone, they are only freed together with the arena
+	while (arena->blocks != mark.block)
+	{
+		ArenaBlock *block = arena->blocks;
+		arena->blocks = block->next;
+		if (block->size == ARENA_BLOCK_SIZE)
+		{
+			block->next = arena->spare;
+			arena->spare = block;
+		}
+		else
+		{
+			arena->bytesAllocated -= block->size;
+			free(block);
+		}
+	}
+
+	if (mark.block != NULL)
+		mark.block->used = mark.used;
+	arena->last = mark.last;
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "serialize.h"
+#include "vm.h"
+
+// the byte order marker makes caches from other machines look stale
+#define BYTE_ORDER_MARK 0x01020304u
+#define FLAG_HAS_LINES 0x1u
+// guards the C stack against corrupt files with absurd nesting
+#define MAX_FUNCTION_DEPTH 256
+
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t flags;
+	uint64_t sourceHash;
+} CacheHeader;
+
+typedef enum
+{
+	CONST_NIL,
+	CONST_FALSE,
+	CONST_TRUE,
+	CONST_NUMBER,
+	CONST_STRING,
+	CONST_FUNCTION,
+} ConstantTag;
+
+static uint32_t buildFlags()
+{
+#ifdef STRIP_LINE_INFO
+	return 0;
+#else
+	return FLAG_HAS_LINES;
+#endif
+}
+
+// FNV-1a, 64 bit version of hashString()
+uint64_t hashSource(const char *source, size_t length)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= (uint8_t)source[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+// -------- writing --------
+
+static void writeString(Writer *writer, ObjString *string)
+{
+	if (string == NULL)
+	{
+		writeU32(writer, UINT32_MAX);
+		return;
+	}
+
+	writeU32(writer, (uint32_t)string->length);
+	writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer *writer, ObjFunction *function)
+{
+	Chunk *chunk = &function->chunk;
+
+	writeU32(writer, (uint32_t)function->arity);
+	writeU32(writer, (uint32_t)function->upvalueCount);
+	writeString(writer, function->name);
+
+	writeChunkCode(writer, chunk);
+
+	writeU32(writer, (uint32_t)chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++)
+	{
+		Value constant = chunk->constants.values[i];
+		switch (constant.type)
+		{
+		case VAL_NIL:
+			writeU8(writer, CONST_NIL);
+			break;
+		case VAL_BOOL:
+			writeU8(writer, AS_BOOL(constant) ? CONST_TRUE : CONST_FALSE);
+			break;
+		case VAL_NUMBER:
+		{
+			writeU8(writer, CONST_NUMBER);
+			writeDouble(writer, AS_NUMBER(constant));
+			break;
+		}
+		case VAL_OBJ:
+			if (IS_STRING(constant))
+			{
+				writeU8(writer, CONST_STRING);
+				writeString(writer, AS_STRING(constant));
+			}
+			else
+			{
+				writeU8(writer, CONST_FUNCTION);
+				writeFunction(writer, AS_FUNCTION(constant));
+			}
+			break;
+		}
+	}
+}
+
+bool writeBytecodeCache(const char *path, ObjFunction *function,
+						uint64_t sourceHash)
+{
+	Writer writer;
+	initWriter(&writer);
+
+	CacheHeader header;
+	memcpy(header.magic, LOXC_MAGIC, sizeof(header.magic));
+	header.version = LOXC_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.flags = buildFlags();
+	header.sourceHash = sourceHash;
+	writeBytes(&writer, &header, sizeof(header));
+	writeFunction(&writer, function);
+
+	bool success = writeFileAtomic(path, &writer);
+	freeWriter(&writer);
+	return success;
+}
+
+// -------- reading --------
+
+static ObjString *readString(VM *vm, Reader *reader)
+{
+	uint32_t length = readU32(reader);
+	if (length == UINT32_MAX)
+		return NULL;
+
+	const uint8_t *chars = readSpan(reader, length);
+	if (chars == NULL)
+		return NULL;
+	return copyString(vm, (const char *)chars, (int)length);
+}
+
+// rebuilds a function from the mapping. code and line table are used in
+// place, which is why their capacities stay 0 (see freeChunk())
+static ObjFunction *readFunction(VM *vm, Reader *reader, int depth)
+{
+	if (depth > MAX_FUNCTION_DEPTH)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+
+	ObjFunction *function = newFunction(vm);
+	push(vm, OBJ_VAL(function)); // keep it safe from the GC while loading
+	Chunk *chunk = &function->chunk;
+
+	function->arity = (int)readU32(reader);
+	function->upvalueCount = (int)readU32(reader);
+	function->name = readString(vm, reader);
+
+	readChunkCode(reader, chunk);
+
+	uint32_t constantCount = readU32(reader);
+	for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+	{
+		Value constant = NIL_VAL;
+		switch (readU8(reader))
+		{
+		case CONST_NIL:
+			break;
+		case CONST_FALSE:
+			constant = BOOL_VAL(false);
+			break;
+		case CONST_TRUE:
+			constant = BOOL_VAL(true);
+			break;
+		case CONST_NUMBER:
+		{
+			constant = NUMBER_VAL(readDouble(reader));
+			break;
+		}
+		case CONST_STRING:
+		{
+			ObjString *string = readString(vm, reader);
+			if (string != NULL)
+				constant = OBJ_VAL(string);
+			else
+				reader->failed = true;
+			break;
+		}
+		case CONST_FUNCTION:
+		{
+			ObjFunction *nested = readFunction(vm, reader, depth + 1);
+			if (nested != NULL)
+				constant = OBJ_VAL(nested);
+			break;
+		}
+		default:
+			reader->failed = true;
+			break;
+		}
+		addConstant(vm, chunk, constant);
+	}
+	if (!reader->failed && !checkFunction(function))
+		reader->failed = true;
+
+	pop(vm);
+	return reader->failed ? NULL : function;
+}
+
+// moves the code and line table of function, and of the functions
+// nested in it, out of the mapping into arrays the chunks own
+static void copyCode(VM *vm, ObjFunction *function)
+{
+	Chunk *chunk = &function->chunk;
+	uint8_t *code = ALLOCATE(vm, uint8_t, chunk->count);
+	memcpy(code, chunk->code, chunk->count);
+	chunk->code = code;
+	chunk->capacity = chunk->count;
+#ifndef STRIP_LINE_INFO
+	LineStart *lines = ALLOCATE(vm, LineStart, chunk->lineCount);
+	memcpy(lines, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+	chunk->lines = lines;
+	chunk->lineCapacity = chunk->lineCount;
+#endif
+
+	for (int i = 0; i < chunk->constants.count; i++)
+	{
+		if (IS_FUNCTION(chunk->constants.values[i]))
+			copyCode(vm, AS_FUNCTION(chunk->constants.values[i]));
+	}
+}
+
+ObjFunction *loadBytecodeCache(VM *vm, const char *path, uint64_t sourceHash)
+{
+	size_t size;
+	void *base = mapFile(path, &size);
+	if (base == NULL)
+		return NULL;
+
+	CacheHeader header;
+	Reader reader;
+	initReader(&reader, base, size);
+	readBytes(&reader, &header, sizeof(header));
+	if (reader.failed ||
+		memcmp(header.magic, LOXC_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != LOXC_VERSION ||
+		header.byteOrder != BYTE_ORDER_MARK ||
+		header.flags != buildFlags() ||
+		header.sourceHash != sourceHash)
+	{
+		unmapFile(base, size);
+		return NULL;
+	}
+
+	// the script is called without arguments, or a closure to take
+	// upvalues from
+	ObjFunction *function = readFunction(vm, &reader, 0);
+	if (function == NULL || function->arity != 0 ||
+		function->upvalueCount != 0 ||
+		reader.current != reader.end)
+	{
+		// objects from a failed load are left to the GC. their chunks
+		// never free the borrowed code, so unmapping here is safe
+		unmapFile(base, size);
+		return NULL;
+	}
+
+	if (vm->copyCachedCode)
+	{
+		push(vm, OBJ_VAL(function)); // copying can collect
+		copyCode(vm, function);
+		pop(vm);
+		unmapFile(base, size);
+		return function;
+	}
+
+	// the code of the loaded functions lives in the mapping,
+	// so keep it around for as long as the VM does
+	keepMapped(vm, base, size);
+	return function;
+}
+
+// returns a malloc'ed path of the cache for the given source path
+static char *cachePathFor(const char *path)
+{
+	size_t length = strlen(path);
+	char *cachePath = (char *)malloc(length + 6);
+	if (cachePath == NULL)
+		exit(1);
+
+	memcpy(cachePath, path, length);
+	if (length > 4 && memcmp(path + length - 4, ".lox", 4) == 0)
+		memcpy(cachePath + length, "c", 2);
+	else
+		memcpy(cachePath + length, ".loxc", 6);
+	return cachePath;
+}
+
+ObjFunction *compileCached(VM *vm, const char *path, const char *source,
+						   size_t length)
+{
+	uint64_t hash = hashSource(source, length);
+	char *cachePath = cachePathFor(path);
+
+	ObjFunction *function = loadBytecodeCache(vm, cachePath, hash);
+	if (function == NULL)
+	{
+		function = compile(vm, source, length);
+		// the cache is best effort, e.g. the directory may be read-only
+		if (function != NULL)
+			writeBytecodeCache(cachePath, function, hash);
+	}
+
+	free(cachePath);
+	return function;
+}
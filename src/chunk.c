@@ -15,39 +15,97 @@ void initChunk(Chunk *chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+#ifndef STRIP_LINE_INFO
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+#endif
     initValueArray(&chunk->constants);
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line)
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(
+        chunk->code = GROW_ARRAY(vm,
             uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(
-            int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+#ifndef STRIP_LINE_INFO
+    // still on the same line, so the current run covers this byte
+    if (chunk->lineCount > 0 &&
+        chunk->lines[chunk->lineCount - 1].line == line)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(vm,
+            LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+#endif
 }
 
-void freeChunk(Chunk *chunk)
+void freeChunk(VM *vm, Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    // chunks loaded from a .loxc file borrow their code and lines
+    // from the mapping and have no capacity of their own
+    if (chunk->capacity > 0)
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+#ifndef STRIP_LINE_INFO
+    if (chunk->lineCapacity > 0)
+        FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+#endif
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
 
-int addConstant(Chunk *chunk, Value value)
+int addConstant(VM *vm, Chunk *chunk, Value value)
 {
-    push(value); // push and pop to guarantee that the GC doesnt delete it
-    writeValueArray(&chunk->constants, value);
-    pop();
+    push(vm, value); // push and pop to guarantee that the GC doesnt delete it
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
+}
+
+// returns the source line of the instruction at offset
+// (always 0 when line info was stripped at build time)
+int getLine(Chunk *chunk, int offset)
+{
+#ifdef STRIP_LINE_INFO
+    return 0;
+#else
+    // binary search for the last run starting at or before offset
+    int start = 0;
+    int end = chunk->lineCount - 1;
+
+    for (;;)
+    {
+        int mid = (start + end) / 2;
+        LineStart *line = &chunk->lines[mid];
+        if (offset < line->offset)
+        {
+            end = mid - 1;
+        }
+        else if (mid == chunk->lineCount - 1 ||
+                 offset < chunk->lines[mid + 1].offset)
+        {
+            return line->line;
+        }
+        else
+        {
+            start = mid + 1;
+        }
+    }
+#endif
 }
\ No newline at end of file
@@ -1,25 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <threads.h>
+#include <time.h>
 
 #include "common.h"
+#include "arena.h"
 #include "compiler.h"
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "serialize.h"
+#include "trace.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
 // -------- structs n shit --------
 
-typedef struct
-{
-	Token current;
-	Token previous;
-	bool hadError;
-	bool panicMode;
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum
 {
@@ -36,7 +36,7 @@ typedef enum
 	PREC_PRIMARY	 // literals n shit
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct
 {
@@ -66,16 +66,86 @@ typedef enum
 	TYPE_SCRIPT
 } FunctionType;
 
+typedef enum
+{
+	CONSTANT_VALUE,
+	CONSTANT_STRING,
+	CONSTANT_FUNCTION
+} ConstantType;
+
+// a constant that only becomes a Value once the compilation succeeded
+typedef struct
+{
+	ConstantType type;
+	union
+	{
+		Value value;
+		Token string;
+		struct Proto *function;
+	} as;
+} Constant;
+
+// what a pre-parsed body needs to be compiled later on
+typedef struct
+{
+	const char *source;
+	int length;
+	int line;
+	FunctionType type;
+	bool inClass;
+	// the name of each upvalue, in order
+	Token *upvalueNames;
+	int upvalueNameCapacity;
+} ProtoLazy;
+
+// like Chunk, but with constants that are not allocated yet
+typedef struct
+{
+	int count;
+	int capacity;
+	uint8_t *code;
+#ifndef STRIP_LINE_INFO
+	int lineCount;
+	int lineCapacity;
+	LineStart *lines;
+#endif
+	int constantCount;
+	int constantCapacity;
+	Constant *constants;
+} ProtoChunk;
+
+// a function being compiled. it lives in the compile arena until
+// the whole compilation succeeded and is turned into an ObjFunction
+typedef struct Proto
+{
+	int arity;
+	int upvalueCount;
+	Token name; // not used by the script
+	// grows in the scratch arena while the function is being compiled
+	ProtoChunk chunk;
+	Upvalue *upvalues;
+	ProtoLazy *lazy;
+} Proto;
+
 typedef struct Compiler
 {
 	struct Compiler *enclosing;
-	ObjFunction *function;
+	Proto *proto;
 	FunctionType type;
+	// everything this compiler put in the scratch arena comes after it
+	ArenaMark scratchMark;
 
-	Local locals[UINT8_COUNT];
+	// grows in the scratch arena, up to UINT8_COUNT entries
+	Local *locals;
 	int localCount;
-	Upvalue upvalues[UINT8_COUNT];
+	int localCapacity;
+	// allocated in full, as inner functions add to it while
+	// they have scratch memory of their own on top of it
+	Upvalue *upvalues;
 	int scopeDepth;
+
+	// set when compiling a pre-parsed body on its first call
+	LazyBody *lazy;
 } Compiler;
 
 typedef struct ClassCompiler
@@ -83,76 +153,101 @@ typedef struct ClassCompiler
 	struct ClassCompiler *enclosing;
 } ClassCompiler;
 
+// everything one compilation works on. nothing else is written to until
+// the result is materialized, so sources can be parsed in parallel
+struct Parser
+{
+	Scanner scanner;
+	Token current;
+	Token previous;
+	bool hadError;
+	bool panicMode;
+
+	// the current compiler
+	Compiler *compiler;
+	// the current class being compiled
+	ClassCompiler *currentClass;
+	// the finished protos, freed when the compilation is done
+	Arena arena;
+	// the growing arrays of the compilers. a compiler releases its part
+	// when it ends, so the memory is reused by the next function
+	Arena scratch;
+	// whether function bodies are only pre-parsed
+	bool lazyCompilation;
+	LazyStats lazyStats;
+	// reported by freeParser(), so that the errors of
+	// parallel compilations don't get mixed up
+	Writer errors;
+};
+
 // -------- variables --------
 
-// the parser
-Parser parser;
-// the current compiler
-Compiler *current = NULL;
-// the current class being compiled
-ClassCompiler *currentClass = NULL;
-// the chunk being compiled
-Chunk *compilingChunk;
 // retreives the current chunk
-static Chunk *currentChunk()
+static ProtoChunk *currentChunk(Parser *parser)
 {
-	return &current->function->chunk;
+	return &parser->compiler->proto->chunk;
 }
 
 // -------- predefinitions --------
-static void initCompiler(Compiler *compiler, FunctionType type);
-static ObjFunction *endCompiler();
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal);
-
-static void advance();
-static void declareVariable();
-static void beginScope();
-static void endScope();
-
-static void expression();
-static void statement();
-static void varDeclaration();
-static void classDeclaration();
-static void funDeclaration();
-static void expressionStatement();
-static void printStatement();
-static void returnStatement();
-static void ifStatement();
-static void forStatement();
-static void whileStatement();
-static void declaration();
-
-static void grouping(bool canAssign);
-static void number(bool canAssign);
-static void unary(bool canAssign);
-static void binary(bool canAssign);
-static void call(bool canAssign);
-static void literal(bool canAssign);
-static void string(bool canAssign);
-static void variable(bool canAssign);
-static void and_(bool canAssign);
-static void or_(bool canAssign);
-static void dot(bool canAssign);
-static void this_(bool canAssign);
-
-static void namedVariable(Token name, bool canAssing);
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type);
+static Proto *closeCompiler(Parser *parser);
+static Proto *endCompiler(Parser *parser);
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index, bool isLocal);
+static int addNamedUpvalue(Parser *parser, Compiler *compiler, uint8_t index,
+						   bool isLocal, Token *name);
+
+static void advance(Parser *parser);
+static void declareVariable(Parser *parser);
+static void beginScope(Parser *parser);
+static void endScope(Parser *parser);
+
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void varDeclaration(Parser *parser);
+static void classDeclaration(Parser *parser);
+static void funDeclaration(Parser *parser);
+static void expressionStatement(Parser *parser);
+static void printStatement(Parser *parser);
+static void returnStatement(Parser *parser);
+static void ifStatement(Parser *parser);
+static void forStatement(Parser *parser);
+static void whileStatement(Parser *parser);
+static void declaration(Parser *parser);
+
+static void grouping(Parser *parser, bool canAssign);
+static void number(Parser *parser, bool canAssign);
+static void unary(Parser *parser, bool canAssign);
+static void binary(Parser *parser, bool canAssign);
+static void call(Parser *parser, bool canAssign);
+static void literal(Parser *parser, bool canAssign);
+static void string(Parser *parser, bool canAssign);
+static void variable(Parser *parser, bool canAssign);
+static void and_(Parser *parser, bool canAssign);
+static void or_(Parser *parser, bool canAssign);
+static void dot(Parser *parser, bool canAssign);
+static void this_(Parser *parser, bool canAssign);
+
+static void namedVariable(Parser *parser, Token name, bool canAssing);
 
 // -------- error stuff --------
 
 // displays an error with the given token and message
-static void errorAt(Token *token, const char *message)
+static void errorAt(Parser *parser, Token *token, const char *message)
 {
 	// already in panicmode. swallow error.
-	if (parser.panicMode)
+	if (parser->panicMode)
 		return;
 
-	parser.panicMode = true;
+	parser->panicMode = true;
 
-	fprintf(stderr, "[line %d] Error", token->line);
+	Writer *errors = &parser->errors;
+	char line[32];
+	snprintf(line, sizeof(line), "[line %d] Error", token->line);
+	writeBytes(errors, line, strlen(line));
 
 	if (token->type == TOKEN_EOF)
 	{
-		fprintf(stderr, " at end");
+		writeBytes(errors, " at end", 7);
 	}
 	else if (token->type == TOKEN_ERROR)
 	{
@@ -160,36 +255,40 @@ static void errorAt(Token *token, const char *message)
 	}
 	else
 	{
-		fprintf(stderr, " at '%.*s'", token->length, token->start);
+		writeBytes(errors, " at '", 5);
+		writeBytes(errors, token->start, token->length);
+		writeBytes(errors, "'", 1);
 	}
 
-	fprintf(stderr, ": %s\n", message);
-	parser.hadError = true;
+	writeBytes(errors, ": ", 2);
+	writeBytes(errors, message, strlen(message));
+	writeBytes(errors, "\n", 1);
+	parser->hadError = true;
 }
 
 // displays an error at the previous token with the given message
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-	errorAt(&parser.previous, message);
+	errorAt(parser, &parser->previous, message);
 }
 
 // displays an error at the current token with the given message
-static void errorAtCurrent(const char *message)
+static void errorAtCurrent(Parser *parser, const char *message)
 {
-	errorAt(&parser.current, message);
+	errorAt(parser, &parser->current, message);
 }
 
 // skip tokens until something that appears to be the end
 // of a statement or smth is reached
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-	parser.panicMode = false;
+	parser->panicMode = false;
 
-	while (parser.current.type != TOKEN_EOF)
+	while (parser->current.type != TOKEN_EOF)
 	{
-		if (parser.previous.type == TOKEN_SEMICOLON)
+		if (parser->previous.type == TOKEN_SEMICOLON)
 			return;
-		switch (parser.current.type)
+		switch (parser->current.type)
 		{
 		case TOKEN_CLASS:
 		case TOKEN_FUN:
@@ -204,146 +303,210 @@ static void synchronize()
 		default:; // Do nothing.
 		}
 
-		advance();
+		advance(parser);
 	}
 }
 
 // -------- token flow stuff --------
 
 // advances to the next token
-static void advance()
+static void advance(Parser *parser)
 {
-	parser.previous = parser.current;
+	parser->previous = parser->current;
 
 	for (;;)
 	{
-		parser.current = scanToken();
-		if (parser.current.type != TOKEN_ERROR)
+		parser->current = scanToken(&parser->scanner);
+		if (parser->current.type != TOKEN_ERROR)
 			break;
 
-		errorAtCurrent(parser.current.start);
+		errorAtCurrent(parser, parser->current.start);
 	}
 }
 
 // checks if the current token is of the given type
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-	return parser.current.type == type;
+	return parser->current.type == type;
 }
 
 // consume the next token if it is of the correct type,
 // otherwise throw an error with the given message
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-	if (parser.current.type == type)
+	if (parser->current.type == type)
 	{
-		advance();
+		advance(parser);
 		return;
 	}
 
-	errorAtCurrent(message);
+	errorAtCurrent(parser, message);
 }
 
 // returns true and advances if the current token is of the given type
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-	if (!check(type))
+	if (!check(parser, type))
 		return false;
-	advance();
+	advance(parser);
 	return true;
 }
 
 // -------- emit/byte stuff --------
 
 // write one byte to the current chunk
-static void emitByte(uint8_t byte)
+static void emitByte(Parser *parser, uint8_t byte)
 {
-	writeChunk(currentChunk(), byte, parser.previous.line);
+	ProtoChunk *chunk = currentChunk(parser);
+	if (chunk->capacity < chunk->count + 1)
+	{
+		int oldCapacity = chunk->capacity;
+		chunk->capacity = GROW_CAPACITY(oldCapacity);
+		chunk->code = ARENA_GROW_ARRAY(&parser->scratch, uint8_t, chunk->code,
+									   oldCapacity, chunk->capacity);
+	}
+
+	chunk->code[chunk->count++] = byte;
+
+#ifndef STRIP_LINE_INFO
+	// same run-length encoding as writeChunk()
+	int line = parser->previous.line;
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+		return;
+
+	if (chunk->lineCapacity < chunk->lineCount + 1)
+	{
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = ARENA_GROW_ARRAY(&parser->scratch, LineStart, chunk->lines,
+										oldCapacity, chunk->lineCapacity);
+	}
+
+	LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+	lineStart->offset = chunk->count - 1;
+	lineStart->line = line;
+#endif
 }
 
 // emit two bytes to the current chunk
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-	emitByte(byte1);
-	emitByte(byte2);
+	emitByte(parser, byte1);
+	emitByte(parser, byte2);
 }
 
 // emit a (partially unfinished) jump instruction
-static int emitJump(uint8_t instruction)
+static int emitJump(Parser *parser, uint8_t instruction)
 {
-	emitByte(instruction);
-	emitByte(0xff);
-	emitByte(0xff);
-	return currentChunk()->count - 2;
+	emitByte(parser, instruction);
+	emitByte(parser, 0xff);
+	emitByte(parser, 0xff);
+	return currentChunk(parser)->count - 2;
 }
 
-// patch up the last unfinished jump instruction emitted by emitJump()
-static void patchJump(int offset)
+// patch up the last unfinished jump instruction emitted by emitJump(parser)
+static void patchJump(Parser *parser, int offset)
 {
 	// -2 to adjust for the bytecode for the jump offset itself.
-	int jump = currentChunk()->count - offset - 2;
+	int jump = currentChunk(parser)->count - offset - 2;
 
 	if (jump > UINT16_MAX)
 	{
-		error("Too much code to jump over.");
+		error(parser, "Too much code to jump over.");
 	}
 
-	currentChunk()->code[offset] = (jump >> 8) & 0xff;
-	currentChunk()->code[offset + 1] = jump & 0xff;
+	currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+	currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
 // emit the return instruction to the current chunk
-static void emitReturn()
+static void emitReturn(Parser *parser)
 {
-	if (current->type == TYPE_INITIALIZER)
+	if (parser->compiler->type == TYPE_INITIALIZER)
 	{
 		// init() returns 'this'
-		emitBytes(OP_GET_LOCAL, 0);
+		emitBytes(parser, OP_GET_LOCAL, 0);
 	}
 	else
 	{
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 	}
 
-	emitByte(OP_RETURN);
+	emitByte(parser, OP_RETURN);
 }
 
 // emit a jump back instruction or smth
-static void emitLoop(int loopStart)
+static void emitLoop(Parser *parser, int loopStart)
 {
-	emitByte(OP_JUMP_BACK);
+	emitByte(parser, OP_JUMP_BACK);
 
-	int offset = currentChunk()->count - loopStart + 2;
+	int offset = currentChunk(parser)->count - loopStart + 2;
 	if (offset > UINT16_MAX)
-		error("Loop body too large.");
+		error(parser, "Loop body too large.");
 
-	emitByte((offset >> 8) & 0xff);
-	emitByte(offset & 0xff);
+	emitByte(parser, (offset >> 8) & 0xff);
+	emitByte(parser, offset & 0xff);
 }
 
 // create a constant for the stack and return its index
-static uint8_t makeConstant(Value value)
+static uint8_t makeConstant(Parser *parser, Constant constant)
 {
-	int constant = addConstant(currentChunk(), value);
-	if (constant > UINT8_MAX)
+	ProtoChunk *chunk = currentChunk(parser);
+	if (chunk->constantCount == UINT8_COUNT)
 	{
-		error("Too many constants in one chunk.");
+		error(parser, "Too many constants in one chunk.");
 		return 0;
 	}
 
-	return (uint8_t)constant;
+	if (chunk->constantCapacity < chunk->constantCount + 1)
+	{
+		int oldCapacity = chunk->constantCapacity;
+		chunk->constantCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->constants = ARENA_GROW_ARRAY(&parser->scratch, Constant, chunk->constants,
+											oldCapacity, chunk->constantCapacity);
+	}
+
+	chunk->constants[chunk->constantCount] = constant;
+	return (uint8_t)chunk->constantCount++;
+}
+
+// a constant that needs no allocation, like a number
+static Constant valueConstant(Value value)
+{
+	Constant constant;
+	constant.type = CONSTANT_VALUE;
+	constant.as.value = value;
+	return constant;
+}
+
+// a string constant, interned once the compilation succeeded
+static Constant stringConstant(const char *start, int length)
+{
+	Constant constant;
+	constant.type = CONSTANT_STRING;
+	constant.as.string.start = start;
+	constant.as.string.length = length;
+	return constant;
+}
+
+static Constant functionConstant(Proto *function)
+{
+	Constant constant;
+	constant.type = CONSTANT_FUNCTION;
+	constant.as.function = function;
+	return constant;
 }
 
 // emit a constant to the current chunk
-static void emitConstant(Value value)
+static void emitConstant(Parser *parser, Constant constant)
 {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	emitBytes(parser, OP_CONSTANT, makeConstant(parser, constant));
 }
 
 // makes an identifier with the given name
-static uint8_t identifierConstant(Token *name)
+static uint8_t identifierConstant(Parser *parser, Token *name)
 {
-	return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+	return makeConstant(parser, stringConstant(name->start, name->length));
 }
 
 // check if two identifiers are the same
@@ -355,7 +518,7 @@ static bool identifiersEqual(Token *a, Token *b)
 }
 
 // returns the local's slot if it exists, else -1
-static int resolveLocal(Compiler *compiler, Token *name)
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
 	for (int i = compiler->localCount - 1; i >= 0; i--)
 	{
@@ -364,7 +527,7 @@ static int resolveLocal(Compiler *compiler, Token *name)
 		{
 			if (local->depth == -1)
 			{
-				error("Can't read local variable in its own initializer.");
+				error(parser, "Can't read local variable in its own initializer.");
 			}
 			return i;
 		}
@@ -373,23 +536,43 @@ static int resolveLocal(Compiler *compiler, Token *name)
 	return -1;
 }
 
+// looks the name up in the variables a pre-parsed body closes over
+static int resolveLazyUpvalue(Compiler *compiler, Token *name)
+{
+	if (compiler->lazy == NULL)
+		return -1;
+
+	ValueArray *names = &compiler->lazy->upvalueNames;
+	for (int i = 0; i < names->count; i++)
+	{
+		ObjString *upvalueName = AS_STRING(names->values[i]);
+		if (upvalueName->length == name->length &&
+			memcmp(upvalueName->chars, name->start, name->length) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 // returns the index of an upvalue if it exists, else -1
-static int resolveUpvalue(Compiler *compiler, Token *name)
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name)
 {
 	if (compiler->enclosing == NULL)
-		return -1;
+		return resolveLazyUpvalue(compiler, name);
 
-	int local = resolveLocal(compiler->enclosing, name);
+	int local = resolveLocal(parser, compiler->enclosing, name);
 	if (local != -1)
 	{
 		compiler->enclosing->locals[local].isCaptured = true;
-		return addUpvalue(compiler, (uint8_t)local, true);
+		return addNamedUpvalue(parser, compiler, (uint8_t)local, true, name);
 	}
 
-	int upvalue = resolveUpvalue(compiler->enclosing, name);
+	int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
 	if (upvalue != -1)
 	{
-		return addUpvalue(compiler, (uint8_t)upvalue, false);
+		return addNamedUpvalue(parser, compiler, (uint8_t)upvalue, false, name);
 	}
 
 	return -1;
@@ -397,24 +580,32 @@ static int resolveUpvalue(Compiler *compiler, Token *name)
 
 // adds a local with the given name automatically assigning
 // its slot and depth
-static void addLocal(Token name)
+static void addLocal(Parser *parser, Token name)
 {
-	if (current->localCount == UINT8_COUNT)
+	if (parser->compiler->localCount == UINT8_COUNT)
 	{
-		error("Too many local variables in function.");
+		error(parser, "Too many local variables in function.");
 		return;
 	}
 
-	Local *local = &current->locals[current->localCount++];
+	if (parser->compiler->localCapacity < parser->compiler->localCount + 1)
+	{
+		int oldCapacity = parser->compiler->localCapacity;
+		parser->compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+		parser->compiler->locals = ARENA_GROW_ARRAY(&parser->scratch, Local, parser->compiler->locals,
+										   oldCapacity, parser->compiler->localCapacity);
+	}
+
+	Local *local = &parser->compiler->locals[parser->compiler->localCount++];
 	local->name = name;
 	local->depth = -1; // mark uninitialized
 	local->isCaptured = false;
 }
 
-// like addLocal() but for upvalues
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
+// like addLocal(parser) but for upvalues
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index, bool isLocal)
 {
-	int upvalueCount = compiler->function->upvalueCount;
+	int upvalueCount = compiler->proto->upvalueCount;
 
 	for (int i = 0; i < upvalueCount; i++)
 	{
@@ -427,13 +618,36 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
 
 	if (upvalueCount == UINT8_COUNT)
 	{
-		error("Too many closure variables in function.");
+		error(parser, "Too many closure variables in function.");
 		return 0;
 	}
 
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
-	return compiler->function->upvalueCount++;
+	return compiler->proto->upvalueCount++;
+}
+
+// like addUpvalue(parser), but a pre-parsed function also remembers the
+// name for when its body gets compiled
+static int addNamedUpvalue(Parser *parser, Compiler *compiler, uint8_t index,
+						   bool isLocal, Token *name)
+{
+	int upvalueCount = compiler->proto->upvalueCount;
+	int upvalue = addUpvalue(parser, compiler, index, isLocal);
+
+	ProtoLazy *lazy = compiler->proto->lazy;
+	if (lazy == NULL || compiler->proto->upvalueCount == upvalueCount)
+		return upvalue;
+
+	if (lazy->upvalueNameCapacity < upvalueCount + 1)
+	{
+		int oldCapacity = lazy->upvalueNameCapacity;
+		lazy->upvalueNameCapacity = GROW_CAPACITY(oldCapacity);
+		lazy->upvalueNames = ARENA_GROW_ARRAY(&parser->arena, Token, lazy->upvalueNames,
+											  oldCapacity, lazy->upvalueNameCapacity);
+	}
+	lazy->upvalueNames[upvalueCount] = *name;
+	return upvalue;
 }
 
 // -------- grammar stuff --------
@@ -489,567 +703,675 @@ static ParseRule *getRule(TokenType type)
 }
 
 // parses the current expression with correct precedence
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser *parser, Precedence precedence)
 {
-	advance();
+	advance(parser);
 
-	ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+	ParseFn prefixRule = getRule(parser->previous.type)->prefix;
 
 	if (prefixRule == NULL)
 	{
-		error("Expect expression.");
+		error(parser, "Expect expression.");
 
 		return;
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
-	prefixRule(canAssign);
+	prefixRule(parser, canAssign);
 
-	while (precedence <= getRule(parser.current.type)->precedence)
+	while (precedence <= getRule(parser->current.type)->precedence)
 	{
-		advance();
+		advance(parser);
 
-		ParseFn infixRule = getRule(parser.previous.type)->infix;
+		ParseFn infixRule = getRule(parser->previous.type)->infix;
 
-		infixRule(canAssign);
+		infixRule(parser, canAssign);
 	}
 
-	if (canAssign && match(TOKEN_EQUAL))
+	if (canAssign && match(parser, TOKEN_EQUAL))
 	{
-		error("Invalid assignment target.");
-		expression();
+		error(parser, "Invalid assignment target.");
+		expression(parser);
 	}
 }
 
 // parse the current variable (identifier)
-static uint8_t parseVariable(const char *errorMessage)
+static uint8_t parseVariable(Parser *parser, const char *errorMessage)
 {
-	consume(TOKEN_IDENTIFIER, errorMessage);
+	consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-	declareVariable();
+	declareVariable(parser);
 	// set the scope depth of the variable so that
 	// it gets discarded when the scope ends
-	if (current->scopeDepth > 0)
+	if (parser->compiler->scopeDepth > 0)
 		return 0;
 
-	return identifierConstant(&parser.previous);
+	return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser *parser)
 {
-	if (current->scopeDepth == 0)
+	if (parser->compiler->scopeDepth == 0)
 		return;
-	current->locals[current->localCount - 1].depth =
-		current->scopeDepth;
+	parser->compiler->locals[parser->compiler->localCount - 1].depth =
+		parser->compiler->scopeDepth;
 }
 
 // declares a variable
-static void declareVariable()
+static void declareVariable(Parser *parser)
 {
-	if (current->scopeDepth == 0)
+	if (parser->compiler->scopeDepth == 0)
 		return;
 
-	Token *name = &parser.previous;
+	Token *name = &parser->previous;
 
 	// make sure the variable doesn't get re-declared
-	for (int i = current->localCount - 1; i >= 0; i--)
+	for (int i = parser->compiler->localCount - 1; i >= 0; i--)
 	{
-		Local *local = &current->locals[i];
-		if (local->depth != -1 && local->depth < current->scopeDepth)
+		Local *local = &parser->compiler->locals[i];
+		if (local->depth != -1 && local->depth < parser->compiler->scopeDepth)
 		{
 			break;
 		}
 
 		if (identifiersEqual(name, &local->name))
 		{
-			error("Already a variable with this name in this scope.");
+			error(parser, "Already a variable with this name in this scope.");
 		}
 	}
-	addLocal(*name);
+	addLocal(parser, *name);
 }
 
 // emits the bytes for a global variable
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser *parser, uint8_t global)
 {
-	if (current->scopeDepth > 0)
+	if (parser->compiler->scopeDepth > 0)
 	{
-		markInitialized();
+		markInitialized(parser);
 		return;
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList()
+static uint8_t argumentList(Parser *parser)
 {
 	uint8_t argCount = 0;
-	if (!check(TOKEN_RIGHT_PAREN))
+	if (!check(parser, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
-			expression();
+			expression(parser);
 			if (argCount == 255)
 			{
-				error("Can't have more than 255 arguments.");
+				error(parser, "Can't have more than 255 arguments.");
 			}
 			argCount++;
-		} while (match(TOKEN_COMMA));
+		} while (match(parser, TOKEN_COMMA));
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
 	return argCount;
 }
 
-static void and_(bool canAssign)
+static void and_(Parser *parser, bool canAssign)
 {
-	int endJump = emitJump(OP_JUMP_IF_FALSE);
+	int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-	emitByte(OP_POP);
-	parsePrecedence(PREC_AND);
+	emitByte(parser, OP_POP);
+	parsePrecedence(parser, PREC_AND);
 
-	patchJump(endJump);
+	patchJump(parser, endJump);
 }
 
-static void or_(bool canAssign)
+static void or_(Parser *parser, bool canAssign)
 {
-	int elseJump = emitJump(OP_JUMP_IF_FALSE);
-	int endJump = emitJump(OP_JUMP);
+	int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	int endJump = emitJump(parser, OP_JUMP);
 
-	patchJump(elseJump);
-	emitByte(OP_POP);
+	patchJump(parser, elseJump);
+	emitByte(parser, OP_POP);
 
-	parsePrecedence(PREC_OR);
-	patchJump(endJump);
+	parsePrecedence(parser, PREC_OR);
+	patchJump(parser, endJump);
 }
 
-static void dot(bool canAssign)
+static void dot(Parser *parser, bool canAssign)
 {
-	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifierConstant(&parser.previous);
+	consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+	uint8_t name = identifierConstant(parser, &parser->previous);
 
-	if (canAssign && match(TOKEN_EQUAL))
+	if (canAssign && match(parser, TOKEN_EQUAL))
 	{
-		expression();
-		emitBytes(OP_SET_PROPERTY, name);
+		expression(parser);
+		emitBytes(parser, OP_SET_PROPERTY, name);
 	}
 	else
 	{
-		emitBytes(OP_GET_PROPERTY, name);
+		emitBytes(parser, OP_GET_PROPERTY, name);
 	}
 }
 
-static void this_(bool canAssign)
+static void this_(Parser *parser, bool canAssign)
 {
-	if (currentClass == NULL)
+	if (parser->currentClass == NULL)
 	{
-		error("Can't use 'this' outside of a class.");
+		error(parser, "Can't use 'this' outside of a class.");
 		return;
 	}
-	variable(false); // 'this' will be in slot 0 of the callframe
+	variable(parser, false); // 'this' will be in slot 0 of the callframe
 }
 
 // -------- expr/stmt stuff --------
 
 // compile an expression
-static void expression()
+static void expression(Parser *parser)
 {
-	parsePrecedence(PREC_ASSIGNMENT);
+	parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
 // compile a block
-static void block()
+static void block(Parser *parser)
 {
-	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
 	{
-		declaration();
+		declaration(parser);
 	}
 
-	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-// compiles a function
-static void function(FunctionType type)
+// returns a timestamp in nanoseconds
+static uint64_t nanoTime()
 {
-	Compiler compiler;
-	initCompiler(&compiler, type);
-	beginScope();
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+// compiles the parameter list of the current function
+static void parameters(Parser *parser)
+{
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
-	// parameters
-	if (!check(TOKEN_RIGHT_PAREN))
+	if (!check(parser, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
-			current->function->arity++;
-			if (current->function->arity > 255)
+			parser->compiler->proto->arity++;
+			if (parser->compiler->proto->arity > 255)
 			{
-				errorAtCurrent("Can't have more than 255 parameters.");
+				errorAtCurrent(parser, "Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parseVariable("Expect parameter name.");
-			defineVariable(constant);
-		} while (match(TOKEN_COMMA));
+			uint8_t constant = parseVariable(parser, "Expect parameter name.");
+			defineVariable(parser, constant);
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+}
+
+// compiles parameters and body of the current function
+static void functionBody(Parser *parser)
+{
+	parameters(parser);
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	block(parser);
+}
+
+// a name in a skipped body that is a variable of an enclosing function
+// is captured. locals declared in the body that shadow it are not told
+// apart, so a few more variables than needed may be captured, which only
+// costs a closed upvalue
+static void preparseName(Parser *parser, Token *name)
+{
+	if (resolveLocal(parser, parser->compiler, name) == -1)
+		resolveUpvalue(parser, parser->compiler, name);
+}
+
+// skips the body of the current function up to its closing brace,
+// capturing the variables it may use. nothing is compiled, so errors
+// other than unbalanced braces show up on its first call
+static void skipBody(Parser *parser)
+{
+	TokenType before = TOKEN_LEFT_BRACE;
+	int depth = 1;
+	while (!check(parser, TOKEN_EOF))
+	{
+		advance(parser);
+		TokenType type = parser->previous.type;
+		if (type == TOKEN_LEFT_BRACE)
+		{
+			depth++;
+		}
+		else if (type == TOKEN_RIGHT_BRACE)
+		{
+			if (--depth == 0)
+				return;
+		}
+		else if ((type == TOKEN_IDENTIFIER || type == TOKEN_THIS) &&
+				 before != TOKEN_DOT)
+		{
+			preparseName(parser, &parser->previous);
+		}
+		before = type;
+	}
+
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// records where the function is and which variables it closes over, for
+// compiling it on its first call. only the parameters are declared, the
+// body is skipped with the scanner
+static void preparseFunction(Parser *parser, FunctionType type)
+{
+	uint64_t start = nanoTime();
+	Proto *proto = parser->compiler->proto;
+	ProtoLazy *lazy = ARENA_ALLOCATE(&parser->arena, ProtoLazy, 1);
+	lazy->source = parser->current.start;
+	lazy->length = 0;
+	lazy->line = parser->current.line;
+	lazy->type = type;
+	lazy->inClass = parser->currentClass != NULL;
+	lazy->upvalueNames = NULL;
+	lazy->upvalueNameCapacity = 0;
+	proto->lazy = lazy;
+
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(parser, TOKEN_RIGHT_PAREN))
+	{
+		do
+		{
+			if (++proto->arity > 255)
+				errorAtCurrent(parser, "Can't have more than 255 parameters.");
+			parseVariable(parser, "Expect parameter name.");
+			markInitialized(parser);
+		} while (match(parser, TOKEN_COMMA));
+	}
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	skipBody(parser);
+
+	const char *sourceEnd = parser->previous.start + parser->previous.length;
+	// the source is copied out of the script by materialize()
+	lazy->length = (int)(sourceEnd - lazy->source);
+
+	parser->lazyStats.preparsed++;
+	parser->lazyStats.preparsedBytes += lazy->length;
+	parser->lazyStats.preparseTime += nanoTime() - start;
+}
+
+// compiles a function
+static void function(Parser *parser, FunctionType type)
+{
+	Compiler compiler;
+	initCompiler(parser, &compiler, type);
+	beginScope(parser);
+
+	Proto *function;
+	if (parser->lazyCompilation)
+	{
+		preparseFunction(parser, type);
+		function = closeCompiler(parser);
+	}
+	else
+	{
+		functionBody(parser);
+		function = endCompiler(parser);
 	}
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-	
-	// body
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-	block();
 
-	ObjFunction *function = endCompiler();
-	emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+	emitBytes(parser, OP_CLOSURE, makeConstant(parser, functionConstant(function)));
 
 	// emit the upvalues as well
 	for (int i = 0; i < function->upvalueCount; i++)
 	{
-		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emitByte(compiler.upvalues[i].index);
+		emitByte(parser, function->upvalues[i].isLocal ? 1 : 0);
+		emitByte(parser, function->upvalues[i].index);
 	}
 }
 
 // compiles a function
-static void method()
+static void method(Parser *parser)
 {
-	consume(TOKEN_IDENTIFIER, "Expect method name.");
-	uint8_t constant = identifierConstant(&parser.previous);
+	consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+	uint8_t constant = identifierConstant(parser, &parser->previous);
 
 	FunctionType type = TYPE_METHOD;
 	
 	// check if the method is init()
-	if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
+	if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0)
 	{
 		type = TYPE_INITIALIZER;
 	}
 
-	function(type);
-	emitBytes(OP_METHOD, constant);
+	function(parser, type);
+	emitBytes(parser, OP_METHOD, constant);
 }
 
 // compile a declaration
-static void declaration()
+static void declaration(Parser *parser)
 {
-	if (match(TOKEN_CLASS))
+	if (match(parser, TOKEN_CLASS))
 	{
-		classDeclaration();
+		classDeclaration(parser);
 	}
-	if (match(TOKEN_FUN)) {
-    	funDeclaration();
+	else if (match(parser, TOKEN_FUN)) {
+    	funDeclaration(parser);
   	}
-	else if (match(TOKEN_VAR))
+	else if (match(parser, TOKEN_VAR))
 	{
-		varDeclaration();
+		varDeclaration(parser);
 	}
 	else
 	{
-		statement();
+		statement(parser);
 	}
 
-	if (parser.panicMode)
-		synchronize();
+	if (parser->panicMode)
+		synchronize(parser);
 }
 
 // compile a statement
-static void statement()
+static void statement(Parser *parser)
 {
-	if (match(TOKEN_PRINT))
+	if (match(parser, TOKEN_PRINT))
 	{
-		printStatement();
+		printStatement(parser);
 	}
-	else if (match(TOKEN_FOR)) {
-    	forStatement();
+	else if (match(parser, TOKEN_FOR)) {
+    	forStatement(parser);
 	}
-	else if (match(TOKEN_IF))
+	else if (match(parser, TOKEN_IF))
 	{
-		ifStatement();
+		ifStatement(parser);
 	}
-	else if (match(TOKEN_RETURN)) {
-    	returnStatement();
+	else if (match(parser, TOKEN_RETURN)) {
+    	returnStatement(parser);
 	}
-	else if (match(TOKEN_WHILE))
+	else if (match(parser, TOKEN_WHILE))
 	{
-		whileStatement();
+		whileStatement(parser);
 	}
-	else if (match(TOKEN_LEFT_BRACE))
+	else if (match(parser, TOKEN_LEFT_BRACE))
 	{
-		beginScope();
-		block();
-		endScope();
+		beginScope(parser);
+		block(parser);
+		endScope(parser);
 	}
 	else
 	{
-		expressionStatement();
+		expressionStatement(parser);
 	}
 }
 
 // compiles a variable declaration
-static void varDeclaration()
+static void varDeclaration(Parser *parser)
 {
-	uint8_t global = parseVariable("Expect variable name.");
+	uint8_t global = parseVariable(parser, "Expect variable name.");
 
-	if (match(TOKEN_EQUAL))
+	if (match(parser, TOKEN_EQUAL))
 	{
-		expression();
+		expression(parser);
 	}
 	else
 	{
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 	}
-	consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-	defineVariable(global);
+	defineVariable(parser, global);
 }
 
 // compiles a class declaration
-static void classDeclaration()
+static void classDeclaration(Parser *parser)
 {
 	// name
-	consume(TOKEN_IDENTIFIER, "Expect class name.");
-	Token className = parser.previous; // the class Value can be anywhere
+	consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+	Token className = parser->previous; // the class Value can be anywhere
 									   // on the stack so we need to remember
 									   // its name
-	uint8_t nameConstant = identifierConstant(&parser.previous);
-	declareVariable();
+	uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+	declareVariable(parser);
 
-	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	emitBytes(parser, OP_CLASS, nameConstant);
+	defineVariable(parser, nameConstant);
 
 	// let the compiler know we're compiling a class
 	ClassCompiler classCompiler;
-	classCompiler.enclosing = currentClass;
-	currentClass = &classCompiler;
+	classCompiler.enclosing = parser->currentClass;
+	parser->currentClass = &classCompiler;
 
-	namedVariable(className, false); // load the class again so that we can use it
+	namedVariable(parser, className, false); // load the class again so that we can use it
 
 	// methods and fields
-	consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+	consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
 	
-	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+	while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
 	{
-		method();
+		method(parser);
 	}
 
-	consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-	emitByte(OP_POP); // pop the class we loaded off the stack
+	consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+	emitByte(parser, OP_POP); // pop the class we loaded off the stack
 
-	currentClass = currentClass->enclosing;
+	parser->currentClass = parser->currentClass->enclosing;
 }
 
 // compiles a function declaration
-static void funDeclaration()
+static void funDeclaration(Parser *parser)
 {
-	uint8_t global = parseVariable("Expect function name.");
-	markInitialized();
-	function(TYPE_FUNCTION);
-	defineVariable(global);
+	uint8_t global = parseVariable(parser, "Expect function name.");
+	markInitialized(parser);
+	function(parser, TYPE_FUNCTION);
+	defineVariable(parser, global);
 }
 
 // compiles an expression statement
-static void expressionStatement()
+static void expressionStatement(Parser *parser)
 {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-	emitByte(OP_POP);
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+	emitByte(parser, OP_POP);
 }
 
 // compiles a print statement
-static void printStatement()
+static void printStatement(Parser *parser)
 {
-	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-	emitByte(OP_PRINT);
+	expression(parser);
+	consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+	emitByte(parser, OP_PRINT);
 }
 
 // compiles a return statement
-static void returnStatement()
+static void returnStatement(Parser *parser)
 {
-	if (current->type == TYPE_SCRIPT)
+	if (parser->compiler->type == TYPE_SCRIPT)
 	{
-		error("Can't return from top-level code.");
+		error(parser, "Can't return from top-level code.");
 	}
 
-	if (match(TOKEN_SEMICOLON))
+	if (match(parser, TOKEN_SEMICOLON))
 	{
-		emitReturn();
+		emitReturn(parser);
 	}
 	else
 	{
-		if (current->type == TYPE_INITIALIZER)
+		if (parser->compiler->type == TYPE_INITIALIZER)
 		{
-			error("Can't return a value from an initializer.");
+			error(parser, "Can't return a value from an initializer.");
 		}
 		
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-		emitByte(OP_RETURN);
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+		emitByte(parser, OP_RETURN);
 	}
 }
 
 // compiles an if statement
-static void ifStatement()
+static void ifStatement(Parser *parser)
 {
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int thenJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
+	int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);
+	statement(parser);
 
-	int elseJump = emitJump(OP_JUMP);
+	int elseJump = emitJump(parser, OP_JUMP);
 
-	patchJump(thenJump);
-	emitByte(OP_POP);
+	patchJump(parser, thenJump);
+	emitByte(parser, OP_POP);
 
-	if (match(TOKEN_ELSE))
-		statement();
-	patchJump(elseJump);
+	if (match(parser, TOKEN_ELSE))
+		statement(parser);
+	patchJump(parser, elseJump);
 }
 
 // compiles a for statement
-static void forStatement()
+static void forStatement(Parser *parser)
 {
-	beginScope();
+	beginScope(parser);
 
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-	if (match(TOKEN_SEMICOLON))
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	if (match(parser, TOKEN_SEMICOLON))
 	{
 		// No initializer.
 	}
-	else if (match(TOKEN_VAR))
+	else if (match(parser, TOKEN_VAR))
 	{
-		varDeclaration();
+		varDeclaration(parser);
 	}
 	else
 	{
-		expressionStatement();
+		expressionStatement(parser);
 	}
 
-	int loopStart = currentChunk()->count;
+	int loopStart = currentChunk(parser)->count;
 
 	int exitJump = -1;
-	if (!match(TOKEN_SEMICOLON))
+	if (!match(parser, TOKEN_SEMICOLON))
 	{
-		expression();
-		consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+		expression(parser);
+		consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
 		// Jump out of the loop if the condition is false.
-		exitJump = emitJump(OP_JUMP_IF_FALSE);
-		emitByte(OP_POP); // Condition.
+		exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+		emitByte(parser, OP_POP); // Condition.
 	}
 
-	if (!match(TOKEN_RIGHT_PAREN))
+	if (!match(parser, TOKEN_RIGHT_PAREN))
 	{
-		int bodyJump = emitJump(OP_JUMP);
-		int incrementStart = currentChunk()->count;
-		expression();
-		emitByte(OP_POP);
-		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+		int bodyJump = emitJump(parser, OP_JUMP);
+		int incrementStart = currentChunk(parser)->count;
+		expression(parser);
+		emitByte(parser, OP_POP);
+		consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-		emitLoop(loopStart);
+		emitLoop(parser, loopStart);
 		loopStart = incrementStart;
-		patchJump(bodyJump);
+		patchJump(parser, bodyJump);
 	}
 
-	statement();
-	emitLoop(loopStart);
+	statement(parser);
+	emitLoop(parser, loopStart);
 	if (exitJump != -1)
 	{
-		patchJump(exitJump);
-		emitByte(OP_POP); // Condition.
+		patchJump(parser, exitJump);
+		emitByte(parser, OP_POP); // Condition.
 	}
-	endScope();
+	endScope(parser);
 }
 
 // compiles a while statement
-static void whileStatement()
+static void whileStatement(Parser *parser)
 {
-	int loopStart = currentChunk()->count;
+	int loopStart = currentChunk(parser)->count;
 
-	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	int exitJump = emitJump(OP_JUMP_IF_FALSE);
-	emitByte(OP_POP);
-	statement();
-	emitLoop(loopStart);
+	int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+	emitByte(parser, OP_POP);
+	statement(parser);
+	emitLoop(parser, loopStart);
 
-	patchJump(exitJump);
-	emitByte(OP_POP);
+	patchJump(parser, exitJump);
+	emitByte(parser, OP_POP);
 }
 
 // compile a grouping
-static void grouping(bool canAssign)
+static void grouping(Parser *parser, bool canAssign)
 {
-	expression();
-	consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+	expression(parser);
+	consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 // compiles a number
-static void number(bool canAssign)
+static void number(Parser *parser, bool canAssign)
 {
-	double value = strtod(parser.previous.start, NULL);
-	emitConstant(NUMBER_VAL(value));
+	double value = strtod(parser->previous.start, NULL);
+	emitConstant(parser, valueConstant(NUMBER_VAL(value)));
 }
 
 // compiles a string
-static void string(bool canAssign)
+static void string(Parser *parser, bool canAssign)
 {
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+	emitConstant(parser, stringConstant(parser->previous.start + 1, parser->previous.length - 2));
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser *parser, Token name, bool canAssign)
 {
 	uint8_t getOp, setOp;
-	int arg = resolveLocal(current, &name);
+	int arg = resolveLocal(parser, parser->compiler, &name);
 	if (arg != -1)
 	{
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
 	}
-	else if ((arg = resolveUpvalue(current, &name)) != -1)
+	else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1)
 	{
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	}
 	else
 	{
-		arg = identifierConstant(&name);
+		arg = identifierConstant(parser, &name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
-	if (canAssign && match(TOKEN_EQUAL))
+	if (canAssign && match(parser, TOKEN_EQUAL))
 	{
-		expression();
-		emitBytes(setOp, (uint8_t)arg);
+		expression(parser);
+		emitBytes(parser, setOp, (uint8_t)arg);
 	}
 	else
 	{
-		emitBytes(getOp, (uint8_t)arg);
+		emitBytes(parser, getOp, (uint8_t)arg);
 	}
 }
 
 // compiles a variable
-static void variable(bool canAssign)
+static void variable(Parser *parser, bool canAssign)
 {
-	namedVariable(parser.previous, canAssign);
+	namedVariable(parser, parser->previous, canAssign);
 }
 
 // compile a unary expression
-static void unary(bool canAssign)
+static void unary(Parser *parser, bool canAssign)
 {
-	TokenType operatorType = parser.previous.type;
+	TokenType operatorType = parser->previous.type;
 
 	// Compile the operand.
-	expression();
+	expression(parser);
 
 	// Emit the operator instruction.
 	switch (operatorType)
 	{
 	case TOKEN_BANG:
-		emitByte(OP_NOT);
+		emitByte(parser, OP_NOT);
 		break;
 	case TOKEN_MINUS:
-		emitByte(OP_NEGATE);
+		emitByte(parser, OP_NEGATE);
 		break;
 	default:
 		return; // Unreachable.
@@ -1057,43 +1379,43 @@ static void unary(bool canAssign)
 }
 
 // parses a binary expression
-static void binary(bool canAssign)
+static void binary(Parser *parser, bool canAssign)
 {
-	TokenType operatorType = parser.previous.type;
+	TokenType operatorType = parser->previous.type;
 	ParseRule *rule = getRule(operatorType);
-	parsePrecedence((Precedence)(rule->precedence + 1));
+	parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
 	switch (operatorType)
 	{
 	case TOKEN_BANG_EQUAL:
-		emitBytes(OP_EQUAL, OP_NOT);
+		emitBytes(parser, OP_EQUAL, OP_NOT);
 		break;
 	case TOKEN_EQUAL_EQUAL:
-		emitByte(OP_EQUAL);
+		emitByte(parser, OP_EQUAL);
 		break;
 	case TOKEN_GREATER:
-		emitByte(OP_GREATER);
+		emitByte(parser, OP_GREATER);
 		break;
 	case TOKEN_GREATER_EQUAL:
-		emitBytes(OP_LESS, OP_NOT);
+		emitBytes(parser, OP_LESS, OP_NOT);
 		break;
 	case TOKEN_LESS:
-		emitByte(OP_LESS);
+		emitByte(parser, OP_LESS);
 		break;
 	case TOKEN_LESS_EQUAL:
-		emitBytes(OP_GREATER, OP_NOT);
+		emitBytes(parser, OP_GREATER, OP_NOT);
 		break;
 	case TOKEN_PLUS:
-		emitByte(OP_ADD);
+		emitByte(parser, OP_ADD);
 		break;
 	case TOKEN_MINUS:
-		emitByte(OP_SUBTRACT);
+		emitByte(parser, OP_SUBTRACT);
 		break;
 	case TOKEN_STAR:
-		emitByte(OP_MULTIPLY);
+		emitByte(parser, OP_MULTIPLY);
 		break;
 	case TOKEN_SLASH:
-		emitByte(OP_DIVIDE);
+		emitByte(parser, OP_DIVIDE);
 		break;
 	default:
 		return; // Unreachable.
@@ -1101,25 +1423,25 @@ static void binary(bool canAssign)
 }
 
 // parses a call
-static void call(bool canAssign)
+static void call(Parser *parser, bool canAssign)
 {
-	uint8_t argCount = argumentList();
-	emitBytes(OP_CALL, argCount);
+	uint8_t argCount = argumentList(parser);
+	emitBytes(parser, OP_CALL, argCount);
 }
 
 // parses a literal
-static void literal(bool canAssign)
+static void literal(Parser *parser, bool canAssign)
 {
-	switch (parser.previous.type)
+	switch (parser->previous.type)
 	{
 	case TOKEN_FALSE:
-		emitByte(OP_FALSE);
+		emitByte(parser, OP_FALSE);
 		break;
 	case TOKEN_NIL:
-		emitByte(OP_NIL);
+		emitByte(parser, OP_NIL);
 		break;
 	case TOKEN_TRUE:
-		emitByte(OP_TRUE);
+		emitByte(parser, OP_TRUE);
 		break;
 	default:
 		return; // Unreachable.
@@ -1128,106 +1450,524 @@ static void literal(bool canAssign)
 
 // -------- control stuff --------
 
-static void initCompiler(Compiler *compiler, FunctionType type)
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type)
 {
-	compiler->enclosing = current;
-	compiler->function = newFunction();
+	Proto *proto = ARENA_ALLOCATE(&parser->arena, Proto, 1);
+	memset(proto, 0, sizeof(Proto));
+	if (type != TYPE_SCRIPT)
+		proto->name = parser->previous;
+
+	compiler->enclosing = parser->compiler;
+	compiler->proto = proto;
 	compiler->type = type;
+	compiler->scratchMark = arenaMark(&parser->scratch);
+	compiler->locals = NULL;
 	compiler->localCount = 0;
+	compiler->localCapacity = 0;
+	compiler->upvalues = ARENA_ALLOCATE(&parser->scratch, Upvalue, UINT8_COUNT);
 	compiler->scopeDepth = 0;
-	current = compiler;
-
-	if (type != TYPE_SCRIPT)
-	{
-		current->function->name = 
-			copyString(parser.previous.start, parser.previous.length);
-	}
+	compiler->lazy = NULL;
+	parser->compiler = compiler;
 
 	// the first local slot is automatically used for
-	// call frame reasons	
-	Local *local = &current->locals[current->localCount++];
-	local->depth = 0;
-	local->isCaptured = false;
+	// call frame reasons
+	Token name;
 	if (type != TYPE_FUNCTION)
 	{
 		// we're in a method so yea
-		local->name.start = "this";
-		local->name.length = 4;
+		name.start = "this";
+		name.length = 4;
 	}
 	else
 	{
-		local->name.start = "";
-		local->name.length = 0;
+		name.start = "";
+		name.length = 0;
 	}
-}	
+	addLocal(parser, name);
+	parser->compiler->locals[0].depth = 0;
+}
+
+// moves the finished function out of the scratch arena
+static Proto *closeCompiler(Parser *parser)
+{
+	Proto *proto = parser->compiler->proto;
+	ProtoChunk *chunk = &proto->chunk;
+
+	chunk->code = (uint8_t *)arenaCopy(&parser->arena, chunk->code, chunk->count);
+	chunk->capacity = chunk->count;
+#ifndef STRIP_LINE_INFO
+	chunk->lines = (LineStart *)arenaCopy(&parser->arena, chunk->lines,
+										  sizeof(LineStart) * chunk->lineCount);
+	chunk->lineCapacity = chunk->lineCount;
+#endif
+	chunk->constants = (Constant *)arenaCopy(&parser->arena, chunk->constants,
+											 sizeof(Constant) * chunk->constantCount);
+	chunk->constantCapacity = chunk->constantCount;
+	proto->upvalues = (Upvalue *)arenaCopy(&parser->arena, parser->compiler->upvalues,
+										   sizeof(Upvalue) * proto->upvalueCount);
+
+	arenaRelease(&parser->scratch, parser->compiler->scratchMark);
+	parser->compiler = parser->compiler->enclosing;
+	return proto;
+}
 
 // end the compilation process
-static ObjFunction* endCompiler()
+static Proto *endCompiler(Parser *parser)
 {
-	emitReturn();
-	ObjFunction *function = current->function;
+	emitReturn(parser);
+	return closeCompiler(parser);
+}
+
+// copies what preparseFunction(parser) recorded into the function
+static void materializeLazy(VM *vm, ObjFunction *function, ProtoLazy *protoLazy)
+{
+	LazyBody *lazy = ALLOCATE(vm, LazyBody, 1);
+	lazy->source = NULL;
+	lazy->length = 0;
+	lazy->line = protoLazy->line;
+	lazy->type = protoLazy->type;
+	lazy->inClass = protoLazy->inClass;
+	initValueArray(&lazy->upvalueNames);
+	function->lazy = lazy;
+
+	lazy->source = ALLOCATE(vm, char, protoLazy->length + 1);
+	memcpy(lazy->source, protoLazy->source, protoLazy->length);
+	lazy->source[protoLazy->length] = '\0';
+	lazy->length = protoLazy->length;
+
+	for (int i = 0; i < function->upvalueCount; i++)
+	{
+		Token *name = &protoLazy->upvalueNames[i];
+		Value upvalueName = OBJ_VAL(copyString(vm, name->start, name->length));
+		push(vm, upvalueName);
+		writeValueArray(vm, &lazy->upvalueNames, upvalueName);
+		pop(vm);
+	}
+}
+
+// turns a compiled proto into a function, interning its strings on the
+// way. this is the only part of a compilation that allocates GC objects.
+// a lazy body is compiled into its existing function, which keeps the
+// name and upvalues it got when it was pre-parsed
+static ObjFunction *materialize(VM *vm, Proto *proto, ObjFunction *into)
+{
+	ObjFunction *function = into != NULL ? into : newFunction(vm);
+	push(vm, OBJ_VAL(function)); // keep it safe from the GC while filling it in
+	function->arity = proto->arity;
+	if (into == NULL)
+	{
+		function->upvalueCount = proto->upvalueCount;
+		if (proto->name.start != NULL)
+			function->name = copyString(vm, proto->name.start, proto->name.length);
+	}
+
+	// a pre-parsed function has no code yet
+	ProtoChunk *protoChunk = &proto->chunk;
+	Chunk *chunk = &function->chunk;
+	if (protoChunk->count > 0)
+	{
+		chunk->code = ALLOCATE(vm, uint8_t, protoChunk->count);
+		memcpy(chunk->code, protoChunk->code, protoChunk->count);
+		chunk->capacity = protoChunk->count;
+		chunk->count = protoChunk->count;
+#ifndef STRIP_LINE_INFO
+		chunk->lines = ALLOCATE(vm, LineStart, protoChunk->lineCount);
+		memcpy(chunk->lines, protoChunk->lines,
+			   sizeof(LineStart) * protoChunk->lineCount);
+		chunk->lineCapacity = protoChunk->lineCount;
+		chunk->lineCount = protoChunk->lineCount;
+#endif
+	}
+
+	// only the constants filled in so far are visible to the GC
+	ValueArray *constants = &chunk->constants;
+	if (protoChunk->constantCount > 0)
+	{
+		constants->values = ALLOCATE(vm, Value, protoChunk->constantCount);
+		constants->capacity = protoChunk->constantCount;
+	}
+	for (int i = 0; i < protoChunk->constantCount; i++)
+	{
+		Constant *constant = &protoChunk->constants[i];
+		Value value = constant->as.value;
+		if (constant->type == CONSTANT_STRING)
+		{
+			Token *string = &constant->as.string;
+			value = OBJ_VAL(copyString(vm, string->start, string->length));
+		}
+		else if (constant->type == CONSTANT_FUNCTION)
+		{
+			value = OBJ_VAL(materialize(vm, constant->as.function, NULL));
+		}
+		constants->values[constants->count++] = value;
+	}
+
+	if (proto->lazy != NULL)
+		materializeLazy(vm, function, proto->lazy);
+
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.hadError)
+	if (proto->lazy == NULL)
 	{
-		disassembleChunk(currentChunk(),
+		disassembleChunk(chunk,
 			function->name != NULL ? function->name->chars : "<script>");
 	}
 #endif
-	current = current->enclosing;
+	pop(vm);
 	return function;
 }
 
-static void beginScope()
+static void beginScope(Parser *parser)
 {
-	current->scopeDepth++;
+	parser->compiler->scopeDepth++;
 }
-static void endScope()
+static void endScope(Parser *parser)
 {
-	current->scopeDepth--;
+	parser->compiler->scopeDepth--;
 	// pop locals from discarded scope
-	while (current->localCount > 0 &&
-		   current->locals[current->localCount - 1].depth >
-			   current->scopeDepth)
+	while (parser->compiler->localCount > 0 &&
+		   parser->compiler->locals[parser->compiler->localCount - 1].depth >
+			   parser->compiler->scopeDepth)
 	{
-		if (current->locals[current->localCount - 1].isCaptured)
+		if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured)
 		{
-			emitByte(OP_CLOSE_UPVALUE);
+			emitByte(parser, OP_CLOSE_UPVALUE);
 		}
 		else
 		{
-			emitByte(OP_POP);
+			emitByte(parser, OP_POP);
 		}
-		current->localCount--;
+		parser->compiler->localCount--;
 	}
 }
 
-// main compile function
-ObjFunction* compile(const char *source)
+static void initParser(Parser *parser, const char *source, size_t length,
+					   int line)
+{
+	initScanner(&parser->scanner, source, length, line);
+	parser->hadError = false;
+	parser->panicMode = false;
+	parser->compiler = NULL;
+	parser->currentClass = NULL;
+	parser->lazyCompilation = false;
+	initArena(&parser->arena);
+	initArena(&parser->scratch);
+	memset(&parser->lazyStats, 0, sizeof(LazyStats));
+	initWriter(&parser->errors);
+}
+
+// reports the errors of the compilation and frees its arenas
+static void freeParser(VM *vm, Parser *parser)
 {
-	initScanner(source);
+	if (parser->errors.count > 0)
+		fwrite(parser->errors.bytes, 1, parser->errors.count, stderr);
+	freeWriter(&parser->errors);
+	freeArena(&parser->arena);
+	freeArena(&parser->scratch);
+
+	vm->lazyStats.preparsed += parser->lazyStats.preparsed;
+	vm->lazyStats.preparsedBytes += parser->lazyStats.preparsedBytes;
+	vm->lazyStats.loadTime += parser->lazyStats.loadTime;
+	vm->lazyStats.preparseTime += parser->lazyStats.preparseTime;
+}
+
+// parses a whole script without touching the VM. returns NULL on errors
+static Proto *parseScript(Parser *parser)
+{
+	uint64_t start = nanoTime();
 	Compiler compiler;
-	initCompiler(&compiler, TYPE_SCRIPT);
-	parser.hadError = false;
-	parser.panicMode = false;
+	initCompiler(parser, &compiler, TYPE_SCRIPT);
 
-	advance();
-	while (!match(TOKEN_EOF))
+	advance(parser);
+	while (!match(parser, TOKEN_EOF))
 	{
-		declaration();
+		declaration(parser);
 	}
 
 	// consume(TOKEN_EOF, "Expect end of expression.");
-	ObjFunction *function = endCompiler();
-	return parser.hadError ? NULL : function;
+	Proto *proto = endCompiler(parser);
+	parser->lazyStats.loadTime += nanoTime() - start;
+	return parser->hadError ? NULL : proto;
+}
+
+// materializing is all that compiling does on the GC heap, so its
+// reallocate() calls and collections are what compiling costs the GC
+static void countCompileGc(VM *vm, uint64_t reallocations,
+						   uint64_t collections)
+{
+	GcStats *stats = &vm->gcStats;
+	stats->compileReallocations += stats->reallocations - reallocations;
+	stats->compileCollections += stats->collections - collections;
+}
+
+// how long parsing the script takes with every body compiled. errors
+// are not reported, they were or will be when the body is compiled
+static uint64_t timeEagerParse(const char *source, size_t length)
+{
+	Parser parser;
+	initParser(&parser, source, length, 1);
+	parseScript(&parser);
+	freeWriter(&parser.errors);
+	freeArena(&parser.arena);
+	freeArena(&parser.scratch);
+	return parser.lazyStats.loadTime;
+}
+
+// main compile function
+ObjFunction* compile(VM *vm, const char *source, size_t length)
+{
+	Parser parser;
+	initParser(&parser, source, length, 1);
+	parser.lazyCompilation = vm->lazyCompilation;
+	Tracer *tracer = vm->tracer;
+	if (tracer != NULL)
+	{
+		tracePhase(tracer, 'B', TRACE_COMPILE, "compile");
+		tracePhase(tracer, 'B', TRACE_COMPILE, "parse");
+	}
+
+	Proto *proto = parseScript(&parser);
+	if (tracer != NULL)
+	{
+		tracePhase(tracer, 'E', TRACE_COMPILE, "parse");
+		tracePhase(tracer, 'B', TRACE_COMPILE, "materialize");
+	}
+	uint64_t reallocations = vm->gcStats.reallocations;
+	uint64_t collections = vm->gcStats.collections;
+	ObjFunction *function = proto != NULL ? materialize(vm, proto, NULL) : NULL;
+	countCompileGc(vm, reallocations, collections);
+	freeParser(vm, &parser);
+	if (vm->measureLazy)
+		vm->lazyStats.eagerTime += timeEagerParse(source, length);
+	if (tracer != NULL)
+	{
+		tracePhase(tracer, 'E', TRACE_COMPILE, "materialize");
+		tracePhase(tracer, 'E', TRACE_COMPILE, "compile");
+	}
+	return function;
+}
+
+// compiles a pre-parsed function on its first call
+bool compileLazy(VM *vm, ObjFunction *function)
+{
+	uint64_t start = nanoTime();
+	LazyBody *lazy = function->lazy;
+	if (vm->tracer != NULL)
+		tracePhase(vm->tracer, 'B', TRACE_COMPILE, "compile lazy");
+
+	Parser parser;
+	initParser(&parser, lazy->source, lazy->length, lazy->line);
+	parser.lazyCompilation = vm->lazyCompilation;
+
+	// 'this' is only allowed in bodies that were inside a class
+	ClassCompiler classCompiler;
+	classCompiler.enclosing = NULL;
+	parser.currentClass = lazy->inClass ? &classCompiler : NULL;
+
+	Compiler compiler;
+	initCompiler(&parser, &compiler, (FunctionType)lazy->type);
+	compiler.lazy = lazy;
+	beginScope(&parser);
+
+	advance(&parser);
+	functionBody(&parser);
+	Proto *proto = endCompiler(&parser);
+
+	// on an error it stays lazy, so every call reports the error again
+	bool compiled = !parser.hadError;
+	if (compiled)
+	{
+		uint64_t reallocations = vm->gcStats.reallocations;
+		uint64_t collections = vm->gcStats.collections;
+		materialize(vm, proto, function);
+		countCompileGc(vm, reallocations, collections);
+	}
+
+	// the bodies nested in this one were already counted with it, and
+	// skipping them is part of compiling it
+	size_t nestedBytes = parser.lazyStats.preparsedBytes;
+	parser.lazyStats.preparsedBytes = 0;
+	parser.lazyStats.preparseTime = 0;
+	freeParser(vm, &parser);
+
+	vm->lazyStats.compileTime += nanoTime() - start;
+	if (vm->tracer != NULL)
+		tracePhase(vm->tracer, 'E', TRACE_COMPILE, "compile lazy");
+	if (!compiled)
+		return false;
+
+	vm->lazyStats.compiled++;
+	vm->lazyStats.compiledBytes += lazy->length - nestedBytes;
+	freeLazyBody(vm, function);
+	return true;
+}
+
+// -------- parallel compilation --------
+
+// the files of a parallel compile. workers take the next file from a
+// shared counter, each with a parser of its own
+typedef struct
+{
+	const char **sources;
+	const size_t *lengths;
+	Parser *parsers;
+	Proto **protos;
+	bool lazyCompilation;
+	int count;
+	atomic_int next;
+} CompileJob;
+
+static int compileWorker(void *arg)
+{
+	CompileJob *job = (CompileJob *)arg;
+	for (;;)
+	{
+		int i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->count)
+			break;
+
+		initParser(&job->parsers[i], job->sources[i], job->lengths[i], 1);
+		job->parsers[i].lazyCompilation = job->lazyCompilation;
+		job->protos[i] = parseScript(&job->parsers[i]);
+	}
+	return 0;
 }
 
-// gc stuff
-void markCompilerRoots()
+// wraps the scripts in one that calls them in order. they are
+// materialized in file order, so that the interned strings and
+// the linked program don't depend on the scheduling
+static ObjFunction *linkScripts(VM *vm, Proto **protos, int count)
 {
-	Compiler *compiler = current;
-	while (compiler != NULL)
+	ObjFunction *linked = newFunction(vm);
+	push(vm, OBJ_VAL(linked));
+	Chunk *chunk = &linked->chunk;
+
+	for (int i = 0; i < count; i++)
+	{
+		ObjFunction *script = materialize(vm, protos[i], NULL);
+		push(vm, OBJ_VAL(script));
+		int constant = addConstant(vm, chunk, OBJ_VAL(script));
+		pop(vm);
+
+		writeChunk(vm, chunk, OP_CLOSURE, 0);
+		writeChunk(vm, chunk, (uint8_t)constant, 0);
+		writeChunk(vm, chunk, OP_CALL, 0);
+		writeChunk(vm, chunk, 0, 0);
+		writeChunk(vm, chunk, OP_POP, 0);
+	}
+	writeChunk(vm, chunk, OP_NIL, 0);
+	writeChunk(vm, chunk, OP_RETURN, 0);
+
+	pop(vm);
+	return linked;
+}
+
+ObjFunction *compileFiles(VM *vm, const char **paths, const char **sources,
+						  const size_t *lengths, int count, int threads)
+{
+	if (count < 1 || count > UINT8_COUNT)
+		return NULL;
+	if (threads > count)
+		threads = count;
+	if (threads < 1)
+		threads = 1;
+
+	CompileJob job;
+	job.sources = sources;
+	job.lengths = lengths;
+	job.parsers = (Parser *)malloc(sizeof(Parser) * count);
+	job.protos = (Proto **)malloc(sizeof(Proto *) * count);
+	thrd_t *workers = (thrd_t *)malloc(sizeof(thrd_t) * threads);
+	if (job.parsers == NULL || job.protos == NULL || workers == NULL)
+		exit(1);
+	job.lazyCompilation = vm->lazyCompilation;
+	job.count = count;
+	atomic_init(&job.next, 0);
+	// only this thread records events, the workers' parsing shows as one
+	Tracer *tracer = vm->tracer;
+	if (tracer != NULL)
+	{
+		tracePhase(tracer, 'B', TRACE_COMPILE, "compile");
+		tracePhase(tracer, 'B', TRACE_COMPILE, "parse");
+	}
+
+	// parsing doesn't touch the VM, so only that part runs on the workers.
+	// the calling thread is one of them
+	int started = 0;
+	for (; started < threads - 1; started++)
+	{
+		if (thrd_create(&workers[started], compileWorker, &job) != thrd_success)
+			break;
+	}
+	compileWorker(&job);
+	for (int i = 0; i < started; i++)
+		thrd_join(workers[i], NULL);
+
+	bool hadError = false;
+	for (int i = 0; i < count; i++)
+		hadError |= job.protos[i] == NULL;
+	if (tracer != NULL)
+	{
+		tracePhase(tracer, 'E', TRACE_COMPILE, "parse");
+		tracePhase(tracer, 'B', TRACE_COMPILE, "link");
+	}
+	uint64_t reallocations = vm->gcStats.reallocations;
+	uint64_t collections = vm->gcStats.collections;
+	ObjFunction *linked = hadError ? NULL : linkScripts(vm, job.protos, count);
+	countCompileGc(vm, reallocations, collections);
+	if (tracer != NULL)
 	{
-		markObject((Obj *)compiler->function);
-		compiler = compiler->enclosing;
+		tracePhase(tracer, 'E', TRACE_COMPILE, "link");
+		tracePhase(tracer, 'E', TRACE_COMPILE, "compile");
 	}
-}
\ No newline at end of file
+
+	// in order, so that the errors are too
+	for (int i = 0; i < count; i++)
+	{
+		if (job.parsers[i].errors.count > 0)
+			fprintf(stderr, "In \"%s\":\n", paths[i]);
+		freeParser(vm, &job.parsers[i]);
+		if (vm->measureLazy)
+			vm->lazyStats.eagerTime += timeEagerParse(sources[i], lengths[i]);
+	}
+	free(workers);
+	free(job.protos);
+	free(job.parsers);
+	return linked;
+}
+
+void setLazyCompilation(VM *vm, bool enabled)
+{
+	vm->lazyCompilation = enabled;
+}
+
+void measureLazyCompilation(VM *vm)
+{
+	vm->measureLazy = true;
+}
+
+// reports how much work lazy compilation avoided. the saving is the
+// time an eager parse of the same scripts took, less the time loading
+// them and compiling the bodies that were called
+void printLazyStats(VM *vm)
+{
+	LazyStats *stats = &vm->lazyStats;
+	int never = stats->preparsed - stats->compiled;
+	size_t neverBytes = stats->preparsedBytes - stats->compiledBytes;
+
+	fprintf(stderr, "lazy: %d functions pre-parsed, %d compiled on first call, "
+					"%d never compiled (%zu of %zu bytes)\n",
+			stats->preparsed, stats->compiled, never,
+			neverBytes, stats->preparsedBytes);
+	fprintf(stderr, "lazy: %.3f ms loading (%.3f ms of it pre-parsing), "
+					"%.3f ms compiling bodies\n",
+			stats->loadTime / 1e6, stats->preparseTime / 1e6,
+			stats->compileTime / 1e6);
+	if (!vm->measureLazy)
+		return;
+
+	double saved = ((double)stats->eagerTime - stats->loadTime -
+					stats->compileTime) / 1e6;
+	fprintf(stderr, "lazy: %.3f ms loading eagerly, %.3f ms %s\n",
+			stats->eagerTime / 1e6, saved < 0 ? -saved : saved,
+			saved < 0 ? "lost" : "saved");
+}
@@ -0,0 +1,152 @@
+// clock_gettime() and syscall()
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "counters.h"
+
+typedef enum
+{
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CYCLES,
+	COUNTER_CACHE_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT,
+} Counter;
+
+static const char *counterNames[COUNTER_COUNT] = {
+	[COUNTER_INSTRUCTIONS] = "instructions",
+	[COUNTER_CYCLES] = "cycles",
+	[COUNTER_CACHE_MISSES] = "cacheMisses",
+	[COUNTER_BRANCH_MISSES] = "branchMisses",
+};
+
+// file descriptors of the opened counters, -1 where one isn't there
+typedef struct Counters
+{
+	int fds[COUNTER_COUNT];
+} Counters;
+
+uint64_t monotonicNanos()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+Value nanosNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+	return NUMBER_VAL((double)monotonicNanos());
+}
+
+Value cyclesNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+#if defined(__x86_64__) || defined(__i386__)
+	return NUMBER_VAL((double)__rdtsc());
+#else
+	return NUMBER_VAL((double)monotonicNanos());
+#endif
+}
+
+// -------- perf events --------
+
+#ifdef __linux__
+// counts for the calling thread on any cpu, so each VM opens its own
+static int openCounter(uint64_t config)
+{
+	struct perf_event_attr attr = {0};
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	// there are only so many counters, the kernel takes turns when more
+	// are open and reports how long each one ran
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+					   PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static Counters *openCounters()
+{
+	Counters *counters = (Counters *)malloc(sizeof(Counters));
+	if (counters == NULL)
+		exit(1);
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		counters->fds[i] = -1;
+
+#ifdef __linux__
+	static const uint64_t configs[COUNTER_COUNT] = {
+		[COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+		[COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+		[COUNTER_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+		[COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+	};
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		counters->fds[i] = openCounter(configs[i]);
+#endif
+	return counters;
+}
+
+// nil if the counter isn't there or hasn't run yet
+static Value readCounter(int fd)
+{
+	uint64_t values[3]; // the count, time enabled and time running
+	if (fd < 0 || read(fd, values, sizeof(values)) != sizeof(values) ||
+		values[2] == 0)
+		return NIL_VAL;
+
+	double count = (double)values[0];
+	// estimated from the share of the time it was counting
+	if (values[2] < values[1])
+		count *= (double)values[1] / values[2];
+	return NUMBER_VAL(count);
+}
+
+Value countersNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+
+	if (vm->counters == NULL)
+		vm->counters = openCounters();
+
+	// read before the instance is made, so that isn't counted
+	Value values[COUNTER_COUNT];
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		values[i] = readCounter(vm->counters->fds[i]);
+
+	pushInstance(vm, "Counters");
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		setField(vm, counterNames[i], values[i]);
+	return pop(vm);
+}
+
+void closeCounters(VM *vm)
+{
+	if (vm->counters == NULL)
+		return;
+	for (int i = 0; i < COUNTER_COUNT; i++)
+	{
+		if (vm->counters->fds[i] >= 0)
+			close(vm->counters->fds[i]);
+	}
+	free(vm->counters);
+	vm->counters = NULL;
+}
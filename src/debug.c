@@ -4,6 +4,56 @@
 #include "value.h"
 #include "object.h"
 
+static const char *opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_NOT] = "OP_NOT",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_BACK] = "OP_JUMP_BACK",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_ADD_MIXED] = "OP_ADD_MIXED",
+};
+
+const char *opcodeName(uint8_t opcode)
+{
+    if (opcode >= OPCODE_COUNT || opcodeNames[opcode] == NULL)
+        return "OP_UNKNOWN";
+    return opcodeNames[opcode];
+}
+
 static int simpleInstruction(const char *name, int offset)
 {
     printf("%s\n", name);
@@ -41,81 +91,71 @@ int disassembleInstruction(Chunk *chunk, int offset)
     printf("%04d ", offset);
 
     // if line is same as previous print pipe, else print line
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
     {
         printf("   |  ");
     }
     else
     {
-        printf("%4d  ", chunk->lines[offset]);
+        printf("%4d  ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
+    const char *name = opcodeName(instruction);
 
-    // switch for all instructions
+    // switch for all instructions, grouped by their operands
     switch (instruction)
     {
-    case OP_CONSTANT:
-        return constantInstruction("OP_CONSTANT", chunk, offset);
     case OP_NIL:
-        return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
-        return simpleInstruction("OP_TRUE", offset);
     case OP_FALSE:
-        return simpleInstruction("OP_FALSE", offset);
     case OP_POP:
-        return simpleInstruction("OP_POP", offset);
-    case OP_GET_LOCAL:
-        return byteInstruction("OP_GET_LOCAL", chunk, offset);
-    case OP_SET_LOCAL:
-        return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
-    case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_GET_UPVALUE:
-        return byteInstruction("OP_GET_UPVALUE", chunk, offset);
-    case OP_SET_UPVALUE:
-        return byteInstruction("OP_SET_UPVALUE", chunk, offset);
-    case OP_GET_PROPERTY:
-        return constantInstruction("OP_GET_PROPERTY", chunk, offset);
-    case OP_SET_PROPERTY:
-        return constantInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_EQUAL:
-        return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
-        return simpleInstruction("OP_GREATER", offset);
     case OP_LESS:
-        return simpleInstruction("OP_LESS", offset);
     case OP_ADD:
-        return simpleInstruction("OP_ADD", offset);
     case OP_SUBTRACT:
-        return simpleInstruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
-        return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
-        return simpleInstruction("OP_DIVIDE", offset);
     case OP_NEGATE:
-        return simpleInstruction("OP_NEGATE", offset);
     case OP_NOT:
-        return simpleInstruction("OP_NOT", offset);
     case OP_PRINT:
-        return simpleInstruction("OP_PRINT", offset);
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_ADD_MIXED:
+        return simpleInstruction(name, offset);
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+        return byteInstruction(name, chunk, offset);
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_CLASS:
+    case OP_METHOD:
+        return constantInstruction(name, chunk, offset);
     case OP_JUMP:
-        return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
-        return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        return jumpInstruction(name, 1, chunk, offset);
     case OP_JUMP_BACK:
-        return jumpInstruction("OP_JUMP_BACK", -1, chunk, offset);
-    case OP_CALL:
-        return byteInstruction("OP_CALL", chunk, offset);
+        return jumpInstruction(name, -1, chunk, offset);
     case OP_CLOSURE:
     {
         offset++;
         uint8_t constant = chunk->code[offset++];
-        printf("%-16s %4d ", "OP_CLOSURE", constant);
+        printf("%-16s %4d ", name, constant);
         printValue(chunk->constants.values[constant]);
         printf("\n");
 
@@ -131,14 +171,6 @@ int disassembleInstruction(Chunk *chunk, int offset)
 
         return offset;
     }
-    case OP_CLOSE_UPVALUE:
-        return simpleInstruction("OP_CLOSE_UPVALUE", offset);
-    case OP_CLASS:
-        return constantInstruction("OP_CLASS", chunk, offset);
-    case OP_METHOD:
-        return constantInstruction("OP_METHOD", chunk, offset);
-    case OP_RETURN:
-        return simpleInstruction("OP_RETURN", offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
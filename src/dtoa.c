@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "dtoa.h"
+
+// shortest round trip double formatting after Florian Loitsch's Grisu2
+// ("Printing Floating-Point Numbers Quickly and Accurately with
+// Integers", 2010). the output always reads back as the same double
+// and is the shortest such string for all but very few inputs, which
+// get one digit too many.
+
+#define SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFu
+#define HIDDEN_BIT 0x0010000000000000u
+#define EXPONENT_BIAS 1075 // 1023 plus the 52 significand bits
+// doubles this small and integral are printed without Grisu
+#define MAX_SAFE_INTEGER 9007199254740992.0
+
+// a floating point number f * 2^e with a 64 bit significand
+typedef struct
+{
+	uint64_t f;
+	int e;
+} DiyFp;
+
+// normalized 10^k for k = -348, -340, ..., 340
+static const uint64_t cachedPowersF[] = {
+	0xfa8fd5a0081c0288u, 0xbaaee17fa23ebf76u, 0x8b16fb203055ac76u,
+	0xcf42894a5dce35eau, 0x9a6bb0aa55653b2du, 0xe61acf033d1a45dfu,
+	0xab70fe17c79ac6cau, 0xff77b1fcbebcdc4fu, 0xbe5691ef416bd60cu,
+	0x8dd01fad907ffc3cu, 0xd3515c2831559a83u, 0x9d71ac8fada6c9b5u,
+	0xea9c227723ee8bcbu, 0xaecc49914078536du, 0x823c12795db6ce57u,
+	0xc21094364dfb5637u, 0x9096ea6f3848984fu, 0xd77485cb25823ac7u,
+	0xa086cfcd97bf97f4u, 0xef340a98172aace5u, 0xb23867fb2a35b28eu,
+	0x84c8d4dfd2c63f3bu, 0xc5dd44271ad3cdbau, 0x936b9fcebb25c996u,
+	0xdbac6c247d62a584u, 0xa3ab66580d5fdaf6u, 0xf3e2f893dec3f126u,
+	0xb5b5ada8aaff80b8u, 0x87625f056c7c4a8bu, 0xc9bcff6034c13053u,
+	0x964e858c91ba2655u, 0xdff9772470297ebdu, 0xa6dfbd9fb8e5b88fu,
+	0xf8a95fcf88747d94u, 0xb94470938fa89bcfu, 0x8a08f0f8bf0f156bu,
+	0xcdb02555653131b6u, 0x993fe2c6d07b7facu, 0xe45c10c42a2b3b06u,
+	0xaa242499697392d3u, 0xfd87b5f28300ca0eu, 0xbce5086492111aebu,
+	0x8cbccc096f5088ccu, 0xd1b71758e219652cu, 0x9c40000000000000u,
+	0xe8d4a51000000000u, 0xad78ebc5ac620000u, 0x813f3978f8940984u,
+	0xc097ce7bc90715b3u, 0x8f7e32ce7bea5c70u, 0xd5d238a4abe98068u,
+	0x9f4f2726179a2245u, 0xed63a231d4c4fb27u, 0xb0de65388cc8ada8u,
+	0x83c7088e1aab65dbu, 0xc45d1df942711d9au, 0x924d692ca61be758u,
+	0xda01ee641a708deau, 0xa26da3999aef774au, 0xf209787bb47d6b85u,
+	0xb454e4a179dd1877u, 0x865b86925b9bc5c2u, 0xc83553c5c8965d3du,
+	0x952ab45cfa97a0b3u, 0xde469fbd99a05fe3u, 0xa59bc234db398c25u,
+	0xf6c69a72a3989f5cu, 0xb7dcbf5354e9beceu, 0x88fcf317f22241e2u,
+	0xcc20ce9bd35c78a5u, 0x98165af37b2153dfu, 0xe2a0b5dc971f303au,
+	0xa8d9d1535ce3b396u, 0xfb9b7cd9a4a7443cu, 0xbb764c4ca7a44410u,
+	0x8bab8eefb6409c1au, 0xd01fef10a657842cu, 0x9b10a4e5e9913129u,
+	0xe7109bfba19c0c9du, 0xac2820d9623bf429u, 0x80444b5e7aa7cf85u,
+	0xbf21e44003acdd2du, 0x8e679c2f5e44ff8fu, 0xd433179d9c8cb841u,
+	0x9e19db92b4e31ba9u, 0xeb96bf6ebadf77d9u, 0xaf87023b9bf0ee6bu,
+};
+static const int16_t cachedPowersE[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t powersOf10[] = {
+	1u, 10u, 100u, 1000u, 10000u, 100000u, 1000000u, 10000000u,
+	100000000u, 1000000000u, 10000000000u, 100000000000u,
+	1000000000000u, 10000000000000u, 100000000000000u,
+	1000000000000000u, 10000000000000000u, 100000000000000000u,
+	1000000000000000000u, 10000000000000000000u,
+};
+
+static DiyFp diyFromDouble(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	int biased = (int)((bits >> 52) & 0x7FF);
+	uint64_t significand = bits & SIGNIFICAND_MASK;
+
+	DiyFp result;
+	if (biased != 0)
+	{
+		result.f = significand + HIDDEN_BIT;
+		result.e = biased - EXPONENT_BIAS;
+	}
+	else
+	{
+		// subnormal
+		result.f = significand;
+		result.e = 1 - EXPONENT_BIAS;
+	}
+	return result;
+}
+
+// the upper 64 bits of the 128 bit product, rounded
+static DiyFp diyMultiply(DiyFp x, DiyFp y)
+{
+	const uint64_t mask = 0xFFFFFFFFu;
+	uint64_t a = x.f >> 32, b = x.f & mask;
+	uint64_t c = y.f >> 32, d = y.f & mask;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask);
+	middle += 1u << 31;
+
+	DiyFp result = {ac + (ad >> 32) + (bc >> 32) + (middle >> 32),
+					x.e + y.e + 64};
+	return result;
+}
+
+static DiyFp diyNormalize(DiyFp value)
+{
+	while ((value.f & (HIDDEN_BIT << 11)) == 0)
+	{
+		value.f <<= 1;
+		value.e--;
+	}
+	return value;
+}
+
+// the neighbours halfway to the next doubles up and down, normalized
+// to the same exponent
+static void boundaries(DiyFp value, DiyFp *minus, DiyFp *plus)
+{
+	DiyFp upper = {(value.f << 1) + 1, value.e - 1};
+	while ((upper.f & (HIDDEN_BIT << 1)) == 0)
+	{
+		upper.f <<= 1;
+		upper.e--;
+	}
+	upper.f <<= 10;
+	upper.e -= 10;
+
+	// the gap below a power of two is half as big
+	DiyFp lower = value.f == HIDDEN_BIT
+					  ? (DiyFp){(value.f << 2) - 1, value.e - 2}
+					  : (DiyFp){(value.f << 1) - 1, value.e - 1};
+	lower.f <<= lower.e - upper.e;
+	lower.e = upper.e;
+
+	*minus = lower;
+	*plus = upper;
+}
+
+// picks a cached 10^-k that brings a number with binary exponent e
+// into the range Grisu needs
+static DiyFp cachedPower(int e, int *k)
+{
+	// ceil((-61 - e) * log10(2)) + 347, without libm
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	if (dk - ik > 0.0)
+		ik++;
+
+	int index = (ik >> 3) + 1;
+	*k = -(-348 + index * 8);
+	DiyFp power = {cachedPowersF[index], cachedPowersE[index]};
+	return power;
+}
+
+static int countDigits(uint32_t n)
+{
+	int digits = 1;
+	while (n >= 10)
+	{
+		n /= 10;
+		digits++;
+	}
+	return digits;
+}
+
+// moves the last digit towards the exact value while staying in range
+static void roundDigit(char *buffer, int length, uint64_t delta, uint64_t rest,
+					   uint64_t tenKappa, uint64_t distance)
+{
+	while (rest < distance && delta - rest >= tenKappa &&
+		   (rest + tenKappa < distance ||
+			distance - rest > rest + tenKappa - distance))
+	{
+		buffer[length - 1]--;
+		rest += tenKappa;
+	}
+}
+
+// generates the digits of high as long as they are needed to tell
+// it apart from everything outside [high - delta, high]
+static int generateDigits(DiyFp value, DiyFp high, uint64_t delta,
+						  char *buffer, int *k)
+{
+	DiyFp one = {(uint64_t)1 << -high.e, high.e};
+	uint64_t distance = high.f - value.f;
+	uint32_t integral = (uint32_t)(high.f >> -one.e);
+	uint64_t fractional = high.f & (one.f - 1);
+	int kappa = countDigits(integral);
+	int length = 0;
+
+	while (kappa > 0)
+	{
+		uint32_t divisor = (uint32_t)powersOf10[kappa - 1];
+		uint32_t digit = integral / divisor;
+		integral %= divisor;
+		if (digit != 0 || length != 0)
+			buffer[length++] = (char)('0' + digit);
+		kappa--;
+
+		uint64_t rest = ((uint64_t)integral << -one.e) + fractional;
+		if (rest <= delta)
+		{
+			*k += kappa;
+			roundDigit(buffer, length, delta, rest,
+					   powersOf10[kappa] << -one.e, distance);
+			return length;
+		}
+	}
+
+	for (;;)
+	{
+		fractional *= 10;
+		delta *= 10;
+		char digit = (char)(fractional >> -one.e);
+		if (digit != 0 || length != 0)
+			buffer[length++] = (char)('0' + digit);
+		fractional &= one.f - 1;
+		kappa--;
+
+		if (fractional < delta)
+		{
+			*k += kappa;
+			int index = -kappa;
+			roundDigit(buffer, length, delta, fractional, one.f,
+					   index < 20 ? distance * powersOf10[index] : 0);
+			return length;
+		}
+	}
+}
+
+// writes the digits of a positive, finite value to buffer. the
+// value is digits * 10^k
+static int grisu2(double value, char *buffer, int *k)
+{
+	DiyFp v = diyFromDouble(value);
+	DiyFp minus, plus;
+	boundaries(v, &minus, &plus);
+
+	int mk;
+	DiyFp power = cachedPower(plus.e, &mk);
+	DiyFp w = diyMultiply(diyNormalize(v), power);
+	DiyFp high = diyMultiply(plus, power);
+	DiyFp low = diyMultiply(minus, power);
+	// stay clear of the rounding error of the multiplications
+	low.f++;
+	high.f--;
+
+	*k = mk;
+	return generateDigits(w, high, high.f - low.f, buffer, k);
+}
+
+static int writeExponent(int exponent, char *buffer)
+{
+	char *start = buffer;
+	*buffer++ = 'e';
+	*buffer++ = exponent < 0 ? '-' : '+';
+	if (exponent < 0)
+		exponent = -exponent;
+
+	if (exponent >= 100)
+	{
+		*buffer++ = (char)('0' + exponent / 100);
+		exponent %= 100;
+		*buffer++ = (char)('0' + exponent / 10);
+	}
+	else if (exponent >= 10)
+	{
+		*buffer++ = (char)('0' + exponent / 10);
+	}
+	*buffer++ = (char)('0' + exponent % 10);
+	return (int)(buffer - start);
+}
+
+// lays out digits * 10^k the way JavaScript prints numbers: plain
+// notation for 1e-7 < |value| < 1e21 and exponent notation otherwise
+static int placeDecimalPoint(char *buffer, int length, int k)
+{
+	int point = length + k; // digits before the decimal point
+
+	if (length <= point && point <= 21)
+	{
+		// integer, pad with zeroes
+		memset(buffer + length, '0', point - length);
+		return point;
+	}
+	if (0 < point && point <= 21)
+	{
+		// 1234.5678
+		memmove(buffer + point + 1, buffer + point, length - point);
+		buffer[point] = '.';
+		return length + 1;
+	}
+	if (-6 < point && point <= 0)
+	{
+		// 0.0001234
+		int zeroes = -point;
+		memmove(buffer + 2 + zeroes, buffer, length);
+		buffer[0] = '0';
+		buffer[1] = '.';
+		memset(buffer + 2, '0', zeroes);
+		return length + 2 + zeroes;
+	}
+
+	// 1.234e+30
+	if (length == 1)
+		return 1 + writeExponent(point - 1, buffer + 1);
+
+	memmove(buffer + 2, buffer + 1, length - 1);
+	buffer[1] = '.';
+	return length + 1 + writeExponent(point - 1, buffer + length + 1);
+}
+
+// writes a nonnegative integer below 2^53
+static int formatInteger(uint64_t value, char *buffer)
+{
+	char digits[20];
+	int count = 0;
+	do
+	{
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+
+	for (int i = 0; i < count; i++)
+		buffer[i] = digits[count - 1 - i];
+	return count;
+}
+
+int formatNumber(double value, char *buffer)
+{
+	int length = 0;
+
+	if (value != value)
+	{
+		memcpy(buffer, "nan", 4);
+		return 3;
+	}
+
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	if (bits >> 63)
+	{
+		buffer[length++] = '-';
+		value = -value;
+	}
+
+	if (value == 0)
+	{
+		buffer[length++] = '0';
+	}
+	else if (value > 1.7976931348623157e308)
+	{
+		memcpy(buffer + length, "inf", 3);
+		length += 3;
+	}
+	else if (value < MAX_SAFE_INTEGER && value == (double)(uint64_t)value)
+	{
+		// the common case
+		length += formatInteger((uint64_t)value, buffer + length);
+	}
+	else
+	{
+		int k;
+		int digits = grisu2(value, buffer + length, &k);
+		length += placeDecimalPoint(buffer + length, digits, k);
+	}
+
+	buffer[length] = '\0';
+	return length;
+}
@@ -0,0 +1,306 @@
+#include <string.h>
+
+#include "fiber.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+
+// fails the native after an error has been reported
+static Value failed(VM *vm)
+{
+	vm->nativeFailed = true;
+	return NIL_VAL;
+}
+
+// -------- switching --------
+
+// puts the fiber on top of the VM's stacks and makes it the running
+// one. value becomes the result of its yield(), or the argument of
+// its function when it starts
+static bool enterFiber(VM *vm, ObjFiber *fiber, Value value)
+{
+	Value *base = vm->stackTop;
+	if (vm->frameCount + fiber->frameCount > FRAMES_MAX ||
+		base + fiber->stackCount + 2 > vm->stack + STACK_MAX)
+	{
+		runtimeError(vm, "Stack overflow.");
+		return false;
+	}
+
+	fiber->caller = vm->fiber;
+	fiber->baseFrame = vm->frameCount;
+	fiber->baseSlot = (int)(base - vm->stack);
+	vm->fiber = fiber;
+
+	if (fiber->state == FIBER_NEW)
+	{
+		ObjClosure *closure = fiber->closure;
+		fiber->closure = NULL;
+		fiber->state = FIBER_RUNNING;
+		push(vm, OBJ_VAL(closure));
+		if (closure->function->arity == 0)
+			return callClosure(vm, closure, 0);
+		push(vm, value);
+		return callClosure(vm, closure, 1);
+	}
+
+	fiber->state = FIBER_RUNNING;
+	memcpy(base, fiber->stack, sizeof(Value) * fiber->stackCount);
+	for (int i = 0; i < fiber->frameCount; i++)
+	{
+		CallFrame *frame = &vm->frames[vm->frameCount + i];
+		*frame = fiber->frames[i];
+		frame->slots = base + (frame->slots - fiber->stack);
+		if (vm->tracer != NULL)
+			traceFunction(vm->tracer, 'B', frame->closure->function);
+	}
+
+	// its upvalues point above any of the resumer's
+	if (fiber->openUpvalues != NULL)
+	{
+		ObjUpvalue *last = fiber->openUpvalues;
+		for (;;)
+		{
+			last->location = base + (last->location - fiber->stack);
+			if (last->next == NULL)
+				break;
+			last = last->next;
+		}
+		last->next = vm->openUpvalues;
+		vm->openUpvalues = fiber->openUpvalues;
+		fiber->openUpvalues = NULL;
+	}
+
+	vm->frameCount += fiber->frameCount;
+	vm->stackTop = base + fiber->stackCount;
+	// the copy is stale while running, see blackenObject()
+	fiber->frameCount = 0;
+	fiber->stackCount = 0;
+	push(vm, value);
+	return true;
+}
+
+// moves the running fiber's frames and values below top off the VM's
+// stacks, handing control back to its resumer
+static void suspendFiber(VM *vm, ObjFiber *fiber, Value *top)
+{
+	Value *base = vm->stack + fiber->baseSlot;
+	int frameCount = vm->frameCount - fiber->baseFrame;
+	int stackCount = (int)(top - base);
+
+	// grown to fit rather than doubled, idle fibers should stay small.
+	// this may collect, so it happens while all is still on the stack
+	if (frameCount > fiber->frameCapacity)
+	{
+		fiber->frames = GROW_ARRAY(vm, CallFrame, fiber->frames,
+								   fiber->frameCapacity, frameCount);
+		fiber->frameCapacity = frameCount;
+	}
+	if (stackCount > fiber->stackCapacity)
+	{
+		fiber->stack = GROW_ARRAY(vm, Value, fiber->stack,
+								  fiber->stackCapacity, stackCount);
+		fiber->stackCapacity = stackCount;
+	}
+
+	memcpy(fiber->stack, base, sizeof(Value) * stackCount);
+	// innermost first, so the trace's calls stay nested
+	if (vm->tracer != NULL)
+		for (int i = frameCount - 1; i >= 0; i--)
+			traceFunction(vm->tracer, 'E',
+						  vm->frames[fiber->baseFrame + i].closure->function);
+	for (int i = 0; i < frameCount; i++)
+	{
+		CallFrame *frame = &fiber->frames[i];
+		*frame = vm->frames[fiber->baseFrame + i];
+		frame->slots = fiber->stack + (frame->slots - base);
+	}
+
+	// its open upvalues are the ones at the front of the list
+	ObjUpvalue *last = NULL;
+	ObjUpvalue *upvalue = vm->openUpvalues;
+	while (upvalue != NULL && upvalue->location >= base)
+	{
+		upvalue->location = fiber->stack + (upvalue->location - base);
+		last = upvalue;
+		upvalue = upvalue->next;
+	}
+	if (last != NULL)
+	{
+		fiber->openUpvalues = vm->openUpvalues;
+		last->next = NULL;
+		vm->openUpvalues = upvalue;
+	}
+
+	fiber->frameCount = frameCount;
+	fiber->stackCount = stackCount;
+	fiber->state = FIBER_SUSPENDED;
+	vm->frameCount = fiber->baseFrame;
+	vm->stackTop = base;
+	vm->fiber = fiber->caller;
+	fiber->caller = NULL;
+}
+
+// -------- scheduling --------
+
+static void schedule(VM *vm, ObjFiber *fiber)
+{
+	fiber->scheduled = true;
+	fiber->nextScheduled = NULL;
+	if (vm->lastScheduled != NULL)
+		vm->lastScheduled->nextScheduled = fiber;
+	else
+		vm->scheduled = fiber;
+	vm->lastScheduled = fiber;
+}
+
+// starts the next scheduled fiber in place of the one that yielded or
+// returned. once none are left, wait() returns nil
+static bool runNext(VM *vm)
+{
+	ObjFiber *next = vm->scheduled;
+	if (next == NULL)
+	{
+		push(vm, NIL_VAL);
+		return true;
+	}
+
+	vm->scheduled = next->nextScheduled;
+	if (vm->scheduled == NULL)
+		vm->lastScheduled = NULL;
+	next->nextScheduled = NULL;
+	return enterFiber(vm, next, NIL_VAL);
+}
+
+bool finishFiber(VM *vm)
+{
+	ObjFiber *fiber = vm->fiber;
+	vm->fiber = fiber->caller;
+	fiber->caller = NULL;
+	fiber->state = FIBER_DONE;
+
+	FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+	FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
+	fiber->frames = NULL;
+	fiber->frameCapacity = 0;
+	fiber->stack = NULL;
+	fiber->stackCapacity = 0;
+
+	if (!fiber->scheduled)
+		return true;
+
+	// nobody gets the results of scheduled fibers
+	fiber->scheduled = false;
+	pop(vm);
+	return runNext(vm);
+}
+
+// -------- natives --------
+
+Value fiberNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 1)
+		return nativeError(vm, "Expected 1 arguments but got %d.", argCount);
+	if (!IS_CLOSURE(args[0]))
+		return nativeError(vm, "Argument of fiber() must be a function.");
+
+	return OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+}
+
+Value resumeNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount < 1 || argCount > 2)
+		return nativeError(vm, "Expected 1 or 2 arguments but got %d.",
+						   argCount);
+	if (!IS_FIBER(args[0]))
+		return nativeError(vm, "First argument of resume() must be a fiber.");
+
+	ObjFiber *fiber = AS_FIBER(args[0]);
+	if (fiber->state == FIBER_RUNNING)
+		return nativeError(vm, "Cannot resume a running fiber.");
+	if (fiber->state == FIBER_DONE)
+		return nativeError(vm, "Cannot resume a finished fiber.");
+	if (fiber->scheduled)
+		return nativeError(vm, "Cannot resume a scheduled fiber.");
+
+	// the fiber goes where the call was
+	Value value = argCount == 2 ? args[1] : NIL_VAL;
+	vm->stackTop = args - 1;
+	if (!enterFiber(vm, fiber, value))
+		return failed(vm);
+	vm->fiberSwitched = true;
+	return NIL_VAL;
+}
+
+Value yieldNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount > 1)
+		return nativeError(vm, "Expected 0 or 1 arguments but got %d.",
+						   argCount);
+
+	ObjFiber *fiber = vm->fiber;
+	if (fiber == NULL)
+		return nativeError(vm, "Cannot yield outside of a fiber.");
+
+	// the call itself is not part of what is kept
+	Value value = argCount == 1 ? args[0] : NIL_VAL;
+	suspendFiber(vm, fiber, args - 1);
+
+	if (fiber->scheduled)
+	{
+		schedule(vm, fiber);
+		if (!runNext(vm))
+			return failed(vm);
+	}
+	else
+	{
+		push(vm, value);
+	}
+	vm->fiberSwitched = true;
+	return NIL_VAL;
+}
+
+Value doneNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 1)
+		return nativeError(vm, "Expected 1 arguments but got %d.", argCount);
+	if (!IS_FIBER(args[0]))
+		return nativeError(vm, "Argument of done() must be a fiber.");
+
+	return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+Value scheduleNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 1)
+		return nativeError(vm, "Expected 1 arguments but got %d.", argCount);
+
+	ObjFiber *fiber;
+	if (IS_CLOSURE(args[0]))
+		fiber = newFiber(vm, AS_CLOSURE(args[0]));
+	else if (IS_FIBER(args[0]))
+		fiber = AS_FIBER(args[0]);
+	else
+		return nativeError(vm, "Argument of schedule() must be a fiber "
+							   "or a function.");
+
+	if (fiber->state == FIBER_RUNNING || fiber->state == FIBER_DONE)
+		return nativeError(vm, "Can only schedule new and suspended fibers.");
+	if (fiber->scheduled)
+		return nativeError(vm, "Fiber is already scheduled.");
+
+	schedule(vm, fiber);
+	return OBJ_VAL(fiber);
+}
+
+Value waitNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+
+	vm->stackTop = args - 1;
+	if (!runNext(vm))
+		return failed(vm);
+	vm->fiberSwitched = true;
+	return NIL_VAL;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "counters.h"
+#include "gcstats.h"
+#include "vm.h"
+
+// as fields of the instances gcStats() returns
+static const char *typeNames[OBJ_TYPE_COUNT] = {
+	[OBJ_BOUND_METHOD] = "boundMethod",
+	[OBJ_CLASS] = "class",
+	[OBJ_CLOSURE] = "closure",
+	[OBJ_FUNCTION] = "function",
+	[OBJ_INSTANCE] = "instance",
+	[OBJ_NATIVE] = "native",
+	[OBJ_STRING] = "string",
+	[OBJ_UPVALUE] = "upvalue",
+	[OBJ_CHANNEL] = "channel",
+	[OBJ_FIBER] = "fiber",
+};
+
+void initGcStats(GcStats *stats)
+{
+	memset(stats, 0, sizeof(GcStats));
+	const char *print = getenv("LOX_GC_STATS");
+	stats->printAtExit = print != NULL && print[0] != '\0' &&
+						 strcmp(print, "0") != 0;
+}
+
+uint64_t gcClock()
+{
+	return monotonicNanos();
+}
+
+void recordCollection(VM *vm, uint64_t start)
+{
+	GcStats *stats = &vm->gcStats;
+	uint64_t pause = gcClock() - start;
+	stats->pauseTotal += pause;
+	if (pause > stats->pauseMax)
+		stats->pauseMax = pause;
+
+	int bucket = 0;
+	while (bucket < GC_PAUSE_BUCKETS - 1 && (1u << bucket) * 1000u <= pause)
+		bucket++;
+	stats->pauses[bucket]++;
+
+	GcRecord *record = &stats->history[stats->collections % GC_HISTORY];
+	record->live = vm->bytesAllocated;
+	record->nextGC = vm->nextGC;
+	record->strings = vm->strings.count;
+	record->pause = pause;
+	stats->collections++;
+}
+
+void printGcStats(VM *vm)
+{
+	GcStats *stats = &vm->gcStats;
+	fprintf(stderr, "-- gc: %llu collections, %.3f ms paused, %.3f ms "
+					"at most\n",
+			(unsigned long long)stats->collections, stats->pauseTotal / 1e6,
+			stats->pauseMax / 1e6);
+	fprintf(stderr, "-- gc: %llu bytes allocated, %llu freed, %zu live, "
+					"next collection at %zu\n",
+			(unsigned long long)stats->bytesAllocated,
+			(unsigned long long)(stats->bytesAllocated - vm->bytesAllocated),
+			vm->bytesAllocated,
+			vm->nextGC);
+	fprintf(stderr, "-- gc: %llu reallocate() calls, %llu of them and %llu "
+					"collections while compiling\n",
+			(unsigned long long)stats->reallocations,
+			(unsigned long long)stats->compileReallocations,
+			(unsigned long long)stats->compileCollections);
+	fprintf(stderr, "-- gc: %d strings interned, table of %d\n",
+			vm->strings.count, vm->strings.capacity);
+
+	if (stats->collections > 0)
+	{
+		fprintf(stderr, "%-10s %10s\n", "pause", "count");
+		for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+		{
+			if (stats->pauses[i] == 0)
+				continue;
+			char label[32];
+			if (i == GC_PAUSE_BUCKETS - 1)
+				snprintf(label, sizeof(label), ">= %uus", 1u << (i - 1));
+			else
+				snprintf(label, sizeof(label), "< %uus", 1u << i);
+			fprintf(stderr, "%-10s %10llu\n", label,
+					(unsigned long long)stats->pauses[i]);
+		}
+	}
+
+	fprintf(stderr, "%-12s %14s %14s %14s\n", "objects", "allocated",
+			"freed", "live");
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+	{
+		if (stats->allocated[i] == 0)
+			continue;
+		fprintf(stderr, "%-12s %14llu %14llu %14llu\n", typeNames[i],
+				(unsigned long long)stats->allocated[i],
+				(unsigned long long)stats->freed[i],
+				(unsigned long long)(stats->allocated[i] - stats->freed[i]));
+	}
+
+	if (stats->collections == 0)
+		return;
+	uint64_t first = stats->collections > GC_HISTORY
+						 ? stats->collections - GC_HISTORY
+						 : 0;
+	fprintf(stderr, "%-10s %14s %14s %10s %10s\n", "collection", "live",
+			"next", "strings", "pause us");
+	for (uint64_t i = first; i < stats->collections; i++)
+	{
+		GcRecord *record = &stats->history[i % GC_HISTORY];
+		fprintf(stderr, "%-10llu %14zu %14zu %10d %10.1f\n",
+				(unsigned long long)i + 1, record->live, record->nextGC,
+				record->strings, record->pause / 1e3);
+	}
+}
+
+// -------- native --------
+
+// sets the instance on top of the stack as a field of the one below
+static void popField(VM *vm, const char *name)
+{
+	Value value = vm->stackTop[-1];
+	pop(vm);
+	setField(vm, name, value);
+}
+
+static void pushByType(VM *vm, uint64_t *bytes)
+{
+	pushInstance(vm, "GcBytes");
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+		setField(vm, typeNames[i], NUMBER_VAL((double)bytes[i]));
+}
+
+Value gcStatsNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+
+	// building the result allocates, and may collect
+	GcStats stats = vm->gcStats;
+	size_t live = vm->bytesAllocated;
+	size_t nextGC = vm->nextGC;
+	int strings = vm->strings.count;
+	GcRecord *last = stats.collections > 0
+						 ? &stats.history[(stats.collections - 1) % GC_HISTORY]
+						 : NULL;
+
+	pushInstance(vm, "GcStats");
+	setField(vm, "collections", NUMBER_VAL((double)stats.collections));
+	setField(vm, "pauseTotal", NUMBER_VAL(stats.pauseTotal / 1e6));
+	setField(vm, "pauseMax", NUMBER_VAL(stats.pauseMax / 1e6));
+	setField(vm, "bytesAllocated", NUMBER_VAL((double)stats.bytesAllocated));
+	setField(vm, "bytesFreed",
+			 NUMBER_VAL((double)(stats.bytesAllocated - live)));
+	setField(vm, "live", NUMBER_VAL((double)live));
+	setField(vm, "nextGC", NUMBER_VAL((double)nextGC));
+	setField(vm, "strings", NUMBER_VAL(strings));
+	setField(vm, "reallocations", NUMBER_VAL((double)stats.reallocations));
+	setField(vm, "compileReallocations",
+			 NUMBER_VAL((double)stats.compileReallocations));
+	setField(vm, "compileCollections",
+			 NUMBER_VAL((double)stats.compileCollections));
+	setField(vm, "liveAfterGC", last != NULL ? NUMBER_VAL((double)last->live)
+											 : NIL_VAL);
+
+	pushByType(vm, stats.allocated);
+	popField(vm, "allocated");
+	pushByType(vm, stats.freed);
+	popField(vm, "freed");
+
+	// under1us, under2us and so on, with the longest ones in longer
+	pushInstance(vm, "GcPauses");
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+	{
+		char name[32];
+		if (i == GC_PAUSE_BUCKETS - 1)
+			snprintf(name, sizeof(name), "longer");
+		else
+			snprintf(name, sizeof(name), "under%uus", 1u << i);
+		setField(vm, name, NUMBER_VAL((double)stats.pauses[i]));
+	}
+	popField(vm, "pauses");
+
+	return pop(vm);
+}
@@ -0,0 +1,25 @@
+#ifndef clox_allocprofile_h
+#define clox_allocprofile_h
+
+#include "common.h"
+#include "object.h"
+
+// once started, an object is sampled every interval bytes of objects
+// allocated, and attributed to the function and line that allocated
+// it. sampled objects are followed until they are freed, to tell
+// which sites allocate objects that survive collections. the report
+// is printed to stderr when the VM is freed, and by allocProfile()
+void startAllocProfile(VM *vm, size_t interval);
+// prints the report and frees the profile
+void stopAllocProfile(VM *vm);
+void printAllocProfile(VM *vm);
+
+// called by allocateObject() while profiling
+void countAllocation(VM *vm, Obj *object, size_t size);
+// called by freeObject() for sampled objects
+void sampledFree(VM *vm, Obj *object);
+
+// allocProfile() prints the report so far
+Value allocProfileNative(VM *vm, int argCount, Value *args);
+
+#endif
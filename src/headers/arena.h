@@ -0,0 +1,58 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// size of a regular arena block. bigger requests get a block of their own
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	uint8_t bytes[];
+} ArenaBlock;
+
+// bump allocator for data that dies all at once, like everything the
+// compiler keeps while compiling. arena memory is invisible to the GC
+// and not counted in vm.bytesAllocated
+typedef struct
+{
+	// newest first, the head is the one being bumped
+	ArenaBlock *blocks;
+	// regular blocks given back by arenaRelease(), reused before mallocing
+	ArenaBlock *spare;
+	// the newest allocation, which can be grown in place
+	void *last;
+	size_t bytesAllocated;
+} Arena;
+
+// a point to go back to with arenaRelease()
+typedef struct
+{
+	ArenaBlock *block;
+	size_t used;
+	void *last;
+} ArenaMark;
+
+void initArena(Arena *arena);
+// frees every allocation of the arena at once
+void freeArena(Arena *arena);
+void *arenaAllocate(Arena *arena, size_t size);
+void *arenaGrow(Arena *arena, void *pointer, size_t oldSize, size_t newSize);
+void *arenaCopy(Arena *arena, const void *pointer, size_t size);
+ArenaMark arenaMark(Arena *arena);
+// frees everything allocated since mark was taken. marks
+// have to be released in the reverse order of taking them
+void arenaRelease(Arena *arena, ArenaMark mark);
+
+#define ARENA_ALLOCATE(arena, type, count) \
+	(type *)arenaAllocate(arena, sizeof(type) * (count))
+
+// like GROW_ARRAY(). the old array is left to the arena
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+	(type *)arenaGrow(arena, pointer, sizeof(type) * (oldCount),   \
+					  sizeof(type) * (newCount))
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+// on-disk format of precompiled .loxc files.
+// bump LOXC_VERSION whenever the layout or the opcodes change.
+#define LOXC_MAGIC "LOXC"
+#define LOXC_VERSION 3
+
+// hashes a source text for the staleness check of a cache file
+uint64_t hashSource(const char *source, size_t length);
+// serializes the function tree to path, returns false on failure
+bool writeBytecodeCache(const char *path, ObjFunction *function,
+						uint64_t sourceHash);
+// maps the cache file at path and returns its script function,
+// or NULL if it is missing, corrupt or stale
+ObjFunction *loadBytecodeCache(VM *vm, const char *path, uint64_t sourceHash);
+// compiles source, going through <path>c (or <path>.loxc) when possible
+ObjFunction *compileCached(VM *vm, const char *path, const char *source,
+						   size_t length);
+
+#endif
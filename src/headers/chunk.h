@@ -39,20 +39,49 @@ typedef enum
 	OP_CLASS,
 	OP_METHOD,
 	OP_RETURN,
+	// never emitted by the compiler. run() rewrites the arithmetic and
+	// comparison instructions above into these once they have seen two
+	// numbers, and back when they see anything else
+	OP_GREATER_NUM,
+	OP_LESS_NUM,
+	OP_ADD_NUM,
+	OP_SUBTRACT_NUM,
+	OP_MULTIPLY_NUM,
+	OP_DIVIDE_NUM,
+	// an OP_ADD_NUM that saw something else becomes this OP_ADD, which
+	// is never rewritten again. the others only see anything else when
+	// they fail, so they go back to what they were
+	OP_ADD_MIXED,
 } OpCode;
 
+// one more than the last opcode
+#define OPCODE_COUNT (OP_ADD_MIXED + 1)
+
+// start of a run of bytecode that was emitted for the same line
+typedef struct
+{
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct
 {
 	int count;
 	int capacity;
 	uint8_t *code;
-	int *lines;
+#ifndef STRIP_LINE_INFO
+	// run-length encoded line table, only decoded by getLine()
+	int lineCount;
+	int lineCapacity;
+	LineStart *lines;
+#endif
 	ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk *chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
-void freeChunk(Chunk *chunk);
-int addConstant(Chunk *chunk, Value value);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+void freeChunk(VM *vm, Chunk *chunk);
+int addConstant(VM *vm, Chunk *chunk, Value value);
+int getLine(Chunk *chunk, int offset);
 
 #endif
\ No newline at end of file
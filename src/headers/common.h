@@ -7,6 +7,9 @@
 
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
+// #define STRIP_LINE_INFO
+// #define NO_SIMD
+// #define PROFILE_OPCODES
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
@@ -4,7 +4,19 @@
 #include "vm.h"
 
 // main compile function
-ObjFunction *compile(const char *source);
-void markCompilerRoots();
+ObjFunction *compile(VM *vm, const char *source, size_t length);
+// compiles every file on its own thread, at most threads at once, and
+// links them into a script that runs them in the given order.
+// the paths are only used to report errors
+ObjFunction *compileFiles(VM *vm, const char **paths, const char **sources,
+						  const size_t *lengths, int count, int threads);
+// compiles the body of a function that was only pre-parsed
+bool compileLazy(VM *vm, ObjFunction *function);
+// only pre-parse function bodies until they are first called
+void setLazyCompilation(VM *vm, bool enabled);
+// also parses each script without pre-parsing, which printLazyStats()
+// compares with what pre-parsing cost
+void measureLazyCompilation(VM *vm);
+void printLazyStats(VM *vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+
+#include "common.h"
+#include "vm.h"
+
+// timers and hardware counters for scripts that time themselves:
+//   var start = nanos();
+//   var before = counters();
+//   ...
+//   var after = counters();
+//   print nanos() - start;
+//   print after.instructions - before.instructions;
+// only differences mean anything
+
+// the monotonic clock in nanoseconds, which never jumps backwards.
+// what the runtime times itself with
+uint64_t monotonicNanos();
+
+// nanos() is a monotonic clock in nanoseconds, unlike clock() it counts
+// wall time and isn't affected by changes to the system's clock
+Value nanosNative(VM *vm, int argCount, Value *args);
+// cycles() reads the cpu's time stamp counter, or is nanos() where
+// there is none
+Value cyclesNative(VM *vm, int argCount, Value *args);
+// counters() returns an instance with the instructions, cycles,
+// cacheMisses and branchMisses of the VM's thread so far, in user
+// space. they come from perf_event_open, which is opened on the first
+// call. a counter that can't be read, say in a container or virtual
+// machine, is nil
+Value countersNative(VM *vm, int argCount, Value *args);
+
+// closes the counters
+void closeCounters(VM *vm);
+
+#endif
@@ -5,5 +5,7 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+// the name of the opcode, like "OP_ADD"
+const char *opcodeName(uint8_t opcode);
 
 #endif
\ No newline at end of file
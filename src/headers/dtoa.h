@@ -0,0 +1,14 @@
+#ifndef clox_dtoa_h
+#define clox_dtoa_h
+
+#include "common.h"
+
+// enough for "-1.2345678901234567e-308" and a terminator
+#define NUMBER_BUFFER_SIZE 32
+
+// writes the shortest decimal that reads back as exactly value,
+// NUL-terminated, and returns its length. large and tiny numbers
+// use exponent notation like 1e+21 and 1e-7
+int formatNumber(double value, char *buffer);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef clox_fiber_h
+#define clox_fiber_h
+
+#include "common.h"
+#include "vm.h"
+
+// fiber(function) creates a fiber that calls function when first
+// resumed, passing it the resumed value if it takes a parameter
+Value fiberNative(VM *vm, int argCount, Value *args);
+// resume(fiber, value) runs fiber until it yields or returns, which
+// is what resume() returns. value is what the fiber's yield() returns
+Value resumeNative(VM *vm, int argCount, Value *args);
+// yield(value) suspends the running fiber, handing value to resume()
+Value yieldNative(VM *vm, int argCount, Value *args);
+// done(fiber) tells whether the fiber's function has returned
+Value doneNative(VM *vm, int argCount, Value *args);
+// schedule(fiber) queues a fiber (or a function, as a new fiber) to be
+// run by wait(), and returns it
+Value scheduleNative(VM *vm, int argCount, Value *args);
+// wait() runs the scheduled fibers round-robin, switching whenever one
+// yields, until all of them have returned
+Value waitNative(VM *vm, int argCount, Value *args);
+
+// called once the running fiber's function has returned, which left
+// its result on the stack. returns false after reporting an error
+bool finishFiber(VM *vm);
+
+#endif
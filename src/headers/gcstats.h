@@ -0,0 +1,74 @@
+#ifndef clox_gcstats_h
+#define clox_gcstats_h
+
+#include "common.h"
+#include "object.h"
+
+#define OBJ_TYPE_COUNT (OBJ_FIBER + 1)
+// pauses are counted in buckets of under 1us, 2us, 4us and so on
+#define GC_PAUSE_BUCKETS 16
+// the collections whose heap sizes are kept, the most recent ones
+#define GC_HISTORY 32
+
+// the heap right after a collection
+typedef struct
+{
+	size_t live;
+	size_t nextGC;
+	int strings;
+	uint64_t pause; // ns
+} GcRecord;
+
+// what the collector did. always on, counting costs an addition per
+// allocation and two clock reads per collection
+typedef struct
+{
+	uint64_t collections;
+	uint64_t pauseTotal; // ns
+	uint64_t pauseMax;
+	uint64_t pauses[GC_PAUSE_BUCKETS];
+
+	// all memory that went through reallocate(). what was freed is
+	// what is no longer allocated
+	uint64_t bytesAllocated;
+	uint64_t reallocations; // calls to reallocate()
+	// the part of the calls and collections that was compiling
+	uint64_t compileReallocations;
+	uint64_t compileCollections;
+	// just the objects, not the arrays and tables they own
+	uint64_t allocated[OBJ_TYPE_COUNT];
+	uint64_t freed[OBJ_TYPE_COUNT];
+
+	GcRecord history[GC_HISTORY]; // ring, by collection
+	// LOX_GC_STATS was set, print everything when the VM is freed
+	bool printAtExit;
+} GcStats;
+
+void initGcStats(GcStats *stats);
+uint64_t gcClock();
+// records a collection that started at start, by gcClock()
+void recordCollection(VM *vm, uint64_t start);
+void printGcStats(VM *vm);
+
+// called by freeObject(), so a table rather than a switch
+static inline void recordFree(GcStats *stats, ObjType type)
+{
+	static const size_t sizes[OBJ_TYPE_COUNT] = {
+		[OBJ_BOUND_METHOD] = sizeof(ObjBoundMethod),
+		[OBJ_CLASS] = sizeof(ObjClass),
+		[OBJ_CLOSURE] = sizeof(ObjClosure),
+		[OBJ_FUNCTION] = sizeof(ObjFunction),
+		[OBJ_INSTANCE] = sizeof(ObjInstance),
+		[OBJ_NATIVE] = sizeof(ObjNative),
+		[OBJ_STRING] = sizeof(ObjString),
+		[OBJ_UPVALUE] = sizeof(ObjUpvalue),
+		[OBJ_CHANNEL] = sizeof(ObjChannel),
+		[OBJ_FIBER] = sizeof(ObjFiber),
+	};
+	stats->freed[type] += sizes[type];
+}
+
+// gcStats() returns an instance with the counters as fields
+Value gcStatsNative(VM *vm, int argCount, Value *args);
+
+#endif
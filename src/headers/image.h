@@ -0,0 +1,19 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+#include "vm.h"
+
+// on-disk format of heap images. bump LOXI_VERSION whenever
+// the layout, the object types or the opcodes change.
+#define LOXI_MAGIC "LOXI"
+#define LOXI_VERSION 3
+
+// writes everything reachable from the globals to path
+bool dumpImage(VM *vm, const char *path);
+// maps the image at path and defines its globals in the VM
+bool loadImage(VM *vm, const char *path);
+// keeps half restored objects alive while an image is loading
+void markImageRoots(VM *vm);
+
+#endif
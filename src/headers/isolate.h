@@ -0,0 +1,37 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "vm.h"
+
+// messages waiting in a channel when it is created without a capacity
+#define CHANNEL_CAPACITY 64
+#define POOL_MAX_WORKERS 256
+
+// spawn(path, input) runs the script at path in a new VM on its own
+// thread. input, if given, is sent along as the global 'input'
+Value spawnNative(VM *vm, int argCount, Value *args);
+// channel(capacity) creates a queue that isolates can share
+Value channelNative(VM *vm, int argCount, Value *args);
+// send(channel, value) blocks while the channel is full. only nil,
+// booleans, numbers, strings and channels can be sent
+Value sendNative(VM *vm, int argCount, Value *args);
+// receive(channel) blocks while the channel is empty. returns nil
+// once the channel is closed and drained
+Value receiveNative(VM *vm, int argCount, Value *args);
+// close(channel) makes receivers stop waiting once it is drained
+Value closeNative(VM *vm, int argCount, Value *args);
+// pool(path, workers) runs the script at path on workers isolates, one
+// per core by default, and returns a channel. what is sent to it is a
+// job for the script's task(value), which the workers share by
+// stealing. what a task returns, unless nil, is received from it.
+// closing it lets the workers finish and receive() return nil after
+// the last result. in a worker, the global pool is the pool
+Value poolNative(VM *vm, int argCount, Value *args);
+
+// drops a VM's reference to the channel, freeing it with the last one
+void releaseChannel(Channel *channel);
+// waits for the isolates spawned by vm to finish
+void joinIsolates(VM *vm);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// calls and backward jumps of a function before it is compiled
+#define JIT_DEFAULT_THRESHOLD 1000
+
+// a baseline compiler for x86-64 linux. each instruction of a chunk is
+// turned into a fixed piece of machine code working on the same stack
+// and frames as run(), which calls back into the VM for anything not
+// simple enough to do inline. calls and returns go through the VM too,
+// and straight on into the native code of the next frame if it has
+// any. elsewhere compileJit() does nothing and returns false
+typedef struct JitCode JitCode;
+
+typedef enum
+{
+	JIT_ERROR,
+	// the VM's top frame has no native code, run() goes on with it
+	JIT_INTERPRET,
+	// the frame at baseFrame returned
+	JIT_RETURNED,
+} JitResult;
+
+// compiles the function's chunk, false if it could not be
+bool compileJit(VM *vm, ObjFunction *function);
+// runs the native code of the frame's function from frame->ip on, and
+// of the frames after it, until one without any is reached or the
+// frame at baseFrame returns, as in run()
+JitResult runJit(VM *vm, CallFrame *frame, int baseFrame);
+void freeJit(ObjFunction *function);
+
+// 0 turns the compiler off
+void setJitThreshold(VM *vm, uint32_t threshold);
+
+#endif
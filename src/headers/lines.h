@@ -0,0 +1,15 @@
+#ifndef clox_lines_h
+#define clox_lines_h
+
+#include "common.h"
+#include "vm.h"
+
+// input is read in blocks of this size, or bigger for longer lines
+#define LINE_BLOCK_SIZE (1024 * 1024)
+
+// the awk-like -n mode. calls the script's line(text) for every line
+// read from fd, then end() if the script defines it. lines are views
+// into the block they were read into, without the trailing newline
+InterpretResult runLines(VM *vm, int fd);
+
+#endif
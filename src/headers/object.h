@@ -9,16 +9,20 @@
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
@@ -35,16 +39,20 @@ typedef enum
 	OBJ_NATIVE,
 	OBJ_STRING,
 	OBJ_UPVALUE,
+	OBJ_CHANNEL,
+	OBJ_FIBER,
 } ObjType;
 
 struct Obj
 {
 	ObjType type;
 	bool isMarked;
+	// followed by the allocation profiler, see allocprofile.h
+	bool isSampled;
 	struct Obj* next;
 };
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args);
 
 typedef struct
 {
@@ -52,6 +60,35 @@ typedef struct
 	NativeFn function;
 } ObjNative;
 
+// a function body that was only pre-parsed. it is compiled on the
+// first call, with upvalueNames standing in for the enclosing scopes
+typedef struct
+{
+	char *source;
+	int length;
+	int line;
+	int type;
+	bool inClass;
+	ValueArray upvalueNames;
+} LazyBody;
+
+// what lazy compilation did, for --lazy-stats
+typedef struct
+{
+	int preparsed;
+	int compiled;
+	// each byte of source is only counted once, a body is not counted
+	// again in the one it is nested in
+	size_t preparsedBytes;
+	size_t compiledBytes;
+	// parsing the scripts, pre-parsing included
+	uint64_t loadTime;
+	uint64_t preparseTime;
+	uint64_t compileTime;
+	// parsing the scripts again without pre-parsing, to compare
+	uint64_t eagerTime;
+} LazyStats;
+
 typedef struct
 {
 	Obj obj;
@@ -59,6 +96,10 @@ typedef struct
 	int upvalueCount;
 	Chunk chunk;
 	ObjString *name;
+	LazyBody *lazy; // NULL once compiled
+	// calls and backward jumps so far, see jit.h
+	uint32_t hotness;
+	struct JitCode *jit; // NULL until it is hot
 } ObjFunction;
 
 struct ObjString
@@ -67,12 +108,17 @@ struct ObjString
 	int length;
 	char *chars;
 	uint32_t hash;
+	// set for views, whose chars belong to owner. views are neither
+	// interned nor hashed, so they never serve as table keys
+	struct ObjString *owner;
 };
 
 typedef struct ObjUpvalue
 {
 	Obj obj;
 	Value *location;
+	// while open, the fiber whose stack location points into. this
+	// keeps a suspended fiber alive for as long as its locals are used
 	Value closed;
 	struct ObjUpvalue *next;
 } ObjUpvalue;
@@ -98,6 +144,49 @@ typedef struct {
   Table fields; 
 } ObjInstance;
 
+// a channel lives outside of any heap, so that isolates can share it.
+// every VM holding it has one of these
+typedef struct Channel Channel;
+
+typedef struct
+{
+	Obj obj;
+	Channel *channel;
+} ObjChannel;
+
+typedef enum
+{
+	FIBER_NEW,
+	FIBER_SUSPENDED,
+	FIBER_RUNNING,
+	FIBER_DONE,
+} FiberState;
+
+// a running fiber lives on top of the VM's stacks, right above the
+// one that resumed it. a suspended one keeps a copy of its frames and
+// values, sized to what it used, so that idle fibers stay small
+typedef struct ObjFiber
+{
+	Obj obj;
+	FiberState state;
+	bool scheduled; // run by wait() rather than resume()
+	ObjClosure *closure;
+
+	struct CallFrame *frames;
+	int frameCount;
+	int frameCapacity;
+	Value *stack;
+	int stackCount;
+	int stackCapacity;
+	ObjUpvalue *openUpvalues;
+
+	// where it starts on the VM's stacks while running
+	int baseFrame;
+	int baseSlot;
+	struct ObjFiber *caller;
+	struct ObjFiber *nextScheduled;
+} ObjFiber;
+
 typedef struct {
   Obj obj;
   // the calling instance is stored
@@ -106,15 +195,19 @@ typedef struct {
   ObjClosure* method;
 } ObjBoundMethod;
 
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
-ObjClass *newClass(ObjString *name);
-ObjClosure *newClosure(ObjFunction *function);
-ObjFunction *newFunction();
-ObjInstance *newInstance(ObjClass *klass);
-ObjNative *newNative(NativeFn function);
-ObjUpvalue *newUpvalue(Value *slot);
-ObjString *takeString(char *chars, int length);
-ObjString *copyString(const char *chars, int length);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
+ObjChannel *newChannel(VM *vm, Channel *channel);
+ObjClass *newClass(VM *vm, ObjString *name);
+ObjClosure *newClosure(VM *vm, ObjFunction *function);
+ObjFiber *newFiber(VM *vm, ObjClosure *closure);
+ObjFunction *newFunction(VM *vm);
+ObjInstance *newInstance(VM *vm, ObjClass *klass);
+ObjNative *newNative(VM *vm, NativeFn function);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot);
+ObjString *takeString(VM *vm, char *chars, int length);
+ObjString *copyString(VM *vm, const char *chars, int length);
+ObjString *newStringBuffer(VM *vm, int length);
+ObjString *newStringView(VM *vm, ObjString *owner, char *chars, int length);
 void printObject(Value value);
 // checks wether the given Value is of ObjType type
 static inline bool isObjType(Value value, ObjType type)
@@ -0,0 +1,28 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+#include "value.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// buffer for what scripts print. it is flushed when full, at the end
+// of a line in line buffered mode, and before anything else gets
+// written to the terminal (errors, prompts, sleeping)
+typedef struct
+{
+	char *bytes;
+	size_t count;
+	size_t capacity;
+	bool lineBuffered;
+} Output;
+
+void initOutput(Output *output, size_t size, bool lineBuffered);
+void freeOutput(Output *output);
+void flushOutput(Output *output);
+void writeOutput(Output *output, const char *bytes, size_t length);
+// writes value the way printValue() prints it
+void outputValue(Output *output, Value value);
+void outputLine(Output *output, Value value);
+
+#endif
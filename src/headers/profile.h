@@ -0,0 +1,87 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+#include "chunk.h"
+
+// with PROFILE_OPCODES defined, run() counts every opcode it executes
+// and every pair of consecutive ones. every PROFILE_SAMPLE_INTERVAL'th
+// instruction is also timed, in cycles where the cpu has a counter.
+// the histogram is printed to stderr when the VM is freed
+#ifdef PROFILE_OPCODES
+
+#ifndef PROFILE_SAMPLE_INTERVAL
+// prime, so that it doesn't line up with the length of a loop
+#define PROFILE_SAMPLE_INTERVAL 101
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define readCycles() __rdtsc()
+#else
+#include <time.h>
+static inline uint64_t readCycles()
+{
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return time.tv_sec * 1000000000u + time.tv_nsec;
+}
+#endif
+
+typedef struct
+{
+	uint64_t counts[OPCODE_COUNT];
+	// by opcode and the one executed right after it
+	uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+	uint8_t previous;
+
+	int countdown;
+	bool sampling;
+	uint8_t sampled;
+	uint64_t sampleStart;
+	uint64_t cycles[OPCODE_COUNT];
+	uint64_t samples[OPCODE_COUNT];
+	// what reading the counter itself takes
+	uint64_t overhead;
+} OpcodeProfile;
+
+void initOpcodeProfile(OpcodeProfile *profile);
+void printOpcodeProfile(OpcodeProfile *profile);
+
+// starts a sample, or ends it at the next dispatch
+static inline void sampleOpcode(OpcodeProfile *profile, uint8_t opcode)
+{
+	uint64_t now = readCycles();
+	if (profile->sampling)
+	{
+		profile->cycles[profile->sampled] += now - profile->sampleStart;
+		profile->samples[profile->sampled]++;
+		profile->sampling = false;
+		profile->countdown = PROFILE_SAMPLE_INTERVAL - 1;
+	}
+	else
+	{
+		profile->sampling = true;
+		profile->sampled = opcode;
+		profile->sampleStart = now;
+		profile->countdown = 1;
+	}
+}
+
+// called right before the opcode is dispatched
+static inline void countOpcode(OpcodeProfile *profile, uint8_t opcode)
+{
+	profile->counts[opcode]++;
+	profile->pairs[profile->previous][opcode]++;
+	profile->previous = opcode;
+
+#if PROFILE_SAMPLE_INTERVAL > 0
+	// the countdown is the only check on the way of every opcode
+	if (--profile->countdown == 0)
+		sampleOpcode(profile, opcode);
+#endif
+}
+
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include "common.h"
+#include "vm.h"
+
+// samples per second when none are given
+#define SAMPLER_DEFAULT_HZ 997
+
+// samples the call stack of vm hz times per second of cpu time, through
+// SIGPROF. one VM per process can be sampled, see signals.h. the
+// collapsed stacks go to path, for flamegraph.pl and similar tools.
+// returns false if the timer could not be set up
+bool startSampler(VM *vm, const char *path, int hz);
+// records the stack, called by run() at calls, returns and backward
+// jumps once a sample is due
+void takeSample(VM *vm);
+// stops sampling, writes the stacks and prints a table of the time spent
+// in each function to stderr. also happens when the VM is freed
+void stopSampler(VM *vm);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef enum
 {
 	// Single-character tokens.
@@ -62,9 +64,20 @@ typedef struct
 	int line;
 } Token;
 
-// initialize the scanner
-void initScanner(const char *source);
+// all of the scanner's state, so that several sources
+// can be scanned at the same time
+typedef struct
+{
+	const char *start;
+	const char *current;
+	// sources need not be NUL-terminated, e.g. when mapped
+	const char *end;
+	int line;
+} Scanner;
+
+// initialize the scanner, line being the line source starts at
+void initScanner(Scanner *scanner, const char *source, size_t length, int line);
 // scan the next token
-Token scanToken();
+Token scanToken(Scanner *scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+// helpers shared by the .loxc bytecode cache and heap images
+
+// growable byte buffer. lives on the C heap, so serializing
+// never triggers a collection
+typedef struct
+{
+	uint8_t *bytes;
+	size_t count;
+	size_t capacity;
+} Writer;
+
+// bounds checked cursor over a mapped file. any read past the end
+// sets failed and yields zeroes
+typedef struct
+{
+	const uint8_t *base;
+	const uint8_t *current;
+	const uint8_t *end;
+	bool failed;
+} Reader;
+
+void initWriter(Writer *writer);
+void freeWriter(Writer *writer);
+void writeBytes(Writer *writer, const void *bytes, size_t length);
+void writeU8(Writer *writer, uint8_t value);
+void writeU32(Writer *writer, uint32_t value);
+void writeDouble(Writer *writer, double value);
+void writeAlign(Writer *writer, size_t alignment);
+// writes code and line table so that readChunkCode() can use them in place
+void writeChunkCode(Writer *writer, Chunk *chunk);
+// writes the buffer to path through a temp file + rename
+bool writeFileAtomic(const char *path, Writer *writer);
+
+void initReader(Reader *reader, const void *base, size_t size);
+const uint8_t *readSpan(Reader *reader, size_t length);
+void readBytes(Reader *reader, void *out, size_t length);
+uint8_t readU8(Reader *reader);
+uint32_t readU32(Reader *reader);
+double readDouble(Reader *reader);
+void readAlign(Reader *reader, size_t alignment);
+// points the chunk's code and lines into the mapping. their capacities
+// stay 0, so freeChunk() never frees them
+void readChunkCode(Reader *reader, Chunk *chunk);
+// checks the code of a function that was read, once its constants are
+// in, so that a corrupt file can't make run() read out of bounds:
+// opcodes are known, constant and upvalue indices in range, jumps land
+// on an instruction and the code ends with OP_RETURN
+bool checkFunction(ObjFunction *function);
+
+// maps a whole file copy-on-write, returns NULL on failure
+void *mapFile(const char *path, size_t *size);
+void unmapFile(void *base, size_t size);
+// hands a mapping to the VM, which unmaps it in freeVM()
+void keepMapped(VM *vm, void *base, size_t size);
+void freeMappedFiles(VM *vm);
+
+#endif
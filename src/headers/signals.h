@@ -0,0 +1,23 @@
+#ifndef clox_signals_h
+#define clox_signals_h
+
+#include <signal.h>
+
+#include "common.h"
+#include "vm.h"
+
+// signals go to the process and not to a VM, so the handlers look up
+// here which VM asked for one. a signal belongs to one VM at a time.
+// the handler only raises *due and vm->safepointDue, run() does the
+// work at its next call, return or backward jump
+
+// routes the signal to vm. if another VM has it, or the handler could not
+// be installed, prints "Could not <what>, ..." to stderr and returns
+// false
+bool claimSignal(VM *vm, int number, volatile sig_atomic_t *due,
+				 const char *what);
+// restores the default handler if vm has the signal
+void releaseSignal(VM *vm, int number);
+bool ownsSignal(VM *vm, int number);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+#include "vm.h"
+
+// collects garbage, then writes every object left with its type, size
+// and references, and the roots they are reachable from. written line
+// by line as it goes, nothing is allocated on the Lox heap:
+//   clox heap snapshot 1
+//   root <id> <what>
+//   object <id> <type> <bytes> <description>
+//   edge <id> <what>        a reference of the object before it
+// ids are addresses. see tools/heapsnapshot.c for an analyzer.
+// returns false if the file could not be written
+bool writeHeapSnapshot(VM *vm, const char *path);
+
+// on SIGUSR1 a snapshot is written to prefix.1.heap, prefix.2.heap and
+// so on, at the next call, return or backward jump. one VM per process
+// can be watched, see signals.h
+bool watchSnapshotSignal(VM *vm, const char *prefix);
+void unwatchSnapshotSignal(VM *vm);
+// called by run() once a snapshot was asked for
+void takeSnapshot(VM *vm);
+
+// heapSnapshot(path) writes a snapshot to path
+Value heapSnapshotNative(VM *vm, int argCount, Value *args);
+
+#endif
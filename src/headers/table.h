@@ -18,13 +18,13 @@ typedef struct
 } Table;
 
 void initTable(Table *table);
-void freeTable(Table *table);
+void freeTable(VM *vm, Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
-bool tableSet(Table *table, ObjString *key, Value value);
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
-void tableAddAll(Table *from, Table *to);
+void tableAddAll(VM *vm, Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash);
 void tableRemoveWhite(Table *table);
-void markTable(Table *table);
+void markTable(VM *vm, Table *table);
 #endif
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include <string.h>
+
+#include "common.h"
+#include "counters.h"
+#include "object.h"
+
+// events kept when no number is given, the oldest are overwritten
+#define TRACE_DEFAULT_EVENTS (1 << 18)
+// longer names are cut short
+#define TRACE_NAME_LENGTH 22
+
+typedef enum
+{
+	TRACE_CALL,
+	TRACE_GC,
+	TRACE_COMPILE,
+} TraceCategory;
+
+typedef struct
+{
+	uint64_t time; // ns
+	char phase;	   // 'B'egin or 'E'nd, as in the trace event format
+	uint8_t category;
+	char name[TRACE_NAME_LENGTH];
+} TraceEvent;
+
+// a ring of events, one per VM and written only by its own thread, so
+// it needs no lock. every place that records one checks vm->tracer
+// first, which is all tracing costs while it is off
+typedef struct Tracer
+{
+	TraceEvent *events;
+	uint64_t capacity; // a power of two
+	uint64_t count;	   // ever recorded, the next goes at count % capacity
+	uint64_t start;
+	char *path;
+} Tracer;
+
+// records events into a ring of at least capacity of them, written to
+// path as chrome trace event json when the VM is freed, even after an
+// error. open it in chrome://tracing or ui.perfetto.dev
+bool startTracer(VM *vm, const char *path, size_t capacity);
+// writes the trace and frees the tracer
+void stopTracer(VM *vm);
+
+static inline void traceEvent(Tracer *tracer, char phase,
+							  TraceCategory category, const char *name,
+							  size_t length)
+{
+	TraceEvent *event = &tracer->events[tracer->count++ &
+										(tracer->capacity - 1)];
+	event->time = monotonicNanos();
+	event->phase = phase;
+	event->category = (uint8_t)category;
+	if (length >= TRACE_NAME_LENGTH)
+		length = TRACE_NAME_LENGTH - 1;
+	memcpy(event->name, name, length);
+	event->name[length] = '\0';
+}
+
+// a call or return of the function
+static inline void traceFunction(Tracer *tracer, char phase,
+								 ObjFunction *function)
+{
+	if (function->name == NULL)
+		traceEvent(tracer, phase, TRACE_CALL, "script", 6);
+	else
+		traceEvent(tracer, phase, TRACE_CALL, function->name->chars,
+				   function->name->length);
+}
+
+static inline void tracePhase(Tracer *tracer, char phase,
+							  TraceCategory category, const char *name)
+{
+	traceEvent(tracer, phase, category, name, strlen(name));
+}
+
+#endif
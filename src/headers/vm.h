@@ -1,21 +1,36 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <signal.h>
+
+#include "gcstats.h"
 #include "object.h"
+#include "output.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct
+typedef struct CallFrame
 {
 	ObjClosure *closure;
 	uint8_t *ip;
 	Value *slots;
 } CallFrame;
 
-typedef struct
+// a file mapped into memory for as long as the VM lives
+typedef struct MappedFile
+{
+	void *base;
+	size_t size;
+	struct MappedFile *next;
+} MappedFile;
+
+// everything one interpreter owns. VMs share no mutable state, so
+// each of them can run on its own thread
+struct VM
 {
 	CallFrame frames[FRAMES_MAX];
 	int frameCount;
@@ -23,6 +38,8 @@ typedef struct
 	Value stack[STACK_MAX];
 	Value *stackTop;
 	Table globals;
+	// what globals is reset to between batch scripts
+	Table baseGlobals;
 	Table strings;
 	ObjString *initString;
 	ObjUpvalue *openUpvalues;
@@ -30,11 +47,79 @@ typedef struct
 	size_t bytesAllocated;
 	size_t nextGC;
 	Obj *objects;
+	GcStats gcStats;
 	
 	int grayCount;
 	int grayCapacity;
 	Obj **grayStack;
-} VM;
+
+	MappedFile *mappedFiles;
+	// whether cached code is copied out of its mapping, so it is freed
+	// with its functions instead of kept until freeVM()
+	bool copyCachedCode;
+	Output output;
+
+	// whether function bodies are only pre-parsed
+	bool lazyCompilation;
+	// whether the scripts are also parsed eagerly, for --lazy-stats
+	bool measureLazy;
+	LazyStats lazyStats;
+
+	// the objects of the image being loaded. marked by markImageRoots(),
+	// since they are only reachable from the globals once loading is done
+	Obj **loading;
+	uint32_t loadingCount;
+
+	// set by nativeError(), fails the native's call
+	bool nativeFailed;
+	// the isolates spawned by this VM, joined in freeVM()
+	struct Isolate *isolates;
+	// the pool this VM is a worker of, NULL if none, and its deque
+	struct Pool *pool;
+	int poolWorker;
+
+	// the fiber on top of the stacks, NULL for the script itself
+	ObjFiber *fiber;
+	// set by natives that switched fibers and arranged the stack
+	// themselves
+	bool fiberSwitched;
+	// the fibers waiting to be run by wait(), in order
+	ObjFiber *scheduled;
+	ObjFiber *lastScheduled;
+
+	// set from signal handlers, run() acts on them at the next call,
+	// return or backward jump. see signals.h
+	volatile sig_atomic_t safepointDue;
+	volatile sig_atomic_t sampleDue;
+	volatile sig_atomic_t snapshotDue;
+	struct Sampler *sampler;
+	// where SIGUSR1 writes heap snapshots, NULL when it doesn't
+	char *snapshotPrefix;
+	int snapshotCount;
+	// see allocprofile.h
+	struct AllocProfile *allocProfile;
+	// see trace.h
+	struct Tracer *tracer;
+	// see counters.h, opened by the first counters()
+	struct Counters *counters;
+	// calls and backward jumps before a function is compiled to
+	// native code, 0 for never. see jit.h
+	uint32_t jitThreshold;
+	// instructions rewritten into their number variants and back, see
+	// OP_ADD_NUM
+	uint64_t quickened;
+	uint64_t dequickened;
+
+#ifdef PROFILE_OPCODES
+	OpcodeProfile opcodeProfile;
+#endif
+};
+
+typedef struct
+{
+	const char *name;
+	NativeFn function;
+} NativeDef;
 
 typedef enum
 {
@@ -43,12 +128,45 @@ typedef enum
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// the embedding API. a VM is only ever used by one thread at a time
+VM *createVM();
+void destroyVM(VM *vm);
+InterpretResult interpret(VM *vm, const char *source);
+
+void initVM(VM *vm);
+void freeVM(VM *vm);
+void saveBaseGlobals(VM *vm);
+void resetVM(VM *vm);
+void setOutputBuffer(VM *vm, size_t size, bool lineBuffered);
+InterpretResult interpretFunction(VM *vm, ObjFunction *function);
+InterpretResult callFunction(VM *vm, int argCount);
+// pushes a frame for the closure below the argCount arguments on top
+// of the stack, returns false after reporting an error
+bool callClosure(VM *vm, ObjClosure *closure, int argCount);
+// reports a runtime error along with a stack trace, and resets
+// the stack
+void runtimeError(VM *vm, const char *format, ...);
+// reports a runtime error from within a native, which should
+// return the result right away
+Value nativeError(VM *vm, const char *format, ...);
+// for natives that return their results as fields: pushes an
+// instance of a class of its own, then sets fields of the instance
+// on top of the stack
+void pushInstance(VM *vm, const char *className);
+void setField(VM *vm, const char *name, Value value);
+const char *nativeName(NativeFn function);
+NativeFn findNative(const char *name, int length);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
-void push(Value value);
-Value pop();
+// the parts of run() that jit.c calls back into
+bool jitCallValue(VM *vm, Value callee, int argCount);
+void jitPopFrame(VM *vm, CallFrame *frame);
+bool jitBindMethod(VM *vm, ObjClass *klass, ObjString *name);
+ObjUpvalue *jitCaptureUpvalue(VM *vm, Value *local);
+void jitCloseUpvalues(VM *vm, Value *last);
+bool jitDefineMethod(VM *vm, ObjString *name);
+void jitConcatenate(VM *vm);
+void jitSafepoint(VM *vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,726 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "serialize.h"
+#include "vm.h"
+
+// the byte order marker makes images from other machines unloadable
+#define BYTE_ORDER_MARK 0x01020304u
+#define FLAG_HAS_LINES 0x1u
+#define NO_REF UINT32_MAX
+
+// objects are referred to by their index in the image, which makes the
+// file relocatable. they are written grouped in this order, so that
+// the first loading pass can always create an object from objects
+// that already exist (e.g. a closure needs its function's upvalue count)
+static const ObjType typeOrder[] = {
+	OBJ_STRING,
+	OBJ_NATIVE,
+	OBJ_FUNCTION,
+	OBJ_UPVALUE,
+	OBJ_CLOSURE,
+	OBJ_CLASS,
+	OBJ_INSTANCE,
+	OBJ_BOUND_METHOD,
+};
+#define TYPE_COUNT (sizeof(typeOrder) / sizeof(typeOrder[0]))
+
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t flags;
+	uint32_t objectCount;
+} ImageHeader;
+
+typedef enum
+{
+	TAG_NIL,
+	TAG_FALSE,
+	TAG_TRUE,
+	TAG_NUMBER,
+	TAG_OBJECT,
+} ValueTag;
+
+static uint32_t buildFlags()
+{
+#ifdef STRIP_LINE_INFO
+	return 0;
+#else
+	return FLAG_HAS_LINES;
+#endif
+}
+
+// -------- object numbering --------
+
+// open addressing map from object address to its index in the image.
+// lives on the C heap so that dumping never touches the Lox heap
+typedef struct
+{
+	Obj *key;
+	uint32_t index;
+} ObjSlot;
+
+typedef struct
+{
+	int count;
+	int capacity;
+	ObjSlot *slots;
+} ObjMap;
+
+static ObjSlot *findSlot(ObjSlot *slots, int capacity, Obj *key)
+{
+	uint32_t index = (uint32_t)(((uintptr_t)key >> 4) * 2654435761u) &
+					 (uint32_t)(capacity - 1);
+	for (;;)
+	{
+		ObjSlot *slot = &slots[index];
+		if (slot->key == NULL || slot->key == key)
+			return slot;
+		index = (index + 1) & (uint32_t)(capacity - 1);
+	}
+}
+
+// adds key to the map, returns false if it was already there
+static bool mapAdd(ObjMap *map, Obj *key, uint32_t index)
+{
+	if (map->count + 1 > map->capacity / 2)
+	{
+		int capacity = GROW_CAPACITY(map->capacity);
+		ObjSlot *slots = (ObjSlot *)calloc(capacity, sizeof(ObjSlot));
+		if (slots == NULL)
+			exit(1);
+
+		for (int i = 0; i < map->capacity; i++)
+		{
+			if (map->slots[i].key != NULL)
+				*findSlot(slots, capacity, map->slots[i].key) = map->slots[i];
+		}
+
+		free(map->slots);
+		map->slots = slots;
+		map->capacity = capacity;
+	}
+
+	ObjSlot *slot = findSlot(map->slots, map->capacity, key);
+	if (slot->key != NULL)
+		return false;
+
+	slot->key = key;
+	slot->index = index;
+	map->count++;
+	return true;
+}
+
+typedef struct
+{
+	VM *vm;
+	ObjMap map;
+	Obj **objects;
+	int count;
+	int capacity;
+} Dump;
+
+static void visitObject(Dump *dump, Obj *object)
+{
+	if (object == NULL || !mapAdd(&dump->map, object, 0))
+		return;
+
+	if (dump->capacity < dump->count + 1)
+	{
+		dump->capacity = GROW_CAPACITY(dump->capacity);
+		dump->objects = (Obj **)realloc(dump->objects,
+										sizeof(Obj *) * dump->capacity);
+		if (dump->objects == NULL)
+			exit(1);
+	}
+	dump->objects[dump->count++] = object;
+}
+
+static void visitValue(Dump *dump, Value value)
+{
+	if (IS_OBJ(value))
+		visitObject(dump, AS_OBJ(value));
+}
+
+static void visitTable(Dump *dump, Table *table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry *entry = &table->entries[i];
+		if (entry->key == NULL)
+			continue;
+		visitObject(dump, (Obj *)entry->key);
+		visitValue(dump, entry->value);
+	}
+}
+
+// same edges as blackenObject() in memory.c
+static void visitReferences(Dump *dump, Obj *object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod *bound = (ObjBoundMethod *)object;
+		visitValue(dump, bound->receiver);
+		visitObject(dump, (Obj *)bound->method);
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjClass *klass = (ObjClass *)object;
+		visitObject(dump, (Obj *)klass->name);
+		visitTable(dump, &klass->methods);
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure *closure = (ObjClosure *)object;
+		visitObject(dump, (Obj *)closure->function);
+		for (int i = 0; i < closure->upvalueCount; i++)
+			visitObject(dump, (Obj *)closure->upvalues[i]);
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction *function = (ObjFunction *)object;
+		// images hold bytecode only, so compile bodies that never ran
+		if (function->lazy != NULL)
+			compileLazy(dump->vm, function);
+		visitObject(dump, (Obj *)function->name);
+		for (int i = 0; i < function->chunk.constants.count; i++)
+			visitValue(dump, function->chunk.constants.values[i]);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance *instance = (ObjInstance *)object;
+		visitObject(dump, (Obj *)instance->klass);
+		visitTable(dump, &instance->fields);
+		break;
+	}
+	case OBJ_UPVALUE:
+	{
+		ObjUpvalue *upvalue = (ObjUpvalue *)object;
+		visitValue(dump, *upvalue->location);
+		break;
+	}
+	case OBJ_NATIVE:
+	case OBJ_STRING:
+	case OBJ_CHANNEL:
+	case OBJ_FIBER:
+		break;
+	}
+}
+
+static uint32_t refOf(Dump *dump, Obj *object)
+{
+	if (object == NULL)
+		return NO_REF;
+	return findSlot(dump->map.slots, dump->map.capacity, object)->index;
+}
+
+// -------- writing --------
+
+static void writeRef(Writer *writer, Dump *dump, Obj *object)
+{
+	writeU32(writer, refOf(dump, object));
+}
+
+static void writeValue(Writer *writer, Dump *dump, Value value)
+{
+	switch (value.type)
+	{
+	case VAL_NIL:
+		writeU8(writer, TAG_NIL);
+		break;
+	case VAL_BOOL:
+		writeU8(writer, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+		break;
+	case VAL_NUMBER:
+		writeU8(writer, TAG_NUMBER);
+		writeDouble(writer, AS_NUMBER(value));
+		break;
+	case VAL_OBJ:
+		writeU8(writer, TAG_OBJECT);
+		writeRef(writer, dump, AS_OBJ(value));
+		break;
+	}
+}
+
+static void writeTable(Writer *writer, Dump *dump, Table *table)
+{
+	uint32_t count = 0;
+	for (int i = 0; i < table->capacity; i++)
+	{
+		if (table->entries[i].key != NULL)
+			count++;
+	}
+
+	writeU32(writer, count);
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry *entry = &table->entries[i];
+		if (entry->key == NULL)
+			continue;
+		writeRef(writer, dump, (Obj *)entry->key);
+		writeValue(writer, dump, entry->value);
+	}
+}
+
+static void writeName(Writer *writer, const char *name)
+{
+	uint32_t length = (uint32_t)strlen(name);
+	writeU32(writer, length);
+	writeBytes(writer, name, length);
+}
+
+static bool writeObject(Writer *writer, Dump *dump, Obj *object)
+{
+	writeU8(writer, (uint8_t)object->type);
+	switch (object->type)
+	{
+	case OBJ_STRING:
+	{
+		ObjString *string = (ObjString *)object;
+		writeU32(writer, (uint32_t)string->length);
+		writeBytes(writer, string->chars, string->length);
+		break;
+	}
+	case OBJ_NATIVE:
+	{
+		// natives are C code, so they are restored by name
+		const char *name = nativeName(((ObjNative *)object)->function);
+		if (name == NULL)
+			return false;
+		writeName(writer, name);
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction *function = (ObjFunction *)object;
+		if (function->lazy != NULL)
+			return false; // its body does not compile
+		writeU32(writer, (uint32_t)function->arity);
+		writeU32(writer, (uint32_t)function->upvalueCount);
+		writeRef(writer, dump, (Obj *)function->name);
+		writeChunkCode(writer, &function->chunk);
+		writeU32(writer, (uint32_t)function->chunk.constants.count);
+		for (int i = 0; i < function->chunk.constants.count; i++)
+			writeValue(writer, dump, function->chunk.constants.values[i]);
+		break;
+	}
+	case OBJ_UPVALUE:
+		writeValue(writer, dump, *((ObjUpvalue *)object)->location);
+		break;
+	case OBJ_CLOSURE:
+	{
+		ObjClosure *closure = (ObjClosure *)object;
+		writeRef(writer, dump, (Obj *)closure->function);
+		writeU32(writer, (uint32_t)closure->upvalueCount);
+		for (int i = 0; i < closure->upvalueCount; i++)
+			writeRef(writer, dump, (Obj *)closure->upvalues[i]);
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjClass *klass = (ObjClass *)object;
+		writeRef(writer, dump, (Obj *)klass->name);
+		writeTable(writer, dump, &klass->methods);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance *instance = (ObjInstance *)object;
+		writeRef(writer, dump, (Obj *)instance->klass);
+		writeTable(writer, dump, &instance->fields);
+		break;
+	}
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod *bound = (ObjBoundMethod *)object;
+		writeValue(writer, dump, bound->receiver);
+		writeRef(writer, dump, (Obj *)bound->method);
+		break;
+	}
+	case OBJ_CHANNEL:
+	case OBJ_FIBER:
+		return false;
+	}
+	return true;
+}
+
+bool dumpImage(VM *vm, const char *path)
+{
+	Dump dump = {vm, {0, 0, NULL}, NULL, 0, 0};
+
+	// find everything reachable from the globals
+	visitTable(&dump, &vm->globals);
+	for (int i = 0; i < dump.count; i++)
+		visitReferences(&dump, dump.objects[i]);
+
+	// group the objects by type and number them in that order
+	Obj **ordered = (Obj **)malloc(sizeof(Obj *) * (dump.count + 1));
+	if (ordered == NULL)
+		exit(1);
+	int orderedCount = 0;
+	for (size_t type = 0; type < TYPE_COUNT; type++)
+	{
+		for (int i = 0; i < dump.count; i++)
+		{
+			if (dump.objects[i]->type != typeOrder[type])
+				continue;
+			findSlot(dump.map.slots, dump.map.capacity,
+					 dump.objects[i])->index = (uint32_t)orderedCount;
+			ordered[orderedCount++] = dump.objects[i];
+		}
+	}
+
+	Writer writer;
+	initWriter(&writer);
+
+	ImageHeader header;
+	memcpy(header.magic, LOXI_MAGIC, sizeof(header.magic));
+	header.version = LOXI_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.flags = buildFlags();
+	header.objectCount = (uint32_t)orderedCount;
+	writeBytes(&writer, &header, sizeof(header));
+
+	// channels are not in typeOrder, they only make sense
+	// between running isolates
+	bool success = orderedCount == dump.count;
+	for (int i = 0; i < orderedCount && success; i++)
+		success = writeObject(&writer, &dump, ordered[i]);
+	writeTable(&writer, &dump, &vm->globals);
+
+	success = success && writeFileAtomic(path, &writer);
+
+	freeWriter(&writer);
+	free(ordered);
+	free(dump.objects);
+	free(dump.map.slots);
+	return success;
+}
+
+// -------- reading --------
+
+void markImageRoots(VM *vm)
+{
+	for (uint32_t i = 0; i < vm->loadingCount; i++)
+		markObject(vm, vm->loading[i]);
+}
+
+static Obj *readRef(VM *vm, Reader *reader, ObjType type)
+{
+	uint32_t index = readU32(reader);
+	if (index == NO_REF)
+		return NULL;
+
+	if (index >= vm->loadingCount || vm->loading[index] == NULL ||
+		vm->loading[index]->type != type)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+	return vm->loading[index];
+}
+
+// reads a value. objects are only looked up when resolve is set,
+// as they may not have been created yet in the first pass
+static Value readValue(VM *vm, Reader *reader, bool resolve)
+{
+	switch (readU8(reader))
+	{
+	case TAG_NIL:
+		return NIL_VAL;
+	case TAG_FALSE:
+		return BOOL_VAL(false);
+	case TAG_TRUE:
+		return BOOL_VAL(true);
+	case TAG_NUMBER:
+		return NUMBER_VAL(readDouble(reader));
+	case TAG_OBJECT:
+	{
+		uint32_t index = readU32(reader);
+		if (index < vm->loadingCount && !resolve)
+			return NIL_VAL;
+		if (index < vm->loadingCount && vm->loading[index] != NULL)
+			return OBJ_VAL(vm->loading[index]);
+		break;
+	}
+	}
+
+	reader->failed = true;
+	return NIL_VAL;
+}
+
+// reads a table, filling it only when fill is set. the values of a
+// class's methods are called without checking, so they must be closures
+static void readTable(VM *vm, Reader *reader, Table *table, bool fill,
+					  bool methods)
+{
+	uint32_t count = readU32(reader);
+	for (uint32_t i = 0; i < count && !reader->failed; i++)
+	{
+		uint32_t keyIndex = readU32(reader);
+		Value value = readValue(vm, reader, fill);
+		if (keyIndex >= vm->loadingCount || vm->loading[keyIndex] == NULL ||
+			vm->loading[keyIndex]->type != OBJ_STRING ||
+			(methods && fill && !IS_CLOSURE(value)))
+		{
+			reader->failed = true;
+			return;
+		}
+
+		if (fill)
+			tableSet(vm, table, (ObjString *)vm->loading[keyIndex], value);
+	}
+}
+
+// the first pass creates the objects with everything that does not
+// point to other objects, or only to objects of an earlier type group.
+// the second pass fills in the remaining references
+static Obj *readObject(VM *vm, Reader *reader, uint32_t index, bool firstPass)
+{
+	ObjType type = (ObjType)readU8(reader);
+	Obj *object = firstPass ? NULL : vm->loading[index];
+
+	switch (type)
+	{
+	case OBJ_STRING:
+	{
+		uint32_t length = readU32(reader);
+		const uint8_t *chars = readSpan(reader, length);
+		if (firstPass && chars != NULL)
+			object = (Obj *)copyString(vm, (const char *)chars, (int)length);
+		break;
+	}
+	case OBJ_NATIVE:
+	{
+		uint32_t length = readU32(reader);
+		const uint8_t *name = readSpan(reader, length);
+		if (firstPass && name != NULL)
+		{
+			NativeFn native = findNative((const char *)name, (int)length);
+			if (native != NULL)
+				object = (Obj *)newNative(vm, native);
+		}
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		int arity = (int)readU32(reader);
+		int upvalueCount = (int)readU32(reader);
+		ObjString *name = (ObjString *)readRef(vm, reader, OBJ_STRING);
+		ObjFunction *function = firstPass ? newFunction(vm)
+										  : (ObjFunction *)object;
+		if (firstPass)
+		{
+			vm->loading[index] = (Obj *)function; // root it right away
+			function->arity = arity;
+			function->upvalueCount = upvalueCount;
+			function->name = name;
+		}
+
+		Chunk chunk;
+		initChunk(&chunk);
+		readChunkCode(reader, &chunk);
+		if (firstPass)
+		{
+			// code and lines stay in the mapping
+			function->chunk.code = chunk.code;
+			function->chunk.count = chunk.count;
+#ifndef STRIP_LINE_INFO
+			function->chunk.lines = chunk.lines;
+			function->chunk.lineCount = chunk.lineCount;
+#endif
+		}
+
+		uint32_t constantCount = readU32(reader);
+		for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+		{
+			Value constant = readValue(vm, reader, !firstPass);
+			if (!firstPass)
+				writeValueArray(vm, &function->chunk.constants, constant);
+		}
+		if (!firstPass && !reader->failed && !checkFunction(function))
+			reader->failed = true;
+		object = (Obj *)function;
+		break;
+	}
+	case OBJ_UPVALUE:
+	{
+		if (firstPass)
+		{
+			// images are dumped between scripts, so all upvalues are closed
+			ObjUpvalue *upvalue = newUpvalue(vm, NULL);
+			upvalue->location = &upvalue->closed;
+			vm->loading[index] = (Obj *)upvalue;
+			readValue(vm, reader, false);
+			object = (Obj *)upvalue;
+		}
+		else
+		{
+			((ObjUpvalue *)object)->closed = readValue(vm, reader, true);
+		}
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjFunction *function = (ObjFunction *)readRef(vm, reader, OBJ_FUNCTION);
+		uint32_t upvalueCount = readU32(reader);
+		if (function == NULL || (int)upvalueCount != function->upvalueCount)
+		{
+			reader->failed = true;
+			break;
+		}
+
+		ObjClosure *closure = firstPass ? newClosure(vm, function)
+										: (ObjClosure *)object;
+		for (uint32_t i = 0; i < upvalueCount; i++)
+		{
+			closure->upvalues[i] =
+				(ObjUpvalue *)readRef(vm, reader, OBJ_UPVALUE);
+		}
+		object = (Obj *)closure;
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		// a class has a name and an instance a class, unlike a function
+		// that may have no name
+		ObjString *name = (ObjString *)readRef(vm, reader, OBJ_STRING);
+		if (name == NULL)
+		{
+			reader->failed = true;
+			break;
+		}
+		if (firstPass)
+		{
+			object = (Obj *)newClass(vm, name);
+			vm->loading[index] = object;
+		}
+		readTable(vm, reader, &((ObjClass *)object)->methods, !firstPass,
+				  true);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjClass *klass = (ObjClass *)readRef(vm, reader, OBJ_CLASS);
+		if (klass == NULL)
+		{
+			reader->failed = true;
+			break;
+		}
+		if (firstPass)
+		{
+			object = (Obj *)newInstance(vm, klass);
+			vm->loading[index] = object;
+		}
+		readTable(vm, reader, &((ObjInstance *)object)->fields, !firstPass,
+				  false);
+		break;
+	}
+	case OBJ_BOUND_METHOD:
+	{
+		if (firstPass)
+		{
+			readValue(vm, reader, false);
+			ObjClosure *method = (ObjClosure *)readRef(vm, reader, OBJ_CLOSURE);
+			if (method != NULL)
+				object = (Obj *)newBoundMethod(vm, NIL_VAL, method);
+		}
+		else
+		{
+			((ObjBoundMethod *)object)->receiver = readValue(vm, reader, true);
+			readRef(vm, reader, OBJ_CLOSURE);
+		}
+		break;
+	}
+	default:
+		reader->failed = true;
+		return NULL;
+	}
+
+	if (object == NULL || object->type != type)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+	return object;
+}
+
+bool loadImage(VM *vm, const char *path)
+{
+	size_t size;
+	void *base = mapFile(path, &size);
+	if (base == NULL)
+		return false;
+
+	ImageHeader header;
+	Reader reader;
+	initReader(&reader, base, size);
+	readBytes(&reader, &header, sizeof(header));
+	if (reader.failed ||
+		memcmp(header.magic, LOXI_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != LOXI_VERSION ||
+		header.byteOrder != BYTE_ORDER_MARK ||
+		header.flags != buildFlags() ||
+		header.objectCount > size)
+	{
+		unmapFile(base, size);
+		return false;
+	}
+
+	vm->loadingCount = header.objectCount;
+	vm->loading = (Obj **)calloc(vm->loadingCount + 1, sizeof(Obj *));
+	if (vm->loading == NULL)
+		exit(1);
+
+	const uint8_t *objectsStart = reader.current;
+	for (uint32_t i = 0; i < vm->loadingCount && !reader.failed; i++)
+		vm->loading[i] = readObject(vm, &reader, i, true);
+
+	reader.current = objectsStart;
+	for (uint32_t i = 0; i < vm->loadingCount && !reader.failed; i++)
+		readObject(vm, &reader, i, false);
+
+	if (!reader.failed)
+	{
+		// validate the globals before defining any of them
+		const uint8_t *globalsStart = reader.current;
+		readTable(vm, &reader, &vm->globals, false, false);
+		if (!reader.failed && reader.current == reader.end)
+		{
+			reader.current = globalsStart;
+			readTable(vm, &reader, &vm->globals, true, false);
+		}
+		else
+		{
+			reader.failed = true;
+		}
+	}
+
+	free(vm->loading);
+	vm->loading = NULL;
+	vm->loadingCount = 0;
+
+	if (reader.failed)
+	{
+		// the half restored objects are garbage now and their
+		// chunks never free the borrowed code
+		unmapFile(base, size);
+		return false;
+	}
+
+	keepMapped(vm, base, size);
+	return true;
+}
@@ -0,0 +1,726 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "isolate.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+
+// isolates share no heap, so values cross between them as messages.
+// strings are copied out of the sender's heap and into the receiver's,
+// channels are passed by reference
+typedef enum
+{
+	MESSAGE_VALUE, // nil, booleans and numbers
+	MESSAGE_STRING,
+	MESSAGE_CHANNEL,
+} MessageType;
+
+typedef struct
+{
+	MessageType type;
+	Value value;
+	char *chars;
+	int length;
+	Channel *channel; // retained for the message
+} Message;
+
+// a bounded queue of messages. its memory is malloc'ed rather than
+// owned by a VM, and freed when the last VM lets go of it
+struct Channel
+{
+	mtx_t lock;
+	cnd_t notEmpty;
+	cnd_t notFull;
+	Message *messages; // ring buffer
+	int capacity;
+	int head;
+	int count;
+	bool closed;
+	atomic_int references;
+	// the jobs of a pool, whose results are the messages. NULL for
+	// other channels
+	struct Pool *pool;
+};
+
+// a pool's jobs are split among its workers. each takes the newest of
+// its own, and once out of them steals the oldest of another's. what a
+// task sends goes to its own worker, so the work it fans out stays on
+// its core until the others run dry
+typedef struct
+{
+	mtx_t lock;
+	Message *jobs; // ring buffer, grown when full
+	int capacity;
+	int head; // the oldest, where thieves take from
+	int count;
+} Deque;
+
+typedef struct Pool
+{
+	Deque *deques; // one per worker
+	int workers;
+	atomic_uint next;	// the deque of the next job sent from outside
+	atomic_int queued;	// jobs in the deques
+	atomic_int pending; // jobs queued or running
+	// idle workers wait here for jobs
+	mtx_t lock;
+	cnd_t wake;
+	bool closed;   // no more jobs from outside
+	bool finished; // closed, and every job done
+} Pool;
+
+typedef struct Isolate
+{
+	thrd_t thread;
+	char *path;
+	bool hasInput;
+	Message input;
+	bool lazyCompilation;
+	// the pool the isolate works for, retained, and its deque
+	Channel *pool;
+	int worker;
+	struct Isolate *next;
+} Isolate;
+
+// -------- messages --------
+
+// fails for values that live in the sender's heap, like instances
+static bool toMessage(Value value, Message *message)
+{
+	message->type = MESSAGE_VALUE;
+	message->value = value;
+	if (!IS_OBJ(value))
+		return true;
+
+	if (IS_STRING(value))
+	{
+		ObjString *string = AS_STRING(value);
+		message->type = MESSAGE_STRING;
+		message->length = string->length;
+		message->chars = (char *)malloc(string->length + 1);
+		if (message->chars == NULL)
+			exit(1);
+		memcpy(message->chars, string->chars, string->length);
+		message->chars[string->length] = '\0';
+		return true;
+	}
+	if (IS_CHANNEL(value))
+	{
+		message->type = MESSAGE_CHANNEL;
+		message->channel = AS_CHANNEL(value);
+		atomic_fetch_add(&message->channel->references, 1);
+		return true;
+	}
+	return false;
+}
+
+static void freeMessage(Message *message)
+{
+	if (message->type == MESSAGE_STRING)
+		free(message->chars);
+	else if (message->type == MESSAGE_CHANNEL)
+		releaseChannel(message->channel);
+}
+
+// turns the message into a value of the receiving VM, consuming it
+static Value fromMessage(VM *vm, Message *message)
+{
+	switch (message->type)
+	{
+	case MESSAGE_STRING:
+	{
+		ObjString *string = copyString(vm, message->chars, message->length);
+		free(message->chars);
+		return OBJ_VAL(string);
+	}
+	case MESSAGE_CHANNEL:
+		// the message's reference goes to the new handle
+		return OBJ_VAL(newChannel(vm, message->channel));
+	default:
+		return message->value;
+	}
+}
+
+// -------- channels --------
+
+static Channel *createChannel(int capacity)
+{
+	Channel *channel = (Channel *)malloc(sizeof(Channel));
+	Message *messages = (Message *)malloc(sizeof(Message) * capacity);
+	if (channel == NULL || messages == NULL)
+		exit(1);
+
+	mtx_init(&channel->lock, mtx_plain);
+	cnd_init(&channel->notEmpty);
+	cnd_init(&channel->notFull);
+	channel->messages = messages;
+	channel->capacity = capacity;
+	channel->head = 0;
+	channel->count = 0;
+	channel->closed = false;
+	atomic_init(&channel->references, 1);
+	channel->pool = NULL;
+	return channel;
+}
+
+static void freePool(Pool *pool)
+{
+	for (int i = 0; i < pool->workers; i++)
+	{
+		Deque *deque = &pool->deques[i];
+		for (int j = 0; j < deque->count; j++)
+			freeMessage(&deque->jobs[(deque->head + j) % deque->capacity]);
+		free(deque->jobs);
+		mtx_destroy(&deque->lock);
+	}
+	free(pool->deques);
+	cnd_destroy(&pool->wake);
+	mtx_destroy(&pool->lock);
+	free(pool);
+}
+
+void releaseChannel(Channel *channel)
+{
+	if (atomic_fetch_sub(&channel->references, 1) != 1)
+		return;
+
+	for (int i = 0; i < channel->count; i++)
+		freeMessage(&channel->messages[(channel->head + i) % channel->capacity]);
+	free(channel->messages);
+	if (channel->pool != NULL)
+		freePool(channel->pool);
+	cnd_destroy(&channel->notFull);
+	cnd_destroy(&channel->notEmpty);
+	mtx_destroy(&channel->lock);
+	free(channel);
+}
+
+// blocks while the channel is full. returns false, keeping the
+// message, if the channel is closed
+static bool sendMessage(Channel *channel, Message *message)
+{
+	mtx_lock(&channel->lock);
+	while (channel->count == channel->capacity && !channel->closed)
+		cnd_wait(&channel->notFull, &channel->lock);
+
+	if (channel->closed)
+	{
+		mtx_unlock(&channel->lock);
+		return false;
+	}
+
+	int tail = (channel->head + channel->count) % channel->capacity;
+	channel->messages[tail] = *message;
+	channel->count++;
+	cnd_signal(&channel->notEmpty);
+	mtx_unlock(&channel->lock);
+	return true;
+}
+
+static void closeChannel(Channel *channel)
+{
+	mtx_lock(&channel->lock);
+	channel->closed = true;
+	cnd_broadcast(&channel->notEmpty);
+	cnd_broadcast(&channel->notFull);
+	mtx_unlock(&channel->lock);
+}
+
+// -------- pools --------
+
+static Pool *createPool(int workers)
+{
+	Pool *pool = (Pool *)malloc(sizeof(Pool));
+	Deque *deques = (Deque *)malloc(sizeof(Deque) * workers);
+	if (pool == NULL || deques == NULL)
+		exit(1);
+
+	for (int i = 0; i < workers; i++)
+	{
+		Deque *deque = &deques[i];
+		mtx_init(&deque->lock, mtx_plain);
+		deque->capacity = CHANNEL_CAPACITY;
+		deque->jobs = (Message *)malloc(sizeof(Message) * deque->capacity);
+		if (deque->jobs == NULL)
+			exit(1);
+		deque->head = 0;
+		deque->count = 0;
+	}
+	pool->deques = deques;
+	pool->workers = workers;
+	atomic_init(&pool->next, 0);
+	atomic_init(&pool->queued, 0);
+	atomic_init(&pool->pending, 0);
+	mtx_init(&pool->lock, mtx_plain);
+	cnd_init(&pool->wake);
+	pool->closed = false;
+	pool->finished = false;
+	return pool;
+}
+
+static void pushJob(Deque *deque, Message *job)
+{
+	mtx_lock(&deque->lock);
+	if (deque->count == deque->capacity)
+	{
+		int capacity = deque->capacity * 2;
+		Message *jobs = (Message *)malloc(sizeof(Message) * capacity);
+		if (jobs == NULL)
+			exit(1);
+		for (int i = 0; i < deque->count; i++)
+			jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+		free(deque->jobs);
+		deque->jobs = jobs;
+		deque->capacity = capacity;
+		deque->head = 0;
+	}
+	deque->jobs[(deque->head + deque->count) % deque->capacity] = *job;
+	deque->count++;
+	mtx_unlock(&deque->lock);
+}
+
+// the newest job for the deque's own worker, the oldest for a thief
+static bool takeJob(Deque *deque, bool newest, Message *job)
+{
+	mtx_lock(&deque->lock);
+	bool taken = deque->count > 0;
+	if (taken && newest)
+	{
+		*job = deque->jobs[(deque->head + deque->count - 1) % deque->capacity];
+	}
+	else if (taken)
+	{
+		*job = deque->jobs[deque->head];
+		deque->head = (deque->head + 1) % deque->capacity;
+	}
+	if (taken)
+		deque->count--;
+	mtx_unlock(&deque->lock);
+	return taken;
+}
+
+// worker is the deque of the worker sending the job, or -1 from outside
+// the pool, where jobs go round-robin. returns false, keeping the job,
+// once the pool is closed to jobs from outside
+static bool submitJob(Pool *pool, int worker, Message *job)
+{
+	mtx_lock(&pool->lock);
+	bool open = worker >= 0 || !pool->closed;
+	if (open)
+		atomic_fetch_add(&pool->pending, 1);
+	mtx_unlock(&pool->lock);
+	if (!open)
+		return false;
+
+	if (worker < 0)
+		worker = (int)(atomic_fetch_add(&pool->next, 1) % pool->workers);
+	pushJob(&pool->deques[worker], job);
+	atomic_fetch_add(&pool->queued, 1);
+
+	mtx_lock(&pool->lock);
+	cnd_signal(&pool->wake);
+	mtx_unlock(&pool->lock);
+	return true;
+}
+
+// waits for a job for the worker. returns false once the pool is
+// finished
+static bool nextJob(Pool *pool, int worker, Message *job)
+{
+	for (;;)
+	{
+		bool taken = takeJob(&pool->deques[worker], true, job);
+		for (int i = 1; !taken && i < pool->workers; i++)
+			taken = takeJob(&pool->deques[(worker + i) % pool->workers],
+							false, job);
+		if (taken)
+		{
+			atomic_fetch_sub(&pool->queued, 1);
+			return true;
+		}
+
+		mtx_lock(&pool->lock);
+		while (atomic_load(&pool->queued) <= 0 && !pool->finished)
+			cnd_wait(&pool->wake, &pool->lock);
+		bool finished = pool->finished;
+		mtx_unlock(&pool->lock);
+		if (finished)
+			return false;
+	}
+}
+
+// once the pool is closed and its last job done, the workers stop and
+// the results channel closes, so that receive() returns nil after the
+// last result
+static void finishIfDone(Channel *channel)
+{
+	Pool *pool = channel->pool;
+	mtx_lock(&pool->lock);
+	bool done = pool->closed && !pool->finished &&
+				atomic_load(&pool->pending) == 0;
+	if (done)
+	{
+		pool->finished = true;
+		cnd_broadcast(&pool->wake);
+	}
+	mtx_unlock(&pool->lock);
+	if (done)
+		closeChannel(channel);
+}
+
+static void closePool(Channel *channel)
+{
+	Pool *pool = channel->pool;
+	mtx_lock(&pool->lock);
+	pool->closed = true;
+	mtx_unlock(&pool->lock);
+	finishIfDone(channel);
+}
+
+// calls the script's task(value) for every job the worker gets, and
+// sends what it returns, unless nil, to the pool's channel
+static void work(VM *vm, Channel *channel, int worker, bool ready)
+{
+	Pool *pool = channel->pool;
+	Value task = NIL_VAL;
+	if (ready)
+	{
+		ObjString *name = copyString(vm, "task", 4);
+		if (!tableGet(&vm->globals, name, &task))
+		{
+			fprintf(stderr, "The script of a pool must define a function "
+							"task(value).\n");
+			ready = false;
+		}
+	}
+
+	// a worker that can't run them still takes its jobs, so that the
+	// pool finishes
+	Message job;
+	while (nextJob(pool, worker, &job))
+	{
+		if (!ready)
+		{
+			freeMessage(&job);
+		}
+		else
+		{
+			push(vm, task);
+			push(vm, fromMessage(vm, &job));
+			if (callFunction(vm, 1) == INTERPRET_OK)
+			{
+				Value value = pop(vm);
+				Message result;
+				if (!IS_NIL(value) && !toMessage(value, &result))
+					fprintf(stderr, "A task can only return nil, booleans, "
+									"numbers, strings and channels.\n");
+				else if (!IS_NIL(value) && !sendMessage(channel, &result))
+					freeMessage(&result); // nobody is left to receive it
+			}
+		}
+		if (atomic_fetch_sub(&pool->pending, 1) == 1)
+			finishIfDone(channel);
+	}
+}
+
+// -------- isolates --------
+
+static char *readScript(const char *path, size_t *length)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	char *source = size >= 0 ? (char *)malloc(size + 1) : NULL;
+	if (source != NULL)
+		*length = fread(source, 1, size, file);
+	fclose(file);
+	return source;
+}
+
+static int runIsolate(void *arg)
+{
+	Isolate *isolate = (Isolate *)arg;
+	VM *vm = createVM();
+	if (vm == NULL)
+		return 1;
+	vm->lazyCompilation = isolate->lazyCompilation;
+
+	// a worker's global pool is its pool, for sending it more jobs
+	if (isolate->pool != NULL)
+	{
+		atomic_fetch_add(&isolate->pool->references, 1);
+		push(vm, OBJ_VAL(newChannel(vm, isolate->pool)));
+		push(vm, OBJ_VAL(copyString(vm, "pool", 4)));
+		tableSet(vm, &vm->globals, AS_STRING(vm->stackTop[-1]),
+				 vm->stackTop[-2]);
+		pop(vm);
+		pop(vm);
+		vm->pool = isolate->pool->pool;
+		vm->poolWorker = isolate->worker;
+	}
+
+	if (isolate->hasInput)
+	{
+		isolate->hasInput = false;
+		push(vm, fromMessage(vm, &isolate->input));
+		push(vm, OBJ_VAL(copyString(vm, "input", 5)));
+		tableSet(vm, &vm->globals, AS_STRING(vm->stackTop[-1]),
+				 vm->stackTop[-2]);
+		pop(vm);
+		pop(vm);
+	}
+
+	size_t length;
+	char *source = readScript(isolate->path, &length);
+	InterpretResult result = INTERPRET_RUNTIME_ERROR;
+	if (source == NULL)
+	{
+		fprintf(stderr, "Could not open file \"%s\".\n", isolate->path);
+	}
+	else
+	{
+		ObjFunction *function = compile(vm, source, length);
+		free(source);
+		result = interpretFunction(vm, function);
+	}
+
+	if (isolate->pool != NULL)
+		work(vm, isolate->pool, isolate->worker, result == INTERPRET_OK);
+	destroyVM(vm);
+	return 0;
+}
+
+void joinIsolates(VM *vm)
+{
+	// nobody is left to send jobs or receive results. the workers
+	// finish what they have, and drop the results
+	for (Isolate *isolate = vm->isolates; isolate != NULL;
+		 isolate = isolate->next)
+	{
+		if (isolate->pool != NULL)
+		{
+			closePool(isolate->pool);
+			closeChannel(isolate->pool);
+		}
+	}
+
+	while (vm->isolates != NULL)
+	{
+		Isolate *isolate = vm->isolates;
+		vm->isolates = isolate->next;
+
+		thrd_join(isolate->thread, NULL);
+		if (isolate->pool != NULL)
+			releaseChannel(isolate->pool);
+		free(isolate->path);
+		free(isolate);
+	}
+}
+
+// -------- natives --------
+
+static Channel *channelArgument(VM *vm, int argCount, Value *args,
+								int expected, const char *native)
+{
+	if (argCount != expected)
+	{
+		nativeError(vm, "Expected %d arguments but got %d.",
+					expected, argCount);
+		return NULL;
+	}
+	if (!IS_CHANNEL(args[0]))
+	{
+		nativeError(vm, "First argument of %s() must be a channel.", native);
+		return NULL;
+	}
+	return AS_CHANNEL(args[0]);
+}
+
+Value spawnNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount < 1 || argCount > 2)
+		return nativeError(vm, "Expected 1 or 2 arguments but got %d.",
+						   argCount);
+	if (!IS_STRING(args[0]))
+		return nativeError(vm, "Path of spawn() must be a string.");
+
+	Isolate *isolate = (Isolate *)malloc(sizeof(Isolate));
+	ObjString *path = AS_STRING(args[0]);
+	char *pathChars = (char *)malloc(path->length + 1);
+	if (isolate == NULL || pathChars == NULL)
+		exit(1);
+	memcpy(pathChars, path->chars, path->length);
+	pathChars[path->length] = '\0';
+
+	isolate->path = pathChars;
+	isolate->hasInput = argCount == 2;
+	isolate->lazyCompilation = vm->lazyCompilation;
+	isolate->pool = NULL;
+	if (isolate->hasInput && !toMessage(args[1], &isolate->input))
+	{
+		free(pathChars);
+		free(isolate);
+		return nativeError(vm, "Can only pass nil, booleans, numbers, "
+							   "strings and channels to an isolate.");
+	}
+
+	if (thrd_create(&isolate->thread, runIsolate, isolate) != thrd_success)
+	{
+		if (isolate->hasInput)
+			freeMessage(&isolate->input);
+		free(pathChars);
+		free(isolate);
+		return nativeError(vm, "Could not start an isolate.");
+	}
+
+	isolate->next = vm->isolates;
+	vm->isolates = isolate;
+	return NIL_VAL;
+}
+
+Value channelNative(VM *vm, int argCount, Value *args)
+{
+	int capacity = CHANNEL_CAPACITY;
+	if (argCount > 1)
+		return nativeError(vm, "Expected 0 or 1 arguments but got %d.",
+						   argCount);
+	if (argCount == 1)
+	{
+		if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 ||
+			AS_NUMBER(args[0]) > INT32_MAX / sizeof(Message))
+			return nativeError(vm, "Capacity must be a positive number.");
+		capacity = (int)AS_NUMBER(args[0]);
+	}
+
+	return OBJ_VAL(newChannel(vm, createChannel(capacity)));
+}
+
+Value sendNative(VM *vm, int argCount, Value *args)
+{
+	Channel *channel = channelArgument(vm, argCount, args, 2, "send");
+	if (channel == NULL)
+		return NIL_VAL;
+
+	Message message;
+	if (!toMessage(args[1], &message))
+		return nativeError(vm, "Can only send nil, booleans, numbers, "
+							   "strings and channels.");
+
+	// to a pool, it is a job
+	Pool *pool = channel->pool;
+	bool sent = pool != NULL
+					? submitJob(pool, vm->pool == pool ? vm->poolWorker : -1,
+								&message)
+					: sendMessage(channel, &message);
+	if (!sent)
+	{
+		freeMessage(&message);
+		return nativeError(vm, "Cannot send to a closed channel.");
+	}
+	return NIL_VAL;
+}
+
+Value receiveNative(VM *vm, int argCount, Value *args)
+{
+	Channel *channel = channelArgument(vm, argCount, args, 1, "receive");
+	if (channel == NULL)
+		return NIL_VAL;
+
+	mtx_lock(&channel->lock);
+	while (channel->count == 0 && !channel->closed)
+		cnd_wait(&channel->notEmpty, &channel->lock);
+
+	if (channel->count == 0)
+	{
+		mtx_unlock(&channel->lock);
+		return NIL_VAL; // closed and drained
+	}
+
+	Message message = channel->messages[channel->head];
+	channel->head = (channel->head + 1) % channel->capacity;
+	channel->count--;
+	cnd_signal(&channel->notFull);
+	mtx_unlock(&channel->lock);
+
+	// allocating may collect, so only once the lock is released
+	return fromMessage(vm, &message);
+}
+
+Value closeNative(VM *vm, int argCount, Value *args)
+{
+	Channel *channel = channelArgument(vm, argCount, args, 1, "close");
+	if (channel == NULL)
+		return NIL_VAL;
+
+	if (channel->pool != NULL)
+		closePool(channel);
+	else
+		closeChannel(channel);
+	return NIL_VAL;
+}
+
+Value poolNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount < 1 || argCount > 2)
+		return nativeError(vm, "Expected 1 or 2 arguments but got %d.",
+						   argCount);
+	if (!IS_STRING(args[0]))
+		return nativeError(vm, "Path of pool() must be a string.");
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argCount == 2)
+	{
+		if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1 ||
+			AS_NUMBER(args[1]) > POOL_MAX_WORKERS)
+			return nativeError(vm, "Workers must be a number from 1 to %d.",
+							   POOL_MAX_WORKERS);
+		workers = (long)AS_NUMBER(args[1]);
+	}
+	if (workers < 1)
+		workers = 1;
+
+	Channel *channel = createChannel(CHANNEL_CAPACITY);
+	channel->pool = createPool((int)workers);
+	// the handle keeps the channel's first reference
+	push(vm, OBJ_VAL(newChannel(vm, channel)));
+
+	ObjString *path = AS_STRING(args[0]);
+	for (int i = 0; i < workers; i++)
+	{
+		Isolate *isolate = (Isolate *)malloc(sizeof(Isolate));
+		char *pathChars = (char *)malloc(path->length + 1);
+		if (isolate == NULL || pathChars == NULL)
+			exit(1);
+		memcpy(pathChars, path->chars, path->length);
+		pathChars[path->length] = '\0';
+
+		isolate->path = pathChars;
+		isolate->hasInput = false;
+		isolate->lazyCompilation = vm->lazyCompilation;
+		isolate->pool = channel;
+		isolate->worker = i;
+		atomic_fetch_add(&channel->references, 1);
+		if (thrd_create(&isolate->thread, runIsolate, isolate) != thrd_success)
+		{
+			releaseChannel(channel);
+			free(pathChars);
+			free(isolate);
+			// the ones started take the jobs of the others
+			if (i > 0)
+				break;
+			return nativeError(vm, "Could not start an isolate.");
+		}
+		isolate->next = vm->isolates;
+		vm->isolates = isolate;
+	}
+	return pop(vm);
+}
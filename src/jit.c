@@ -0,0 +1,968 @@
+// mmap()'s MAP_ANONYMOUS
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber.h"
+#include "jit.h"
+#include "table.h"
+
+void setJitThreshold(VM *vm, uint32_t threshold)
+{
+	vm->jitThreshold = threshold;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct JitCode
+{
+	uint8_t *code; // mapped executable, starts with the entry
+	size_t size;
+	// the offset into code of each instruction, by bytecode offset
+	uint32_t *entries;
+};
+
+// native code is called with the VM, the frame, where to start and the
+// frame to stop after, and returns a JitResult
+typedef int (*JitFn)(VM *vm, CallFrame *frame, uint8_t *start,
+					 int baseFrame);
+
+// -------- runtime --------
+
+// the slow paths. frame->ip points past the opcode and the stack top
+// is stored, as in run(). they return false after a runtime error
+
+#define READ_BYTE() (*frame->ip++)
+#define READ_CONSTANT() \
+	(frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+
+static bool getGlobal(VM *vm, CallFrame *frame)
+{
+	ObjString *name = READ_STRING();
+	Value value;
+	if (!tableGet(&vm->globals, name, &value))
+	{
+		runtimeError(vm, "Undefined variable '%s'.", name->chars);
+		return false;
+	}
+	push(vm, value);
+	return true;
+}
+
+static bool defineGlobal(VM *vm, CallFrame *frame)
+{
+	ObjString *name = READ_STRING();
+	tableSet(vm, &vm->globals, name, vm->stackTop[-1]);
+	pop(vm);
+	return true;
+}
+
+static bool setGlobal(VM *vm, CallFrame *frame)
+{
+	ObjString *name = READ_STRING();
+	if (tableSet(vm, &vm->globals, name, vm->stackTop[-1]))
+	{
+		runtimeError(vm, "Undefined variable '%s'.", name->chars);
+		return false;
+	}
+	return true;
+}
+
+static bool getProperty(VM *vm, CallFrame *frame)
+{
+	if (!IS_INSTANCE(vm->stackTop[-1]))
+	{
+		runtimeError(vm, "Cannot get property of non-instance value.");
+		return false;
+	}
+
+	ObjInstance *instance = AS_INSTANCE(vm->stackTop[-1]);
+	ObjString *name = READ_STRING();
+	Value value;
+	if (tableGet(&instance->fields, name, &value))
+	{
+		vm->stackTop[-1] = value;
+		return true;
+	}
+	return jitBindMethod(vm, instance->klass, name);
+}
+
+static bool setProperty(VM *vm, CallFrame *frame)
+{
+	if (!IS_INSTANCE(vm->stackTop[-2]))
+	{
+		runtimeError(vm, "Cannot set field of non-instance value.");
+		return false;
+	}
+
+	ObjInstance *instance = AS_INSTANCE(vm->stackTop[-2]);
+	tableSet(vm, &instance->fields, READ_STRING(), vm->stackTop[-1]);
+	Value value = pop(vm);
+	vm->stackTop[-1] = value;
+	return true;
+}
+
+static bool equal(VM *vm, CallFrame *frame)
+{
+	Value b = pop(vm);
+	Value a = pop(vm);
+	push(vm, BOOL_VAL(valuesEqual(a, b)));
+	return true;
+}
+
+// the numbers are done inline, so only strings are left
+static bool add(VM *vm, CallFrame *frame)
+{
+	if (IS_STRING(vm->stackTop[-1]) && IS_STRING(vm->stackTop[-2]))
+	{
+		jitConcatenate(vm);
+		return true;
+	}
+	runtimeError(vm, "Operands must be two numbers or two strings.");
+	return false;
+}
+
+static bool notNumbers(VM *vm, CallFrame *frame)
+{
+	runtimeError(vm, "Operands must be numbers.");
+	return false;
+}
+
+static bool notNumber(VM *vm, CallFrame *frame)
+{
+	runtimeError(vm, "Operand must be a number.");
+	return false;
+}
+
+static bool print(VM *vm, CallFrame *frame)
+{
+	outputLine(&vm->output, pop(vm));
+	return true;
+}
+
+static bool closure(VM *vm, CallFrame *frame)
+{
+	ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+	ObjClosure *closure = newClosure(vm, function);
+	push(vm, OBJ_VAL(closure));
+	for (int i = 0; i < closure->upvalueCount; i++)
+	{
+		uint8_t isLocal = READ_BYTE();
+		uint8_t index = READ_BYTE();
+		if (isLocal)
+			closure->upvalues[i] =
+				jitCaptureUpvalue(vm, frame->slots + index);
+		else
+			closure->upvalues[i] = frame->closure->upvalues[index];
+	}
+	return true;
+}
+
+static bool closeUpvalue(VM *vm, CallFrame *frame)
+{
+	jitCloseUpvalues(vm, vm->stackTop - 1);
+	pop(vm);
+	return true;
+}
+
+static bool makeClass(VM *vm, CallFrame *frame)
+{
+	push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
+	return true;
+}
+
+static bool method(VM *vm, CallFrame *frame)
+{
+	return jitDefineMethod(vm, READ_STRING());
+}
+
+static bool checkSafepoint(VM *vm, CallFrame *frame)
+{
+	jitSafepoint(vm);
+	return true;
+}
+
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_STRING
+
+typedef bool (*Helper)(VM *vm, CallFrame *frame);
+
+// where native code goes on after a call or return, in rax and rdx.
+// a JitResult instead of a target leaves it
+typedef struct
+{
+	uint8_t *target;
+	CallFrame *frame;
+} JitNext;
+
+// the VM's top frame, in native code if it has any
+static JitNext next(VM *vm)
+{
+	CallFrame *frame = &vm->frames[vm->frameCount - 1];
+	ObjFunction *function = frame->closure->function;
+	if (function->jit == NULL)
+		return (JitNext){(uint8_t *)JIT_INTERPRET, NULL};
+	uint32_t entry = function->jit->entries[frame->ip - function->chunk.code];
+	return (JitNext){function->jit->code + entry, frame};
+}
+
+// frame->ip is past the argument count
+static JitNext call(VM *vm, CallFrame *frame)
+{
+	int argCount = frame->ip[-1];
+	if (vm->safepointDue)
+		jitSafepoint(vm);
+	if (!jitCallValue(vm, vm->stackTop[-1 - argCount], argCount))
+		return (JitNext){(uint8_t *)JIT_ERROR, NULL};
+	return next(vm);
+}
+
+static JitNext ret(VM *vm, CallFrame *frame, int baseFrame)
+{
+	jitPopFrame(vm, frame);
+	if (vm->frameCount == baseFrame)
+		return (JitNext){(uint8_t *)JIT_RETURNED, NULL};
+	if (vm->fiber != NULL && vm->frameCount == vm->fiber->baseFrame &&
+		!finishFiber(vm))
+		return (JitNext){(uint8_t *)JIT_ERROR, NULL};
+	return next(vm);
+}
+
+// -------- assembler --------
+
+enum
+{
+	RAX = 0,
+	RCX = 1,
+	RDX = 2,
+	RBX = 3,
+	RSP = 4,
+	R12 = 12,
+	R13 = 13,
+	R14 = 14,
+	R15 = 15,
+	// xmm registers in the same field
+	XMM0 = 0,
+};
+
+// condition codes
+enum
+{
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+};
+
+// registers the generated code keeps
+#define VM_REG RBX
+#define FRAME_REG R12
+#define TOP_REG R13 // vm->stackTop
+#define SLOTS_REG R14
+#define CONSTANTS_REG R15
+
+// Value fields, relative to a slot
+#define TYPE 0
+#define AS (int32_t)offsetof(Value, as)
+
+// a rel32 to point at the native code of an instruction
+typedef struct
+{
+	size_t at;
+	int target; // bytecode offset
+} Fixup;
+
+// an out of line call to a helper, for when the inline code can't
+// handle its operands
+typedef struct
+{
+	size_t jumps[2]; // rel32s to point at it
+	int jumpCount;
+	int offset; // of the instruction
+	Helper helper;
+	int resume; // bytecode offset to go on at
+} Stub;
+
+typedef struct
+{
+	uint8_t *code;
+	size_t count;
+	size_t capacity;
+	Fixup *fixups;
+	int fixupCount;
+	int fixupCapacity;
+	Stub *stubs;
+	int stubCount;
+	int stubCapacity;
+	// rel32s to point at the shared exit and error paths
+	size_t *leaves;
+	int leaveCount;
+	int leaveCapacity;
+	size_t *errors;
+	int errorCount;
+	int errorCapacity;
+} Assembler;
+
+// grows one of the assembler's arrays by one, malloc'd because none of
+// it lives on the Lox heap
+#define APPEND(type, array, count, capacity, value)                      \
+	do                                                                   \
+	{                                                                    \
+		if (count == capacity)                                           \
+		{                                                                \
+			capacity = capacity < 8 ? 8 : capacity * 2;                  \
+			array = (type *)realloc(array, sizeof(type) * capacity);     \
+			if (array == NULL)                                           \
+				exit(1);                                                 \
+		}                                                                \
+		array[count++] = value;                                          \
+	} while (false)
+
+static void emit(Assembler *a, uint8_t byte)
+{
+	APPEND(uint8_t, a->code, a->count, a->capacity, byte);
+}
+
+static void emitBytes(Assembler *a, const uint8_t *bytes, int count)
+{
+	for (int i = 0; i < count; i++)
+		emit(a, bytes[i]);
+}
+
+static void emit32(Assembler *a, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		emit(a, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler *a, uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+		emit(a, (uint8_t)(value >> (8 * i)));
+}
+
+// an instruction with a reg and a [base + disp32] operand. opcodes
+// above 0xff are two bytes, 0x0f first
+static void emitMem(Assembler *a, uint8_t prefix, bool wide,
+					uint16_t opcode, int reg, int base, int32_t disp)
+{
+	if (prefix != 0)
+		emit(a, prefix);
+	uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8 ? 0x04 : 0) |
+				  (base & 8 ? 0x01 : 0);
+	if (rex != 0x40)
+		emit(a, rex);
+	if (opcode > 0xff)
+		emit(a, (uint8_t)(opcode >> 8));
+	emit(a, (uint8_t)opcode);
+	emit(a, 0x80 | (reg & 7) << 3 | (base & 7));
+	if ((base & 7) == RSP)
+		emit(a, 0x24); // a sib byte for rsp and r12
+	emit32(a, (uint32_t)disp);
+}
+
+// a jump or conditional jump whose rel32 is set later, returns where
+static size_t emitJump(Assembler *a, int condition)
+{
+	if (condition < 0)
+		emit(a, 0xe9);
+	else
+		emitBytes(a, (uint8_t[]){0x0f, 0x80 | condition}, 2);
+	emit32(a, 0);
+	return a->count - 4;
+}
+
+static void patch(Assembler *a, size_t at, size_t target)
+{
+	uint32_t rel = (uint32_t)(target - (at + 4));
+	memcpy(&a->code[at], &rel, 4);
+}
+
+static void jumpTo(Assembler *a, int condition, int target)
+{
+	Fixup fixup = {emitJump(a, condition), target};
+	APPEND(Fixup, a->fixups, a->fixupCount, a->fixupCapacity, fixup);
+}
+
+static void jumpToError(Assembler *a, int condition)
+{
+	size_t at = emitJump(a, condition);
+	APPEND(size_t, a->errors, a->errorCount, a->errorCapacity, at);
+}
+
+// adds to the stack top, by a multiple of the size of a Value
+static void moveTop(Assembler *a, int values)
+{
+	int bytes = values * (int)sizeof(Value);
+	// add/sub r13, imm8
+	emitBytes(a, (uint8_t[]){0x49, 0x83, bytes > 0 ? 0xc5 : 0xed,
+							 (uint8_t)abs(bytes)},
+			  4);
+}
+
+// copies a Value through xmm0
+static void copyValue(Assembler *a, int fromBase, int32_t from, int toBase,
+					  int32_t to)
+{
+	emitMem(a, 0, false, 0x0f10, XMM0, fromBase, from); // movups
+	emitMem(a, 0, false, 0x0f11, XMM0, toBase, to);
+}
+
+// stores a type and 64 bits of payload
+static void storeValue(Assembler *a, int base, int32_t disp, ValueType type,
+					   int32_t payload)
+{
+	emitMem(a, 0, false, 0xc7, 0, base, disp + TYPE); // mov dword
+	emit32(a, type);
+	emitMem(a, 0, true, 0xc7, 0, base, disp + AS); // mov qword
+	emit32(a, (uint32_t)payload);
+}
+
+// the flag in al as a bool in the slot
+static void storeBool(Assembler *a, int base, int32_t disp)
+{
+	emitBytes(a, (uint8_t[]){0x0f, 0xb6, 0xc0}, 3); // movzx eax, al
+	emitMem(a, 0, false, 0xc7, 0, base, disp + TYPE);
+	emit32(a, VAL_BOOL);
+	emitMem(a, 0, true, 0x89, RAX, base, disp + AS); // mov [], rax
+}
+
+// jumps to a new stub unless the slot holds a number, for the stub
+// to be finished by addStub()
+static void checkNumber(Assembler *a, Stub *stub, int32_t disp)
+{
+	emitMem(a, 0, false, 0x83, 7, TOP_REG, disp + TYPE); // cmp dword, imm8
+	emit(a, VAL_NUMBER);
+	stub->jumps[stub->jumpCount++] = emitJump(a, CC_NE);
+}
+
+static void addStub(Assembler *a, Stub stub, int offset, Helper helper,
+					int resume)
+{
+	stub.offset = offset;
+	stub.helper = helper;
+	stub.resume = resume;
+	APPEND(Stub, a->stubs, a->stubCount, a->stubCapacity, stub);
+}
+
+// stores the frame's ip and the stack top, calls the helper and
+// leaves for the error path if it failed
+static void callHelper(Assembler *a, Helper helper, uint8_t *ip)
+{
+	emitBytes(a, (uint8_t[]){0x48, 0xb8}, 2); // mov rax, imm64
+	emit64(a, (uint64_t)(uintptr_t)ip);
+	emitMem(a, 0, true, 0x89, RAX, FRAME_REG, offsetof(CallFrame, ip));
+	emitMem(a, 0, true, 0x89, TOP_REG, VM_REG, offsetof(VM, stackTop));
+	emitBytes(a, (uint8_t[]){0x48, 0x89, 0xdf}, 3); // mov rdi, rbx
+	emitBytes(a, (uint8_t[]){0x4c, 0x89, 0xe6}, 3); // mov rsi, r12
+	emitBytes(a, (uint8_t[]){0x48, 0xb8}, 2);
+	emit64(a, (uint64_t)(uintptr_t)helper);
+	emitBytes(a, (uint8_t[]){0xff, 0xd0}, 2); // call rax
+	emitMem(a, 0, true, 0x8b, TOP_REG, VM_REG, offsetof(VM, stackTop));
+	emitBytes(a, (uint8_t[]){0x84, 0xc0}, 2); // test al, al
+	jumpToError(a, CC_E);
+}
+
+// loads the registers for the frame in rdx and jumps to rax. the stack
+// top is stored
+static void enterFrame(Assembler *a)
+{
+	emitBytes(a, (uint8_t[]){0x49, 0x89, 0xd4}, 3); // mov r12, rdx
+	emitMem(a, 0, true, 0x8b, TOP_REG, VM_REG, offsetof(VM, stackTop));
+	emitMem(a, 0, true, 0x8b, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+	emitMem(a, 0, true, 0x8b, RCX, FRAME_REG, offsetof(CallFrame, closure));
+	emitMem(a, 0, true, 0x8b, RCX, RCX, offsetof(ObjClosure, function));
+	emitMem(a, 0, true, 0x8b, CONSTANTS_REG, RCX,
+			offsetof(ObjFunction, chunk.constants.values));
+	emitBytes(a, (uint8_t[]){0xff, 0xe0}, 2); // jmp rax
+}
+
+// calls call() or ret() and goes on where they say. the jump is at
+// every call and return rather than shared, to be predicted apart
+static void callOrReturn(Assembler *a, void *helper, uint8_t *ip)
+{
+	emitBytes(a, (uint8_t[]){0x48, 0xb8}, 2);
+	emit64(a, (uint64_t)(uintptr_t)ip);
+	emitMem(a, 0, true, 0x89, RAX, FRAME_REG, offsetof(CallFrame, ip));
+	emitMem(a, 0, true, 0x89, TOP_REG, VM_REG, offsetof(VM, stackTop));
+	emitBytes(a, (uint8_t[]){0x48, 0x89, 0xdf}, 3); // mov rdi, rbx
+	emitBytes(a, (uint8_t[]){0x4c, 0x89, 0xe6}, 3); // mov rsi, r12
+	emitBytes(a, (uint8_t[]){0x89, 0xea}, 2);		// mov edx, ebp
+	emitBytes(a, (uint8_t[]){0x48, 0xb8}, 2);
+	emit64(a, (uint64_t)(uintptr_t)helper);
+	emitBytes(a, (uint8_t[]){0xff, 0xd0}, 2); // call rax
+	// a JitResult leaves with it in eax, cmp rax, 2 then jbe
+	emitBytes(a, (uint8_t[]){0x48, 0x83, 0xf8, JIT_RETURNED}, 4);
+	size_t at = emitJump(a, CC_BE);
+	APPEND(size_t, a->leaves, a->leaveCount, a->leaveCapacity, at);
+	enterFrame(a);
+}
+
+static void emitPrologue(Assembler *a)
+{
+	// push rbp, rbx, r12 to r15, then align the stack for calls
+	emitBytes(a, (uint8_t[]){0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,
+							 0x41, 0x57, 0x48, 0x83, 0xec, 0x08},
+			  14);
+	emitBytes(a, (uint8_t[]){0x48, 0x89, 0xfb}, 3); // mov rbx, rdi
+	emitBytes(a, (uint8_t[]){0x89, 0xcd}, 2);		// mov ebp, ecx
+	emitBytes(a, (uint8_t[]){0x48, 0x89, 0xd0}, 3); // mov rax, rdx
+	emitBytes(a, (uint8_t[]){0x48, 0x89, 0xf2}, 3); // mov rdx, rsi
+	enterFrame(a);
+}
+
+static void emitEpilogue(Assembler *a)
+{
+	// add rsp, 8, pop r15 to r12, rbx, rbp and ret
+	emitBytes(a, (uint8_t[]){0x48, 0x83, 0xc4, 0x08, 0x41, 0x5f, 0x41, 0x5e,
+							 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d, 0xc3},
+			  15);
+}
+
+// -------- templates --------
+
+// the length of the instruction at offset, 0 if it isn't one
+static int instructionLength(Chunk *chunk, int offset)
+{
+	switch (chunk->code[offset])
+	{
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_POP:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_NEGATE:
+	case OP_NOT:
+	case OP_PRINT:
+	case OP_CLOSE_UPVALUE:
+	case OP_RETURN:
+	case OP_GREATER_NUM:
+	case OP_LESS_NUM:
+	case OP_ADD_NUM:
+	case OP_SUBTRACT_NUM:
+	case OP_MULTIPLY_NUM:
+	case OP_DIVIDE_NUM:
+	case OP_ADD_MIXED:
+		return 1;
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_CALL:
+	case OP_CLASS:
+	case OP_METHOD:
+		return 2;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_BACK:
+		return 3;
+	case OP_CLOSURE:
+	{
+		if (offset + 1 >= chunk->count)
+			return 0;
+		Value function = chunk->constants.values[chunk->code[offset + 1]];
+		return 2 + 2 * AS_FUNCTION(function)->upvalueCount;
+	}
+	default:
+		return 0;
+	}
+}
+
+// the address of an upvalue's value in rax
+static void loadUpvalue(Assembler *a, int slot)
+{
+	emitMem(a, 0, true, 0x8b, RAX, FRAME_REG, offsetof(CallFrame, closure));
+	emitMem(a, 0, true, 0x8b, RAX, RAX, offsetof(ObjClosure, upvalues));
+	emitMem(a, 0, true, 0x8b, RAX, RAX, slot * (int)sizeof(ObjUpvalue *));
+	emitMem(a, 0, true, 0x8b, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+// arithmetic on two numbers, anything else goes to the helper
+static void arithmetic(Assembler *a, uint16_t opcode, Helper helper,
+					   int offset)
+{
+	Stub stub = {.jumpCount = 0};
+	checkNumber(a, &stub, -16);
+	checkNumber(a, &stub, -32);
+	emitMem(a, 0xf2, false, 0x0f10, XMM0, TOP_REG, -32 + AS); // movsd
+	emitMem(a, 0xf2, false, opcode, XMM0, TOP_REG, -16 + AS);
+	emitMem(a, 0xf2, false, 0x0f11, XMM0, TOP_REG, -32 + AS);
+	moveTop(a, -1);
+	addStub(a, stub, offset, helper, offset + 1);
+}
+
+// a > b as a bool, or b > a when swapped
+static void comparison(Assembler *a, bool swapped, int offset)
+{
+	Stub stub = {.jumpCount = 0};
+	checkNumber(a, &stub, -16);
+	checkNumber(a, &stub, -32);
+	int32_t left = swapped ? -16 : -32;
+	int32_t right = swapped ? -32 : -16;
+	emitMem(a, 0xf2, false, 0x0f10, XMM0, TOP_REG, left + AS);
+	emitMem(a, 0x66, false, 0x0f2e, XMM0, TOP_REG, right + AS); // ucomisd
+	emitBytes(a, (uint8_t[]){0x0f, 0x97, 0xc0}, 3);			   // seta al
+	storeBool(a, TOP_REG, -32);
+	moveTop(a, -1);
+	addStub(a, stub, offset, notNumbers, offset + 1);
+}
+
+// jumps to target if the value on top is falsey, its type in eax
+static void jumpIfFalsey(Assembler *a, int target)
+{
+	emitMem(a, 0, false, 0x8b, RAX, TOP_REG, -16 + TYPE);
+	emitBytes(a, (uint8_t[]){0x83, 0xf8, VAL_NIL}, 3); // cmp eax, imm8
+	jumpTo(a, CC_E, target);
+	emitBytes(a, (uint8_t[]){0x83, 0xf8, VAL_BOOL}, 3);
+	size_t truthy = emitJump(a, CC_NE);
+	emitMem(a, 0, false, 0x80, 7, TOP_REG, -16 + AS); // cmp byte, imm8
+	emit(a, 0);
+	jumpTo(a, CC_E, target);
+	patch(a, truthy, a->count);
+}
+
+static void logicalNot(Assembler *a)
+{
+	emitMem(a, 0, false, 0x8b, RAX, TOP_REG, -16 + TYPE);
+	emitBytes(a, (uint8_t[]){0x31, 0xc9}, 2);			// xor ecx, ecx
+	emitBytes(a, (uint8_t[]){0x83, 0xf8, VAL_NIL}, 3);	// cmp eax, nil
+	emitBytes(a, (uint8_t[]){0x0f, 0x94, 0xc1}, 3);		// sete cl
+	emitBytes(a, (uint8_t[]){0x83, 0xf8, VAL_BOOL}, 3); // cmp eax, bool
+	size_t done = emitJump(a, CC_NE);
+	emitMem(a, 0, false, 0x80, 7, TOP_REG, -16 + AS);
+	emit(a, 0);
+	emitBytes(a, (uint8_t[]){0x0f, 0x94, 0xc1}, 3);
+	patch(a, done, a->count);
+	emitMem(a, 0, false, 0xc7, 0, TOP_REG, -16 + TYPE);
+	emit32(a, VAL_BOOL);
+	emitMem(a, 0, true, 0x89, RCX, TOP_REG, -16 + AS);
+}
+
+// values of different types are never equal and nils always are,
+// objects and bools are left to valuesEqual()
+static void equalValues(Assembler *a, int offset)
+{
+	Stub stub = {.jumpCount = 1};
+	emitMem(a, 0, false, 0x8b, RAX, TOP_REG, -32 + TYPE);
+	emitMem(a, 0, false, 0x3b, RAX, TOP_REG, -16 + TYPE); // cmp eax, []
+	size_t different = emitJump(a, CC_NE);
+	emitBytes(a, (uint8_t[]){0x83, 0xf8, VAL_NIL}, 3);
+	size_t nils = emitJump(a, CC_E);
+	emitBytes(a, (uint8_t[]){0x83, 0xf8, VAL_NUMBER}, 3);
+	stub.jumps[0] = emitJump(a, CC_NE);
+
+	emitMem(a, 0xf2, false, 0x0f10, XMM0, TOP_REG, -32 + AS);
+	emitMem(a, 0x66, false, 0x0f2e, XMM0, TOP_REG, -16 + AS);
+	// equal and ordered, NaN isn't equal to itself
+	emitBytes(a, (uint8_t[]){0x0f, 0x94, 0xc0, 0x0f, 0x9b, 0xc1, 0x20, 0xc8},
+			  8); // sete al, setnp cl, and al, cl
+	size_t numbers = emitJump(a, -1);
+	patch(a, different, a->count);
+	emitBytes(a, (uint8_t[]){0x31, 0xc0}, 2); // xor eax, eax
+	size_t unequal = emitJump(a, -1);
+	patch(a, nils, a->count);
+	emitBytes(a, (uint8_t[]){0xb0, 0x01}, 2); // mov al, 1
+	patch(a, numbers, a->count);
+	patch(a, unequal, a->count);
+	storeBool(a, TOP_REG, -32);
+	moveTop(a, -1);
+	addStub(a, stub, offset, equal, offset + 1);
+}
+
+// the code of one instruction, false if it has none
+static bool emitInstruction(Assembler *a, Chunk *chunk, int offset,
+							int length)
+{
+	uint8_t *ip = &chunk->code[offset];
+	int operand = length > 1 ? ip[1] : 0;
+	int jump = length > 2 ? (ip[1] << 8) | ip[2] : 0;
+
+	switch (*ip)
+	{
+	case OP_CONSTANT:
+		copyValue(a, CONSTANTS_REG, operand * (int)sizeof(Value), TOP_REG, 0);
+		moveTop(a, 1);
+		return true;
+	case OP_NIL:
+		storeValue(a, TOP_REG, 0, VAL_NIL, 0);
+		moveTop(a, 1);
+		return true;
+	case OP_TRUE:
+	case OP_FALSE:
+		storeValue(a, TOP_REG, 0, VAL_BOOL, *ip == OP_TRUE);
+		moveTop(a, 1);
+		return true;
+	case OP_POP:
+		moveTop(a, -1);
+		return true;
+	case OP_GET_LOCAL:
+		copyValue(a, SLOTS_REG, operand * (int)sizeof(Value), TOP_REG, 0);
+		moveTop(a, 1);
+		return true;
+	case OP_SET_LOCAL:
+		copyValue(a, TOP_REG, -16, SLOTS_REG, operand * (int)sizeof(Value));
+		return true;
+	case OP_GET_UPVALUE:
+		loadUpvalue(a, operand);
+		copyValue(a, RAX, 0, TOP_REG, 0);
+		moveTop(a, 1);
+		return true;
+	case OP_SET_UPVALUE:
+		loadUpvalue(a, operand);
+		copyValue(a, TOP_REG, -16, RAX, 0);
+		return true;
+	case OP_GET_GLOBAL:
+		callHelper(a, getGlobal, ip + 1);
+		return true;
+	case OP_DEFINE_GLOBAL:
+		callHelper(a, defineGlobal, ip + 1);
+		return true;
+	case OP_SET_GLOBAL:
+		callHelper(a, setGlobal, ip + 1);
+		return true;
+	case OP_GET_PROPERTY:
+		callHelper(a, getProperty, ip + 1);
+		return true;
+	case OP_SET_PROPERTY:
+		callHelper(a, setProperty, ip + 1);
+		return true;
+	case OP_EQUAL:
+		equalValues(a, offset);
+		return true;
+	// run()'s number variants get the same templates, which check for
+	// numbers inline anyway
+	case OP_GREATER:
+	case OP_GREATER_NUM:
+		comparison(a, false, offset);
+		return true;
+	case OP_LESS:
+	case OP_LESS_NUM:
+		comparison(a, true, offset);
+		return true;
+	case OP_ADD:
+	case OP_ADD_NUM:
+	case OP_ADD_MIXED:
+		arithmetic(a, 0x0f58, add, offset);
+		return true;
+	case OP_SUBTRACT:
+	case OP_SUBTRACT_NUM:
+		arithmetic(a, 0x0f5c, notNumbers, offset);
+		return true;
+	case OP_MULTIPLY:
+	case OP_MULTIPLY_NUM:
+		arithmetic(a, 0x0f59, notNumbers, offset);
+		return true;
+	case OP_DIVIDE:
+	case OP_DIVIDE_NUM:
+		arithmetic(a, 0x0f5e, notNumbers, offset);
+		return true;
+	case OP_NEGATE:
+	{
+		Stub stub = {.jumpCount = 0};
+		checkNumber(a, &stub, -16);
+		// flips the sign bit, xor byte [r13 - 1], 0x80
+		emitMem(a, 0, false, 0x80, 6, TOP_REG, -1);
+		emit(a, 0x80);
+		addStub(a, stub, offset, notNumber, offset + 1);
+		return true;
+	}
+	case OP_NOT:
+		logicalNot(a);
+		return true;
+	case OP_PRINT:
+		callHelper(a, print, ip + 1);
+		return true;
+	case OP_JUMP:
+		jumpTo(a, -1, offset + 3 + jump);
+		return true;
+	case OP_JUMP_IF_FALSE:
+		jumpIfFalsey(a, offset + 3 + jump);
+		return true;
+	case OP_JUMP_BACK:
+	{
+		// cmp dword [rbx + safepointDue], 0
+		Stub stub = {.jumpCount = 1};
+		emitMem(a, 0, false, 0x83, 7, VM_REG, offsetof(VM, safepointDue));
+		emit(a, 0);
+		stub.jumps[0] = emitJump(a, CC_NE);
+		jumpTo(a, -1, offset + 3 - jump);
+		addStub(a, stub, offset, checkSafepoint, offset + 3 - jump);
+		return true;
+	}
+	case OP_CALL:
+		callOrReturn(a, call, ip + 2);
+		return true;
+	case OP_RETURN:
+		callOrReturn(a, ret, ip + 1);
+		return true;
+	case OP_CLOSURE:
+		callHelper(a, closure, ip + 1);
+		return true;
+	case OP_CLOSE_UPVALUE:
+		callHelper(a, closeUpvalue, ip + 1);
+		return true;
+	case OP_CLASS:
+		callHelper(a, makeClass, ip + 1);
+		return true;
+	case OP_METHOD:
+		callHelper(a, method, ip + 1);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// -------- compiling --------
+
+static void freeAssembler(Assembler *a)
+{
+	free(a->code);
+	free(a->fixups);
+	free(a->stubs);
+	free(a->leaves);
+	free(a->errors);
+}
+
+// copies the code into executable memory
+static uint8_t *mapCode(Assembler *a, size_t *size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	*size = (a->count + page - 1) / page * page;
+	uint8_t *code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return NULL;
+	memcpy(code, a->code, a->count);
+	if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(code, *size);
+		return NULL;
+	}
+	return code;
+}
+
+bool compileJit(VM *vm, ObjFunction *function)
+{
+	Chunk *chunk = &function->chunk;
+	if (vm->jitThreshold == 0 || function->jit != NULL ||
+		function->lazy != NULL || chunk->count == 0)
+		return false;
+
+	uint32_t *entries = (uint32_t *)malloc(sizeof(uint32_t) * chunk->count);
+	if (entries == NULL)
+		exit(1);
+	Assembler a = {0};
+	emitPrologue(&a);
+
+	bool failed = false;
+	for (int offset = 0; offset < chunk->count && !failed;)
+	{
+		int length = instructionLength(chunk, offset);
+		entries[offset] = (uint32_t)a.count;
+		failed = length == 0 || offset + length > chunk->count ||
+				 !emitInstruction(&a, chunk, offset, length);
+		offset += length;
+	}
+
+	// slow paths after the code, so the fast ones fall straight through
+	for (int i = 0; i < a.stubCount && !failed; i++)
+	{
+		Stub *stub = &a.stubs[i];
+		for (int j = 0; j < stub->jumpCount; j++)
+			patch(&a, stub->jumps[j], a.count);
+		callHelper(&a, stub->helper, &chunk->code[stub->offset + 1]);
+		jumpTo(&a, -1, stub->resume);
+	}
+
+	for (int i = 0; i < a.fixupCount && !failed; i++)
+	{
+		int target = a.fixups[i].target;
+		failed = target < 0 || target >= chunk->count;
+		if (!failed)
+			patch(&a, a.fixups[i].at, entries[target]);
+	}
+
+	// returns the JitResult in eax. the VM's stack top is stored, or was
+	// reset by an error
+	for (int i = 0; i < a.errorCount; i++)
+		patch(&a, a.errors[i], a.count);
+	emitBytes(&a, (uint8_t[]){0x31, 0xc0}, 2); // xor eax, eax
+	for (int i = 0; i < a.leaveCount; i++)
+		patch(&a, a.leaves[i], a.count);
+	emitEpilogue(&a);
+
+	size_t size = 0;
+	uint8_t *code = failed ? NULL : mapCode(&a, &size);
+	freeAssembler(&a);
+	if (code == NULL)
+	{
+		free(entries);
+		return false;
+	}
+
+	JitCode *jit = (JitCode *)malloc(sizeof(JitCode));
+	if (jit == NULL)
+		exit(1);
+	jit->code = code;
+	jit->size = size;
+	jit->entries = entries;
+	function->jit = jit;
+	return true;
+}
+
+JitResult runJit(VM *vm, CallFrame *frame, int baseFrame)
+{
+	ObjFunction *function = frame->closure->function;
+	JitCode *jit = function->jit;
+	uint32_t entry = jit->entries[frame->ip - function->chunk.code];
+	return (JitResult)((JitFn)jit->code)(vm, frame, jit->code + entry,
+										 baseFrame);
+}
+
+void freeJit(ObjFunction *function)
+{
+	JitCode *jit = function->jit;
+	if (jit == NULL)
+		return;
+	munmap(jit->code, jit->size);
+	free(jit->entries);
+	free(jit);
+	function->jit = NULL;
+}
+
+#else
+
+bool compileJit(VM *vm, ObjFunction *function)
+{
+	return false;
+}
+
+JitResult runJit(VM *vm, CallFrame *frame, int baseFrame)
+{
+	return JIT_INTERPRET;
+}
+
+void freeJit(ObjFunction *function)
+{
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lines.h"
+#include "memory.h"
+#include "object.h"
+
+// looks up a global by name
+static bool getGlobal(VM *vm, const char *name, Value *value)
+{
+	ObjString *key = copyString(vm, name, (int)strlen(name));
+	return tableGet(&vm->globals, key, value);
+}
+
+// calls line(text) with a view of text. the view keeps its block
+// alive for as long as the script holds on to it
+static InterpretResult callLine(VM *vm, Value line, ObjString *block,
+								char *start, int length)
+{
+	push(vm, line);
+	push(vm, OBJ_VAL(newStringView(vm, block, start, length)));
+	InterpretResult result = callFunction(vm, 1);
+	if (result == INTERPRET_OK)
+		pop(vm);
+	return result;
+}
+
+// reads into the block until it is full or the input ends. returns
+// false on a read error
+static bool fill(int fd, ObjString *block, int *filled, bool *eof)
+{
+	while (*filled < block->length)
+	{
+		ssize_t count = read(fd, block->chars + *filled, block->length - *filled);
+		if (count < 0)
+			return false;
+		if (count == 0)
+		{
+			*eof = true;
+			break;
+		}
+		*filled += (int)count;
+	}
+	return true;
+}
+
+InterpretResult runLines(VM *vm, int fd)
+{
+	Value line;
+	if (!getGlobal(vm, "line", &line))
+	{
+		fprintf(stderr, "The script must define a function line(text) for -n.\n");
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	push(vm, line);
+
+	// blocks are never reused, because views of old lines may outlive
+	// them. the GC frees a block once no view points into it anymore
+	ObjString *block = newStringBuffer(vm, LINE_BLOCK_SIZE);
+	push(vm, OBJ_VAL(block));
+	int filled = 0;
+	bool eof = false;
+
+	InterpretResult result = INTERPRET_OK;
+	while (result == INTERPRET_OK)
+	{
+		if (!fill(fd, block, &filled, &eof))
+		{
+			perror("Could not read input");
+			result = INTERPRET_RUNTIME_ERROR;
+			break;
+		}
+
+		// every complete line in the block
+		char *start = block->chars;
+		char *end = block->chars + filled;
+		char *newline;
+		while (result == INTERPRET_OK &&
+			   (newline = memchr(start, '\n', end - start)) != NULL)
+		{
+			result = callLine(vm, line, block, start, (int)(newline - start));
+			start = newline + 1;
+		}
+		if (result != INTERPRET_OK)
+			break;
+
+		int rest = (int)(end - start);
+		if (eof)
+		{
+			// last line without a newline
+			if (rest > 0)
+				result = callLine(vm, line, block, start, rest);
+			break;
+		}
+
+		// carry the partial line over into a fresh block, twice as big
+		// if the line did not even fit into this one
+		int size = rest == block->length ? block->length * 2 : LINE_BLOCK_SIZE;
+		ObjString *next = newStringBuffer(vm, size);
+		memcpy(next->chars, start, rest);
+		filled = rest;
+		pop(vm);
+		block = next;
+		push(vm, OBJ_VAL(block));
+	}
+
+	Value endFunction;
+	if (result == INTERPRET_OK && getGlobal(vm, "end", &endFunction))
+	{
+		push(vm, endFunction);
+		result = callFunction(vm, 0);
+		if (result == INTERPRET_OK)
+			pop(vm);
+	}
+
+	// a runtime error has reset the stack already
+	if (result == INTERPRET_OK)
+	{
+		pop(vm);
+		pop(vm);
+	}
+	return result;
+}
@@ -2,10 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "allocprofile.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "jit.h"
+#include "lines.h"
+#include "sampler.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "vm.h"
 
 // static struct termios old, new;
@@ -24,7 +36,7 @@
 // }
 
 // run the REPL
-static void repl()
+static void repl(VM *vm)
 {
 	// bool overwrote = false;
 	// char lines[100][1024];
@@ -89,6 +101,7 @@ static void repl()
 	char line[1024];
 	for (;;)
 	{
+		flushOutput(&vm->output);
 		printf("lox:> ");
 	
 		if (!fgets(line, sizeof(line), stdin))
@@ -97,76 +110,517 @@ static void repl()
 			break;
 		}
 	
-		interpret(line);
+		interpret(vm, line);
 	}
 }
 
-// read the given file to a string
-static char *readFile(const char *path)
+// a script's source text, mapped when possible
+typedef struct
 {
-	FILE *file = fopen(path, "rb");
-	if (file == NULL)
+	char *chars;
+	size_t length;
+	bool mapped;
+} Source;
+
+// reads a stream that can't be mapped, like a pipe, to its end
+static bool readStream(FILE *file, Source *source)
+{
+	size_t capacity = 4096;
+	source->chars = (char *)malloc(capacity);
+	source->length = 0;
+	source->mapped = false;
+	if (source->chars == NULL)
+		return false;
+
+	size_t count;
+	while ((count = fread(source->chars + source->length, 1,
+						  capacity - source->length, file)) > 0)
 	{
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
-		exit(74);
+		source->length += count;
+		if (source->length == capacity)
+		{
+			capacity *= 2;
+			char *grown = (char *)realloc(source->chars, capacity);
+			if (grown == NULL)
+			{
+				free(source->chars);
+				return false;
+			}
+			source->chars = grown;
+		}
 	}
 
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
+	if (ferror(file))
+	{
+		free(source->chars);
+		return false;
+	}
+	return true;
+}
 
-	char *buffer = (char *)malloc(fileSize + 1);
-	if (buffer == NULL)
+// loads the script at path, or stdin for "-". regular files are mapped
+// instead of copied, the scanner doesn't need a NUL terminator. string
+// constants are copied out while compiling, so the source can be
+// released right after
+static bool loadSource(const char *path, Source *source)
+{
+	if (strcmp(path, "-") == 0)
 	{
-		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-		exit(74);
+		if (readStream(stdin, source))
+			return true;
+		fprintf(stderr, "Could not read stdin.\n");
+		return false;
 	}
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize)
+
+	source->chars = (char *)mapFile(path, &source->length);
+	if (source->chars != NULL)
 	{
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
-		exit(74);
+		source->mapped = true;
+		return true;
 	}
-	buffer[bytesRead] = '\0';
 
+	// empty files and special files can't be mapped
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+	bool success = readStream(file, source);
 	fclose(file);
-	return buffer;
+	if (!success)
+		fprintf(stderr, "Could not read file \"%s\".\n", path);
+	return success;
 }
 
-// run the given file
-static void runFile(const char *path)
+static void releaseSource(Source *source)
 {
-	char *source = readFile(path);
-	InterpretResult result = interpret(source);
-	free(source);
+	if (source->mapped)
+		unmapFile(source->chars, source->length);
+	else
+		free(source->chars);
+}
 
+// compiles source, through its .loxc cache if useCache is set.
+// scripts from stdin have no place for a cache
+static ObjFunction *compileSource(VM *vm, const char *path, Source *source,
+								  bool useCache)
+{
+	if (useCache && strcmp(path, "-") != 0)
+		return compileCached(vm, path, source->chars, source->length);
+	return compile(vm, source->chars, source->length);
+}
+
+// the exit status for the result. errors don't exit right away, so the
+// VM is still freed and reports its statistics and profiles
+static int resultStatus(InterpretResult result)
+{
 	if (result == INTERPRET_COMPILE_ERROR)
-		exit(65);
+		return 65;
 	if (result == INTERPRET_RUNTIME_ERROR)
-		exit(70);
+		return 70;
+	return 0;
+}
+
+// run the given file, through its .loxc cache if useCache is set
+static int runFile(VM *vm, const char *path, bool useCache, bool lazyStats)
+{
+	Source source;
+	if (!loadSource(path, &source))
+		return 74;
+	ObjFunction *function = compileSource(vm, path, &source, useCache);
+	releaseSource(&source);
+
+	InterpretResult result = interpretFunction(vm, function);
+	flushOutput(&vm->output);
+
+	if (lazyStats)
+		printLazyStats(vm);
+	return resultStatus(result);
+}
+
+// runs the script, then feeds it the lines of stdin
+static int runLineFilter(VM *vm, const char *path, bool useCache, bool lazyStats)
+{
+	int status = runFile(vm, path, useCache, lazyStats);
+	if (status != 0)
+		return status;
+	InterpretResult result = runLines(vm, STDIN_FILENO);
+	flushOutput(&vm->output);
+	return resultStatus(result);
+}
+
+// compiles the scripts in parallel and runs them one after the other,
+// in the given order, as if they were a single script
+static int runFiles(VM *vm, const char **paths, int count, int jobs, bool lazyStats)
+{
+	if (count > UINT8_COUNT)
+	{
+		fprintf(stderr, "Can't compile more than %d files at once.\n",
+				UINT8_COUNT);
+		return 64;
+	}
+
+	Source *sources = (Source *)malloc(sizeof(Source) * count);
+	const char **chars = (const char **)malloc(sizeof(char *) * count);
+	size_t *lengths = (size_t *)malloc(sizeof(size_t) * count);
+	if (sources == NULL || chars == NULL || lengths == NULL)
+		exit(1);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!loadSource(paths[i], &sources[i]))
+		{
+			while (--i >= 0)
+				releaseSource(&sources[i]);
+			free(lengths);
+			free(chars);
+			free(sources);
+			return 74;
+		}
+		chars[i] = sources[i].chars;
+		lengths[i] = sources[i].length;
+	}
+
+	ObjFunction *function = compileFiles(vm, paths, chars, lengths, count, jobs);
+	for (int i = 0; i < count; i++)
+		releaseSource(&sources[i]);
+	free(lengths);
+	free(chars);
+	free(sources);
+
+	InterpretResult result = interpretFunction(vm, function);
+	flushOutput(&vm->output);
+
+	if (lazyStats)
+		printLazyStats(vm);
+	return resultStatus(result);
+}
+
+static double elapsedMs(struct timespec *start)
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		   (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// writes s as a JSON string
+static void printJsonString(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+// runs one script of a batch and reports it as a line of JSON on stderr.
+// returns the process exit code the script would have had on its own
+static int runBatchScript(VM *vm, const char *path, bool useCache)
+{
+	static const char *statusNames[] = {"ok", "compile-error", "runtime-error"};
+	static const int exitCodes[] = {0, 65, 70};
+
+	struct timespec start;
+	timespec_get(&start, TIME_UTC);
+	resetVM(vm);
+
+	const char *status;
+	int code;
+	double compileMs = 0, runMs = 0;
+	Source source;
+	if (!loadSource(path, &source))
+	{
+		status = "io-error";
+		code = 74;
+	}
+	else
+	{
+		ObjFunction *function = compileSource(vm, path, &source, useCache);
+		releaseSource(&source);
+		compileMs = elapsedMs(&start);
+
+		InterpretResult result = interpretFunction(vm, function);
+		runMs = elapsedMs(&start) - compileMs;
+		status = statusNames[result];
+		code = exitCodes[result];
+	}
+
+	// keep the report in order with the script's own output
+	flushOutput(&vm->output);
+	fprintf(stderr, "{\"script\": ");
+	printJsonString(stderr, path);
+	fprintf(stderr, ", \"status\": \"%s\", \"compile_ms\": %.3f, "
+					"\"run_ms\": %.3f}\n",
+			status, compileMs, runMs);
+	return code;
+}
+
+// runs every script on the same VM, each with fresh globals.
+// with no paths, the scripts are read from stdin one per line
+static int runBatch(VM *vm, const char **paths, int count, bool useCache)
+{
+	struct timespec start;
+	timespec_get(&start, TIME_UTC);
+	saveBaseGlobals(vm);
+	// a mapping would outlive its script, one for each of thousands
+	vm->copyCachedCode = true;
+
+	int scripts = 0, failed = 0, code = 0;
+	char line[4096];
+	for (int i = 0;; i++)
+	{
+		const char *path = line;
+		if (count > 0)
+		{
+			if (i == count)
+				break;
+			path = paths[i];
+		}
+		else
+		{
+			if (fgets(line, sizeof(line), stdin) == NULL)
+				break;
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] == '\0' || line[0] == '#')
+				continue;
+		}
+
+		int result = runBatchScript(vm, path, useCache);
+		scripts++;
+		if (result != 0)
+		{
+			failed++;
+			code = result;
+		}
+	}
+
+	fprintf(stderr, "{\"scripts\": %d, \"failed\": %d, \"total_ms\": %.3f}\n",
+			scripts, failed, elapsedMs(&start));
+	return code;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: clox [--no-cache] [--lazy] [--lazy-stats] "
+					"[--image file] [--dump-image file]\n"
+					"            [--output-buffer bytes] [--line-buffered]\n"
+					"            [--profile file] [--profile-hz n]\n"
+					"            [--alloc-profile bytes] [--heap-snapshots prefix]\n"
+					"            [--trace file] [--trace-events n]\n"
+					"            [--no-jit] [--jit-threshold n]\n"
+					"            [path]\n"
+					"       clox [options] -n path < input\n"
+					"       clox [options] --batch [path...]\n"
+					"       clox [options] [--jobs n] --files path...\n");
+	exit(64);
 }
 
 int main(int argc, const char *argv[])
 {
 	// bool debug = false;
-
-	initVM();
+	bool useCache = true;
+	bool lazy = false;
+	bool lazyStats = false;
+	bool batch = false;
+	bool lineFilter = false;
+	bool files = false;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	const char **batchPaths = NULL;
+	int batchCount = 0;
+	long outputBuffer = -1;
+	bool lineBuffered = false;
+	const char *imagePath = NULL;
+	const char *dumpPath = NULL;
+	const char *profilePath = NULL;
+	long profileHz = SAMPLER_DEFAULT_HZ;
+	long allocInterval = 0;
+	const char *snapshotPrefix = NULL;
+	const char *tracePath = NULL;
+	long traceEvents = TRACE_DEFAULT_EVENTS;
+	long jitThreshold = JIT_DEFAULT_THRESHOLD;
+	const char *path = NULL;
 
 	// handle command line args
-	if (argc == 1)
+	for (int i = 1; i < argc; i++)
 	{
-		repl();
+		if (strcmp(argv[i], "--no-cache") == 0)
+			useCache = false;
+		else if (strcmp(argv[i], "--lazy") == 0)
+			lazy = true;
+		else if (strcmp(argv[i], "--lazy-stats") == 0)
+			lazy = lazyStats = true;
+		else if (strcmp(argv[i], "--batch") == 0)
+		{
+			// everything after it is a script
+			batch = true;
+			batchPaths = &argv[i + 1];
+			batchCount = argc - i - 1;
+			break;
+		}
+		else if (strcmp(argv[i], "--files") == 0)
+		{
+			// same as --batch, but compiled in parallel and run as one
+			files = true;
+			batchPaths = &argv[i + 1];
+			batchCount = argc - i - 1;
+			break;
+		}
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+		{
+			char *end;
+			jobs = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || jobs < 1)
+				usage();
+		}
+		else if (strcmp(argv[i], "--output-buffer") == 0 && i + 1 < argc)
+		{
+			char *end;
+			outputBuffer = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || outputBuffer < 0)
+				usage();
+		}
+		else if (strcmp(argv[i], "-n") == 0)
+			lineFilter = true;
+		else if (strcmp(argv[i], "--line-buffered") == 0)
+			lineBuffered = true;
+		else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+			imagePath = argv[++i];
+		else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc)
+			dumpPath = argv[++i];
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+			profilePath = argv[++i];
+		else if (strcmp(argv[i], "--profile-hz") == 0 && i + 1 < argc)
+		{
+			char *end;
+			profileHz = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || profileHz < 1 || profileHz > 1000000)
+				usage();
+		}
+		else if (strcmp(argv[i], "--alloc-profile") == 0 && i + 1 < argc)
+		{
+			char *end;
+			allocInterval = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || allocInterval < 1)
+				usage();
+		}
+		else if (strcmp(argv[i], "--heap-snapshots") == 0 && i + 1 < argc)
+			snapshotPrefix = argv[++i];
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else if (strcmp(argv[i], "--trace-events") == 0 && i + 1 < argc)
+		{
+			char *end;
+			traceEvents = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || traceEvents < 1 || traceEvents > (1L << 30))
+				usage();
+		}
+		else if (strcmp(argv[i], "--no-jit") == 0)
+			jitThreshold = 0;
+		else if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc)
+		{
+			char *end;
+			jitThreshold = strtol(argv[++i], &end, 10);
+			if (*end != '\0' || jitThreshold < 1 || jitThreshold > UINT32_MAX)
+				usage();
+		}
+		else if (path == NULL && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0))
+			path = argv[i];
+		else
+			usage();
 	}
-	else if (argc == 2)
+
+	if ((batch || files) && path != NULL)
+		usage();
+	if ((files && batchCount == 0) || (lineFilter && path == NULL))
+		usage();
+
+	VM *vm = createVM();
+	if (vm == NULL)
+		exit(1);
+
+	if (jitThreshold != JIT_DEFAULT_THRESHOLD)
+		setJitThreshold(vm, (uint32_t)jitThreshold);
+
+	// cached bytecode is already compiled, so lazy mode skips the cache
+	if (lazy)
+	{
+		setLazyCompilation(vm, true);
+		useCache = false;
+	}
+	if (lazyStats)
+		measureLazyCompilation(vm);
+
+	if (outputBuffer >= 0 || lineBuffered)
+	{
+		setOutputBuffer(vm, outputBuffer >= 0 ? (size_t)outputBuffer
+											  : OUTPUT_BUFFER_SIZE,
+						lineBuffered);
+	}
+
+	// these report why they failed
+	if (profilePath != NULL && !startSampler(vm, profilePath, (int)profileHz))
+	{
+		destroyVM(vm);
+		return 70;
+	}
+
+	if (allocInterval > 0)
+		startAllocProfile(vm, (size_t)allocInterval);
+	if (snapshotPrefix != NULL && !watchSnapshotSignal(vm, snapshotPrefix))
 	{
-		runFile(argv[1]);
+		destroyVM(vm);
+		return 70;
+	}
+	if (tracePath != NULL)
+		startTracer(vm, tracePath, (size_t)traceEvents);
+
+	// restore a prelude instead of running it
+	if (imagePath != NULL && !loadImage(vm, imagePath))
+	{
+		fprintf(stderr, "Could not load image \"%s\".\n", imagePath);
+		destroyVM(vm);
+		return 74;
+	}
+
+	int status = 0;
+	if (batch)
+	{
+		status = runBatch(vm, batchPaths, batchCount, useCache);
+		if (lazyStats)
+			printLazyStats(vm);
+	}
+	else if (files)
+	{
+		status = runFiles(vm, batchPaths, batchCount, (int)jobs, lazyStats);
+	}
+	else if (lineFilter)
+	{
+		status = runLineFilter(vm, path, useCache, lazyStats);
+	}
+	else if (path == NULL)
+	{
+		repl(vm);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+		status = runFile(vm, path, useCache, lazyStats);
 	}
 
-	freeVM();
-	return 0;
+	// only what a script that ran to the end left behind is dumped
+	if (status == 0 && dumpPath != NULL && !dumpImage(vm, dumpPath))
+	{
+		fprintf(stderr, "Could not write image \"%s\".\n", dumpPath);
+		status = 74;
+	}
+
+	destroyVM(vm);
+	return status;
 }
\ No newline at end of file
@@ -6,22 +6,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "trace.h"
 #include "vm.h"
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
-#include "compiler.h"
+#include "allocprofile.h"
+#include "image.h"
+#include "isolate.h"
 
 #define GC_HEAP_GROW_FACTOR 2
 
 // ------------------- GC ---------------------
-static void freeObject(Obj *object);
-void freeObjects();
+static void freeObject(VM *vm, Obj *object);
+void freeObjects(VM *vm);
 
-void markObject(Obj *object)
+void markObject(VM *vm, Obj *object)
 {
     if (object == NULL)
         return;
@@ -34,34 +38,34 @@ void markObject(Obj *object)
     #endif
     object->isMarked = true;
 
-    if (vm.grayCapacity < vm.grayCount + 1)
+    if (vm->grayCapacity < vm->grayCount + 1)
     {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
 
         // allocation failed
-        if (vm.grayStack == NULL)
+        if (vm->grayStack == NULL)
             exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
-void markValue(Value value)
+void markValue(VM *vm, Value value)
 {
     if (IS_OBJ(value))
-        markObject(AS_OBJ(value));
+        markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(ValueArray *array)
+static void markArray(VM *vm, ValueArray *array)
 {
     for (int i = 0; i < array->count; i++)
     {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
-static void blackenObject(Obj *object)
+static void blackenObject(VM *vm, Obj *object)
 {
     #ifdef DEBUG_LOG_GC
         printf("%p blacken ", (void *)object);
@@ -73,95 +77,125 @@ static void blackenObject(Obj *object)
     case OBJ_BOUND_METHOD:
     {
         ObjBoundMethod *bound = (ObjBoundMethod *)object;
-        markValue(bound->receiver);
-        markObject((Obj *)bound->method);
+        markValue(vm, bound->receiver);
+        markObject(vm, (Obj *)bound->method);
         break;
     }
     case OBJ_CLASS:
     {
         ObjClass *klass = (ObjClass *)object;
-        markTable(&klass->methods);
-        markObject((Obj *)klass->name);
+        markTable(vm, &klass->methods);
+        markObject(vm, (Obj *)klass->name);
         break;
     }
     case OBJ_CLOSURE:
     {
         ObjClosure *closure = (ObjClosure *)object;
-        markObject((Obj *)closure->function);
+        markObject(vm, (Obj *)closure->function);
         for (int i = 0; i < closure->upvalueCount; i++)
         {
-            markObject((Obj *)closure->upvalues[i]);
+            markObject(vm, (Obj *)closure->upvalues[i]);
         }
         break;
     }
     case OBJ_UPVALUE:
     {
-        markValue(((ObjUpvalue *)object)->closed);
+        markValue(vm, ((ObjUpvalue *)object)->closed);
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
-        markObject((Obj *)function->name);
-        markArray(&function->chunk.constants);
+        markObject(vm, (Obj *)function->name);
+        markArray(vm, &function->chunk.constants);
+        if (function->lazy != NULL)
+            markArray(vm, &function->lazy->upvalueNames);
         break;
     }
     case OBJ_INSTANCE:
     {
         ObjInstance *instance = (ObjInstance *)object;
-        markObject((Obj *)instance->klass);
-        markTable(&instance->fields);
+        markObject(vm, (Obj *)instance->klass);
+        markTable(vm, &instance->fields);
         break;
     }
 
-    case OBJ_NATIVE:
     case OBJ_STRING:
+        markObject(vm, (Obj *)((ObjString *)object)->owner);
+        break;
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)object;
+        markObject(vm, (Obj *)fiber->closure);
+        markObject(vm, (Obj *)fiber->caller);
+        markObject(vm, (Obj *)fiber->nextScheduled);
+        // only a suspended fiber's copy is up to date
+        for (int i = 0; i < fiber->stackCount; i++)
+            markValue(vm, fiber->stack[i]);
+        for (int i = 0; i < fiber->frameCount; i++)
+            markObject(vm, (Obj *)fiber->frames[i].closure);
+        for (ObjUpvalue *upvalue = fiber->openUpvalues;
+             upvalue != NULL;
+             upvalue = upvalue->next)
+        {
+            markObject(vm, (Obj *)upvalue);
+        }
+        break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_CHANNEL:
         break;
     }
 }
 
-static void markRoots()
+static void markRoots(VM *vm)
 {
     // mark stack items
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
     {
-        markValue(*slot);
+        markValue(vm, *slot);
     }
 
     // mark closed-over variables in closures
-    for (int i = 0; i < vm.frameCount; i++)
+    for (int i = 0; i < vm->frameCount; i++)
     {
-        markObject((Obj *)vm.frames[i].closure);
+        markObject(vm, (Obj *)vm->frames[i].closure);
     }
 
     // mark upvalues
-    for (ObjUpvalue *upvalue = vm.openUpvalues;
+    for (ObjUpvalue *upvalue = vm->openUpvalues;
          upvalue != NULL;
          upvalue = upvalue->next)
     {
-        markObject((Obj *)upvalue);
+        markObject(vm, (Obj *)upvalue);
     }
 
     // mark globals
-    markTable(&vm.globals);
-    markObject((Obj *)vm.initString);
+    markTable(vm, &vm->globals);
+    markTable(vm, &vm->baseGlobals);
+    markObject(vm, (Obj *)vm->initString);
 
-    markCompilerRoots();
+    // the running fiber marks the ones that resumed it, the first
+    // scheduled one those after it
+    markObject(vm, (Obj *)vm->fiber);
+    markObject(vm, (Obj *)vm->scheduled);
+
+    markImageRoots(vm);
 }
 
-static void traceReferences()
+static void traceReferences(VM *vm)
 {
-    while (vm.grayCount > 0)
+    while (vm->grayCount > 0)
     {
-        Obj *object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+        Obj *object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
     }
 }
 
-static void sweep()
+static void sweep(VM *vm)
 {
     Obj *previous = NULL;
-    Obj *object = vm.objects;
+    Obj *object = vm->objects;
     while (object != NULL)
     {
         if (object->isMarked)
@@ -180,36 +214,54 @@ static void sweep()
             }
             else
             {
-                vm.objects = object;
+                vm->objects = object;
             }
 
-            freeObject(unreached);
+            freeObject(vm, unreached);
         }
     }
 }
 
 // collects and frees all garbage
-void collectGarbage()
+void collectGarbage(VM *vm)
 {
     #ifdef DEBUG_LOG_GC
         printf("-- gc begin\n");
-        size_t before = vm.bytesAllocated;
+        size_t before = vm->bytesAllocated;
     #endif
+    uint64_t start = gcClock();
+    Tracer *tracer = vm->tracer;
+    if (tracer != NULL)
+    {
+        tracePhase(tracer, 'B', TRACE_GC, "gc");
+        tracePhase(tracer, 'B', TRACE_GC, "mark");
+    }
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings); // clear unused strings first
+    markRoots(vm);
+    traceReferences(vm);
+    if (tracer != NULL)
+    {
+        tracePhase(tracer, 'E', TRACE_GC, "mark");
+        tracePhase(tracer, 'B', TRACE_GC, "sweep");
+    }
+    tableRemoveWhite(&vm->strings); // clear unused strings first
                                    // bc they are referenced by
                                    // the objects sweep() clears
-    sweep();
+    sweep(vm);
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    recordCollection(vm, start);
+    if (tracer != NULL)
+    {
+        tracePhase(tracer, 'E', TRACE_GC, "sweep");
+        tracePhase(tracer, 'E', TRACE_GC, "gc");
+    }
 
     #ifdef DEBUG_LOG_GC
         printf("-- gc end\n");
         printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-               before - vm.bytesAllocated, before, vm.bytesAllocated,
-               vm.nextGC);
+               before - vm->bytesAllocated, before, vm->bytesAllocated,
+               vm->nextGC);
     #endif
 }
 
@@ -217,19 +269,22 @@ void collectGarbage()
 
 // reallocates memory of size newSize for pointer
 // if newSize is 0, pointer is freed
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize)
 {
-    vm.bytesAllocated += newSize - oldSize;
+    vm->bytesAllocated += newSize - oldSize;
+    vm->gcStats.reallocations++;
+    // only collect when growing, a free can happen during sweep()
     if (newSize > oldSize)
     {
+        vm->gcStats.bytesAllocated += newSize - oldSize;
     #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        collectGarbage(vm);
     #endif
-    }
 
-    if (vm.bytesAllocated > vm.nextGC)
-    {
-        collectGarbage();
+        if (vm->bytesAllocated > vm->nextGC)
+        {
+            collectGarbage(vm);
+        }
     }
 
     if (newSize == 0)
@@ -249,76 +304,109 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 }
 
 // frees a single object
-static void freeObject(Obj *object)
+static void freeObject(VM *vm, Obj *object)
 {
 #ifdef DEBUG_LOG_GC
     printf(" -- %p free type %d\n", (void *)object, object->type);
 #endif
+    recordFree(&vm->gcStats, object->type);
+    if (object->isSampled)
+        sampledFree(vm, object);
 
     switch (object->type)
     {
     case OBJ_BOUND_METHOD:
     {
-        FREE(ObjBoundMethod, object);
+        FREE(vm, ObjBoundMethod, object);
         break;
     }
     case OBJ_CLASS:
     {
         ObjClass *klass = (ObjClass *)object;
-        freeTable(&klass->methods);
-        FREE(ObjClass, object);
+        freeTable(vm, &klass->methods);
+        FREE(vm, ObjClass, object);
         break;
     }
     case OBJ_CLOSURE:
     {
         ObjClosure *closure = (ObjClosure *)object;
-        FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
+        FREE_ARRAY(vm, ObjUpvalue *, closure->upvalues, closure->upvalueCount);
+        FREE(vm, ObjClosure, object);
         break;
     }
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        if (string->owner == NULL)
+            FREE_ARRAY(vm, char, string->chars, string->length + 1);
+        FREE(vm, ObjString, object);
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
-        freeChunk(&function->chunk);
-        FREE(ObjFunction, object);
+        freeChunk(vm, &function->chunk);
+        freeLazyBody(vm, function);
+        freeJit(function);
+        FREE(vm, ObjFunction, object);
         break;
     }
     case OBJ_INSTANCE:
     {
         ObjInstance *instance = (ObjInstance *)object;
-        freeTable(&instance->fields);
-        FREE(ObjInstance, object);
+        freeTable(vm, &instance->fields);
+        FREE(vm, ObjInstance, object);
         break;
     }
     case OBJ_NATIVE:
     {
-        FREE(ObjNative, object);
+        FREE(vm, ObjNative, object);
         break;
     }
     case OBJ_UPVALUE:
     {
-        FREE(ObjUpvalue, object);
+        FREE(vm, ObjUpvalue, object);
         break;
     }
+    case OBJ_CHANNEL:
+    {
+        releaseChannel(((ObjChannel *)object)->channel);
+        FREE(vm, ObjChannel, object);
+        break;
     }
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)object;
+        FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+        FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
+        FREE(vm, ObjFiber, object);
+        break;
+    }
+    }
+}
+
+// frees the source kept around for a lazily compiled function
+void freeLazyBody(VM *vm, ObjFunction *function)
+{
+    LazyBody *lazy = function->lazy;
+    if (lazy == NULL)
+        return;
+
+    function->lazy = NULL;
+    FREE_ARRAY(vm, char, lazy->source, lazy->length + 1);
+    freeValueArray(vm, &lazy->upvalueNames);
+    FREE(vm, LazyBody, lazy);
 }
 
 // frees the VM's objects from memory
-void freeObjects()
+void freeObjects(VM *vm)
 {
-    Obj *object = vm.objects;
+    Obj *object = vm->objects;
     while (object != NULL)
     {
         Obj *next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
-    free(vm.grayStack);
+    free(vm->grayStack);
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "allocprofile.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -14,18 +15,22 @@
 #include "vm.h"
 
 // allocates an Obj (basically the __init__ for an obj)
-#define ALLOCATE_OBJ(type, objectType) \
-	(type *)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+	(type *)allocateObject(vm, sizeof(type), objectType)
 
 // helper for ALLOCATE_OBJ
-static Obj *allocateObject(size_t size, ObjType type)
+static Obj *allocateObject(VM *vm, size_t size, ObjType type)
 {
-	Obj *object = (Obj *)reallocate(NULL, 0, size);
+	Obj *object = (Obj *)reallocate(vm, NULL, 0, size);
 	object->type = type;
 	object->isMarked = false;
+	object->isSampled = false;
 
-	object->next = vm.objects;
-	vm.objects = object;
+	object->next = vm->objects;
+	vm->objects = object;
+	vm->gcStats.allocated[type] += size;
+	if (vm->allocProfile != NULL)
+		countAllocation(vm, object, size);
 
 #ifdef DEBUG_LOG_GC
 	printf(" -- %p allocate %zu for %d\n", (void *)object, size, type);
@@ -35,69 +40,102 @@ static Obj *allocateObject(size_t size, ObjType type)
 }
 
 // allocates and returns a new bound method
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method)
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method)
 {
-	ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+	ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
 	bound->receiver = receiver;
 	bound->method = method;
 	return bound;
 }
 
+// wraps a channel for this VM. the channel must already be
+// retained for it
+ObjChannel *newChannel(VM *vm, Channel *channel)
+{
+	ObjChannel *object = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+	object->channel = channel;
+	return object;
+}
+
 // allocates and returns a new class
-ObjClass *newClass(ObjString *name)
+ObjClass *newClass(VM *vm, ObjString *name)
 {
-	ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+	ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
 	klass->name = name;
 	initTable(&klass->methods);
 	return klass;
 }
 
 // allocates and returns a new closure
-ObjClosure *newClosure(ObjFunction *function)
+ObjClosure *newClosure(VM *vm, ObjFunction *function)
 {
-	ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *,  function->upvalueCount);
+	ObjUpvalue **upvalues = ALLOCATE(vm, ObjUpvalue *,  function->upvalueCount);
 	for (int i = 0; i < function->upvalueCount; i++)
 	{
 		upvalues[i] = NULL;
 	}
 
-	ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+	ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
 	closure->function = function;
 	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
 	return closure;
 }
 
+// allocates and returns a new fiber that calls closure once resumed
+ObjFiber *newFiber(VM *vm, ObjClosure *closure)
+{
+	ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+	fiber->state = FIBER_NEW;
+	fiber->scheduled = false;
+	fiber->closure = closure;
+	fiber->frames = NULL;
+	fiber->frameCount = 0;
+	fiber->frameCapacity = 0;
+	fiber->stack = NULL;
+	fiber->stackCount = 0;
+	fiber->stackCapacity = 0;
+	fiber->openUpvalues = NULL;
+	fiber->baseFrame = 0;
+	fiber->baseSlot = 0;
+	fiber->caller = NULL;
+	fiber->nextScheduled = NULL;
+	return fiber;
+}
+
 // allocates and returns a new native function
-ObjNative *newNative(NativeFn function)
+ObjNative *newNative(VM *vm, NativeFn function)
 {
-	ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+	ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
 	native->function = function;
 	return native;
 }
 
 // allocates and returns a new ObjFunction
-ObjFunction *newFunction()
+ObjFunction *newFunction(VM *vm)
 {
-	ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+	ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
 	function->name = NULL;
+	function->lazy = NULL;
+	function->hotness = 0;
+	function->jit = NULL;
 	initChunk(&function->chunk);
 	return function;
 }
 
-ObjInstance *newInstance(ObjClass *klass)
+ObjInstance *newInstance(VM *vm, ObjClass *klass)
 {
-	ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	ObjInstance *instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
 	instance->klass = klass;
 	initTable(&instance->fields);
 	return instance;
 }
 
-ObjUpvalue *newUpvalue(Value *slot)
+ObjUpvalue *newUpvalue(VM *vm, Value *slot)
 {
-	ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+	ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
 	upvalue->closed = NIL_VAL;
 	upvalue->location = slot;
 	upvalue->next = NULL;
@@ -105,16 +143,17 @@ ObjUpvalue *newUpvalue(Value *slot)
 }
 
 // allocates a ObjString
-static ObjString *allocateString(char *chars, int length, uint32_t hash)
+static ObjString *allocateString(VM *vm, char *chars, int length, uint32_t hash)
 {
-	ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+	ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
 	string->length = length;
 	string->chars = chars;
 	string->hash = hash;
+	string->owner = NULL;
 
-	push(OBJ_VAL(string)); // keep string safe from GC
-	tableSet(&vm.strings, string, NIL_VAL);
-	pop();
+	push(vm, OBJ_VAL(string)); // keep string safe from GC
+	tableSet(vm, &vm->strings, string, NIL_VAL);
+	pop(vm);
 	return string;
 }
 
@@ -129,36 +168,62 @@ static uint32_t hashString(const char *key, int length)
 	return hash;
 }
 
-ObjString *takeString(char *chars, int length)
+ObjString *takeString(VM *vm, char *chars, int length)
 {
 	uint32_t hash = hashString(chars, length);
 
 	// check if the string already existed
 	ObjString *interned = tableFindString(
-		&vm.strings, chars, length, hash);
+		&vm->strings, chars, length, hash);
 	if (interned != NULL)
 	{
-		FREE_ARRAY(char, chars, length + 1);
+		FREE_ARRAY(vm, char, chars, length + 1);
 		return interned;
 	}
 
-	return allocateString(chars, length, hash);
+	return allocateString(vm, chars, length, hash);
 }
 
 // copies a c string to a ObjString and returns that
-ObjString *copyString(const char *chars, int length)
+ObjString *copyString(VM *vm, const char *chars, int length)
 {
-	char *heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
 	uint32_t hash = hashString(chars, length);
 	
 	// check if the string already existed
 	ObjString *interned = tableFindString(
-		&vm.strings, chars, length, hash);
+		&vm->strings, chars, length, hash);
 	if (interned != NULL) return interned;
 
-	return allocateString(heapChars, length, hash);
+	char *heapChars = ALLOCATE(vm, char, length + 1);
+	memcpy(heapChars, chars, length);
+	heapChars[length] = '\0';
+	return allocateString(vm, heapChars, length, hash);
+}
+
+// allocates an uninterned string of length bytes to be filled in
+// by the caller, e.g. as the owner of string views
+ObjString *newStringBuffer(VM *vm, int length)
+{
+	char *chars = ALLOCATE(vm, char, length + 1);
+	chars[length] = '\0';
+
+	ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+	string->length = length;
+	string->chars = chars;
+	string->hash = 0;
+	string->owner = NULL;
+	return string;
+}
+
+// makes a string of length chars inside owner without copying them
+ObjString *newStringView(VM *vm, ObjString *owner, char *chars, int length)
+{
+	ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+	string->length = length;
+	string->chars = chars;
+	string->hash = 0;
+	string->owner = owner;
+	return string;
 }
 
 // prints a function
@@ -199,10 +264,17 @@ void printObject(Value value)
 		printf("<native function>");
 		break;
 	case OBJ_STRING:
-		printf("%s", AS_CSTRING(value));
+		// views are not NUL-terminated
+		printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
 		break;
 	case OBJ_UPVALUE:
 		printf("<upvalue>");
 		break;
+	case OBJ_CHANNEL:
+		printf("<channel>");
+		break;
+	case OBJ_FIBER:
+		printf("<fiber>");
+		break;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "dtoa.h"
+#include "object.h"
+
+void initOutput(Output *output, size_t size, bool lineBuffered)
+{
+	output->bytes = NULL;
+	output->count = 0;
+	output->capacity = size;
+	output->lineBuffered = lineBuffered;
+
+	if (size > 0)
+	{
+		output->bytes = (char *)malloc(size);
+		if (output->bytes == NULL)
+			exit(1);
+	}
+}
+
+void freeOutput(Output *output)
+{
+	flushOutput(output);
+	free(output->bytes);
+	output->bytes = NULL;
+	output->capacity = 0;
+}
+
+void flushOutput(Output *output)
+{
+	if (output->count > 0)
+	{
+		fwrite(output->bytes, 1, output->count, stdout);
+		output->count = 0;
+	}
+	fflush(stdout);
+}
+
+void writeOutput(Output *output, const char *bytes, size_t length)
+{
+	// unbuffered, or too big to be worth copying
+	if (length > output->capacity)
+	{
+		flushOutput(output);
+		fwrite(bytes, 1, length, stdout);
+		return;
+	}
+
+	if (output->count + length > output->capacity)
+		flushOutput(output);
+	memcpy(output->bytes + output->count, bytes, length);
+	output->count += length;
+}
+
+static void outputNumber(Output *output, double number)
+{
+	char buffer[NUMBER_BUFFER_SIZE];
+	int length = formatNumber(number, buffer);
+	writeOutput(output, buffer, length);
+}
+
+void outputValue(Output *output, Value value)
+{
+	switch (value.type)
+	{
+	case VAL_BOOL:
+		if (AS_BOOL(value))
+			writeOutput(output, "true", 4);
+		else
+			writeOutput(output, "false", 5);
+		break;
+	case VAL_NIL:
+		writeOutput(output, "nil", 3);
+		break;
+	case VAL_NUMBER:
+		outputNumber(output, AS_NUMBER(value));
+		break;
+	case VAL_OBJ:
+		if (IS_STRING(value))
+		{
+			ObjString *string = AS_STRING(value);
+			writeOutput(output, string->chars, string->length);
+		}
+		else
+		{
+			// rare enough to go through stdio, in order
+			flushOutput(output);
+			printObject(value);
+		}
+		break;
+	}
+}
+
+void outputLine(Output *output, Value value)
+{
+	outputValue(output, value);
+	writeOutput(output, "\n", 1);
+	if (output->lineBuffered)
+		flushOutput(output);
+}
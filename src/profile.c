@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "profile.h"
+
+#ifdef PROFILE_OPCODES
+
+#define TOP_PAIRS 20
+
+typedef struct
+{
+	uint64_t count;
+	uint8_t first;
+	uint8_t second;
+} Pair;
+
+void initOpcodeProfile(OpcodeProfile *profile)
+{
+	memset(profile, 0, sizeof(OpcodeProfile));
+	profile->previous = OP_RETURN;
+	profile->countdown = PROFILE_SAMPLE_INTERVAL;
+
+	// averaged, since some counters only tick every so many cycles
+	uint64_t elapsed = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		uint64_t start = readCycles();
+		elapsed += readCycles() - start;
+	}
+	profile->overhead = elapsed / 1000;
+}
+
+// sorts by count, descending
+static int comparePairs(const void *a, const void *b)
+{
+	uint64_t x = ((const Pair *)a)->count;
+	uint64_t y = ((const Pair *)b)->count;
+	return (x < y) - (x > y);
+}
+
+void printOpcodeProfile(OpcodeProfile *profile)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < OPCODE_COUNT; i++)
+		total += profile->counts[i];
+	if (total == 0)
+		return;
+
+	// single opcodes are pairs with only a first
+	Pair opcodes[OPCODE_COUNT];
+	for (int i = 0; i < OPCODE_COUNT; i++)
+		opcodes[i] = (Pair){profile->counts[i], (uint8_t)i, 0};
+	qsort(opcodes, OPCODE_COUNT, sizeof(Pair), comparePairs);
+
+	fprintf(stderr, "-- opcodes: %llu executed\n", (unsigned long long)total);
+	fprintf(stderr, "%-18s %14s %7s %10s\n", "opcode", "count", "%",
+			PROFILE_SAMPLE_INTERVAL > 0 ? "cycles" : "");
+	for (int i = 0; i < OPCODE_COUNT && opcodes[i].count > 0; i++)
+	{
+		uint8_t opcode = opcodes[i].first;
+		fprintf(stderr, "%-18s %14llu %6.2f%%", opcodeName(opcode),
+				(unsigned long long)opcodes[i].count,
+				100.0 * opcodes[i].count / total);
+		// average over the sampled executions
+		if (profile->samples[opcode] > 0)
+		{
+			double cycles = (double)profile->cycles[opcode] /
+								profile->samples[opcode] -
+							profile->overhead;
+			fprintf(stderr, " %10.1f", cycles > 0 ? cycles : 0);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	Pair pairs[OPCODE_COUNT * OPCODE_COUNT];
+	for (int i = 0; i < OPCODE_COUNT; i++)
+	{
+		for (int j = 0; j < OPCODE_COUNT; j++)
+			pairs[i * OPCODE_COUNT + j] =
+				(Pair){profile->pairs[i][j], (uint8_t)i, (uint8_t)j};
+	}
+	qsort(pairs, OPCODE_COUNT * OPCODE_COUNT, sizeof(Pair), comparePairs);
+
+	fprintf(stderr, "-- top opcode pairs\n");
+	for (int i = 0; i < TOP_PAIRS && pairs[i].count > 0; i++)
+	{
+		fprintf(stderr, "%-18s %-18s %14llu %6.2f%%\n",
+				opcodeName(pairs[i].first), opcodeName(pairs[i].second),
+				(unsigned long long)pairs[i].count,
+				100.0 * pairs[i].count / total);
+	}
+}
+
+#endif
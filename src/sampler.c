@@ -0,0 +1,253 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "sampler.h"
+#include "signals.h"
+
+#define MAX_NAME 128
+// a stack as "script:12;outer:4;inner:9"
+#define MAX_STACK (FRAMES_MAX * (MAX_NAME + 16))
+
+// counts by stack and by function. keys are malloc'ed, nothing here
+// lives on the Lox heap
+typedef struct
+{
+	char *key;
+	uint64_t hash;
+	uint64_t count; // samples of the stack, or with the function on top
+	uint64_t total; // samples with the function anywhere on the stack
+	uint64_t lastSample;
+} Counter;
+
+typedef struct
+{
+	Counter *entries;
+	int count;
+	int capacity;
+} Counters;
+
+typedef struct Sampler
+{
+	char *path;
+	int hz;
+	uint64_t samples;
+	Counters stacks;
+	Counters functions;
+	char stack[MAX_STACK];
+} Sampler;
+
+// -------- counters --------
+
+static Counter *findCounter(Counters *counters, const char *key,
+							size_t length)
+{
+	if (counters->count + 1 > counters->capacity * 3 / 4)
+	{
+		int capacity = counters->capacity < 64 ? 64 : counters->capacity * 2;
+		Counter *entries = (Counter *)calloc(capacity, sizeof(Counter));
+		if (entries == NULL)
+			exit(1);
+		for (int i = 0; i < counters->capacity; i++)
+		{
+			Counter *entry = &counters->entries[i];
+			if (entry->key == NULL)
+				continue;
+			uint64_t index = entry->hash & (capacity - 1);
+			while (entries[index].key != NULL)
+				index = (index + 1) & (capacity - 1);
+			entries[index] = *entry;
+		}
+		free(counters->entries);
+		counters->entries = entries;
+		counters->capacity = capacity;
+	}
+
+	uint64_t hash = hashSource(key, length);
+	uint64_t index = hash & (counters->capacity - 1);
+	for (;;)
+	{
+		Counter *entry = &counters->entries[index];
+		if (entry->key == NULL)
+		{
+			entry->key = (char *)malloc(length + 1);
+			if (entry->key == NULL)
+				exit(1);
+			memcpy(entry->key, key, length);
+			entry->key[length] = '\0';
+			entry->hash = hash;
+			counters->count++;
+			return entry;
+		}
+		if (entry->hash == hash && strcmp(entry->key, key) == 0)
+			return entry;
+		index = (index + 1) & (counters->capacity - 1);
+	}
+}
+
+static void freeCounters(Counters *counters)
+{
+	for (int i = 0; i < counters->capacity; i++)
+		free(counters->entries[i].key);
+	free(counters->entries);
+}
+
+// -------- sampling --------
+
+// writes "name:line" for the code at offset. with no offset the line
+// is where the function starts, and the script has none
+static int describe(char *buffer, size_t size, ObjFunction *function,
+					int offset)
+{
+	if (function->name == NULL && offset < 0)
+		return snprintf(buffer, size, "script");
+	const char *name = function->name == NULL ? "script"
+											  : function->name->chars;
+#ifdef STRIP_LINE_INFO
+	return snprintf(buffer, size, "%.*s", MAX_NAME, name);
+#else
+	return snprintf(buffer, size, "%.*s:%d", MAX_NAME, name,
+					getLine(&function->chunk, offset < 0 ? 0 : offset));
+#endif
+}
+
+void takeSample(VM *vm)
+{
+	vm->sampleDue = 0;
+	Sampler *sampler = vm->sampler;
+	if (sampler == NULL || vm->frameCount == 0)
+		return;
+	sampler->samples++;
+
+	int length = 0;
+	for (int i = 0; i < vm->frameCount; i++)
+	{
+		CallFrame *frame = &vm->frames[i];
+		ObjFunction *function = frame->closure->function;
+		if (i > 0)
+			sampler->stack[length++] = ';';
+		length += describe(sampler->stack + length, MAX_STACK - length,
+						   function, (int)(frame->ip - function->chunk.code - 1));
+
+		// recursive functions are counted once per sample
+		char name[MAX_NAME + 16];
+		int nameLength = describe(name, sizeof(name), function, -1);
+		Counter *counter = findCounter(&sampler->functions, name, nameLength);
+		if (counter->lastSample != sampler->samples)
+		{
+			counter->lastSample = sampler->samples;
+			counter->total++;
+		}
+		if (i == vm->frameCount - 1)
+			counter->count++;
+	}
+
+	findCounter(&sampler->stacks, sampler->stack, length)->count++;
+}
+
+static void setTimer(int hz)
+{
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = hz > 0 ? 1000000 / hz : 0;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+bool startSampler(VM *vm, const char *path, int hz)
+{
+	if (vm->sampler != NULL || hz < 1 || hz > 1000000)
+		return false;
+	if (!claimSignal(vm, SIGPROF, &vm->sampleDue, "start the profiler"))
+		return false;
+
+	Sampler *sampler = (Sampler *)calloc(1, sizeof(Sampler));
+	char *pathCopy = (char *)malloc(strlen(path) + 1);
+	if (sampler == NULL || pathCopy == NULL)
+		exit(1);
+	strcpy(pathCopy, path);
+	sampler->path = pathCopy;
+	sampler->hz = hz;
+
+	vm->sampler = sampler;
+	setTimer(hz);
+	return true;
+}
+
+// sorts functions by their own samples, descending
+static int compareCounters(const void *a, const void *b)
+{
+	const Counter *x = *(const Counter *const *)a;
+	const Counter *y = *(const Counter *const *)b;
+	if (x->count != y->count)
+		return (x->count < y->count) - (x->count > y->count);
+	return (x->total < y->total) - (x->total > y->total);
+}
+
+static void printFunctions(Sampler *sampler)
+{
+	Counters *functions = &sampler->functions;
+	Counter **sorted = (Counter **)malloc(sizeof(Counter *) *
+										  (functions->count + 1));
+	if (sorted == NULL)
+		exit(1);
+	int count = 0;
+	for (int i = 0; i < functions->capacity; i++)
+	{
+		if (functions->entries[i].key != NULL)
+			sorted[count++] = &functions->entries[i];
+	}
+	qsort(sorted, count, sizeof(Counter *), compareCounters);
+
+	fprintf(stderr, "-- profile: %llu samples at %d Hz, stacks in %s\n",
+			(unsigned long long)sampler->samples, sampler->hz, sampler->path);
+	fprintf(stderr, "%-40s %8s %8s\n", "function", "self", "total");
+	for (int i = 0; i < count; i++)
+	{
+		fprintf(stderr, "%-40s %7.2f%% %7.2f%%\n", sorted[i]->key,
+				100.0 * sorted[i]->count / sampler->samples,
+				100.0 * sorted[i]->total / sampler->samples);
+	}
+	free(sorted);
+}
+
+void stopSampler(VM *vm)
+{
+	Sampler *sampler = vm->sampler;
+	if (sampler == NULL)
+		return;
+	setTimer(0);
+	vm->sampler = NULL;
+	vm->sampleDue = 0;
+	releaseSignal(vm, SIGPROF);
+
+	FILE *file = fopen(sampler->path, "w");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Could not write profile \"%s\".\n", sampler->path);
+	}
+	else
+	{
+		Counters *stacks = &sampler->stacks;
+		for (int i = 0; i < stacks->capacity; i++)
+		{
+			Counter *entry = &stacks->entries[i];
+			if (entry->key != NULL)
+				fprintf(file, "%s %llu\n", entry->key,
+						(unsigned long long)entry->count);
+		}
+		fclose(file);
+	}
+	if (sampler->samples > 0)
+		printFunctions(sampler);
+
+	freeCounters(&sampler->stacks);
+	freeCounters(&sampler->functions);
+	free(sampler->path);
+	free(sampler);
+}
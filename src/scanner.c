@@ -4,25 +4,24 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct
+// the fast paths look at 16 bytes at a time with SSE2, which every
+// x86-64 CPU has. elsewhere, or with NO_SIMD, the plain loops do it all
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#define SCANNER_SIMD
+#include <emmintrin.h>
+#endif
+
+void initScanner(Scanner *scanner, const char *source, size_t length, int line)
 {
-	const char *start;
-	const char *current;
-	int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char *source)
-{
-	scanner.start = source;
-	scanner.current = source;
-	scanner.line = 1;
+	scanner->start = source;
+	scanner->current = source;
+	scanner->end = source + length;
+	scanner->line = line;
 }
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner *scanner)
 {
-	return *scanner.current == '\0';
+	return scanner->current >= scanner->end;
 }
 
 static bool isDigit(char c)
@@ -37,186 +36,336 @@ static bool isAlpha(char c)
 		   c == '_';
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-	if (isAtEnd())
+	if (isAtEnd(scanner))
 		return false;
-	if (*scanner.current != expected)
+	if (*scanner->current != expected)
 		return false;
-	scanner.current++;
+	scanner->current++;
 	return true;
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-	scanner.current++;
-	return scanner.current[-1];
+	scanner->current++;
+	return scanner->current[-1];
 }
 
-static char peek()
+// returns '\0' past the end, like a terminator would
+static char peek(Scanner *scanner)
 {
-	return *scanner.current;
+	if (isAtEnd(scanner))
+		return '\0';
+	return *scanner->current;
 }
 
-static char peekNext()
+static char peekNext(Scanner *scanner)
 {
-	if (isAtEnd())
+	if (scanner->end - scanner->current < 2)
 		return '\0';
-	return scanner.current[1];
+	return scanner->current[1];
+}
+
+typedef struct
+{
+	const char *name;
+	int length;
+	TokenType type;
+} Keyword;
+
+// perfect hash of the keywords, see keywordHash(). empty slots have
+// length 0 and never match
+#define KEYWORD_SLOTS 32
+static const Keyword keywords[KEYWORD_SLOTS] = {
+	[2] = {"else", 4, TOKEN_ELSE},
+	[3] = {"for", 3, TOKEN_FOR},
+	[4] = {"false", 5, TOKEN_FALSE},
+	[7] = {"class", 5, TOKEN_CLASS},
+	[9] = {"if", 2, TOKEN_IF},
+	[11] = {"or", 2, TOKEN_OR},
+	[13] = {"nil", 3, TOKEN_NIL},
+	[15] = {"fun", 3, TOKEN_FUN},
+	[17] = {"true", 4, TOKEN_TRUE},
+	[18] = {"super", 5, TOKEN_SUPER},
+	[19] = {"var", 3, TOKEN_VAR},
+	[21] = {"while", 5, TOKEN_WHILE},
+	[23] = {"this", 4, TOKEN_THIS},
+	[24] = {"and", 3, TOKEN_AND},
+	[25] = {"print", 5, TOKEN_PRINT},
+	[30] = {"return", 6, TOKEN_RETURN},
+};
+
+// no two keywords share a slot. recompute the table when adding one
+static unsigned int keywordHash(const char *start, int length)
+{
+	return ((unsigned char)start[0] + 5u * (unsigned char)start[length - 1] +
+			(unsigned int)length) % KEYWORD_SLOTS;
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType type)
+static TokenType identifierType(Scanner *scanner)
 {
-	if (scanner.current - scanner.start == start + length &&
-		memcmp(scanner.start + start, rest, length) == 0)
+	int length = (int)(scanner->current - scanner->start);
+	if (length < 2 || length > 6)
+		return TOKEN_IDENTIFIER;
+
+	const Keyword *keyword = &keywords[keywordHash(scanner->start, length)];
+	if (keyword->length == length &&
+		memcmp(scanner->start, keyword->name, length) == 0)
 	{
-		return type;
+		return keyword->type;
 	}
-
 	return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType()
+#ifdef SCANNER_SIMD
+// bit i is set if byte i is c
+static inline int equalMask(__m128i bytes, char c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+
+// bit i is set if byte i is in [low, high]. SSE2 only compares signed
+// bytes, so the unsigned byte - low < count is done with flipped signs
+static inline int rangeMask(__m128i bytes, char low, char high)
+{
+	__m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+	__m128i flipped = _mm_xor_si128(offset, _mm_set1_epi8((char)0x80));
+	__m128i limit = _mm_set1_epi8((char)((high - low + 1) ^ 0x80));
+	return _mm_movemask_epi8(_mm_cmplt_epi8(flipped, limit));
+}
+
+static inline __m128i load16(Scanner *scanner)
+{
+	return _mm_loadu_si128((const __m128i *)scanner->current);
+}
+
+// counts the set bits of a 16 bit mask. __builtin_popcount() would be a
+// libgcc call without -mpopcnt
+static inline int countBits(unsigned int mask)
+{
+	mask = mask - ((mask >> 1) & 0x5555u);
+	mask = (mask & 0x3333u) + ((mask >> 2) & 0x3333u);
+	mask = (mask + (mask >> 4)) & 0x0F0Fu;
+	return (int)((mask + (mask >> 8)) & 0x1Fu);
+}
+
+// moves over count bytes, counting the newlines among them
+static inline void skipBytes(Scanner *scanner, int count, int newlines)
+{
+	if (newlines != 0)
+		scanner->line += countBits(newlines & ((1u << count) - 1));
+	scanner->current += count;
+}
+
+#define HAS_16_BYTES(scanner) ((scanner)->end - (scanner)->current >= 16)
+#endif
+
+// most identifiers and numbers are short. the wide loops only pay
+// off once this many bytes have been looked at one by one
+#define SHORT_RUN 8
+
+#ifdef SCANNER_SIMD
+// finishes a long identifier 16 bytes at a time
+static void skipIdentifierWide(Scanner *scanner)
 {
-	switch (scanner.start[0])
+	while (HAS_16_BYTES(scanner))
 	{
-	case 'a':
-		return checkKeyword(1, 2, "nd", TOKEN_AND);
-	case 'c':
-		return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-	case 'e':
-		return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-	case 'f':
-		if (scanner.current - scanner.start > 1)
+		__m128i bytes = load16(scanner);
+		// or-ing in 0x20 lowercases letters and nothing else in range
+		int mask = rangeMask(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z') |
+				   rangeMask(bytes, '0', '9') | equalMask(bytes, '_');
+		if (mask != 0xFFFF)
 		{
-			switch (scanner.start[1])
-			{
-			case 'a':
-				return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-			case 'o':
-				return checkKeyword(2, 1, "r", TOKEN_FOR);
-			case 'u':
-				return checkKeyword(2, 1, "n", TOKEN_FUN);
-			}
+			scanner->current += __builtin_ctz(~mask);
+			return;
+		}
+		scanner->current += 16;
+	}
+
+	while (isAlpha(peek(scanner)) || isDigit(peek(scanner)))
+		advance(scanner);
+}
+
+static void skipDigitsWide(Scanner *scanner)
+{
+	while (HAS_16_BYTES(scanner))
+	{
+		int mask = rangeMask(load16(scanner), '0', '9');
+		if (mask != 0xFFFF)
+		{
+			scanner->current += __builtin_ctz(~mask);
+			return;
+		}
+		scanner->current += 16;
+	}
+
+	while (isDigit(peek(scanner)))
+		advance(scanner);
+}
+#endif
+
+// moves to the first character that can't continue an identifier
+static void skipIdentifierChars(Scanner *scanner)
+{
+#ifdef SCANNER_SIMD
+	const char *limit = scanner->start + SHORT_RUN;
+	while (scanner->current < limit && scanner->current < scanner->end)
+	{
+		char c = *scanner->current;
+		if (!isAlpha(c) && !isDigit(c))
+			return;
+		scanner->current++;
+	}
+	skipIdentifierWide(scanner);
+#else
+	while (isAlpha(peek(scanner)) || isDigit(peek(scanner)))
+		advance(scanner);
+#endif
+}
+
+static void skipDigits(Scanner *scanner)
+{
+#ifdef SCANNER_SIMD
+	const char *limit = scanner->current + SHORT_RUN;
+	while (scanner->current < limit && scanner->current < scanner->end)
+	{
+		if (!isDigit(*scanner->current))
+			return;
+		scanner->current++;
+	}
+	skipDigitsWide(scanner);
+#else
+	while (isDigit(peek(scanner)))
+		advance(scanner);
+#endif
+}
+
+// moves to the next c, or to the end. newlines are counted on the way
+static void skipUntil(Scanner *scanner, char c)
+{
+#ifdef SCANNER_SIMD
+	while (HAS_16_BYTES(scanner))
+	{
+		__m128i bytes = load16(scanner);
+		int found = equalMask(bytes, c);
+		int newlines = equalMask(bytes, '\n');
+		if (found != 0)
+		{
+			skipBytes(scanner, __builtin_ctz(found), newlines);
+			return;
 		}
-		break;
-	case 'i':
-		return checkKeyword(1, 1, "f", TOKEN_IF);
-	case 'n':
-		return checkKeyword(1, 2, "il", TOKEN_NIL);
-	case 'o':
-		return checkKeyword(1, 1, "r", TOKEN_OR);
-	case 'p':
-		return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-	case 'r':
-		return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-	case 's':
-		return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-	case 't':
-		if (scanner.current - scanner.start > 1)
+		skipBytes(scanner, 16, newlines);
+	}
+#endif
+	while (peek(scanner) != c && !isAtEnd(scanner))
+	{
+		if (peek(scanner) == '\n')
+			scanner->line++;
+		advance(scanner);
+	}
+}
+
+#ifdef SCANNER_SIMD
+// moves over a run of spaces, tabs and newlines, like indentation
+static void skipBlanks(Scanner *scanner)
+{
+	while (HAS_16_BYTES(scanner))
+	{
+		__m128i bytes = load16(scanner);
+		int newlines = equalMask(bytes, '\n');
+		int blanks = equalMask(bytes, ' ') | equalMask(bytes, '\t') |
+					 equalMask(bytes, '\r') | newlines;
+		if (blanks != 0xFFFF)
 		{
-			switch (scanner.start[1])
-			{
-			case 'h':
-				return checkKeyword(2, 2, "is", TOKEN_THIS);
-			case 'r':
-				return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-			}
+			skipBytes(scanner, __builtin_ctz(~blanks), newlines);
+			return;
 		}
-		break;
-	case 'v':
-		return checkKeyword(1, 2, "ar", TOKEN_VAR);
-	case 'w':
-		return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+		skipBytes(scanner, 16, newlines);
 	}
-	return TOKEN_IDENTIFIER;
 }
+#endif
 
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner *scanner, TokenType type)
 {
 	Token token;
 	token.type = type;
-	token.start = scanner.start;
-	token.length = (int)(scanner.current - scanner.start);
-	token.line = scanner.line;
+	token.start = scanner->start;
+	token.length = (int)(scanner->current - scanner->start);
+	token.line = scanner->line;
 	return token;
 }
 
-static Token errorToken(const char *message)
+static Token errorToken(Scanner *scanner, const char *message)
 {
 	Token token;
 	token.type = TOKEN_ERROR;
 	token.start = message;
 	token.length = (int)strlen(message);
-	token.line = scanner.line;
+	token.line = scanner->line;
 	return token;
 }
 
-static Token string()
+static Token string(Scanner *scanner)
 {
-	while (peek() != '"' && !isAtEnd())
-	{
-		if (peek() == '\n')
-			scanner.line++;
-		advance();
-	}
+	skipUntil(scanner, '"');
 
-	if (isAtEnd())
-		return errorToken("Unterminated string.");
+	if (isAtEnd(scanner))
+		return errorToken(scanner, "Unterminated string.");
 
 	// The closing quote.
-	advance();
-	return makeToken(TOKEN_STRING);
+	advance(scanner);
+	return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number()
+static Token number(Scanner *scanner)
 {
-	while (isDigit(peek()))
-		advance();
+	skipDigits(scanner);
 
 	// Look for a fractional part.
-	if (peek() == '.' && isDigit(peekNext()))
+	if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
 	{
 		// Consume the ".".
-		advance();
-
-		while (isDigit(peek()))
-			advance();
+		advance(scanner);
+		skipDigits(scanner);
 	}
 
-	return makeToken(TOKEN_NUMBER);
+	return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-	while (isAlpha(peek()) || isDigit(peek()))
-		advance();
-	return makeToken(identifierType());
+	skipIdentifierChars(scanner);
+	return makeToken(scanner, identifierType(scanner));
 }
 
-static void skipWhitespace()
+static void skipWhitespace(Scanner *scanner)
 {
 	for (;;)
 	{
-		char c = peek();
+		char c = peek(scanner);
 		switch (c)
 		{
 		case ' ':
 		case '\r':
 		case '\t':
-			advance();
+			advance(scanner);
 			break;
 		case '\n':
-			scanner.line++;
-			advance();
+			scanner->line++;
+			advance(scanner);
+#ifdef SCANNER_SIMD
+			// only worth it for indentation of more than one level
+			if (peek(scanner) == peekNext(scanner) && (peek(scanner) == ' ' || peek(scanner) == '\t'))
+				skipBlanks(scanner);
+#endif
 			break;
 		// comment maybe
 		case '/':
-			if (peekNext() == '/')
+			if (peekNext(scanner) == '/')
 			{
 				// A comment goes until the end of the line.
-				while (peek() != '\n' && !isAtEnd())
-					advance();
+				skipUntil(scanner, '\n');
 			}
 			else
 			{
@@ -229,64 +378,64 @@ static void skipWhitespace()
 	}
 }
 
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-	skipWhitespace();
+	skipWhitespace(scanner);
 
-	scanner.start = scanner.current;
+	scanner->start = scanner->current;
 
-	if (isAtEnd())
-		return makeToken(TOKEN_EOF);
+	if (isAtEnd(scanner))
+		return makeToken(scanner, TOKEN_EOF);
 
-	char c = advance();
+	char c = advance(scanner);
 
 	// check for idents
 	if (isAlpha(c))
-		return identifier();
+		return identifier(scanner);
 	// check for digits
 	if (isDigit(c))
-		return number();
+		return number(scanner);
 
 	switch (c)
 	{
 	// single-character
 	case '(':
-		return makeToken(TOKEN_LEFT_PAREN);
+		return makeToken(scanner, TOKEN_LEFT_PAREN);
 	case ')':
-		return makeToken(TOKEN_RIGHT_PAREN);
+		return makeToken(scanner, TOKEN_RIGHT_PAREN);
 	case '{':
-		return makeToken(TOKEN_LEFT_BRACE);
+		return makeToken(scanner, TOKEN_LEFT_BRACE);
 	case '}':
-		return makeToken(TOKEN_RIGHT_BRACE);
+		return makeToken(scanner, TOKEN_RIGHT_BRACE);
 	case ';':
-		return makeToken(TOKEN_SEMICOLON);
+		return makeToken(scanner, TOKEN_SEMICOLON);
 	case ',':
-		return makeToken(TOKEN_COMMA);
+		return makeToken(scanner, TOKEN_COMMA);
 	case '.':
-		return makeToken(TOKEN_DOT);
+		return makeToken(scanner, TOKEN_DOT);
 	case '-':
-		return makeToken(TOKEN_MINUS);
+		return makeToken(scanner, TOKEN_MINUS);
 	case '+':
-		return makeToken(TOKEN_PLUS);
+		return makeToken(scanner, TOKEN_PLUS);
 	case '/':
-		return makeToken(TOKEN_SLASH);
+		return makeToken(scanner, TOKEN_SLASH);
 	case '*':
-		return makeToken(TOKEN_STAR);
+		return makeToken(scanner, TOKEN_STAR);
 
 	// two-character
 	case '!':
-		return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 	case '=':
-		return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 	case '<':
-		return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 	case '>':
-		return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+		return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
 	// literals
 	case '"':
-		return string();
+		return string(scanner);
 	}
 
-	return errorToken("Unexpected character.");
+	return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "serialize.h"
+#include "memory.h"
+#include "vm.h"
+
+// -------- writing --------
+
+void initWriter(Writer *writer)
+{
+	writer->bytes = NULL;
+	writer->count = 0;
+	writer->capacity = 0;
+}
+
+void freeWriter(Writer *writer)
+{
+	free(writer->bytes);
+	initWriter(writer);
+}
+
+void writeBytes(Writer *writer, const void *bytes, size_t length)
+{
+	if (writer->capacity < writer->count + length)
+	{
+		while (writer->capacity < writer->count + length)
+			writer->capacity = GROW_CAPACITY(writer->capacity);
+
+		writer->bytes = (uint8_t *)realloc(writer->bytes, writer->capacity);
+		if (writer->bytes == NULL)
+			exit(1);
+	}
+
+	memcpy(writer->bytes + writer->count, bytes, length);
+	writer->count += length;
+}
+
+void writeU8(Writer *writer, uint8_t value)
+{
+	writeBytes(writer, &value, sizeof(value));
+}
+
+void writeU32(Writer *writer, uint32_t value)
+{
+	writeBytes(writer, &value, sizeof(value));
+}
+
+void writeDouble(Writer *writer, double value)
+{
+	writeBytes(writer, &value, sizeof(value));
+}
+
+// pads with zeroes up to the next multiple of alignment, so that
+// arrays in the file can be used in place once mapped
+void writeAlign(Writer *writer, size_t alignment)
+{
+	static const uint8_t zeroes[8] = {0};
+	size_t padding = (alignment - writer->count % alignment) % alignment;
+	writeBytes(writer, zeroes, padding);
+}
+
+void writeChunkCode(Writer *writer, Chunk *chunk)
+{
+	writeU32(writer, (uint32_t)chunk->count);
+	writeBytes(writer, chunk->code, chunk->count);
+
+#ifndef STRIP_LINE_INFO
+	writeAlign(writer, sizeof(uint32_t));
+	writeU32(writer, (uint32_t)chunk->lineCount);
+	writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+#endif
+}
+
+bool writeFileAtomic(const char *path, Writer *writer)
+{
+	// write next to the target and rename, so that a concurrently
+	// starting clox never maps a half written file
+	size_t tempLength = strlen(path) + 32;
+	char *tempPath = (char *)malloc(tempLength);
+	if (tempPath == NULL)
+		return false;
+	snprintf(tempPath, tempLength, "%s.%d.tmp", path, (int)getpid());
+
+	bool success = false;
+	FILE *file = fopen(tempPath, "wb");
+	if (file != NULL)
+	{
+		success = fwrite(writer->bytes, 1, writer->count, file) == writer->count;
+		success = fclose(file) == 0 && success;
+		success = success && rename(tempPath, path) == 0;
+		if (!success)
+			remove(tempPath);
+	}
+
+	free(tempPath);
+	return success;
+}
+
+// -------- reading --------
+
+void initReader(Reader *reader, const void *base, size_t size)
+{
+	reader->base = (const uint8_t *)base;
+	reader->current = reader->base;
+	reader->end = reader->base + size;
+	reader->failed = false;
+}
+
+// returns a pointer to the next length bytes of the mapping
+const uint8_t *readSpan(Reader *reader, size_t length)
+{
+	if (reader->failed || (size_t)(reader->end - reader->current) < length)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+
+	const uint8_t *span = reader->current;
+	reader->current += length;
+	return span;
+}
+
+void readBytes(Reader *reader, void *out, size_t length)
+{
+	const uint8_t *span = readSpan(reader, length);
+	if (span != NULL)
+		memcpy(out, span, length);
+	else
+		memset(out, 0, length);
+}
+
+uint8_t readU8(Reader *reader)
+{
+	uint8_t value;
+	readBytes(reader, &value, sizeof(value));
+	return value;
+}
+
+uint32_t readU32(Reader *reader)
+{
+	uint32_t value;
+	readBytes(reader, &value, sizeof(value));
+	return value;
+}
+
+double readDouble(Reader *reader)
+{
+	double value;
+	readBytes(reader, &value, sizeof(value));
+	return value;
+}
+
+void readAlign(Reader *reader, size_t alignment)
+{
+	size_t offset = (size_t)(reader->current - reader->base);
+	readSpan(reader, (alignment - offset % alignment) % alignment);
+}
+
+void readChunkCode(Reader *reader, Chunk *chunk)
+{
+	uint32_t codeCount = readU32(reader);
+	chunk->code = (uint8_t *)readSpan(reader, codeCount);
+	chunk->count = chunk->code != NULL ? (int)codeCount : 0;
+
+#ifndef STRIP_LINE_INFO
+	readAlign(reader, sizeof(uint32_t));
+	uint32_t lineCount = readU32(reader);
+	if (lineCount > UINT32_MAX / sizeof(LineStart))
+		reader->failed = true;
+	else
+		chunk->lines = (LineStart *)readSpan(reader,
+											 sizeof(LineStart) * lineCount);
+	chunk->lineCount = chunk->lines != NULL ? (int)lineCount : 0;
+#endif
+}
+
+// -------- checking --------
+
+// the size of the instruction at offset, or 0 if it is unknown, runs past
+// the end of the chunk or has an operand out of range
+static int instructionSize(ObjFunction *function, int offset)
+{
+	Chunk *chunk = &function->chunk;
+	ValueArray *constants = &chunk->constants;
+	const uint8_t *code = chunk->code + offset;
+	int left = chunk->count - offset;
+
+	switch (code[0])
+	{
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_CALL:
+		return left >= 2 ? 2 : 0;
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+		return left >= 2 && code[1] < function->upvalueCount ? 2 : 0;
+	case OP_CONSTANT:
+		// functions are only loaded by OP_CLOSURE
+		return left >= 2 && code[1] < constants->count &&
+					   !IS_FUNCTION(constants->values[code[1]])
+				   ? 2
+				   : 0;
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_CLASS:
+	case OP_METHOD:
+		return left >= 2 && code[1] < constants->count &&
+					   IS_STRING(constants->values[code[1]])
+				   ? 2
+				   : 0;
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_BACK:
+		return left >= 3 ? 3 : 0;
+	case OP_CLOSURE:
+	{
+		if (left < 2 || code[1] >= constants->count ||
+			!IS_FUNCTION(constants->values[code[1]]))
+		{
+			return 0;
+		}
+
+		// followed by where each of its upvalues comes from
+		int upvalueCount = AS_FUNCTION(constants->values[code[1]])->upvalueCount;
+		int size = 2 + 2 * upvalueCount;
+		if (left < size)
+			return 0;
+		for (int i = 0; i < upvalueCount; i++)
+		{
+			uint8_t isLocal = code[2 + 2 * i];
+			uint8_t index = code[3 + 2 * i];
+			if (isLocal > 1 || (!isLocal && index >= function->upvalueCount))
+				return 0;
+		}
+		return size;
+	}
+	default:
+		return code[0] < OPCODE_COUNT ? 1 : 0;
+	}
+}
+
+// the stack height before each instruction is NOT_CODE where none
+// starts, and UNSEEN until a path to it has been followed
+#define NOT_CODE -2
+#define UNSEEN -1
+
+// how many values the instruction takes off the stack and puts back on
+static void stackEffect(const uint8_t *code, int *takes, int *puts)
+{
+	*takes = 0;
+	*puts = 0;
+	switch (code[0])
+	{
+	case OP_CONSTANT:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		*puts = 1;
+		break;
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_PRINT:
+	case OP_CLOSE_UPVALUE:
+	case OP_RETURN:
+		*takes = 1;
+		break;
+	case OP_SET_LOCAL:
+	case OP_SET_GLOBAL:
+	case OP_SET_UPVALUE:
+	case OP_GET_PROPERTY:
+	case OP_NEGATE:
+	case OP_NOT:
+	case OP_JUMP_IF_FALSE:
+		*takes = 1;
+		*puts = 1;
+		break;
+	case OP_CALL:
+		*takes = code[1] + 1;
+		*puts = 1;
+		break;
+	case OP_JUMP:
+	case OP_JUMP_BACK:
+		break;
+	default:
+		// the binary operators, OP_SET_PROPERTY and OP_METHOD
+		*takes = 2;
+		*puts = 1;
+		break;
+	}
+}
+
+// follows a path to offset, where the stack is height values deep
+static bool reach(int *heights, int *pending, int *pendingCount, int offset,
+				  int height)
+{
+	if (heights[offset] != UNSEEN)
+		return heights[offset] == height;
+	heights[offset] = height;
+	pending[(*pendingCount)++] = offset;
+	return true;
+}
+
+// follows every path through the code, checking that the stack is deep
+// enough for what each instruction takes off it and for the locals it
+// uses, and that paths which meet agree on the height
+static bool checkStack(ObjFunction *function, int *heights)
+{
+	Chunk *chunk = &function->chunk;
+	// each instruction is pending at most once
+	int *pending = (int *)malloc(sizeof(int) * chunk->count);
+	if (pending == NULL)
+		exit(1);
+	int pendingCount = 0;
+
+	// the callee and its arguments
+	bool valid = reach(heights, pending, &pendingCount, 0, function->arity + 1);
+	while (valid && pendingCount > 0)
+	{
+		int offset = pending[--pendingCount];
+		const uint8_t *code = chunk->code + offset;
+		int height = heights[offset];
+
+		int takes, puts;
+		stackEffect(code, &takes, &puts);
+		valid = height >= takes;
+		if (code[0] == OP_GET_LOCAL || code[0] == OP_SET_LOCAL)
+			valid = valid && code[1] < height;
+		if (code[0] == OP_CLOSURE)
+		{
+			int upvalueCount = AS_FUNCTION(chunk->constants.values[code[1]])->upvalueCount;
+			for (int i = 0; i < upvalueCount && valid; i++)
+				valid = !code[2 + 2 * i] || code[3 + 2 * i] < height;
+		}
+		height += puts - takes;
+
+		if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE ||
+			code[0] == OP_JUMP_BACK)
+		{
+			int jump = (code[1] << 8) | code[2];
+			int target = offset + 3 + (code[0] == OP_JUMP_BACK ? -jump : jump);
+			valid = valid && target >= 0 && target < chunk->count &&
+					reach(heights, pending, &pendingCount, target, height);
+		}
+		// the last instruction is an OP_RETURN, so the next one exists
+		if (code[0] != OP_JUMP && code[0] != OP_JUMP_BACK &&
+			code[0] != OP_RETURN)
+		{
+			int next = offset + instructionSize(function, offset);
+			valid = valid && reach(heights, pending, &pendingCount, next, height);
+		}
+	}
+
+	free(pending);
+	return valid;
+}
+
+bool checkFunction(ObjFunction *function)
+{
+	Chunk *chunk = &function->chunk;
+	if (function->arity < 0 || function->arity > 255 ||
+		function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT ||
+		chunk->count == 0)
+	{
+		return false;
+	}
+
+#ifndef STRIP_LINE_INFO
+	// getLine() needs a run at 0 and the runs in order
+	if (chunk->lineCount == 0 || chunk->lines[0].offset != 0)
+		return false;
+	for (int i = 1; i < chunk->lineCount; i++)
+	{
+		if (chunk->lines[i].offset <= chunk->lines[i - 1].offset ||
+			chunk->lines[i].offset >= chunk->count)
+		{
+			return false;
+		}
+	}
+#endif
+
+	int *heights = (int *)malloc(sizeof(int) * chunk->count);
+	if (heights == NULL)
+		exit(1);
+	for (int i = 0; i < chunk->count; i++)
+		heights[i] = NOT_CODE;
+
+	// where the instructions start, so that jumps can't land
+	// in the middle of one
+	bool valid = true;
+	int last = 0;
+	for (int offset = 0; offset < chunk->count && valid;)
+	{
+		int size = instructionSize(function, offset);
+		heights[offset] = UNSEEN;
+		last = offset;
+		offset += size;
+		valid = size > 0;
+	}
+
+	// the last instruction returns, so nothing runs off the end
+	valid = valid && chunk->code[last] == OP_RETURN &&
+			checkStack(function, heights);
+	free(heights);
+	return valid;
+}
+
+// -------- mappings --------
+
+void *mapFile(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	*size = (size_t)info.st_size;
+	// writable, as run() rewrites instructions in place. the pages it
+	// writes to become private copies, the file never changes
+	void *base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+					  fd, 0);
+	close(fd);
+	return base == MAP_FAILED ? NULL : base;
+}
+
+void unmapFile(void *base, size_t size)
+{
+	munmap(base, size);
+}
+
+void keepMapped(VM *vm, void *base, size_t size)
+{
+	MappedFile *mapped = (MappedFile *)malloc(sizeof(MappedFile));
+	if (mapped == NULL)
+		exit(1);
+	mapped->base = base;
+	mapped->size = size;
+	mapped->next = vm->mappedFiles;
+	vm->mappedFiles = mapped;
+}
+
+void freeMappedFiles(VM *vm)
+{
+	MappedFile *mapped = vm->mappedFiles;
+	while (mapped != NULL)
+	{
+		MappedFile *next = mapped->next;
+		munmap(mapped->base, mapped->size);
+		free(mapped);
+		mapped = next;
+	}
+	vm->mappedFiles = NULL;
+}
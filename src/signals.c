@@ -0,0 +1,76 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "signals.h"
+
+// by signal number. the handler does nothing until both are set, and
+// a claim that fails to install the handler clears them again
+typedef struct
+{
+	_Atomic(VM *) vm;
+	_Atomic(volatile sig_atomic_t *) due;
+} SignalOwner;
+
+static SignalOwner owners[NSIG];
+
+static void onSignal(int number)
+{
+	volatile sig_atomic_t *due = atomic_load(&owners[number].due);
+	VM *vm = atomic_load(&owners[number].vm);
+	if (vm != NULL && due != NULL)
+	{
+		*due = 1;
+		vm->safepointDue = 1;
+	}
+}
+
+bool claimSignal(VM *vm, int number, volatile sig_atomic_t *due,
+				 const char *what)
+{
+	if (number <= 0 || number >= NSIG)
+		return false;
+
+	SignalOwner *owner = &owners[number];
+	VM *none = NULL;
+	if (!atomic_compare_exchange_strong(&owner->vm, &none, vm))
+	{
+		fprintf(stderr, "Could not %s, the signal is taken%s.\n", what,
+				none == vm ? "" : " by another VM");
+		return false;
+	}
+	atomic_store(&owner->due, due);
+
+	// restarted, so that reads aren't cut short by the signal
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(number, &action, NULL) != 0)
+	{
+		fprintf(stderr, "Could not %s: %s.\n", what, strerror(errno));
+		atomic_store(&owner->due, NULL);
+		atomic_store(&owner->vm, NULL);
+		return false;
+	}
+	return true;
+}
+
+void releaseSignal(VM *vm, int number)
+{
+	if (!ownsSignal(vm, number))
+		return;
+	signal(number, SIG_DFL);
+	atomic_store(&owners[number].vm, NULL);
+	atomic_store(&owners[number].due, NULL);
+}
+
+bool ownsSignal(VM *vm, int number)
+{
+	return number > 0 && number < NSIG &&
+		   atomic_load(&owners[number].vm) == vm;
+}
@@ -0,0 +1,386 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "signals.h"
+#include "snapshot.h"
+
+// the longest description of an object written
+#define MAX_DESCRIPTION 64
+
+// -------- writing --------
+
+static void writeChars(FILE *file, const char *chars, int length)
+{
+	int shown = length < MAX_DESCRIPTION ? length : MAX_DESCRIPTION;
+	for (int i = 0; i < shown; i++)
+	{
+		unsigned char c = (unsigned char)chars[i];
+		fputc(c < ' ' || c == 127 ? '?' : c, file);
+	}
+	if (shown < length)
+		fputs("...", file);
+}
+
+static void writeRoot(FILE *file, Value value, const char *what,
+					  ObjString *name)
+{
+	if (!IS_OBJ(value))
+		return;
+	fprintf(file, "root %p %s", (void *)AS_OBJ(value), what);
+	if (name != NULL)
+	{
+		fputc(' ', file);
+		writeChars(file, name->chars, name->length);
+	}
+	fputc('\n', file);
+}
+
+static void writeEdge(FILE *file, Value value, const char *what,
+					  ObjString *name)
+{
+	if (!IS_OBJ(value) || AS_OBJ(value) == NULL)
+		return;
+	fprintf(file, "edge %p %s", (void *)AS_OBJ(value), what);
+	if (name != NULL)
+	{
+		fputc(' ', file);
+		writeChars(file, name->chars, name->length);
+	}
+	fputc('\n', file);
+}
+
+#define OBJ_EDGE(file, object, what) \
+	writeEdge(file, OBJ_VAL((Obj *)(object)), what, NULL)
+
+// the keys and values of a table, named after the keys
+static void writeTable(FILE *file, Table *table, const char *what)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry *entry = &table->entries[i];
+		if (entry->key == NULL)
+			continue;
+		OBJ_EDGE(file, entry->key, "key");
+		writeEdge(file, entry->value, what, entry->key);
+	}
+}
+
+// the same roots as markRoots()
+static void writeRoots(VM *vm, FILE *file)
+{
+	for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+		writeRoot(file, *slot, "stack", NULL);
+	for (int i = 0; i < vm->frameCount; i++)
+		writeRoot(file, OBJ_VAL(vm->frames[i].closure), "frame", NULL);
+	for (ObjUpvalue *upvalue = vm->openUpvalues;
+		 upvalue != NULL;
+		 upvalue = upvalue->next)
+	{
+		writeRoot(file, OBJ_VAL(upvalue), "open upvalue", NULL);
+	}
+
+	Table *tables[] = {&vm->globals, &vm->baseGlobals};
+	for (int t = 0; t < 2; t++)
+	{
+		for (int i = 0; i < tables[t]->capacity; i++)
+		{
+			Entry *entry = &tables[t]->entries[i];
+			if (entry->key == NULL)
+				continue;
+			writeRoot(file, OBJ_VAL(entry->key), "global name", NULL);
+			writeRoot(file, entry->value, "global", entry->key);
+		}
+	}
+
+	if (vm->initString != NULL)
+		writeRoot(file, OBJ_VAL(vm->initString), "init string", NULL);
+	if (vm->fiber != NULL)
+		writeRoot(file, OBJ_VAL(vm->fiber), "running fiber", NULL);
+	if (vm->scheduled != NULL)
+		writeRoot(file, OBJ_VAL(vm->scheduled), "scheduled fiber", NULL);
+	for (uint32_t i = 0; i < vm->loadingCount; i++)
+	{
+		if (vm->loading[i] != NULL)
+			writeRoot(file, OBJ_VAL(vm->loading[i]), "image", NULL);
+	}
+}
+
+// the object and what it owns, as counted by reallocate()
+static size_t objectBytes(Obj *object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:
+		return sizeof(ObjBoundMethod);
+	case OBJ_CLASS:
+		return sizeof(ObjClass) +
+			   sizeof(Entry) * ((ObjClass *)object)->methods.capacity;
+	case OBJ_CLOSURE:
+		return sizeof(ObjClosure) +
+			   sizeof(ObjUpvalue *) * ((ObjClosure *)object)->upvalueCount;
+	case OBJ_FUNCTION:
+	{
+		ObjFunction *function = (ObjFunction *)object;
+		Chunk *chunk = &function->chunk;
+		size_t bytes = sizeof(ObjFunction) + chunk->capacity +
+					   sizeof(Value) * chunk->constants.capacity;
+#ifndef STRIP_LINE_INFO
+		bytes += sizeof(LineStart) * chunk->lineCapacity;
+#endif
+		if (function->lazy != NULL)
+			bytes += sizeof(LazyBody) + function->lazy->length + 1 +
+					 sizeof(Value) * function->lazy->upvalueNames.capacity;
+		return bytes;
+	}
+	case OBJ_INSTANCE:
+		return sizeof(ObjInstance) +
+			   sizeof(Entry) * ((ObjInstance *)object)->fields.capacity;
+	case OBJ_NATIVE:
+		return sizeof(ObjNative);
+	case OBJ_STRING:
+	{
+		ObjString *string = (ObjString *)object;
+		return sizeof(ObjString) +
+			   (string->owner == NULL ? string->length + 1 : 0);
+	}
+	case OBJ_UPVALUE:
+		return sizeof(ObjUpvalue);
+	case OBJ_CHANNEL:
+		return sizeof(ObjChannel);
+	case OBJ_FIBER:
+	{
+		ObjFiber *fiber = (ObjFiber *)object;
+		return sizeof(ObjFiber) + sizeof(CallFrame) * fiber->frameCapacity +
+			   sizeof(Value) * fiber->stackCapacity;
+	}
+	}
+	return 0;
+}
+
+// the type, size and a description, then the same references that
+// blackenObject() follows
+static void writeObject(FILE *file, Obj *object)
+{
+	static const char *typeNames[] = {
+		[OBJ_BOUND_METHOD] = "bound_method",
+		[OBJ_CLASS] = "class",
+		[OBJ_CLOSURE] = "closure",
+		[OBJ_FUNCTION] = "function",
+		[OBJ_INSTANCE] = "instance",
+		[OBJ_NATIVE] = "native",
+		[OBJ_STRING] = "string",
+		[OBJ_UPVALUE] = "upvalue",
+		[OBJ_CHANNEL] = "channel",
+		[OBJ_FIBER] = "fiber",
+	};
+	fprintf(file, "object %p %s %zu ", (void *)object,
+			typeNames[object->type], objectBytes(object));
+
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod *bound = (ObjBoundMethod *)object;
+		ObjString *name = bound->method->function->name;
+		writeChars(file, name->chars, name->length);
+		fputc('\n', file);
+		writeEdge(file, bound->receiver, "receiver", NULL);
+		OBJ_EDGE(file, bound->method, "method");
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjClass *klass = (ObjClass *)object;
+		writeChars(file, klass->name->chars, klass->name->length);
+		fputc('\n', file);
+		OBJ_EDGE(file, klass->name, "name");
+		writeTable(file, &klass->methods, "method");
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure *closure = (ObjClosure *)object;
+		ObjString *name = closure->function->name;
+		if (name != NULL)
+			writeChars(file, name->chars, name->length);
+		else
+			fputs("script", file);
+		fputc('\n', file);
+		OBJ_EDGE(file, closure->function, "function");
+		for (int i = 0; i < closure->upvalueCount; i++)
+		{
+			if (closure->upvalues[i] != NULL)
+				OBJ_EDGE(file, closure->upvalues[i], "upvalue");
+		}
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction *function = (ObjFunction *)object;
+		if (function->name != NULL)
+			writeChars(file, function->name->chars, function->name->length);
+		else
+			fputs("script", file);
+		fputc('\n', file);
+		if (function->name != NULL)
+			OBJ_EDGE(file, function->name, "name");
+		for (int i = 0; i < function->chunk.constants.count; i++)
+			writeEdge(file, function->chunk.constants.values[i], "constant",
+					  NULL);
+		if (function->lazy != NULL)
+		{
+			ValueArray *names = &function->lazy->upvalueNames;
+			for (int i = 0; i < names->count; i++)
+				writeEdge(file, names->values[i], "upvalue name", NULL);
+		}
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance *instance = (ObjInstance *)object;
+		ObjString *name = instance->klass->name;
+		writeChars(file, name->chars, name->length);
+		fputc('\n', file);
+		OBJ_EDGE(file, instance->klass, "class");
+		writeTable(file, &instance->fields, "field");
+		break;
+	}
+	case OBJ_STRING:
+	{
+		ObjString *string = (ObjString *)object;
+		fputc('"', file);
+		writeChars(file, string->chars, string->length);
+		fputs("\"\n", file);
+		if (string->owner != NULL)
+			OBJ_EDGE(file, string->owner, "owner");
+		break;
+	}
+	case OBJ_UPVALUE:
+		fputc('\n', file);
+		writeEdge(file, ((ObjUpvalue *)object)->closed, "value", NULL);
+		break;
+	case OBJ_FIBER:
+	{
+		ObjFiber *fiber = (ObjFiber *)object;
+		fputc('\n', file);
+		if (fiber->closure != NULL)
+			OBJ_EDGE(file, fiber->closure, "closure");
+		if (fiber->caller != NULL)
+			OBJ_EDGE(file, fiber->caller, "caller");
+		if (fiber->nextScheduled != NULL)
+			OBJ_EDGE(file, fiber->nextScheduled, "next scheduled");
+		for (int i = 0; i < fiber->stackCount; i++)
+			writeEdge(file, fiber->stack[i], "stack", NULL);
+		for (int i = 0; i < fiber->frameCount; i++)
+			OBJ_EDGE(file, fiber->frames[i].closure, "frame");
+		for (ObjUpvalue *upvalue = fiber->openUpvalues;
+			 upvalue != NULL;
+			 upvalue = upvalue->next)
+		{
+			OBJ_EDGE(file, upvalue, "open upvalue");
+		}
+		break;
+	}
+	case OBJ_NATIVE:
+		fputs(nativeName(((ObjNative *)object)->function), file);
+		fputc('\n', file);
+		break;
+	case OBJ_CHANNEL:
+		fputc('\n', file);
+		break;
+	}
+}
+
+bool writeHeapSnapshot(VM *vm, const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return false;
+
+	// only what is reachable is left
+	collectGarbage(vm);
+
+	fprintf(file, "clox heap snapshot 1\n");
+	writeRoots(vm, file);
+	for (Obj *object = vm->objects; object != NULL; object = object->next)
+		writeObject(file, object);
+
+	bool failed = ferror(file);
+	return fclose(file) == 0 && !failed;
+}
+
+// -------- on a signal --------
+
+bool watchSnapshotSignal(VM *vm, const char *prefix)
+{
+	if (vm->snapshotPrefix != NULL)
+		return false;
+	if (!claimSignal(vm, SIGUSR1, &vm->snapshotDue, "watch for SIGUSR1"))
+		return false;
+
+	char *copy = (char *)malloc(strlen(prefix) + 1);
+	if (copy == NULL)
+		exit(1);
+	strcpy(copy, prefix);
+	vm->snapshotPrefix = copy;
+	vm->snapshotCount = 0;
+	return true;
+}
+
+void unwatchSnapshotSignal(VM *vm)
+{
+	releaseSignal(vm, SIGUSR1);
+	free(vm->snapshotPrefix);
+	vm->snapshotPrefix = NULL;
+}
+
+void takeSnapshot(VM *vm)
+{
+	vm->snapshotDue = 0;
+	if (vm->snapshotPrefix == NULL)
+		return;
+
+	size_t size = strlen(vm->snapshotPrefix) + 32;
+	char *path = (char *)malloc(size);
+	if (path == NULL)
+		exit(1);
+	snprintf(path, size, "%s.%d.heap", vm->snapshotPrefix,
+			 ++vm->snapshotCount);
+
+	flushOutput(&vm->output);
+	if (writeHeapSnapshot(vm, path))
+		fprintf(stderr, "Heap snapshot written to \"%s\".\n", path);
+	else
+		fprintf(stderr, "Could not write heap snapshot \"%s\".\n", path);
+	free(path);
+}
+
+// -------- native --------
+
+Value heapSnapshotNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 1)
+		return nativeError(vm, "Expected 1 arguments but got %d.", argCount);
+	if (!IS_STRING(args[0]))
+		return nativeError(vm, "Path of heapSnapshot() must be a string.");
+
+	// views aren't terminated, and the heap is what is being written
+	ObjString *string = AS_STRING(args[0]);
+	char *path = (char *)malloc(string->length + 1);
+	if (path == NULL)
+		exit(1);
+	memcpy(path, string->chars, string->length);
+	path[string->length] = '\0';
+
+	bool written = writeHeapSnapshot(vm, path);
+	free(path);
+	if (!written)
+		return nativeError(vm, "Could not write heap snapshot \"%.*s\".",
+						   string->length, string->chars);
+	return NIL_VAL;
+}
@@ -21,9 +21,9 @@ void initTable(Table *table)
     table->entries = NULL;
 }
 
-void freeTable(Table *table)
+void freeTable(VM *vm, Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
@@ -60,9 +60,9 @@ static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
     }
 }
 
-static void adjustCapacity(Table *table, int capacity)
+static void adjustCapacity(VM *vm, Table *table, int capacity)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
+    Entry *entries = ALLOCATE(vm, Entry, capacity);
 
     for (int i = 0; i < capacity; i++)
     {
@@ -83,7 +83,7 @@ static void adjustCapacity(Table *table, int capacity)
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
 
     table->entries = entries;
     table->capacity = capacity;
@@ -102,12 +102,12 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     return true;
 }
 
-bool tableSet(Table *table, ObjString *key, Value value)
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
 
     Entry *entry = findEntry(table->entries, table->capacity, key);
@@ -136,7 +136,7 @@ bool tableDelete(Table *table, ObjString *key)
     return true;
 }
 
-void tableAddAll(Table *from, Table *to)
+void tableAddAll(VM *vm, Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
@@ -144,7 +144,7 @@ void tableAddAll(Table *from, Table *to)
 
         if (entry->key != NULL)
         {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -188,12 +188,12 @@ void tableRemoveWhite(Table *table)
     }
 }
 
-void markTable(Table *table)
+void markTable(VM *vm, Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
-        markObject((Obj *)entry->key);
-        markValue(entry->value);
+        markObject(vm, (Obj *)entry->key);
+        markValue(vm, entry->value);
     }
 }
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "vm.h"
+
+static const char *categoryNames[] = {
+	[TRACE_CALL] = "call",
+	[TRACE_GC] = "gc",
+	[TRACE_COMPILE] = "compile",
+};
+
+bool startTracer(VM *vm, const char *path, size_t capacity)
+{
+	if (vm->tracer != NULL || capacity < 1)
+		return false;
+
+	uint64_t rounded = 1;
+	while (rounded < capacity)
+		rounded *= 2;
+
+	Tracer *tracer = (Tracer *)malloc(sizeof(Tracer));
+	TraceEvent *events = (TraceEvent *)malloc(sizeof(TraceEvent) * rounded);
+	char *pathCopy = (char *)malloc(strlen(path) + 1);
+	if (tracer == NULL || events == NULL || pathCopy == NULL)
+		exit(1);
+	strcpy(pathCopy, path);
+
+	tracer->events = events;
+	tracer->capacity = rounded;
+	tracer->count = 0;
+	tracer->start = monotonicNanos();
+	tracer->path = pathCopy;
+
+	vm->tracer = tracer;
+	return true;
+}
+
+// names are function names and fixed strings, but may hold anything
+static void writeName(FILE *file, const char *name)
+{
+	for (const char *c = name; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')
+			fprintf(file, "\\%c", *c);
+		else if ((unsigned char)*c < ' ')
+			fprintf(file, "\\u%04x", *c);
+		else
+			fputc(*c, file);
+	}
+}
+
+static bool writeTrace(Tracer *tracer)
+{
+	FILE *file = fopen(tracer->path, "w");
+	if (file == NULL)
+		return false;
+
+	uint64_t first = tracer->count > tracer->capacity
+						 ? tracer->count - tracer->capacity
+						 : 0;
+	int pid = (int)getpid();
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (uint64_t i = first; i < tracer->count; i++)
+	{
+		TraceEvent *event = &tracer->events[i & (tracer->capacity - 1)];
+		// microseconds, with the nanoseconds kept
+		double time = event->time >= tracer->start
+						  ? (event->time - tracer->start) / 1e3
+						  : 0;
+		fprintf(file, "{\"name\":\"");
+		writeName(file, event->name);
+		fprintf(file, "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+					  "\"pid\":%d,\"tid\":1}%s\n",
+				categoryNames[event->category], event->phase, time, pid,
+				i + 1 < tracer->count ? "," : "");
+	}
+	fprintf(file, "],\n\"displayTimeUnit\":\"ns\",\n"
+				  "\"otherData\":{\"dropped\":%llu}}\n",
+			(unsigned long long)first);
+
+	bool failed = ferror(file);
+	return fclose(file) == 0 && !failed;
+}
+
+void stopTracer(VM *vm)
+{
+	Tracer *tracer = vm->tracer;
+	if (tracer == NULL)
+		return;
+	vm->tracer = NULL;
+
+	if (!writeTrace(tracer))
+		fprintf(stderr, "Could not write trace \"%s\".\n", tracer->path);
+	free(tracer->events);
+	free(tracer->path);
+	free(tracer);
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "dtoa.h"
 #include "memory.h"
 #include "value.h"
 #include "object.h"
@@ -12,14 +13,14 @@ void initValueArray(ValueArray *array)
     array->count = 0;
 }
 
-void writeValueArray(ValueArray *array, Value value)
+void writeValueArray(VM *vm, ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
         // array needs to grow first
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values,
+        array->values = GROW_ARRAY(vm, Value, array->values,
                                    oldCapacity, array->capacity);
     }
 
@@ -28,9 +29,9 @@ void writeValueArray(ValueArray *array, Value value)
     array->count++;
 }
 
-void freeValueArray(ValueArray *array)
+void freeValueArray(VM *vm, ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -62,8 +63,12 @@ void printValue(Value value)
         printf("nil");
         break;
     case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+    {
+        char buffer[NUMBER_BUFFER_SIZE];
+        formatNumber(AS_NUMBER(value), buffer);
+        printf("%s", buffer);
         break;
+    }
     case VAL_OBJ:
         printObject(value);
         break;
@@ -84,7 +89,17 @@ bool valuesEqual(Value a, Value b)
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
     {
-        return AS_OBJ(a) == AS_OBJ(b);
+        if (AS_OBJ(a) == AS_OBJ(b))
+            return true;
+        // interned strings are equal only if they are the same object
+        if (IS_STRING(a) && IS_STRING(b) &&
+            (AS_STRING(a)->owner != NULL || AS_STRING(b)->owner != NULL))
+        {
+            return AS_STRING(a)->length == AS_STRING(b)->length &&
+                   memcmp(AS_STRING(a)->chars, AS_STRING(b)->chars,
+                          AS_STRING(a)->length) == 0;
+        }
+        return false;
     }
     default:
         return false; // Unreachable.
@@ -9,56 +9,113 @@
 #include <unistd.h>
 #include <time.h>
 
+#include "allocprofile.h"
+#include "bytecode.h"
 #include "compiler.h"
+#include "counters.h"
 #include "common.h"
 #include "debug.h"
+#include "fiber.h"
+#include "gcstats.h"
+#include "isolate.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "sampler.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
-
 // ------- NATIVES -----------
-static Value clockNative(int argCount, Value *args)
+static Value clockNative(VM *vm, int argCount, Value *args)
 {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
-static Value clearNative(int argCount, Value *args)
+static Value clearNative(VM *vm, int argCount, Value *args)
 {
+	flushOutput(&vm->output);
 	system("@cls||clear");
 	return NIL_VAL;
 }
-static Value sleepNative(int argCount, Value *args)
+static Value sleepNative(VM *vm, int argCount, Value *args)
 {
+	flushOutput(&vm->output);
 	sleep(AS_NUMBER(args[0]));
 	return NIL_VAL;
 }
+static Value quickenStatsNative(VM *vm, int argCount, Value *args)
+{
+	if (argCount != 0)
+		return nativeError(vm, "Expected 0 arguments but got %d.", argCount);
+	pushInstance(vm, "QuickenStats");
+	setField(vm, "quickened", NUMBER_VAL((double)vm->quickened));
+	setField(vm, "dequickened", NUMBER_VAL((double)vm->dequickened));
+	return pop(vm);
+}
+
+// every native the VM defines. heap images refer to them by name
+static const NativeDef natives[] = {
+	{"clock", clockNative},
+	{"clear", clearNative},
+	{"sleep", sleepNative},
+	{"spawn", spawnNative},
+	{"channel", channelNative},
+	{"send", sendNative},
+	{"receive", receiveNative},
+	{"close", closeNative},
+	{"pool", poolNative},
+	{"fiber", fiberNative},
+	{"resume", resumeNative},
+	{"yield", yieldNative},
+	{"done", doneNative},
+	{"schedule", scheduleNative},
+	{"wait", waitNative},
+	{"gcStats", gcStatsNative},
+	{"allocProfile", allocProfileNative},
+	{"heapSnapshot", heapSnapshotNative},
+	{"nanos", nanosNative},
+	{"cycles", cyclesNative},
+	{"counters", countersNative},
+	{"quickenStats", quickenStatsNative},
+};
+#define NATIVE_COUNT (sizeof(natives) / sizeof(natives[0]))
 // ---------------------------
 
 // reset the stack
-static void resetStack()
+static void resetStack(VM *vm)
 {
-	vm.stackTop = vm.stack;
-	vm.frameCount = 0;
-	vm.openUpvalues = NULL;
+	vm->stackTop = vm->stack;
+	vm->frameCount = 0;
+	vm->openUpvalues = NULL;
+	vm->fiber = NULL;
+	vm->fiberSwitched = false;
+	vm->scheduled = NULL;
+	vm->lastScheduled = NULL;
 }
 
 // display a runtime error
-static void runtimeError(const char *format, ...)
+void runtimeError(VM *vm, const char *format, ...)
 {
+	flushOutput(&vm->output);
+
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
 	va_end(args);
 	fputs("\n", stderr);
 
-	for (int i = vm.frameCount - 1; i >= 0; i--)
+	for (int i = vm->frameCount - 1; i >= 0; i--)
 	{
-		CallFrame *frame = &vm.frames[i];
+		CallFrame *frame = &vm->frames[i];
 		ObjFunction *function = frame->closure->function;
 		size_t instruction = frame->ip - function->chunk.code - 1;
+#ifdef STRIP_LINE_INFO
+		fprintf(stderr, "[byte %zu] in ", instruction);
+#else
 		fprintf(stderr, "[line %d] in ",
-				function->chunk.lines[instruction]);
+				getLine(&function->chunk, (int)instruction));
+#endif
 		if (function->name == NULL)
 		{
 			fprintf(stderr, "script\n");
@@ -68,93 +125,258 @@ static void runtimeError(const char *format, ...)
 			fprintf(stderr, "%s()\n", function->name->chars);
 		}
 	}
-	resetStack();
+	resetStack(vm);
+}
+
+Value nativeError(VM *vm, const char *format, ...)
+{
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	runtimeError(vm, "%s", message);
+	vm->nativeFailed = true;
+	return NIL_VAL;
+}
+
+// pushes an instance of a class of its own
+void pushInstance(VM *vm, const char *className)
+{
+	push(vm, OBJ_VAL(copyString(vm, className, (int)strlen(className))));
+	push(vm, OBJ_VAL(newClass(vm, AS_STRING(vm->stackTop[-1]))));
+	ObjInstance *instance = newInstance(vm, AS_CLASS(vm->stackTop[-1]));
+	pop(vm);
+	pop(vm);
+	push(vm, OBJ_VAL(instance));
 }
 
-static void defineNative(const char *name, NativeFn function)
+// sets a field of the instance on top of the stack
+void setField(VM *vm, const char *name, Value value)
 {
-	push(OBJ_VAL(copyString(name, (int)strlen(name))));
-	push(OBJ_VAL(newNative(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-	pop();
-	pop();
+	ObjInstance *instance = AS_INSTANCE(vm->stackTop[-1]);
+	push(vm, value);
+	push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+	tableSet(vm, &instance->fields, AS_STRING(vm->stackTop[-1]),
+			 vm->stackTop[-2]);
+	pop(vm);
+	pop(vm);
+}
+
+// returns the name the native was defined under, or NULL
+const char *nativeName(NativeFn function)
+{
+	for (size_t i = 0; i < NATIVE_COUNT; i++)
+	{
+		if (natives[i].function == function)
+			return natives[i].name;
+	}
+	return NULL;
+}
+
+// returns the native defined under the given name, or NULL
+NativeFn findNative(const char *name, int length)
+{
+	for (size_t i = 0; i < NATIVE_COUNT; i++)
+	{
+		if ((int)strlen(natives[i].name) == length &&
+			memcmp(natives[i].name, name, length) == 0)
+			return natives[i].function;
+	}
+	return NULL;
+}
+
+static void defineNative(VM *vm, const char *name, NativeFn function)
+{
+	push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+	push(vm, OBJ_VAL(newNative(vm, function)));
+	tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+	pop(vm);
+	pop(vm);
 }
 
 // initialize the VM
-void initVM()
+void initVM(VM *vm)
 {
-	resetStack();
-	vm.bytesAllocated = 0;
-	vm.nextGC = 1024 * 1024;
-	vm.objects = NULL;
-	vm.grayCount = 0;
-	vm.grayCapacity = 0;
-	vm.grayStack = NULL;
-	initTable(&vm.strings);
-	initTable(&vm.globals);
+	resetStack(vm);
+	vm->bytesAllocated = 0;
+	vm->nextGC = 1024 * 1024;
+	vm->objects = NULL;
+	initGcStats(&vm->gcStats);
+	vm->grayCount = 0;
+	vm->grayCapacity = 0;
+	vm->grayStack = NULL;
+	vm->mappedFiles = NULL;
+	vm->copyCachedCode = false;
+	vm->lazyCompilation = false;
+	vm->measureLazy = false;
+	memset(&vm->lazyStats, 0, sizeof(LazyStats));
+	vm->loading = NULL;
+	vm->loadingCount = 0;
+	vm->nativeFailed = false;
+	vm->isolates = NULL;
+	vm->pool = NULL;
+	vm->poolWorker = -1;
+	vm->safepointDue = 0;
+	vm->sampleDue = 0;
+	vm->snapshotDue = 0;
+	vm->sampler = NULL;
+	vm->snapshotPrefix = NULL;
+	vm->snapshotCount = 0;
+	vm->allocProfile = NULL;
+	vm->tracer = NULL;
+	vm->counters = NULL;
+	// the profile and trace would miss what runs natively
+#if defined(PROFILE_OPCODES) || defined(DEBUG_TRACE_EXECUTION)
+	vm->jitThreshold = 0;
+#else
+	vm->jitThreshold = JIT_DEFAULT_THRESHOLD;
+#endif
+	vm->quickened = 0;
+	vm->dequickened = 0;
+#ifdef PROFILE_OPCODES
+	initOpcodeProfile(&vm->opcodeProfile);
+#endif
+	// interactive output shows up line by line
+	initOutput(&vm->output, OUTPUT_BUFFER_SIZE, isatty(STDOUT_FILENO));
+	initTable(&vm->strings);
+	initTable(&vm->globals);
+	initTable(&vm->baseGlobals);
 
-	vm.initString = NULL;
-	vm.initString = copyString("init", 4);
+	vm->initString = NULL;
+	vm->initString = copyString(vm, "init", 4);
 
-	defineNative("clock", clockNative);
-	defineNative("clear", clearNative);
-	defineNative("sleep", sleepNative);
+	for (size_t i = 0; i < NATIVE_COUNT; i++)
+	{
+		defineNative(vm, natives[i].name, natives[i].function);
+	}
 }
 
 // free the VM
-void freeVM()
+void freeVM(VM *vm)
+{
+	joinIsolates(vm);
+	stopSampler(vm);
+	unwatchSnapshotSignal(vm);
+	if (vm->gcStats.printAtExit)
+		printGcStats(vm);
+	stopAllocProfile(vm);
+	stopTracer(vm);
+	closeCounters(vm);
+#ifdef PROFILE_OPCODES
+	printOpcodeProfile(&vm->opcodeProfile);
+#endif
+	vm->initString = NULL;
+	freeObjects(vm);
+	freeTable(vm, &vm->strings);
+	freeTable(vm, &vm->globals);
+	freeTable(vm, &vm->baseGlobals);
+	freeMappedFiles(vm);
+	freeOutput(&vm->output);
+}
+
+// creates a VM on the heap, for embedders and threads
+VM *createVM()
+{
+	VM *vm = (VM *)malloc(sizeof(VM));
+	if (vm == NULL)
+		return NULL;
+	initVM(vm);
+	return vm;
+}
+
+void destroyVM(VM *vm)
+{
+	flushOutput(&vm->output);
+	freeVM(vm);
+	free(vm);
+}
+
+// size 0 writes every print straight through
+void setOutputBuffer(VM *vm, size_t size, bool lineBuffered)
+{
+	freeOutput(&vm->output);
+	initOutput(&vm->output, size, lineBuffered);
+}
+
+// makes the current globals (natives, a loaded image) the
+// starting point of every script run after resetVM()
+void saveBaseGlobals(VM *vm)
+{
+	freeTable(vm, &vm->baseGlobals);
+	initTable(&vm->baseGlobals);
+	tableAddAll(vm, &vm->globals, &vm->baseGlobals);
+}
+
+// gets the VM ready for the next script. interned strings and the
+// heap are kept, whatever the last script left behind is garbage
+void resetVM(VM *vm)
 {
-	vm.initString = NULL;
-	freeObjects();
-	freeTable(&vm.strings);
-	freeTable(&vm.globals);
+	resetStack(vm);
+	freeTable(vm, &vm->globals);
+	initTable(&vm->globals);
+	tableAddAll(vm, &vm->baseGlobals, &vm->globals);
 }
 
 // push a new value onto the stack
-void push(Value value)
+void push(VM *vm, Value value)
 {
-	*vm.stackTop = value;
-	vm.stackTop++;
+	*vm->stackTop = value;
+	vm->stackTop++;
 }
 
 // pop the last value off the stack
-Value pop()
+Value pop(VM *vm)
 {
-	vm.stackTop--;
-	return *vm.stackTop;
+	vm->stackTop--;
+	return *vm->stackTop;
 }
 
 // return the Value at distance from top of stack without popping
-static Value peek(int distance)
+static Value peek(VM *vm, int distance)
 {
-	return vm.stackTop[-1 - distance];
+	return vm->stackTop[-1 - distance];
 }
 
 // calls the given function with the given argcount
-static bool call(ObjClosure *closure, int argCount)
+bool callClosure(VM *vm, ObjClosure *closure, int argCount)
 {
+	// pre-parsed bodies are compiled on their first call
+	if (closure->function->lazy != NULL && !compileLazy(vm, closure->function))
+	{
+		runtimeError(vm, "Could not compile function '%s'.",
+					 closure->function->name->chars);
+		return false;
+	}
+
 	if (argCount != closure->function->arity)
 	{
-		runtimeError("Expected %d arguments but got %d.",
+		runtimeError(vm, "Expected %d arguments but got %d.",
 					 closure->function->arity, argCount);
 		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX)
+	if (vm->frameCount == FRAMES_MAX)
 	{
-		runtimeError("Stack overflow.");
+		runtimeError(vm, "Stack overflow.");
 		return false;
 	}
 
-	CallFrame *frame = &vm.frames[vm.frameCount++];
+	CallFrame *frame = &vm->frames[vm->frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
-	frame->slots = vm.stackTop - argCount - 1;
+	frame->slots = vm->stackTop - argCount - 1;
+	if (vm->tracer != NULL)
+		traceFunction(vm->tracer, 'B', closure->function);
+	// run() enters the native code
+	if (++closure->function->hotness == vm->jitThreshold)
+		compileJit(vm, closure->function);
 	return true;
 }
 
 // attempts to call the given value with the given amount of args
-static bool callValue(Value callee, int argCount)
+static bool callValue(VM *vm, Value callee, int argCount)
 {
 	if (IS_OBJ(callee))
 	{
@@ -164,68 +386,80 @@ static bool callValue(Value callee, int argCount)
 		{
 			ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
 			// set the 'this' variable at slot 0 of the callframe
-			vm.stackTop[-argCount - 1] = bound->receiver;
-			return call(bound->method, argCount);
+			vm->stackTop[-argCount - 1] = bound->receiver;
+			return callClosure(vm, bound->method, argCount);
 		}
 		case OBJ_CLASS:
 		{
 			ObjClass *klass = AS_CLASS(callee);
-			vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+			vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 
 			Value initializer;
-			if (tableGet(&klass->methods, vm.initString, &initializer))
+			if (tableGet(&klass->methods, vm->initString, &initializer))
 			{
-				return call(AS_CLOSURE(initializer), argCount);
+				return callClosure(vm, AS_CLOSURE(initializer), argCount);
 			}
 			else if (argCount != 0)
 			{
 				// no init() so no args
-				runtimeError("Expected 0 arguments but got %d.", argCount);
+				runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
 				return false;
 			}
 
 			return true;
 		}
 		case OBJ_CLOSURE:
-			return call(AS_CLOSURE(callee), argCount);
+			return callClosure(vm, AS_CLOSURE(callee), argCount);
 		case OBJ_NATIVE:
 		{
 			NativeFn native = AS_NATIVE(callee);
-			Value result = native(argCount, vm.stackTop - argCount);
-			vm.stackTop -= argCount + 1;
-			push(result);
+			Value result = native(vm, argCount, vm->stackTop - argCount);
+			// the error has been reported and the stack reset already
+			if (vm->nativeFailed)
+			{
+				vm->nativeFailed = false;
+				return false;
+			}
+			// another fiber's stack is on top now
+			if (vm->fiberSwitched)
+			{
+				vm->fiberSwitched = false;
+				return true;
+			}
+			vm->stackTop -= argCount + 1;
+			push(vm, result);
 			return true;
 		}
 		default:
 			break; // Non-callable object type.
 		}
 	}
-	runtimeError("Can only call functions and classes.");
+	runtimeError(vm, "Can only call functions and classes.");
 	return false;
 }
 
 // looks up and binds the given method if it exists, otherwise 
 // false is returned
-static bool bindMethod(ObjClass *klass, ObjString *name)
+static bool bindMethod(VM *vm, ObjClass *klass, ObjString *name)
 {
 	Value method;
 	if (!tableGet(&klass->methods, name, &method))
 	{
-		runtimeError("Undefined property '%s'.", name->chars);
+		runtimeError(vm, "Undefined property '%s'.", name->chars);
 		return false;
 	}
 
-	ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-	pop();
-	push(OBJ_VAL(bound));
+	ObjBoundMethod *bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+	pop(vm);
+	push(vm, OBJ_VAL(bound));
 	return true;
 }
 
 // captures the given local as an upvalue and returns that
-static ObjUpvalue *captureUpvalue(Value *local)
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local)
 {
 	ObjUpvalue *prevUpvalue = NULL;
-	ObjUpvalue *upvalue = vm.openUpvalues;
+	ObjUpvalue *upvalue = vm->openUpvalues;
 	while (upvalue != NULL && upvalue->location > local)
 	{
 		prevUpvalue = upvalue;
@@ -237,12 +471,14 @@ static ObjUpvalue *captureUpvalue(Value *local)
 		return upvalue;
 	}
 
-	ObjUpvalue *createdUpvalue = newUpvalue(local);
+	ObjUpvalue *createdUpvalue = newUpvalue(vm, local);
 	createdUpvalue->next = upvalue;
+	if (vm->fiber != NULL)
+		createdUpvalue->closed = OBJ_VAL(vm->fiber);
 
 	if (prevUpvalue == NULL)
 	{
-		vm.openUpvalues = createdUpvalue;
+		vm->openUpvalues = createdUpvalue;
 	}
 	else
 	{
@@ -253,26 +489,35 @@ static ObjUpvalue *captureUpvalue(Value *local)
 }
 
 // closes over the upvalue
-static void closeUpvalues(Value *last)
+static void closeUpvalues(VM *vm, Value *last)
 {
-	while (vm.openUpvalues != NULL &&
-		   vm.openUpvalues->location >= last)
+	while (vm->openUpvalues != NULL &&
+		   vm->openUpvalues->location >= last)
 	{
-		ObjUpvalue *upvalue = vm.openUpvalues;
+		ObjUpvalue *upvalue = vm->openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
-		vm.openUpvalues = upvalue->next;
+		vm->openUpvalues = upvalue->next;
 	}
 }
 
 // add the method that's on top of the stack in the
 // form of a closure to the class below it
-static void defineMethod(ObjString *name)
+// the compiler always puts a class under the method, but bytecode
+// loaded from a file might not
+static bool defineMethod(VM *vm, ObjString *name)
 {
-	Value method = peek(0);
-	ObjClass *klass = AS_CLASS(peek(1));
-	tableSet(&klass->methods, name, method);
-	pop();
+	if (!IS_CLASS(peek(vm, 1)))
+	{
+		runtimeError(vm, "Cannot define a method on a non-class value.");
+		return false;
+	}
+
+	Value method = peek(vm, 0);
+	ObjClass *klass = AS_CLASS(peek(vm, 1));
+	tableSet(vm, &klass->methods, name, method);
+	pop(vm);
+	return true;
 }
 
 // check wether the given value returns to false
@@ -282,22 +527,22 @@ static bool isFalsey(Value value)
 }
 
 // add two strings
-static void concatenate()
+static void concatenate(VM *vm)
 {
-	ObjString *b = AS_STRING(peek(0));
-	ObjString *a = AS_STRING(peek(1));
+	ObjString *b = AS_STRING(peek(vm, 0));
+	ObjString *a = AS_STRING(peek(vm, 1));
 
 	int length = a->length + b->length;
-	char *chars = ALLOCATE(char, length + 1);
+	char *chars = ALLOCATE(vm, char, length + 1);
 	memcpy(chars, a->chars, a->length);
 	memcpy(chars + a->length, b->chars, b->length);
 	chars[length] = '\0';
 
-	ObjString *result = takeString(chars, length);
+	ObjString *result = takeString(vm, chars, length);
 
-	pop();
-	pop();
-	push(OBJ_VAL(result));
+	pop(vm);
+	pop(vm);
+	push(vm, OBJ_VAL(result));
 }
 
 // // add a string and any other type together
@@ -308,30 +553,106 @@ static void concatenate()
 // 	//
 // }
 
-// run shit
-static InterpretResult run()
+// does what signal handlers asked for. the handler sets safepointDue
+// last, so it is cleared first to not lose a signal that comes in now
+static void safepoint(VM *vm)
+{
+	vm->safepointDue = 0;
+	if (vm->sampleDue)
+		takeSample(vm);
+	if (vm->snapshotDue)
+		takeSnapshot(vm);
+}
+
+// pops the frame, with the result on top of the stack put in place of
+// its callee
+static void popFrame(VM *vm, CallFrame *frame)
+{
+	// so that functions which neither call nor loop are seen
+	if (vm->safepointDue)
+		safepoint(vm);
+	if (vm->tracer != NULL)
+		traceFunction(vm->tracer, 'E', frame->closure->function);
+	Value result = pop(vm);
+	closeUpvalues(vm, frame->slots);
+	vm->frameCount--;
+	vm->stackTop = frame->slots;
+	push(vm, result);
+}
+
+// run shit until the frame at baseFrame returns. its result is
+// left on the stack in place of the callee
+static InterpretResult run(VM *vm, int baseFrame)
 {
-	CallFrame *frame = &vm.frames[vm.frameCount - 1];
+	CallFrame *frame = &vm->frames[vm->frameCount - 1];
 
+// goes on in native code for as long as it can, whenever the frame
+// changed
+#define RUN_JIT()                                                  \
+	do                                                             \
+	{                                                              \
+		if (frame->closure->function->jit != NULL)                 \
+		{                                                          \
+			JitResult result = runJit(vm, frame, baseFrame);       \
+			if (result == JIT_ERROR)                               \
+				return INTERPRET_RUNTIME_ERROR;                    \
+			if (result == JIT_RETURNED)                            \
+				return INTERPRET_OK;                               \
+			frame = &vm->frames[vm->frameCount - 1];               \
+		}                                                          \
+	} while (false)
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
 	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                        \
-	do                                                  \
-	{                                                   \
-		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-		{                                               \
-			runtimeError("Operands must be numbers.");  \
-			return INTERPRET_RUNTIME_ERROR;             \
-		}                                               \
-		double b = AS_NUMBER(pop());                    \
-		double a = AS_NUMBER(pop());                    \
-		push(valueType(a op b));                        \
+// rewrites the instruction that was just read
+#define REWRITE(opcode, counter) \
+	(frame->ip[-1] = (opcode), vm->counter++)
+#define BINARY_OP(valueType, op, numberOp)                      \
+	do                                                          \
+	{                                                           \
+		if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+		{                                                       \
+			runtimeError(vm, "Operands must be numbers.");      \
+			return INTERPRET_RUNTIME_ERROR;                     \
+		}                                                       \
+		REWRITE(numberOp, quickened);                           \
+		double b = AS_NUMBER(pop(vm));                          \
+		double a = AS_NUMBER(pop(vm));                          \
+		push(vm, valueType(a op b));                            \
+	} while (false)
+// BINARY_OP after it saw two numbers. anything else turns it into the
+// generic instruction, which then runs in its place
+#define NUMBER_OP(valueType, op, generic)             \
+	do                                                \
+	{                                                 \
+		Value *top = vm->stackTop;                    \
+		if (IS_NUMBER(top[-1]) && IS_NUMBER(top[-2])) \
+		{                                             \
+			double b = AS_NUMBER(top[-1]);            \
+			double a = AS_NUMBER(top[-2]);            \
+			top[-2] = valueType(a op b);              \
+			vm->stackTop = top - 1;                   \
+		}                                             \
+		else                                          \
+		{                                             \
+			REWRITE(generic, dequickened);            \
+			frame->ip--;                              \
+			REDISPATCH();                             \
+		}                                             \
 	} while (false)
 	// wrap in block so that the macro expands safely
+#ifdef PROFILE_OPCODES
+	// set when an instruction runs again as its generic variant, so it
+	// isn't counted twice
+	bool redispatch = false;
+#define REDISPATCH() (redispatch = true)
+#else
+#define REDISPATCH() ((void)0)
+#endif
 
+	RUN_JIT();
 	for (;;)
 	{
 // debugging stuff
@@ -342,7 +663,7 @@ static InterpretResult run()
 		// if (vm.stack[0] == *vm.stackTop)
 		// printf("EMPTY");
 
-		for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+		for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
 		{
 			printf("[");
 			printValue(*slot);
@@ -353,6 +674,11 @@ static InterpretResult run()
 							   (int)(frame->ip - frame->closure->function->chunk.code));
 		// printf(">>> ");
 		// printf("%i", vm.globals.count);
+#endif
+#ifdef PROFILE_OPCODES
+		if (!redispatch)
+			countOpcode(&vm->opcodeProfile, *frame->ip);
+		redispatch = false;
 #endif
 		// swtich for execution of each intruction
 		uint8_t instruction;
@@ -361,67 +687,67 @@ static InterpretResult run()
 		case OP_CONSTANT:
 		{
 			Value constant = READ_CONSTANT();
-			push(constant);
+			push(vm, constant);
 			break;
 		}
 		case OP_NIL:
 		{
-			push(NIL_VAL);
+			push(vm, NIL_VAL);
 			break;
 		}
 		case OP_TRUE:
 		{
-			push(BOOL_VAL(true));
+			push(vm, BOOL_VAL(true));
 			break;
 		}
 		case OP_FALSE:
 		{
-			push(BOOL_VAL(false));
+			push(vm, BOOL_VAL(false));
 			break;
 		}
 		case OP_POP:
 		{
-			pop();
+			pop(vm);
 			break;
 		}
 		case OP_GET_LOCAL:
 		{
 			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]);
+			push(vm, frame->slots[slot]);
 			break;
 		}
 		case OP_SET_LOCAL:
 		{
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(0);
+			frame->slots[slot] = peek(vm, 0);
 			break;
 		}
 		case OP_GET_GLOBAL:
 		{
 			ObjString *name = READ_STRING();
 			Value value;
-			if (!tableGet(&vm.globals, name, &value))
+			if (!tableGet(&vm->globals, name, &value))
 			{
-				runtimeError("Undefined variable '%s'.", name->chars);
+				runtimeError(vm, "Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(value);
+			push(vm, value);
 			break;
 		}
 		case OP_DEFINE_GLOBAL:
 		{
 			ObjString *name = READ_STRING();
-			tableSet(&vm.globals, name, peek(0));
-			pop();
+			tableSet(vm, &vm->globals, name, peek(vm, 0));
+			pop(vm);
 			break;
 		}
 		case OP_SET_GLOBAL:
 		{
 			ObjString *name = READ_STRING();
 
-			if (tableSet(&vm.globals, name, peek(0)))
+			if (tableSet(vm, &vm->globals, name, peek(vm, 0)))
 			{
-				runtimeError("Undefined variable '%s'.", name->chars);
+				runtimeError(vm, "Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
@@ -430,36 +756,36 @@ static InterpretResult run()
 		case OP_GET_UPVALUE:
 		{
 			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
+			push(vm, *frame->closure->upvalues[slot]->location);
 			break;
 		}
 		case OP_SET_UPVALUE:
 		{
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
+			*frame->closure->upvalues[slot]->location = peek(vm, 0);
 			break;
 		}
 		case OP_GET_PROPERTY:
 		{
-			if (!IS_INSTANCE(peek(0)))
+			if (!IS_INSTANCE(peek(vm, 0)))
 			{
-				runtimeError("Cannot get property of non-instance value.");
+				runtimeError(vm, "Cannot get property of non-instance value.");
 				// TODO: "...value: %s.", valueToString(peek(0)); ofzo
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			ObjInstance *instance = AS_INSTANCE(peek(0));
+			ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
 			ObjString *name = READ_STRING();
 
 			Value value;
 			if (tableGet(&instance->fields, name, &value))
 			{
-				pop(); // Instance.
-				push(value);
+				pop(vm); // Instance.
+				push(vm, value);
 				break;
 			}
 
-			if (!bindMethod(instance->klass, name))
+			if (!bindMethod(vm, instance->klass, name))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
@@ -467,94 +793,126 @@ static InterpretResult run()
 		}
 		case OP_SET_PROPERTY:
 		{
-			if (!IS_INSTANCE(peek(1)))
+			if (!IS_INSTANCE(peek(vm, 1)))
 			{
-				runtimeError("Cannot set field of non-instance value.");
+				runtimeError(vm, "Cannot set field of non-instance value.");
 				// TODO: "...value: %s.", valueToString(peek(0)); ofzo
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			ObjInstance *instance = AS_INSTANCE(peek(1));
-			tableSet(&instance->fields, READ_STRING(), peek(0));
-			Value value = pop();
-			pop();
-			push(value);
+			ObjInstance *instance = AS_INSTANCE(peek(vm, 1));
+			tableSet(vm, &instance->fields, READ_STRING(), peek(vm, 0));
+			Value value = pop(vm);
+			pop(vm);
+			push(vm, value);
 			break;
 		}
 		case OP_EQUAL:
 		{
-			Value b = pop();
-			Value a = pop();
-			push(BOOL_VAL(valuesEqual(a, b)));
+			Value b = pop(vm);
+			Value a = pop(vm);
+			push(vm, BOOL_VAL(valuesEqual(a, b)));
 			break;
 		}
 		case OP_GREATER:
 		{
-			BINARY_OP(BOOL_VAL, >);
+			BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+			break;
+		}
+		case OP_GREATER_NUM:
+		{
+			NUMBER_OP(BOOL_VAL, >, OP_GREATER);
 			break;
 		}
 		case OP_LESS:
 		{
-			BINARY_OP(BOOL_VAL, <);
+			BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+			break;
+		}
+		case OP_LESS_NUM:
+		{
+			NUMBER_OP(BOOL_VAL, <, OP_LESS);
 			break;
 		}
 		case OP_ADD:
+		case OP_ADD_MIXED:
 		{
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+			if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1)))
 			{
-				concatenate();
+				concatenate(vm);
 			}
 			// else if (IS_STRING(peek(0)) || IS_STRING(peek(1)))
 			// {
 			// 	concatenate_other(IS_STRING(peek(0)));
 			// }
-			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+			else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
 			{
-				double b = AS_NUMBER(pop());
-				double a = AS_NUMBER(pop());
-				push(NUMBER_VAL(a + b));
+				if (instruction == OP_ADD)
+					REWRITE(OP_ADD_NUM, quickened);
+				double b = AS_NUMBER(pop(vm));
+				double a = AS_NUMBER(pop(vm));
+				push(vm, NUMBER_VAL(a + b));
 			}
 			else
 			{
-				runtimeError("Operands must be two numbers or two strings.");
+				runtimeError(vm, "Operands must be two numbers or two strings.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
 		}
+		case OP_ADD_NUM:
+		{
+			NUMBER_OP(NUMBER_VAL, +, OP_ADD_MIXED);
+			break;
+		}
 		case OP_SUBTRACT:
 		{
-			BINARY_OP(NUMBER_VAL, -);
+			BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+			break;
+		}
+		case OP_SUBTRACT_NUM:
+		{
+			NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
 			break;
 		}
 		case OP_MULTIPLY:
 		{
-			BINARY_OP(NUMBER_VAL, *);
+			BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+			break;
+		}
+		case OP_MULTIPLY_NUM:
+		{
+			NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
 			break;
 		}
 		case OP_DIVIDE:
 		{
-			BINARY_OP(NUMBER_VAL, /);
+			BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+			break;
+		}
+		case OP_DIVIDE_NUM:
+		{
+			NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
 			break;
 		}
 		case OP_NOT:
 		{
-			push(BOOL_VAL(isFalsey(pop())));
+			push(vm, BOOL_VAL(isFalsey(pop(vm))));
 			break;
 		}
 		case OP_NEGATE:
 		{
-			if (!IS_NUMBER(peek(0)))
+			if (!IS_NUMBER(peek(vm, 0)))
 			{
-				runtimeError("Operand must be a number.");
+				runtimeError(vm, "Operand must be a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(NUMBER_VAL(-AS_NUMBER(pop())));
+			push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
 			break;
 		}
 		case OP_PRINT:
 		{
-			printValue(pop());
-			printf("\n");
+			outputLine(&vm->output, pop(vm));
 			break;
 		}
 		case OP_JUMP:
@@ -566,7 +924,7 @@ static InterpretResult run()
 		case OP_JUMP_IF_FALSE:
 		{
 			uint16_t offset = READ_SHORT();
-			if (isFalsey(peek(0)))
+			if (isFalsey(peek(vm, 0)))
 				frame->ip += offset;
 			break;
 		}
@@ -574,23 +932,32 @@ static InterpretResult run()
 		{
 			uint16_t offset = READ_SHORT();
 			frame->ip -= offset;
+			if (vm->safepointDue)
+				safepoint(vm);
+			// a hot loop goes native right away, from its start
+			if (++frame->closure->function->hotness == vm->jitThreshold &&
+				compileJit(vm, frame->closure->function))
+				RUN_JIT();
 			break;
 		}
 		case OP_CALL:
 		{
 			int argCount = READ_BYTE();
-			if (!callValue(peek(argCount), argCount))
+			if (vm->safepointDue)
+				safepoint(vm);
+			if (!callValue(vm, peek(vm, argCount), argCount))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frameCount - 1];
+			frame = &vm->frames[vm->frameCount - 1];
+			RUN_JIT();
 			break;
 		}
 		case OP_CLOSURE:
 		{
 			ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure *closure = newClosure(function);
-			push(OBJ_VAL(closure));
+			ObjClosure *closure = newClosure(vm, function);
+			push(vm, OBJ_VAL(closure));
 			// catch upvalues
 			for (int i = 0; i < closure->upvalueCount; i++)
 			{
@@ -599,7 +966,7 @@ static InterpretResult run()
 				if (isLocal)
 				{
 					closure->upvalues[i] =
-						captureUpvalue(frame->slots + index);
+						captureUpvalue(vm, frame->slots + index);
 				}
 				else
 				{
@@ -610,57 +977,126 @@ static InterpretResult run()
 		}
 		case OP_CLOSE_UPVALUE:
 		{
-			closeUpvalues(vm.stackTop - 1);
-			pop();
+			closeUpvalues(vm, vm->stackTop - 1);
+			pop(vm);
 			break;
 		}
 		case OP_CLASS:
 		{
-			push(OBJ_VAL(newClass(READ_STRING())));
+			push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
 			break;
 		}
 		case OP_METHOD:
 		{
-			defineMethod(READ_STRING());
+			if (!defineMethod(vm, READ_STRING()))
+				return INTERPRET_RUNTIME_ERROR;
 			break;
 		}
 		case OP_RETURN:
 		{
-			Value result = pop();
-			closeUpvalues(frame->slots);
-			vm.frameCount--;
-			if (vm.frameCount == 0)
-			{
-				pop();
+			popFrame(vm, frame);
+			if (vm->frameCount == baseFrame)
 				return INTERPRET_OK;
-			}
+			// the running fiber is done, back to the one that resumed it
+			if (vm->fiber != NULL && vm->frameCount == vm->fiber->baseFrame &&
+				!finishFiber(vm))
+				return INTERPRET_RUNTIME_ERROR;
 
-			vm.stackTop = frame->slots;
-			push(result);
-			frame = &vm.frames[vm.frameCount - 1];
+			frame = &vm->frames[vm->frameCount - 1];
+			RUN_JIT();
 			break;
 		}
 		}
 	}
 
+#undef RUN_JIT
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef REWRITE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef REDISPATCH
 }
 
-// interpret shit and return its result
-InterpretResult interpret(const char *source)
+// the parts of run() that jit.c calls back into. run() inlines the
+// functions themselves
+bool jitCallValue(VM *vm, Value callee, int argCount)
+{
+	return callValue(vm, callee, argCount);
+}
+
+void jitPopFrame(VM *vm, CallFrame *frame)
+{
+	popFrame(vm, frame);
+}
+
+bool jitBindMethod(VM *vm, ObjClass *klass, ObjString *name)
+{
+	return bindMethod(vm, klass, name);
+}
+
+ObjUpvalue *jitCaptureUpvalue(VM *vm, Value *local)
+{
+	return captureUpvalue(vm, local);
+}
+
+void jitCloseUpvalues(VM *vm, Value *last)
+{
+	closeUpvalues(vm, last);
+}
+
+bool jitDefineMethod(VM *vm, ObjString *name)
+{
+	return defineMethod(vm, name);
+}
+
+void jitConcatenate(VM *vm)
+{
+	concatenate(vm);
+}
+
+void jitSafepoint(VM *vm)
+{
+	safepoint(vm);
+}
+
+// run an already compiled script function
+InterpretResult interpretFunction(VM *vm, ObjFunction *function)
 {
-	ObjFunction *function = compile(source);
 	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
 
-	push(OBJ_VAL(function));
-	ObjClosure *closure = newClosure(function);
-	pop();
-	push(OBJ_VAL(closure));
-	call(closure, 0);
-	return run();
+	push(vm, OBJ_VAL(function));
+	ObjClosure *closure = newClosure(vm, function);
+	pop(vm);
+	push(vm, OBJ_VAL(closure));
+	callClosure(vm, closure, 0);
+
+	InterpretResult result = run(vm, 0);
+	if (result == INTERPRET_OK)
+		pop(vm); // the script's nil
+	return result;
+}
+
+// calls the callee below the argCount arguments on top of the stack
+// from C code and runs it to completion. like with OP_CALL, the
+// result replaces callee and arguments
+InterpretResult callFunction(VM *vm, int argCount)
+{
+	int baseFrame = vm->frameCount;
+	if (!callValue(vm, peek(vm, argCount), argCount))
+		return INTERPRET_RUNTIME_ERROR;
+
+	// natives are already done
+	if (vm->frameCount == baseFrame)
+		return INTERPRET_OK;
+	return run(vm, baseFrame);
+}
+
+// interpret shit and return its result
+InterpretResult interpret(VM *vm, const char *source)
+{
+	return interpretFunction(vm, compile(vm, source, strlen(source)));
 }
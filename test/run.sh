@@ -0,0 +1,100 @@
+#!/bin/bash
+# runs the scripts in test/ that say what they should do and compares
+# what they did. a script describes itself in comments:
+#   // expect: text     the next line it prints, in order
+#   // error: text      a line it writes to stderr
+#   // exit: n          its exit status, 0 by default
+#   // args: options    options for clox, at the start of a line
+#   // stdin: path      a file fed to it, relative to test/
+#   // image: path      a script whose heap image is loaded first
+#   // needs: lines     skipped when clox was built without line info
+#   // check: command   a shell command that has to succeed after it ran
+# {tmp} in a script is an empty directory for the files it writes, so
+# it runs from a copy with that filled in, and so do its directives.
+# every script runs twice, so the second run uses its .loxc cache.
+# usage: test/run.sh [clox [option...]]
+# the options are passed to every run, e.g. --jit-threshold 1
+
+clox=${1:-bin/clox}
+[ $# -gt 0 ] && shift
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# a build with STRIP_LINE_INFO shows bytes instead of lines in traces
+printf 'nil();\n' > "$tmp/probe.lox"
+lines=false
+"$clox" --no-cache "$tmp/probe.lox" 2>&1 | grep -qF '[line 1]' && lines=true
+
+passed=0
+failed=0
+skipped=0
+for test in "$dir"/*.lox; do
+	grep -q '// \(expect\|error\|exit\):' "$test" || continue
+	name=$(basename "$test" .lox)
+	if ! $lines && grep -q '^// needs: lines' "$test"; then
+		skipped=$((skipped + 1))
+		continue
+	fi
+
+	script=$test
+	if grep -qF '{tmp}' "$test"; then
+		script="$tmp/$name.lox"
+		sed "s|{tmp}|$tmp/files|g" "$test" > "$script"
+	fi
+
+	# awk ends the last line even where the script doesn't
+	awk 'sub(/^.*\/\/ expect: ?/, "")' "$script" > "$tmp/expected"
+	status=$(sed -n 's|^.*// exit: ||p' "$script")
+	args=$(sed -n 's|^// args: ||p' "$script")
+	input=$(sed -n 's|^// stdin: ||p' "$script")
+	image=$(sed -n 's|^// image: ||p' "$script")
+	if [ -n "$image" ]; then
+		"$clox" --no-cache --dump-image "$tmp/image" "$dir/$image" > /dev/null
+		args="--image $tmp/image $args"
+	fi
+
+	ok=true
+	for run in 1 2; do
+		rm -rf "$tmp/files"
+		mkdir "$tmp/files"
+		# shellcheck disable=SC2086
+		"$clox" "$@" $args "$script" < "${input:+$dir/}${input:-/dev/null}" \
+			> "$tmp/out" 2> "$tmp/err"
+		got=$?
+		if [ "$got" != "${status:-0}" ]; then
+			echo "FAIL $name (run $run): exit status $got, expected ${status:-0}"
+			ok=false
+		fi
+		if ! diff -u "$tmp/expected" "$tmp/out" > "$tmp/diff"; then
+			echo "FAIL $name (run $run): output differs"
+			tail -n +3 "$tmp/diff"
+			ok=false
+		fi
+		while IFS= read -r line; do
+			if ! grep -qxF -- "$line" "$tmp/err"; then
+				echo "FAIL $name (run $run): no error \"$line\""
+				ok=false
+			fi
+		done < <(sed -n 's|^.*// error: ||p' "$script")
+		while IFS= read -r check; do
+			if ! sh -c "$check" < /dev/null > "$tmp/check" 2>&1; then
+				echo "FAIL $name (run $run): check failed: $check"
+				cat "$tmp/check"
+				ok=false
+			fi
+		done < <(sed -n 's|^// check: ||p' "$script")
+		$ok || { cat "$tmp/err"; break; }
+	done
+
+	if $ok; then
+		passed=$((passed + 1))
+	else
+		failed=$((failed + 1))
+	fi
+done
+
+summary="$passed passed, $failed failed"
+[ "$skipped" -gt 0 ] && summary="$summary, $skipped skipped without line info"
+echo "$summary"
+[ "$failed" = 0 ]
@@ -0,0 +1,496 @@
+// reads a heap snapshot written by heapSnapshot() or on SIGUSR1, and
+// reports what retains the most memory. an object retains what would
+// be freed along with it: everything that can only be reached through
+// it. found with the dominator tree of the heap, computed as in
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy.
+// usage: heapsnapshot [-n count] file
+//
+// for each of the count (20 by default) objects retaining the most, it
+// prints the chain of objects that dominate it up to a root, any of
+// which would have to let go of it for it to be freed. objects held by
+// one of the same kind, like the rest of a linked list, aren't listed
+
+#define _DEFAULT_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_LINE 4096
+#define UNDEFINED -1
+
+typedef struct
+{
+	char *type;
+	char *description;
+	uint64_t bytes;
+	uint64_t retained;
+	int *edges;
+	int edgeCount;
+	int edgeCapacity;
+	const char *root; // what makes it a root, if it is one
+	// in the dominator tree
+	int order; // reverse postorder, UNDEFINED while unreachable
+	int dominator;
+} Node;
+
+typedef struct
+{
+	Node *nodes;
+	int count;
+	int capacity;
+	// ids to node indices, open addressing
+	uint64_t *ids;
+	int *indices;
+	int slots;
+	int edgeCount;
+} Graph;
+
+static void *allocate(size_t size)
+{
+	void *result = calloc(1, size);
+	if (result == NULL)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return result;
+}
+
+static char *copy(const char *chars)
+{
+	char *result = (char *)allocate(strlen(chars) + 1);
+	strcpy(result, chars);
+	return result;
+}
+
+static void addEdge(Node *node, int to)
+{
+	if (node->edgeCount == node->edgeCapacity)
+	{
+		node->edgeCapacity = node->edgeCapacity < 4 ? 4
+													: node->edgeCapacity * 2;
+		node->edges = (int *)realloc(node->edges,
+									 sizeof(int) * node->edgeCapacity);
+		if (node->edges == NULL)
+			exit(1);
+	}
+	node->edges[node->edgeCount++] = to;
+}
+
+// -------- ids --------
+
+static uint64_t hashId(uint64_t id)
+{
+	return (id >> 4) * 0x9e3779b97f4a7c15u;
+}
+
+static void growIds(Graph *graph)
+{
+	int slots = graph->slots < 1024 ? 1024 : graph->slots * 2;
+	uint64_t *ids = (uint64_t *)allocate(sizeof(uint64_t) * slots);
+	int *indices = (int *)allocate(sizeof(int) * slots);
+	for (int i = 0; i < graph->slots; i++)
+	{
+		if (graph->ids[i] == 0)
+			continue;
+		uint64_t slot = hashId(graph->ids[i]) & (slots - 1);
+		while (ids[slot] != 0)
+			slot = (slot + 1) & (slots - 1);
+		ids[slot] = graph->ids[i];
+		indices[slot] = graph->indices[i];
+	}
+	free(graph->ids);
+	free(graph->indices);
+	graph->ids = ids;
+	graph->indices = indices;
+	graph->slots = slots;
+}
+
+// the node of the object with the id, added if it is new. objects can
+// be referenced before their own line
+static int findNode(Graph *graph, uint64_t id)
+{
+	if (graph->count + 1 > graph->slots / 2)
+		growIds(graph);
+
+	uint64_t slot = hashId(id) & (graph->slots - 1);
+	while (graph->ids[slot] != 0)
+	{
+		if (graph->ids[slot] == id)
+			return graph->indices[slot];
+		slot = (slot + 1) & (graph->slots - 1);
+	}
+
+	if (graph->count == graph->capacity)
+	{
+		graph->capacity = graph->capacity < 1024 ? 1024 : graph->capacity * 2;
+		graph->nodes = (Node *)realloc(graph->nodes,
+									   sizeof(Node) * graph->capacity);
+		if (graph->nodes == NULL)
+			exit(1);
+	}
+	Node *node = &graph->nodes[graph->count];
+	memset(node, 0, sizeof(Node));
+	node->order = UNDEFINED;
+	node->dominator = UNDEFINED;
+	graph->ids[slot] = id;
+	graph->indices[slot] = graph->count;
+	return graph->count++;
+}
+
+// -------- reading --------
+
+// node 0 stands for all of the roots
+static bool readSnapshot(const char *path, Graph *graph)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+
+	char line[MAX_LINE];
+	if (fgets(line, sizeof(line), file) == NULL ||
+		strcmp(line, "clox heap snapshot 1\n") != 0)
+	{
+		fclose(file);
+		return false;
+	}
+
+	findNode(graph, UINT64_MAX);
+	graph->nodes[0].type = copy("roots");
+	graph->nodes[0].description = copy("");
+	int current = UNDEFINED;
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		char kind[16];
+		uint64_t id;
+		int length;
+		if (sscanf(line, "%15s %" SCNx64 " %n", kind, &id, &length) < 2)
+			continue;
+		const char *rest = line + length;
+
+		if (strcmp(kind, "root") == 0)
+		{
+			int node = findNode(graph, id);
+			addEdge(&graph->nodes[0], node);
+			if (graph->nodes[node].root == NULL)
+				graph->nodes[node].root = copy(rest);
+			graph->edgeCount++;
+		}
+		else if (strcmp(kind, "object") == 0)
+		{
+			char type[32];
+			unsigned long long bytes;
+			int described;
+			if (sscanf(rest, "%31s %llu %n", type, &bytes, &described) < 2)
+				continue;
+			current = findNode(graph, id);
+			Node *node = &graph->nodes[current];
+			node->type = copy(type);
+			node->description = copy(rest + described);
+			node->bytes = bytes;
+		}
+		else if (strcmp(kind, "edge") == 0 && current != UNDEFINED)
+		{
+			int to = findNode(graph, id);
+			addEdge(&graph->nodes[current], to);
+			graph->edgeCount++;
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+// -------- dominators --------
+
+// numbers the nodes reachable from the roots in reverse postorder,
+// returns them in that order
+static int *orderNodes(Graph *graph, int *reachable)
+{
+	int *order = (int *)allocate(sizeof(int) * graph->count);
+	int *stack = (int *)allocate(sizeof(int) * graph->count);
+	int *nextEdge = (int *)allocate(sizeof(int) * graph->count);
+	bool *seen = (bool *)allocate(sizeof(bool) * graph->count);
+
+	// without recursion, a long list would overflow the stack
+	int count = 0;
+	int depth = 0;
+	stack[depth++] = 0;
+	seen[0] = true;
+	while (depth > 0)
+	{
+		int node = stack[depth - 1];
+		Node *from = &graph->nodes[node];
+		if (nextEdge[node] < from->edgeCount)
+		{
+			int to = from->edges[nextEdge[node]++];
+			if (!seen[to])
+			{
+				seen[to] = true;
+				stack[depth++] = to;
+			}
+			continue;
+		}
+		order[count++] = node;
+		depth--;
+	}
+
+	// postorder to reverse postorder
+	for (int i = 0; i < count / 2; i++)
+	{
+		int swap = order[i];
+		order[i] = order[count - 1 - i];
+		order[count - 1 - i] = swap;
+	}
+	for (int i = 0; i < count; i++)
+		graph->nodes[order[i]].order = i;
+
+	free(stack);
+	free(nextEdge);
+	free(seen);
+	*reachable = count;
+	return order;
+}
+
+static int intersect(Graph *graph, int a, int b)
+{
+	while (a != b)
+	{
+		while (graph->nodes[a].order > graph->nodes[b].order)
+			a = graph->nodes[a].dominator;
+		while (graph->nodes[b].order > graph->nodes[a].order)
+			b = graph->nodes[b].dominator;
+	}
+	return a;
+}
+
+static void computeDominators(Graph *graph, int *order, int reachable)
+{
+	// the predecessors of each reachable node, in one array
+	int *predecessorStart = (int *)allocate(sizeof(int) * (graph->count + 1));
+	for (int i = 0; i < reachable; i++)
+	{
+		Node *node = &graph->nodes[order[i]];
+		for (int e = 0; e < node->edgeCount; e++)
+			predecessorStart[node->edges[e] + 1]++;
+	}
+	for (int i = 0; i < graph->count; i++)
+		predecessorStart[i + 1] += predecessorStart[i];
+	int *predecessors = (int *)allocate(sizeof(int) *
+										(predecessorStart[graph->count] + 1));
+	int *filled = (int *)allocate(sizeof(int) * graph->count);
+	for (int i = 0; i < reachable; i++)
+	{
+		Node *node = &graph->nodes[order[i]];
+		for (int e = 0; e < node->edgeCount; e++)
+		{
+			int to = node->edges[e];
+			predecessors[predecessorStart[to] + filled[to]++] = order[i];
+		}
+	}
+
+	graph->nodes[0].dominator = 0;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (int i = 1; i < reachable; i++)
+		{
+			int node = order[i];
+			int dominator = UNDEFINED;
+			for (int p = predecessorStart[node]; p < predecessorStart[node + 1];
+				 p++)
+			{
+				int predecessor = predecessors[p];
+				if (graph->nodes[predecessor].dominator == UNDEFINED)
+					continue;
+				dominator = dominator == UNDEFINED
+								? predecessor
+								: intersect(graph, predecessor, dominator);
+			}
+			if (graph->nodes[node].dominator != dominator)
+			{
+				graph->nodes[node].dominator = dominator;
+				changed = true;
+			}
+		}
+	}
+
+	// dominators come first in reverse postorder, so going backwards
+	// adds up every subtree before its root
+	for (int i = reachable - 1; i >= 0; i--)
+	{
+		Node *node = &graph->nodes[order[i]];
+		node->retained += node->bytes;
+		if (i > 0)
+			graph->nodes[node->dominator].retained += node->retained;
+	}
+
+	free(predecessorStart);
+	free(predecessors);
+	free(filled);
+}
+
+// -------- report --------
+
+typedef struct
+{
+	const char *type;
+	int count;
+	uint64_t bytes;
+} TypeTotal;
+
+static int compareTypes(const void *a, const void *b)
+{
+	uint64_t x = ((const TypeTotal *)a)->bytes;
+	uint64_t y = ((const TypeTotal *)b)->bytes;
+	return (x < y) - (x > y);
+}
+
+static Graph *sortedGraph;
+
+static int compareRetained(const void *a, const void *b)
+{
+	uint64_t x = sortedGraph->nodes[*(const int *)a].retained;
+	uint64_t y = sortedGraph->nodes[*(const int *)b].retained;
+	return (x < y) - (x > y);
+}
+
+static void printNode(Node *node)
+{
+	printf("%s", node->type != NULL ? node->type : "(missing)");
+	if (node->description != NULL && node->description[0] != '\0')
+		printf(" %s", node->description);
+}
+
+static bool sameKind(Node *a, Node *b)
+{
+	return a->type != NULL && b->type != NULL &&
+		   strcmp(a->type, b->type) == 0 &&
+		   strcmp(a->description, b->description) == 0;
+}
+
+static void report(Graph *graph, int *order, int reachable, int top)
+{
+	uint64_t total = 0;
+	int objects = 0;
+	int unreachable = 0;
+	TypeTotal types[32];
+	int typeCount = 0;
+	for (int i = 1; i < graph->count; i++)
+	{
+		Node *node = &graph->nodes[i];
+		if (node->type == NULL)
+			continue;
+		objects++;
+		total += node->bytes;
+		if (node->order == UNDEFINED)
+			unreachable++;
+
+		int t = 0;
+		while (t < typeCount && strcmp(types[t].type, node->type) != 0)
+			t++;
+		if (t == typeCount)
+		{
+			if (typeCount == 32)
+				continue;
+			types[typeCount++] = (TypeTotal){node->type, 0, 0};
+		}
+		types[t].count++;
+		types[t].bytes += node->bytes;
+	}
+
+	printf("%d objects, %llu bytes, %d references, %d unreachable\n",
+		   objects, (unsigned long long)total, graph->edgeCount, unreachable);
+	qsort(types, typeCount, sizeof(TypeTotal), compareTypes);
+	printf("\n%-14s %10s %14s\n", "type", "objects", "bytes");
+	for (int i = 0; i < typeCount; i++)
+		printf("%-14s %10d %14llu\n", types[i].type, types[i].count,
+			   (unsigned long long)types[i].bytes);
+
+	// the roots themselves aren't interesting to rank
+	int *ranked = (int *)allocate(sizeof(int) * reachable);
+	memcpy(ranked, order + 1, sizeof(int) * (reachable - 1));
+	sortedGraph = graph;
+	qsort(ranked, reachable - 1, sizeof(int), compareRetained);
+
+	printf("\n%14s %10s  %s\n", "retained", "bytes", "object");
+	int shown = 0;
+	for (int i = 0; i < reachable - 1 && shown < top; i++)
+	{
+		// the rest of a list is left out for its head
+		Node *node = &graph->nodes[ranked[i]];
+		if (node->dominator != 0 &&
+			sameKind(node, &graph->nodes[node->dominator]))
+			continue;
+		shown++;
+		printf("%14llu %10llu  ", (unsigned long long)node->retained,
+			   (unsigned long long)node->bytes);
+		printNode(node);
+		printf("\n");
+
+		// up the dominator tree to the root that holds on to it, with
+		// runs of the same kind of object on one line
+		int dominator = ranked[i];
+		while (graph->nodes[dominator].dominator != 0)
+		{
+			dominator = graph->nodes[dominator].dominator;
+			int run = 1;
+			while (graph->nodes[dominator].dominator != 0 &&
+				   sameKind(&graph->nodes[dominator],
+							&graph->nodes[graph->nodes[dominator].dominator]))
+			{
+				dominator = graph->nodes[dominator].dominator;
+				run++;
+			}
+			printf("%26s<- ", "");
+			printNode(&graph->nodes[dominator]);
+			if (run > 1)
+				printf(" (%d of them)", run);
+			printf("\n");
+		}
+		Node *root = &graph->nodes[dominator];
+		printf("%26s<- root: %s\n", "",
+			   root->root != NULL ? root->root : "(several)");
+	}
+	free(ranked);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: heapsnapshot [-n count] file\n");
+	exit(64);
+}
+
+int main(int argc, char *argv[])
+{
+	int top = 20;
+	int option;
+	while ((option = getopt(argc, argv, "n:")) != -1)
+	{
+		if (option != 'n')
+			usage();
+		top = atoi(optarg);
+	}
+	if (optind != argc - 1 || top < 0)
+		usage();
+
+	Graph graph;
+	memset(&graph, 0, sizeof(Graph));
+	if (!readSnapshot(argv[optind], &graph))
+	{
+		fprintf(stderr, "Could not read snapshot \"%s\".\n", argv[optind]);
+		return 74;
+	}
+
+	int reachable;
+	int *order = orderNodes(&graph, &reachable);
+	computeDominators(&graph, order, reachable);
+	report(&graph, order, reachable, top);
+	return 0;
+}